@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+
+from typing import List, Optional, Tuple
+
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+LOX_EXT = ".lox"
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+
+
+def toClox(src: str) -> str:
+    # The benchmarks are Lax programs, clox spells 'echo' as 'print'
+    lines = []
+    for line in src.splitlines(keepends=True):
+        stripped = line.lstrip()
+        if stripped.startswith("echo "):
+            line = line[:len(line) - len(stripped)] + "print " + stripped[len("echo "):]
+        lines.append(line)
+    return "".join(lines)
+
+
+def timeRun(cmd: List[str], runs: int) -> Tuple[Optional[float], bytes]:
+    best = None
+    output = bytes()
+
+    for _ in range(runs):
+        start = time.perf_counter()
+        result = subprocess.run(cmd, capture_output=True)
+        elapsed = time.perf_counter() - start
+
+        if result.returncode != 0:
+            print("[ERROR] %s exited with %d" % (' '.join(cmd), result.returncode), file=sys.stderr)
+            print(result.stderr.decode("utf-8"), file=sys.stderr)
+            return None, result.stdout
+
+        output = result.stdout
+        if best is None or elapsed < best:
+            best = elapsed
+
+    return best, output
+
+
+def runBenchmark(path: str, runs: int) -> bool:
+    with open(path, "r") as f:
+        src = f.read()
+
+    with tempfile.NamedTemporaryFile("w", suffix=LOX_EXT, delete=False) as f:
+        f.write(toClox(src))
+        cloxPath = f.name
+
+    try:
+        lax = os.path.join(ROOT_DIR, "lax")
+        clox = os.path.join(ROOT_DIR, "clox")
+        variants = [
+            ("lax", [lax, path]),
+            ("lax -O", [lax, "-O", path]),
+            ("lax --jit", [lax, "-O", "--jit", path]),
+            ("clox", [clox, cloxPath]),
+            ("clox --jit", [clox, "--jit", cloxPath]),
+        ]
+
+        times = []
+        outputs = []
+        for name, cmd in variants:
+            elapsed, output = timeRun(cmd, runs)
+            times.append(elapsed)
+            outputs.append(output)
+    finally:
+        os.remove(cloxPath)
+
+    cells = ["%8.3fs" % t if t is not None else "  failed" for t in times]
+    print("%-16s %s" % (os.path.basename(path), " ".join(cells)))
+
+    if any(t is None for t in times) or any(o != outputs[0] for o in outputs):
+        print("[ERROR] %s: the interpreters disagree" % path, file=sys.stderr)
+        return False
+
+    return True
+
+
+def usage(exec: str) -> None:
+    print(f"Usage: {exec} [RUNS]? [BENCHMARK]*")
+    print("  Times each benchmark with lax, lax -O, lax -O --jit, clox and clox --jit, keeping the best of [RUNS].")
+    print("  The default [RUNS] is 5, and all of the benchmarks in ./bench/ are run.")
+    print("  Build the interpreters with 'make' first.")
+
+
+if __name__ == "__main__":
+    exec, *argv = sys.argv
+    runs = 5
+
+    if len(argv) > 0 and argv[0] in ("-h", "help"):
+        usage(exec)
+        exit(0)
+
+    if len(argv) > 0 and argv[0].isdigit():
+        runs, *argv = int(argv[0]), *argv[1:]
+
+    paths = argv or sorted(
+        os.path.join(BENCH_DIR, entry)
+        for entry in os.listdir(BENCH_DIR) if entry.endswith(LOX_EXT)
+    )
+
+    print("%-16s %9s %9s %9s %9s %10s" % ("benchmark", "lax", "lax -O", "lax --jit", "clox", "clox --jit"))
+    failed = 0
+    for path in paths:
+        if not runBenchmark(path, runs):
+            failed += 1
+
+    exit(1 if failed else 0)
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+
+from typing import Dict, List, Tuple
+
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from run import BENCH_DIR, LOX_EXT, ROOT_DIR, toClox
+
+# Interpreter name, source directory, header holding its OpCode enum
+INTERPRETERS = [
+    ("lax", "src", "chunk.h"),
+    ("clox", "lox", "clox_chunk.h"),
+]
+
+Profile = Dict[Tuple[int, ...], int]
+
+
+def opcodeNames(header: str) -> List[str]:
+    # The enums are implicitly numbered, so the order is the value
+    with open(header, "r") as f:
+        src = f.read()
+
+    body = re.search(r"typedef enum \{(.*?)\} OpCode;", src, re.S).group(1)
+    return re.findall(r"^\s*(OP_\w+)", body, re.M)
+
+
+def build(srcDir: str, out: str) -> None:
+    sources = [
+        os.path.join(srcDir, entry) for entry in sorted(os.listdir(srcDir)) if entry.endswith(".c")
+    ]
+    subprocess.run(
+        ["gcc", "-std=c99", "-O2", "-DDEBUG_PROFILE_OPCODES", *sources, "-o", out, "-lm"],
+        check=True,
+    )
+
+
+def profile(cmd: List[str], sequences: Profile) -> int:
+    result = subprocess.run(cmd, capture_output=True)
+    executed = 0
+
+    for line in result.stderr.decode("utf-8").splitlines():
+        kind, *fields = line.split()
+        if kind == "executed":
+            executed += int(fields[0])
+        elif kind in ("pair", "triple"):
+            *ops, count = map(int, fields)
+            sequences[tuple(ops)] = sequences.get(tuple(ops), 0) + count
+
+    return executed
+
+
+def report(name: str, names: List[str], sequences: Profile, executed: int, top: int) -> None:
+    print(f"=== {name}: {executed} instructions ===")
+
+    for length in (2, 3):
+        ranked = sorted(
+            ((count, ops) for ops, count in sequences.items() if len(ops) == length), reverse=True
+        )
+        for count, ops in ranked[:top]:
+            # Fusing a sequence saves one dispatch per instruction after the first
+            saved = count * (length - 1)
+            fused = "OP_" + "_".join(names[op][len("OP_"):] for op in ops)
+            print("%8.2f%%  %-48s %s" % (100 * saved / max(executed, 1), fused, count))
+        print()
+
+
+def usage(exec: str) -> None:
+    print(f"Usage: {exec} [TOP]? [BENCHMARK]*")
+    print("  Profiles the opcode pairs and triples executed by each benchmark and ranks")
+    print("  them by the share of dispatches a superinstruction for them would remove.")
+    print("  The default [TOP] is 10, and all of the benchmarks in ./bench/ are run.")
+
+
+if __name__ == "__main__":
+    exec, *argv = sys.argv
+    top = 10
+
+    if len(argv) > 0 and argv[0] in ("-h", "help"):
+        usage(exec)
+        exit(0)
+
+    if len(argv) > 0 and argv[0].isdigit():
+        top, *argv = int(argv[0]), *argv[1:]
+
+    paths = argv or sorted(
+        os.path.join(BENCH_DIR, entry)
+        for entry in os.listdir(BENCH_DIR) if entry.endswith(LOX_EXT)
+    )
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, srcDir, header in INTERPRETERS:
+            binary = os.path.join(tmp, name)
+            build(os.path.join(ROOT_DIR, srcDir), binary)
+
+            sequences: Profile = {}
+            executed = 0
+            for path in paths:
+                if name == "clox":
+                    cloxPath = os.path.join(tmp, os.path.basename(path))
+                    with open(path, "r") as f, open(cloxPath, "w") as out:
+                        out.write(toClox(f.read()))
+                    path = cloxPath
+                executed += profile([binary, path], sequences)
+
+            names = opcodeNames(os.path.join(ROOT_DIR, srcDir, header))
+            report(name, names, sequences, executed, top)
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,24 +6,83 @@
 #include "clox_chunk.h"
 #include "clox_common.h"
 #include "clox_debug.h"
+#include "clox_perf.h"
+#include "clox_snapshot.h"
 #include "clox_vm.h"
 
 static void repl();
 static void runFile(const char *path);
 static char *readFile(const char *path);
 
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--max-depth <frames>] [--jit] [--perf-map] [--from-snapshot <image>] [source]\n");
+    fprintf(stderr, "       clox [--from-snapshot <image>] --snapshot <image> <prelude>\n");
+    exit(64);
+}
+
 int main(int argc, char **argv)
 {
-    // Initialize the VM
-    initVM();
+    const char *path = NULL;
+    const char *image = NULL;       // Heap to start from
+    const char *snapshot = NULL;    // Where to write the heap once 'path' has run
+    int frameLimit = FRAMES_LIMIT_DEFAULT;
+    bool jit = false;
+    bool perfMap = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--max-depth")) {
+            if (++i == argc) usage();
+
+            char *end;
+            long depth = strtol(argv[i], &end, 10);
+            if (*end != '\0' || depth < 1 || depth > INT_MAX) usage();
+            frameLimit = (int)depth;
+        } else if (!strcmp(argv[i], "--jit")) {
+            jit = true;
+        } else if (!strcmp(argv[i], "--perf-map")) {
+            perfMap = true;
+        } else if (!strcmp(argv[i], "--snapshot")) {
+            if (++i == argc) usage();
+            snapshot = argv[i];
+        } else if (!strcmp(argv[i], "--from-snapshot")) {
+            if (++i == argc) usage();
+            image = argv[i];
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (snapshot != NULL && path == NULL) usage();
 
-    if (argc == 1) {
+    // Initialize the VM, skipping the setup an image already went through
+    if (image == NULL) {
+        initVM();
+    } else if (!initVMFromSnapshot(image)) {
+        fprintf(stderr, "Could not load the snapshot '%s'.\n", image);
+        exit(74);
+    }
+
+    vm.frameLimit = frameLimit;
+    vm.jit = jit;
+    vm.perfMap = perfMap;
+
+    if (vm.perfMap && !initPerfMap()) {
+        fprintf(stderr, "Could not create a perf map, running without one.\n");
+        vm.perfMap = false;
+    }
+
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox <source>\n");
-        exit(64);
+        runFile(path);
+    }
+
+    if (snapshot != NULL && !writeSnapshot(snapshot)) {
+        fprintf(stderr, "Could not write the snapshot '%s'.\n", snapshot);
+        exit(74);
     }
 
     // Free memory allocated by the VM
@@ -94,15 +94,87 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+// Emits an instruction emitFused() may fold into a superinstruction
+static void emitFusible(uint8_t byte1, uint8_t byte2)
+{
+    current->fusible[0] = current->fusible[1];
+    current->fusible[1] = currentChunk()->count;
+    emitBytes(byte1, byte2);
+}
+
+static int jumpTarget()
+{
+    current->lastTarget = currentChunk()->count;
+    return current->lastTarget;
+}
+
+/*
+ * Emits 'op', folding it and the instructions before it into one of the
+ * superinstructions for the sequences that dominate the bench/ corpus (see
+ * bench/superops.py), unless a jump lands between them.
+*/
+static void emitFused(uint8_t op)
+{
+    Chunk *chunk = currentChunk();
+    int first = current->fusible[0];
+    int last = current->fusible[1];
+
+    // SET_LOCAL POP
+    if (op == OP_POP && last == chunk->count - 2 && last >= current->lastTarget &&
+        chunk->code[last] == OP_SET_LOCAL) {
+
+        chunk->code[last] = OP_SET_LOCAL_POP;
+        current->fusible[1] = -1;
+        return;
+    }
+
+    // GET_LOCAL GET_LOCAL ADD, GET_LOCAL CONSTANT ADD and GET_LOCAL CONSTANT LESS
+    int fused = -1;
+    if (first == chunk->count - 4 && last == chunk->count - 2 &&
+        first >= current->lastTarget && chunk->code[first] == OP_GET_LOCAL) {
+
+        if (op == OP_ADD && chunk->code[last] == OP_GET_LOCAL) {
+            fused = OP_ADD_LOCAL_LOCAL;
+        } else if (op == OP_ADD && chunk->code[last] == OP_CONSTANT) {
+            fused = OP_ADD_LOCAL_CONSTANT;
+        } else if (op == OP_LESS && chunk->code[last] == OP_CONSTANT) {
+            fused = OP_LESS_LOCAL_CONSTANT;
+        }
+    }
+
+    if (fused == -1) {
+        emitByte(op);
+        return;
+    }
+
+    chunk->code[first] = fused;
+    chunk->code[first + 2] = chunk->code[last + 1];
+    chunk->count = first + 3;
+    for (int i = first; i < chunk->count; i++) {
+        chunk->lines[i] = parser.previous.line;
+    }
+    current->fusible[0] = current->fusible[1] = -1;
+}
+
 static void emitLoop(int loopStart)
 {
     emitByte(OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
+    // The offset is taken after both operands
+    int offset = currentChunk()->count - loopStart + 4;
     if (offset > UINT16_MAX) error("Loop body too large.");
 
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
+
+    int loop = addLoop(currentChunk());
+    if (loop > UINT16_MAX) {
+        error("Too many loops in one chunk.");
+        return;
+    }
+
+    emitByte((loop >> 8) & 0xff);
+    emitByte(loop & 0xff);
 }
 
 static int emitJump(uint8_t instruction)
@@ -124,6 +196,18 @@ static void emitReturn()
     emitByte(OP_RETURN);
 }
 
+static void emitCache()
+{
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+        return;
+    }
+
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
 static uint8_t makeConstant(Value value)
 {
     int constant = addConstant(currentChunk(), value);
@@ -137,13 +221,13 @@ static uint8_t makeConstant(Value value)
 
 static void emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitFusible(OP_CONSTANT, makeConstant(value));
 }
 
 static void patchJump(int offset)
 {
     // -2 to adjust for the jump offset itself
-    int jump = currentChunk()->count - offset - 2;
+    int jump = jumpTarget() - offset - 2;
 
     if (jump > UINT16_MAX) {
         error("Too much code to jump over!");
@@ -159,7 +243,11 @@ static void initbCompiler(Compiler *compiler, FunctionType type)
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
+    compiler->captureCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
+    compiler->fusible[0] = compiler->fusible[1] = -1;
+    compiler->lastTarget = 0;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
@@ -170,6 +258,7 @@ static void initbCompiler(Compiler *compiler, FunctionType type)
     Local *local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isReassigned = false;
     if (type != TYPE_FUNCTION) {
         local->name.start = "self";
         local->name.length = 4;
@@ -179,11 +268,65 @@ static void initbCompiler(Compiler *compiler, FunctionType type)
     }
 }
 
+static void flattenUpvalue(ObjFunction *function, int upvalue)
+{
+    // The upvalue now holds the value itself, so every read of it in the
+    // function is patched. Closures nested inside that copy it through are
+    // flat as well. There are no writes to patch, or it wouldn't be flat.
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+
+        if (instruction == OP_GET_UPVALUE && chunk->code[offset + 1] == upvalue) {
+            chunk->code[offset] = OP_GET_UPVALUE_FLAT;
+        } else if (instruction == OP_CLOSURE) {
+            ObjFunction *inner = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            for (int i = 0; i < inner->upvalueCount; i++) {
+                uint8_t capture = chunk->code[offset + 2 + i * 2];
+                uint8_t index = chunk->code[offset + 3 + i * 2];
+                if (!(capture & UPVALUE_LOCAL) && index == upvalue) {
+                    flattenUpvalue(inner, i);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Called once a local goes out of scope, when it's known whether it was
+ * ever reassigned. Returns true if it's still captured by reference.
+*/
+static bool finishLocal(int local)
+{
+    bool isFlat = !current->locals[local].isReassigned;
+    bool isBoxed = false;
+
+    int count = 0;
+    for (int i = 0; i < current->captureCount; i++) {
+        Capture *capture = &current->captures[i];
+        if (capture->local != local) {
+            current->captures[count++] = *capture;
+        } else if (isFlat) {
+            currentChunk()->code[capture->offset] |= UPVALUE_FLAT;
+            flattenUpvalue(capture->function, capture->upvalue);
+        } else {
+            isBoxed = true;
+        }
+    }
+
+    current->captureCount = count;
+    return isBoxed;
+}
+
 static ObjFunction *endCompiler()
 {
     emitReturn();
     ObjFunction *function = current->function;
 
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        finishLocal(i);
+    }
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<Script>");
@@ -205,7 +348,7 @@ static void endScope()
 
     while (current->localCount > 0 &&
                 current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+        if (finishLocal(current->localCount - 1)) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
@@ -265,6 +408,17 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
     return compiler->function->upvalueCount++;
 }
 
+static void markReassigned(Compiler *compiler, uint8_t setOp, int arg)
+{
+    if (setOp == OP_SET_LOCAL) {
+        compiler->locals[arg].isReassigned = true;
+    } else if (setOp == OP_SET_UPVALUE) {
+        Upvalue *upvalue = &compiler->upvalues[arg];
+        markReassigned(compiler->enclosing, upvalue->isLocal ? OP_SET_LOCAL : OP_SET_UPVALUE,
+                       upvalue->index);
+    }
+}
+
 static int resolveUpvalue(Compiler *compiler, Token *name)
 {
     if (compiler->enclosing == NULL) return -1;
@@ -294,6 +448,7 @@ static void addLocal(Token name)
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isReassigned = false;
 }
 
 static void declareVariable()
@@ -387,9 +542,9 @@ static void binary(bool canAssign)
         case TOKEN_EQEQ:    emitByte(OP_EQUAL); break;
         case TOKEN_GT:      emitByte(OP_GREATER); break;
         case TOKEN_GTEQ:    emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LT:      emitByte(OP_LESS); break;
+        case TOKEN_LT:      emitFused(OP_LESS); break;
         case TOKEN_LTEQ:    emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:    emitByte(OP_ADD); break;
+        case TOKEN_PLUS:    emitFused(OP_ADD); break;
         case TOKEN_MINUS:   emitByte(OP_SUBTRACT); break;
         case TOKEN_STAR:    emitByte(OP_MULTIPLY); break;
         case TOKEN_SLASH:   emitByte(OP_DIVIDE); break;
@@ -402,6 +557,7 @@ static void binary(bool canAssign)
 static void call(bool canAssign)
 {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -413,20 +569,28 @@ static void dot(bool canAssign)
     if (canAssign && match(TOKEN_EQ)) {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitCache();
     } else if (canAssign && match(TOKEN_INCREMENT)) {
         emitBytes(OP_GET_PROPERTY_NOPOP, name);
+        emitCache();
         emitByte(OP_INCREMENT);
         emitBytes(OP_SET_PROPERTY, name);
+        emitCache();
     } else if (canAssign && match(TOKEN_DECREMENT)) {
         emitBytes(OP_GET_PROPERTY_NOPOP, name);
+        emitCache();
         emitByte(OP_DECREMENT);
         emitBytes(OP_SET_PROPERTY, name);
+        emitCache();
     } else if (match(TOKEN_LPAREN)) {
         uint8_t argCount = argumentList();
+        current->lastCall = currentChunk()->count;
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     } else {
         emitBytes(OP_GET_PROPERTY, name);
+        emitCache();
     }
 }
 
@@ -469,6 +633,12 @@ static void string(bool canAssign)
     emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+static void emitSetVariable(uint8_t setOp, int arg)
+{
+    markReassigned(current, setOp, arg);
+    emitFusible(setOp, (uint8_t)arg);
+}
+
 static void namedVariable(Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
@@ -487,17 +657,17 @@ static void namedVariable(Token name, bool canAssign)
 
     if (canAssign && match(TOKEN_EQ)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitSetVariable(setOp, arg);
     } else if (canAssign && match(TOKEN_INCREMENT)) {
         namedVariable(name, false);
         emitByte(OP_INCREMENT);
-        emitBytes(setOp, (uint8_t)arg);
+        emitSetVariable(setOp, arg);
     } else if (canAssign && match(TOKEN_DECREMENT)) {
         namedVariable(name, false);
         emitByte(OP_DECREMENT);
-        emitBytes(setOp, (uint8_t)arg);
+        emitSetVariable(setOp, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitFusible(getOp, (uint8_t)arg);
     }
 }
 
@@ -532,6 +702,7 @@ static void super(bool canAssign)
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_SUPER_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     } else {
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_GET_SUPER, name);
@@ -575,7 +746,7 @@ static void unary(bool canAssign)
             if (canAssign) {
                 namedVariable(name, false);
                 emitByte(OP_INCREMENT);
-                emitBytes(setOp, (uint8_t)arg);
+                emitSetVariable(setOp, arg);
             }
         } break;
         case TOKEN_DECREMENT: {
@@ -593,7 +764,7 @@ static void unary(bool canAssign)
             if (canAssign) {
                 namedVariable(name, false);
                 emitByte(OP_DECREMENT);
-                emitBytes(setOp, (uint8_t)arg);
+                emitSetVariable(setOp, arg);
             }
         } break;
         default:                return; // Unreachable
@@ -725,8 +896,23 @@ static void function(FunctionType type)
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        Upvalue *upvalue = &compiler.upvalues[i];
+
+        if (upvalue->isLocal) {
+            if (current->captureCount < CAPTURES_MAX) {
+                Capture *capture = &current->captures[current->captureCount++];
+                capture->local = upvalue->index;
+                capture->offset = currentChunk()->count;
+                capture->function = function;
+                capture->upvalue = (uint8_t)i;
+            } else {
+                // Too many pending captures to track, keep it by reference
+                current->locals[upvalue->index].isReassigned = true;
+            }
+        }
+
+        emitByte(upvalue->isLocal ? UPVALUE_LOCAL : 0);
+        emitByte(upvalue->index);
     }
 }
 
@@ -822,7 +1008,7 @@ static void expressionStatement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
-    emitByte(OP_POP);
+    emitFused(OP_POP);
 }
 
 static void forStatement()
@@ -837,7 +1023,7 @@ static void forStatement()
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = jumpTarget();
 
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON)) {
@@ -851,9 +1037,9 @@ static void forStatement()
 
     if (!match(TOKEN_RPAREN)) {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        int incrementStart = jumpTarget();
         expression();
-        emitByte(OP_POP);
+        emitFused(OP_POP);
         consume(TOKEN_RPAREN, "Expected ')' after for clauses.");
 
         emitLoop(loopStart);
@@ -898,6 +1084,22 @@ static void printStatement()
     emitByte(OP_PRINT);
 }
 
+static void markTailCall()
+{
+    // The return value is in tail position, so a call that was the last
+    // instruction emitted can reuse the frame. The OP_RETURN after it is
+    // still needed for natives and for jumps that land past the call.
+    Chunk *chunk = currentChunk();
+    int offset = current->lastCall;
+    if (offset == -1) return;
+
+    if (chunk->code[offset] == OP_CALL && offset + 2 == chunk->count) {
+        chunk->code[offset] = OP_TAIL_CALL;
+    } else if (chunk->code[offset] == OP_INVOKE && offset + 5 == chunk->count) {
+        chunk->code[offset] = OP_TAIL_INVOKE;
+    }
+}
+
 static void returnStatement()
 {
     if (current->type == TYPE_SCRIPT) {
@@ -913,13 +1115,14 @@ static void returnStatement()
 
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
+        markTailCall();
         emitByte(OP_RETURN);
     }
 }
 
 static void whileStatement()
 {
-    int loopStart = currentChunk()->count;
+    int loopStart = jumpTarget();
 
     consume(TOKEN_LPAREN, "Expected '(' after 'while'.");
     expression();
@@ -38,6 +38,7 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    bool isReassigned;
 } Local;
 
 typedef struct {
@@ -45,6 +46,17 @@ typedef struct {
     bool isLocal;
 } Upvalue;
 
+// An OP_CLOSURE capture of a local, patched to a flat copy if the local
+// turns out to never be reassigned by the time it goes out of scope.
+typedef struct {
+    int local;
+    int offset;             // Offset of the capture descriptor byte
+    ObjFunction *function;  // The function capturing the local
+    uint8_t upvalue;        // Its upvalue index in that function
+} Capture;
+
+#define CAPTURES_MAX UINT8_COUNT
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_INITIALIZER,
@@ -60,7 +72,12 @@ typedef struct Compiler {
     Local locals[UINT8_COUNT];
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
+    Capture captures[CAPTURES_MAX];
+    int captureCount;
     int scopeDepth;
+    int lastCall;   // Offset of the most recent call instruction, or -1
+    int fusible[2]; // Offsets of the latest two variable or constant ops
+    int lastTarget; // Offset of the latest jump target, nothing is fused across it
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -2,6 +2,7 @@
 
 #include "clox_chunk.h"
 #include "clox_memory.h"
+#include "clox_trace.h"
 #include "clox_vm.h"
 
 int addConstant(Chunk *chunk, Value value)
@@ -12,12 +13,92 @@ int addConstant(Chunk *chunk, Value value)
     return chunk->constants.count - 1;
 }
 
+int addInlineCache(Chunk *chunk)
+{
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->epoch = 0;
+    cache->count = 0;
+    return chunk->cacheCount++;
+}
+
+int addLoop(Chunk *chunk)
+{
+    if (chunk->loopCapacity < chunk->loopCount + 1) {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loops = GROW_ARRAY(HotLoop, chunk->loops, oldCapacity, chunk->loopCapacity);
+    }
+
+    HotLoop *loop = &chunk->loops[chunk->loopCount];
+    loop->hotness = 0;
+    loop->aborts = 0;
+    loop->trace = NULL;
+    return chunk->loopCount++;
+}
+
+int instructionLength(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_FLAT:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_GENERIC:
+        case OP_GET_FIELD:
+        case OP_GET_PROPERTY_NOPOP:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_LOOP:
+            return 5;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
 void initChunk(Chunk *chunk)
 {
     chunk->code = NULL;
     chunk->lines = NULL;
     chunk->count = 0;
     chunk->capacity = 0;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->loops = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
     initValueArray(&chunk->constants);
 }
 
@@ -25,6 +106,9 @@ void freeChunk(Chunk *chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    for (int i = 0; i < chunk->loopCount; i++) freeTrace(chunk->loops[i].trace);
+    FREE_ARRAY(HotLoop, chunk->loops, chunk->loopCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
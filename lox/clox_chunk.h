@@ -16,15 +16,23 @@ typedef enum {
     OP_DEFINE_GLOBAL,
     OP_SET_GLOBAL,
     OP_GET_UPVALUE,
+    OP_GET_UPVALUE_FLAT,
     OP_SET_UPVALUE,
     OP_GET_PROPERTY,
+    OP_GET_PROPERTY_GENERIC,
+    OP_GET_FIELD,
     OP_GET_PROPERTY_NOPOP,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
     OP_EQUAL,
+    OP_EQUAL_GENERIC,
+    OP_EQUAL_NUM,
     OP_GREATER,
     OP_LESS,
     OP_ADD,
+    OP_ADD_GENERIC,
+    OP_ADD_NUM,
+    OP_ADD_STR,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -34,12 +42,18 @@ typedef enum {
     OP_NEGATE,
     OP_INCREMENT,
     OP_DECREMENT,
+    OP_SET_LOCAL_POP,           // Superinstructions picked with bench/superops.py
+    OP_ADD_LOCAL_LOCAL,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_LESS_LOCAL_CONSTANT,
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_INVOKE,
+    OP_TAIL_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
@@ -49,15 +63,77 @@ typedef enum {
     OP_RETURN,
 } OpCode;
 
+/*
+ * The _GENERIC, _NUM, _STR and OP_GET_FIELD opcodes are never emitted by
+ * the compiler. The first execution of OP_ADD, OP_EQUAL or OP_GET_PROPERTY
+ * rewrites the instruction in place to a variant specialized for what it
+ * saw. A specialized instruction whose guard fails is rewritten to the
+ * _GENERIC variant, which never specializes again.
+*/
+
+// Capture descriptor bits following OP_CLOSURE, one byte per upvalue
+#define UPVALUE_LOCAL   0x01    // Captures a local of the enclosing function
+#define UPVALUE_FLAT    0x02    // Copies the local, as it's never reassigned
+
+// Number of receiver types an inline cache remembers before the site is
+// treated as megamorphic and always takes the slow path.
+#define IC_WAYS 4
+
+struct ObjClass;
+struct ObjClosure;
+struct ObjShape;
+struct Trace;
+
+typedef struct {
+    struct ObjShape *shape;         // Receiver shape (NULL for super calls)
+    struct ObjClass *klass;         // Receiver class, or the superclass
+    struct ObjShape *transition;    // Shape after a cached field add
+    struct ObjClosure *method;      // Method hit, NULL for a field hit
+    int slot;                       // Field slot for field hits
+} CacheEntry;
+
+/*
+ * Per-instruction inline cache for property access and method invocation.
+ * Entries are only valid for the vm.cacheEpoch they were filled in, which
+ * is bumped whenever the method table of a class with cached methods
+ * changes.
+*/
+typedef struct {
+    uint32_t epoch;
+    int count;
+    CacheEntry entries[IC_WAYS];
+} InlineCache;
+
+/*
+ * Per-loop state of the tracing JIT, indexed by the second operand of
+ * OP_LOOP. A backedge taken HOT_LOOP times records a trace of the loop.
+*/
+typedef struct {
+    int hotness;            // Backedges taken since the last recording
+    int aborts;             // Failed recordings, see MAX_ABORTS
+    struct Trace *trace;
+} HotLoop;
+
 typedef struct {
     uint8_t *code;
     ValueArray constants;
     int *lines;
     int count;
     int capacity;
+
+    InlineCache *caches;
+    int cacheCount;
+    int cacheCapacity;
+
+    HotLoop *loops;
+    int loopCount;
+    int loopCapacity;
 } Chunk;
 
 int addConstant(Chunk *chunk, Value value);
+int addInlineCache(Chunk *chunk);
+int addLoop(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
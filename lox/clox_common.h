@@ -9,6 +9,7 @@
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_PROFILE_OPCODES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
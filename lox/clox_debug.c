@@ -13,13 +13,24 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+static int propertyInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (IC %d)\n", cache);
+    return offset + 4;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
     printf("%-16s   (Argc: %d) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    printf("' (IC %d)\n", cache);
+    return offset + 5;
 }
 
 static int simpleInstruction(const char *name, int offset)
@@ -35,6 +46,20 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+static int localInstruction(const char *name, bool constant, Chunk *chunk, int offset)
+{
+    uint8_t operand = chunk->code[offset + 2];
+    printf("%-16s %4d ", name, chunk->code[offset + 1]);
+    if (constant) {
+        printf("'");
+        printValue(chunk->constants.values[operand]);
+        printf("'\n");
+    } else {
+        printf("%4d\n", operand);
+    }
+    return offset + 3;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -43,6 +68,14 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int loopInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    uint16_t loop = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s %4d -> %d (loop %d)\n", name, offset, offset + 5 - jump, loop);
+    return offset + 5;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
@@ -66,15 +99,23 @@ int disassembleInstruction(Chunk *chunk, int offset)
         case OP_DEFINE_GLOBAL:      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:         return constantInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:        return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_GET_UPVALUE_FLAT:   return byteInstruction("OP_GET_UPVALUE_FLAT", chunk, offset);
         case OP_SET_UPVALUE:        return byteInstruction("OP_SET_UPVALUE", chunk, offset);
-        case OP_GET_PROPERTY:       return constantInstruction("OP_GET_PROPERTY", chunk, offset);
-        case OP_GET_PROPERTY_NOPOP: return constantInstruction("OP_GET_PROPERTY_NOPOP", chunk, offset);
-        case OP_SET_PROPERTY:       return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY:       return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY_GENERIC: return propertyInstruction("OP_GET_PROPERTY_GENERIC", chunk, offset);
+        case OP_GET_FIELD:          return propertyInstruction("OP_GET_FIELD", chunk, offset);
+        case OP_GET_PROPERTY_NOPOP: return propertyInstruction("OP_GET_PROPERTY_NOPOP", chunk, offset);
+        case OP_SET_PROPERTY:       return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:          return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:              return simpleInstruction("OP_EQUAL", offset);
+        case OP_EQUAL_GENERIC:      return simpleInstruction("OP_EQUAL_GENERIC", offset);
+        case OP_EQUAL_NUM:          return simpleInstruction("OP_EQUAL_NUM", offset);
         case OP_GREATER:            return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:               return simpleInstruction("OP_LESS", offset);
         case OP_ADD:                return simpleInstruction("OP_ADD", offset);
+        case OP_ADD_GENERIC:        return simpleInstruction("OP_ADD_GENERIC", offset);
+        case OP_ADD_NUM:            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:            return simpleInstruction("OP_ADD_STR", offset);
         case OP_SUBTRACT:           return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:           return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:             return simpleInstruction("OP_DIVIDE", offset);
@@ -84,12 +125,18 @@ int disassembleInstruction(Chunk *chunk, int offset)
         case OP_NEGATE:             return simpleInstruction("OP_NEGATE", offset);
         case OP_INCREMENT:          return simpleInstruction("OP_INCREMENT", offset);
         case OP_DECREMENT:          return simpleInstruction("OP_DECREMENT", offset);
+        case OP_SET_LOCAL_POP:      return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_ADD_LOCAL_LOCAL:    return localInstruction("OP_ADD_LOCAL_LOCAL", false, chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT: return localInstruction("OP_ADD_LOCAL_CONSTANT", true, chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT: return localInstruction("OP_LESS_LOCAL_CONSTANT", true, chunk, offset);
         case OP_PRINT:              return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:               return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:      return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
-        case OP_LOOP:               return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_LOOP:               return loopInstruction("OP_LOOP", chunk, offset);
         case OP_CALL:               return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:          return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:        return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
             offset++;
@@ -100,12 +147,12 @@ int disassembleInstruction(Chunk *chunk, int offset)
 
             ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
+                int capture = chunk->code[offset++];
                 int index = chunk->code[offset++];
                 printf(
                        "%04d    |                     %s %d\n",
                        offset - 2,
-                       isLocal ? "local" : "upvalue",
+                       (capture & UPVALUE_FLAT) ? "flat" : (capture & UPVALUE_LOCAL) ? "local" : "upvalue",
                        index
                 );
             }
@@ -132,3 +179,65 @@ void disassembleChunk(Chunk *chunk, const char *name)
         offset = disassembleInstruction(chunk, offset);
     }
 }
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define TRIPLE_MAX 4096
+
+typedef struct {
+    uint32_t key;
+    uint64_t count;
+} TripleCount;
+
+static uint64_t executed;
+static uint64_t pairs[UINT8_COUNT][UINT8_COUNT];
+static TripleCount triples[TRIPLE_MAX];
+
+// The instructions that ran last and where the latest one ends
+static Chunk *lastChunk;
+static int lastEnd = -1;
+static int lastOps[2];
+static int run;
+
+void profileInstruction(Chunk *chunk, int offset)
+{
+    uint8_t op = chunk->code[offset];
+    executed++;
+
+    // A call, return or taken jump starts a new straight-line run
+    if (chunk != lastChunk || offset != lastEnd) run = 0;
+
+    if (run >= 1) pairs[lastOps[1]][op]++;
+    if (run >= 2) {
+        uint32_t key = (uint32_t)lastOps[0] << 16 | (uint32_t)lastOps[1] << 8 | op;
+        uint32_t index = (key * 2654435761u) % TRIPLE_MAX;
+        while (triples[index].count != 0 && triples[index].key != key) {
+            index = (index + 1) % TRIPLE_MAX;
+        }
+        triples[index].key = key;
+        triples[index].count++;
+    }
+
+    lastChunk = chunk;
+    lastEnd = offset + instructionLength(chunk, offset);
+    lastOps[0] = lastOps[1];
+    lastOps[1] = op;
+    if (run < 2) run++;
+}
+
+void printProfile()
+{
+    fprintf(stderr, "executed %lu\n", (unsigned long)executed);
+    for (int a = 0; a < UINT8_COUNT; a++) {
+        for (int b = 0; b < UINT8_COUNT; b++) {
+            if (pairs[a][b] == 0) continue;
+            fprintf(stderr, "pair %d %d %lu\n", a, b, (unsigned long)pairs[a][b]);
+        }
+    }
+    for (int i = 0; i < TRIPLE_MAX; i++) {
+        if (triples[i].count == 0) continue;
+        uint32_t key = triples[i].key;
+        fprintf(stderr, "triple %u %u %u %lu\n",
+                key >> 16, (key >> 8) & 0xff, key & 0xff, (unsigned long)triples[i].count);
+    }
+}
+#endif // DEBUG_PROFILE_OPCODES
@@ -6,4 +6,14 @@
 int disassembleInstruction(Chunk *chunk, int offset);
 void disassembleChunk(Chunk *chunk, const char *name);
 
+#ifdef DEBUG_PROFILE_OPCODES
+/*
+ * Counts the instruction at 'offset' along with the one or two instructions
+ * that fell through into it. printProfile() dumps the counts to stderr for
+ * bench/superops.py.
+*/
+void profileInstruction(Chunk *chunk, int offset);
+void printProfile();
+#endif // DEBUG_PROFILE_OPCODES
+
 #endif // CLOX_DEBUG_H
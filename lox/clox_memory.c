@@ -2,6 +2,7 @@
 
 #include "clox_bcompiler.h"
 #include "clox_memory.h"
+#include "clox_snapshot.h"
 #include "clox_vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -35,7 +36,7 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
 void markObject(Obj *object)
 {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (objIsMarked(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p | Marked: ", (void *)object);
@@ -43,7 +44,7 @@ void markObject(Obj *object)
     printf("\n");
 #endif // DEBUG_LOG_GC
 
-    object->isMarked = true;
+    objSetMarked(object, true);
 
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -67,6 +68,22 @@ static void markArray(ValueArray *array)
     }
 }
 
+static void markCaches(Chunk *chunk)
+{
+    // Cache entries hold strong references so a stale entry can never
+    // match a new object allocated at a freed address.
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache *cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count; j++) {
+            CacheEntry *entry = &cache->entries[j];
+            markObject((Obj *)entry->shape);
+            markObject((Obj *)entry->klass);
+            markObject((Obj *)entry->transition);
+            markObject((Obj *)entry->method);
+        }
+    }
+}
+
 static void blackenObject(Obj *object)
 {
 #ifdef DEBUG_LOG_GC
@@ -75,7 +92,7 @@ static void blackenObject(Obj *object)
     printf("\n");
 #endif // DEBUG_LOG_GC
 
-    switch (object->type) {
+    switch (objType(object)) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = (ObjBoundMethod *)object;
             markValue(bound->receiver);
@@ -90,23 +107,40 @@ static void blackenObject(Obj *object)
             ObjClosure *closure = (ObjClosure *)object;
             markObject((Obj *)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj *)closure->upvalues[i]);
+                markValue(closure->upvalues[i]);
             }
         } break;
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *)object;
             markObject((Obj *)function->name);
+            markObject((Obj *)function->closure);
             markArray(&function->chunk.constants);
+            markCaches(&function->chunk);
         } break;
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
             markObject((Obj *)instance->class);
-            markTable(&instance->fields);
+            if (instance->shape != NULL) {
+                markObject((Obj *)instance->shape);
+                for (int i = 0; i < instance->shape->fieldCount; i++) {
+                    markValue(instance->fields[i]);
+                }
+            }
+            markTable(&instance->dictionary);
+        } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            for (int i = 0; i < shape->fieldCount; i++) {
+                markObject((Obj *)shape->names[i]);
+            }
+            markTable(&shape->transitions);
         } break;
         case OBJ_UPVALUE: {
             markValue(((ObjUpvalue *)object)->closed);
         } break;
-        case OBJ_NATIVE:    break;
+        case OBJ_NATIVE: {
+            markObject((Obj *)((ObjNative *)object)->name);
+        } break;
         case OBJ_STRING:    break;
     }
 }
@@ -114,10 +148,10 @@ static void blackenObject(Obj *object)
 static void freeObject(Obj *object)
 {
 #ifdef DEBUG_LOG_GC
-    printf("%p | Freed Type: %d\n", (void *)object, object->type);
+    printf("%p | Freed Type: %d\n", (void *)object, objType(object));
 #endif // DEBUG_LOG_GC
 
-    switch (object->type) {
+    switch (objType(object)) {
         case OBJ_BOUND_METHOD: {
             FREE(ObjBoundMethod, object);
         } break;
@@ -128,7 +162,7 @@ static void freeObject(Obj *object)
         } break;
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *)object;
-            FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
+            FREE_ARRAY(Value, closure->upvalues, closure->upvalueCount);
             FREE(ObjClosure, object);
         } break;
         case OBJ_FUNCTION: {
@@ -138,12 +172,21 @@ static void freeObject(Obj *object)
         } break;
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            }
+            freeTable(&instance->dictionary);
+            reallocate(object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
         } break;
         case OBJ_NATIVE: {
             FREE(ObjNative, object);
         } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            FREE_ARRAY(ObjString *, shape->names, shape->fieldCount);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+        } break;
         case OBJ_STRING: {
             ObjString *string = (ObjString *)object;
             FREE_ARRAY(char, string->chars, string->length + 1);
@@ -171,7 +214,9 @@ static void markRoots()
 
     markTable(&vm.globals);
     markbCompilerRoots();
+    markSnapshotRoots();
     markObject((Obj *)vm.initString);
+    markObject((Obj *)vm.rootShape);
 }
 
 static void traceReferences()
@@ -187,15 +232,15 @@ static void sweep()
     Obj *previous = NULL;
     Obj *object = vm.objects;
     while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
+        if (objIsMarked(object)) {
+            objSetMarked(object, false);
             previous = object;
-            object = object->next;
+            object = objNext(object);
         } else {
             Obj *unreached = object;
-            object = object->next;
+            object = objNext(object);
             if (previous != NULL) {
-                previous->next = object;
+                objSetNext(previous, object);
             } else {
                 vm.objects = object;
             }
@@ -230,7 +275,7 @@ void freeObjects()
 {
     Obj *object = vm.objects;
     while (object != NULL) {
-        Obj *next = object->next;
+        Obj *next = objNext(object);
         freeObject(object);
         object = next;
     }
@@ -12,10 +12,8 @@
 static Obj *allocateObject(size_t size, ObjType type)
 {
     Obj *object = (Obj *)reallocate(NULL, 0, size);
-    object->type = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;
+    object->header = (uint64_t)type << OBJ_TYPE_SHIFT;
+    objSetNext(object, vm.objects);
     vm.objects = object;
 
 #ifdef DEBUG_LOG_GC
@@ -62,6 +60,8 @@ ObjClass *newClass(ObjString *name)
 {
     ObjClass *class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     class->name = name;
+    class->fieldHint = 0;
+    class->methodsCached = false;
     initTable(&class->methods);
     return class;
 }
@@ -77,9 +77,9 @@ ObjUpvalue *newUpvalue(Value *slot)
 
 ObjClosure *newClosure(ObjFunction *function)
 {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+    Value *upvalues = ALLOCATE(Value, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
+        upvalues[i] = NIL_VAL;
     }
 
     ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
@@ -96,25 +96,159 @@ ObjFunction *newFunction()
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->closure = NULL;
+    function->trampoline = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
 ObjInstance *newInstance(ObjClass *class)
 {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int inlineCapacity = class->fieldHint;
+    ObjInstance *instance = (ObjInstance *)allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
+
     instance->class = class;
-    initTable(&instance->fields);
+    instance->shape = vm.rootShape;
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
+    initTable(&instance->dictionary);
     return instance;
 }
 
-ObjNative *newNative(NativeFn function)
+ObjNative *newNative(NativeFn function, ObjString *name, int arity)
 {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->name = name;
+    native->arity = arity;
     return native;
 }
 
+ObjShape *newShape()
+{
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->fieldCount = 0;
+    shape->names = NULL;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name)
+{
+    Value existing;
+    if (tableGet(&shape->transitions, name, &existing)) {
+        return AS_SHAPE(existing);
+    }
+
+    ObjShape *child = newShape();
+    push(OBJ_VAL(child));
+
+    child->names = ALLOCATE(ObjString *, shape->fieldCount + 1);
+    for (int i = 0; i < shape->fieldCount; i++) {
+        child->names[i] = shape->names[i];
+    }
+    child->names[shape->fieldCount] = name;
+    child->fieldCount = shape->fieldCount + 1;
+
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    pop();
+
+    return child;
+}
+
+int shapeSlot(ObjShape *shape, ObjString *name)
+{
+    // Shapes are small and names are interned, so a backwards scan
+    // comparing pointers beats hashing.
+    for (int i = shape->fieldCount - 1; i >= 0; i--) {
+        if (shape->names[i] == name) return i;
+    }
+
+    return -1;
+}
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value)
+{
+    if (instance->shape == NULL) {
+        return tableGet(&instance->dictionary, name, value);
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+static void growFields(ObjInstance *instance, int count)
+{
+    if (count <= instance->fieldCapacity) return;
+
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (capacity > SHAPE_MAX_FIELDS) capacity = SHAPE_MAX_FIELDS;
+
+    if (instance->fields == instance->inlineFields) {
+        Value *fields = ALLOCATE(Value, capacity);
+        for (int i = 0; i < oldCapacity; i++) {
+            fields[i] = instance->inlineFields[i];
+        }
+        instance->fields = fields;
+    } else {
+        instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+    }
+
+    instance->fieldCapacity = capacity;
+}
+
+static void enterDictionaryMode(ObjInstance *instance)
+{
+    // The shape stays in place (and so keeps the fields marked) until
+    // every field has been copied over, as tableSet() can trigger a GC.
+    ObjShape *shape = instance->shape;
+    for (int i = 0; i < shape->fieldCount; i++) {
+        tableSet(&instance->dictionary, shape->names[i], instance->fields[i]);
+    }
+
+    instance->shape = NULL;
+    if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    }
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = instance->inlineCapacity;
+}
+
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value)
+{
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            instance->fields[slot] = value;
+            return;
+        }
+
+        if (instance->shape->fieldCount < SHAPE_MAX_FIELDS) {
+            int count = instance->shape->fieldCount + 1;
+            growFields(instance, count);
+
+            ObjShape *shape = shapeTransition(instance->shape, name);
+            instance->fields[count - 1] = value;
+            instance->shape = shape;
+
+            if (count > instance->class->fieldHint) {
+                instance->class->fieldHint = count;
+            }
+            return;
+        }
+
+        enterDictionaryMode(instance);
+    }
+
+    tableSet(&instance->dictionary, name, value);
+}
+
 ObjString *takeString(char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
@@ -128,6 +262,21 @@ ObjString *takeString(char *chars, int length)
     return allocateString(chars, length, hash);
 }
 
+/*
+ * Allocates before anything is released, so 'a' and 'b' must be
+ * reachable by the GC, for instance from the stack.
+*/
+ObjString *concatStrings(ObjString *a, ObjString *b)
+{
+    int length = a->length + b->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+
+    return takeString(chars, length);
+}
+
 ObjString *copyString(const char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
@@ -163,6 +312,7 @@ void printObject(Value value)
             printf("%s Instance", AS_INSTANCE(value)->class->name->chars);
         } break;
         case OBJ_NATIVE:    printf("<fn native>"); break;
+        case OBJ_SHAPE:     printf("shape"); break;
         case OBJ_STRING:    printf("%s", AS_CSTRING(value)); break;
         case OBJ_UPVALUE:   printf("upvalue"); break;
         default:            return; // Unreachable
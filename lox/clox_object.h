@@ -1,13 +1,15 @@
 #ifndef CLOX_OBJECT_H
 #define CLOX_OBJECT_H
 
+#include <assert.h>
+
 #include "clox_common.h"
 #include "clox_chunk.h"
 #include "clox_table.h"
 #include "clox_value.h"
 
 // Checks if the value is of type Obj
-#define OBJ_TYPE(value)     (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)     (objType(AS_OBJ(value)))
 
 // Checks more specifically what type of Obj it is
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
@@ -16,6 +18,7 @@
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
 
 // Casts the value to that Obj type
@@ -24,8 +27,10 @@
 #define AS_CLOSURE(value)       ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance *)AS_OBJ(value))
-#define AS_NATIVE(value)        (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value)        ((ObjNative *)AS_OBJ(value))
+#define AS_SHAPE(value)         ((ObjShape *)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString *)AS_OBJ(value))
+#define AS_UPVALUE(value)       ((ObjUpvalue *)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString *)AS_OBJ(value))->chars)
 
 typedef enum {
@@ -35,14 +40,32 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
 
+/*
+ * Every heap object starts with a single packed header word rather than
+ * separate type, mark, and next fields. User-space pointers on the 64-bit
+ * targets we care about fit in 48 bits, which leaves the top 16 bits free:
+ *
+ *   bits  0-47 | next object in the vm.objects list
+ *   bits 48-55 | ObjType
+ *   bit     56 | GC mark bit
+ *
+ * 5-level paging (LA57) and allocators that tag the top bits break that
+ * assumption, so objSetNext() asserts every pointer it packs fits.
+*/
+#define OBJ_NEXT_MASK       ((UINT64_C(1) << 48) - 1)
+#define OBJ_TYPE_SHIFT      48
+#define OBJ_TYPE_MASK       ((uint64_t)0xff << OBJ_TYPE_SHIFT)
+#define OBJ_MARK_BIT        (UINT64_C(1) << 56)
+
+_Static_assert(sizeof(void *) <= sizeof(uint64_t), "Object pointers must fit in the packed header.");
+
 struct Obj {
-    ObjType type;
-    bool isMarked;
-    struct Obj *next;
+    uint64_t header;
 };
 
 typedef struct {
@@ -51,20 +74,31 @@ typedef struct {
     int upvalueCount;
     Chunk chunk;
     ObjString *name;
+    struct ObjClosure *closure;     // Shared closure when upvalueCount is 0
+    void *trampoline;               // Its perf trampoline, once called under --perf-map
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args, ...);
+/*
+ * Natives store their return value in *result and return true. On failure
+ * they report a runtimeError() and return false. The argument count has
+ * already been checked against the arity unless it's NATIVE_VARIADIC.
+*/
+typedef bool (*NativeFn)(int argCount, Value *args, Value *result);
+
+#define NATIVE_VARIADIC -1
 
 typedef struct {
     Obj obj;
     NativeFn function;
+    ObjString *name;
+    int arity;
 } ObjNative;
 
 struct ObjString {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    char *chars;
 };
 
 typedef struct ObjUpvalue {
@@ -74,23 +108,48 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction *function;
-    ObjUpvalue **upvalues;
+    Value *upvalues;    // An ObjUpvalue, or the captured value itself if flat
     int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+typedef struct ObjClass {
     Obj obj;
     ObjString *name;
     Table methods;
+    int fieldHint;      // Inline field slots given to new instances
+    bool methodsCached; // An inline cache may hold one of its methods
 } ObjClass;
 
+// Past this many fields an instance gives up on shapes and falls back to
+// a per-instance hash table ("dictionary mode").
+#define SHAPE_MAX_FIELDS 32
+
+/*
+ * A shape (hidden class) describes the layout of an instance's fields.
+ * Instances that had the same fields added in the same order share a
+ * shape, which maps each field name to a slot in the instance's field
+ * array. Adding a field moves an instance along a transition to a child
+ * shape; all shapes descend from vm.rootShape.
+*/
+typedef struct ObjShape {
+    Obj obj;
+    int fieldCount;
+    ObjString **names;      // Field names, indexed by slot
+    Table transitions;      // Field name -> child ObjShape
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjClass *class;
-    Table fields;
+    ObjShape *shape;        // NULL once the instance is in dictionary mode
+    Value *fields;          // Points at inlineFields until they are outgrown
+    int fieldCapacity;
+    int inlineCapacity;
+    Table dictionary;       // Only used in dictionary mode
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -105,14 +164,50 @@ ObjUpvalue *newUpvalue(Value *slot);
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *class);
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(NativeFn function, ObjString *name, int arity);
+ObjShape *newShape();
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+int shapeSlot(ObjShape *shape, ObjString *name);
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
+ObjString *concatStrings(ObjString *a, ObjString *b);
 void printObject(Value value);
 
+static inline ObjType objType(Obj *object)
+{
+    return (ObjType)((object->header & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT);
+}
+
+static inline bool objIsMarked(Obj *object)
+{
+    return (object->header & OBJ_MARK_BIT) != 0;
+}
+
+static inline void objSetMarked(Obj *object, bool isMarked)
+{
+    if (isMarked) {
+        object->header |= OBJ_MARK_BIT;
+    } else {
+        object->header &= ~OBJ_MARK_BIT;
+    }
+}
+
+static inline Obj *objNext(Obj *object)
+{
+    return (Obj *)(uintptr_t)(object->header & OBJ_NEXT_MASK);
+}
+
+static inline void objSetNext(Obj *object, Obj *next)
+{
+    assert(((uint64_t)(uintptr_t)next & ~OBJ_NEXT_MASK) == 0 && "Pointer doesn't fit in 48 bits");
+    object->header = (object->header & ~OBJ_NEXT_MASK) | ((uint64_t)(uintptr_t)next & OBJ_NEXT_MASK);
+}
+
 static inline bool isObjType(Value value, ObjType type)
 {
-    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+    return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
 }
 
 #endif // CLOX_OBJECT_H
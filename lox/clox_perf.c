@@ -0,0 +1,117 @@
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS and getpid() aren't part of C99
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox_perf.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define PERF_NATIVE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define TRAMPOLINE_SIZE 16          // Each copy, padded to keep them aligned
+#define ARENA_SIZE      (1 << 16)   // Trampolines mapped at a time
+
+typedef InterpretResult (*TrampolineFn)(int base, PerfEntry entry);
+
+typedef struct Arena {
+    struct Arena *next;
+    uint8_t *code;
+    int used;
+} Arena;
+
+static FILE *perfMap = NULL;
+static Arena *arenas = NULL;
+
+#ifdef PERF_NATIVE
+// push rbp; mov rbp, rsp; call rsi; pop rbp; ret
+// 'base' is still in edi for the call. Setting up a frame keeps the
+// trampoline on the chain perf's frame pointer unwinding walks.
+static const uint8_t trampolineCode[] = {0x55, 0x48, 0x89, 0xe5, 0xff, 0xd6, 0x5d, 0xc3};
+
+/*
+ * Trampolines are all the same code, so an arena is filled with copies
+ * once and made executable before any are handed out. Only the map tells
+ * them apart.
+*/
+static Arena *newArena()
+{
+    void *code = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+
+    memset(code, 0xcc, ARENA_SIZE);     // int3 between copies
+    for (int offset = 0; offset < ARENA_SIZE; offset += TRAMPOLINE_SIZE) {
+        memcpy((uint8_t *)code + offset, trampolineCode, sizeof(trampolineCode));
+    }
+
+    // Writable and executable are never both set
+    mprotect(code, ARENA_SIZE, PROT_READ | PROT_EXEC);
+
+    Arena *arena = (Arena *)malloc(sizeof(Arena));
+    if (arena == NULL) exit(1);
+    arena->next = arenas;
+    arena->code = (uint8_t *)code;
+    arena->used = 0;
+    arenas = arena;
+    return arena;
+}
+
+static void *newTrampoline(ObjFunction *function)
+{
+    Arena *arena = arenas;
+    if (arena == NULL || arena->used == ARENA_SIZE) arena = newArena();
+    if (arena == NULL) return NULL;
+
+    uint8_t *trampoline = arena->code + arena->used;
+    arena->used += TRAMPOLINE_SIZE;
+
+    // Freed functions keep their entries, perf has no way to retract one
+    const char *name = function->name != NULL ? function->name->chars : "<script>";
+    fprintf(perfMap, "%lx %x lox::%s\n", (unsigned long)(uintptr_t)trampoline, TRAMPOLINE_SIZE, name);
+    fflush(perfMap);
+    return trampoline;
+}
+#endif // PERF_NATIVE
+
+bool initPerfMap()
+{
+#ifdef PERF_NATIVE
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perfMap = fopen(path, "w");
+    return perfMap != NULL;
+#else
+    return false;
+#endif // PERF_NATIVE
+}
+
+InterpretResult perfTrampoline(ObjFunction *function, PerfEntry entry, int base)
+{
+#ifdef PERF_NATIVE
+    if (function->trampoline == NULL) function->trampoline = newTrampoline(function);
+    if (function->trampoline != NULL) {
+        TrampolineFn trampoline = (TrampolineFn)(uintptr_t)function->trampoline;
+        return trampoline(base, entry);
+    }
+#endif // PERF_NATIVE
+
+    return entry(base);
+}
+
+void freePerfMap()
+{
+    if (perfMap != NULL) fclose(perfMap);
+    perfMap = NULL;
+
+    while (arenas != NULL) {
+        Arena *next = arenas->next;
+#ifdef PERF_NATIVE
+        munmap(arenas->code, ARENA_SIZE);
+#endif // PERF_NATIVE
+        free(arenas);
+        arenas = next;
+    }
+}
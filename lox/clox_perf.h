@@ -0,0 +1,31 @@
+#ifndef CLOX_PERF_H
+#define CLOX_PERF_H
+
+#include "clox_common.h"
+#include "clox_object.h"
+#include "clox_vm.h"
+
+// Calls nested this deep in trampolines are interpreted in their caller's
+// run() instead, so deep recursion can't exhaust the native stack.
+#define PERF_MAX_DEPTH 1024
+
+typedef InterpretResult (*PerfEntry)(int base);
+
+/*
+ * With --perf-map every function gets its own copy of a few bytes of x86-64
+ * that just call back into the interpreter, and each copy is listed under
+ * its function's name in /tmp/perf-<pid>.map. A perf profile then shows the
+ * time run() spends on a function under that function's trampoline, the way
+ * CPython's perf trampolines do for Python code.
+*/
+
+// Creates the map, false where trampolines aren't supported or it can't be written
+bool initPerfMap();
+
+// Calls entry(base) through the function's trampoline, made on first use
+InterpretResult perfTrampoline(ObjFunction *function, PerfEntry entry, int base);
+
+// Closes the map and unmaps the trampolines. The map file is left for perf.
+void freePerfMap();
+
+#endif // CLOX_PERF_H
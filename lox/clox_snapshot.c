@@ -0,0 +1,672 @@
+#define _DEFAULT_SOURCE     // mmap() and friends aren't part of C99
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox_memory.h"
+#include "clox_object.h"
+#include "clox_snapshot.h"
+#include "clox_table.h"
+#include "clox_vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SNAPSHOT_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SNAPSHOT_MAGIC      "CLXS"
+#define SNAPSHOT_VERSION    2
+#define HEADER_SIZE         20      // Magic, version, opcode count, body length and hash
+
+#define FNV_OFFSET          UINT64_C(14695981039346656037)
+#define FNV_PRIME           UINT64_C(1099511628211)
+
+// Objects are created in this order, so whatever a constructor takes
+// already exists: a closure's function, an instance's class and so on.
+static const ObjType creationOrder[] = {
+    OBJ_STRING, OBJ_NATIVE, OBJ_FUNCTION, OBJ_CLASS, OBJ_SHAPE,
+    OBJ_CLOSURE, OBJ_UPVALUE, OBJ_INSTANCE, OBJ_BOUND_METHOD,
+};
+
+#define TYPE_COUNT ((int)(sizeof(creationOrder) / sizeof(creationOrder[0])))
+
+typedef struct {
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+// Open addressing from an object to its index in the image
+typedef struct {
+    Obj **objects;
+    uint32_t *indices;
+    size_t capacity;
+} ObjectMap;
+
+typedef struct {
+    const uint8_t *bytes;
+    size_t count;
+    size_t offset;
+    bool failed;
+} Reader;
+
+static Obj **loaded = NULL;
+static int loadedCount = 0;
+
+static uint64_t hashBytes(const uint8_t *bytes, size_t count)
+{
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < count; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// The writer's buffers bypass reallocate(), they're not part of the heap
+static void writeBytes(Buffer *buf, const void *bytes, size_t count)
+{
+    if (count == 0) return;
+
+    if (buf->capacity < buf->count + count) {
+        while (buf->capacity < buf->count + count) buf->capacity = GROW_CAPACITY(buf->capacity);
+        buf->bytes = (uint8_t *)realloc(buf->bytes, buf->capacity);
+        if (buf->bytes == NULL) exit(1);
+    }
+
+    memcpy(buf->bytes + buf->count, bytes, count);
+    buf->count += count;
+}
+
+static void writeByte(Buffer *buf, uint8_t byte)
+{
+    writeBytes(buf, &byte, 1);
+}
+
+static void writeU32(Buffer *buf, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+    writeBytes(buf, bytes, 4);
+}
+
+static void writeU64(Buffer *buf, uint64_t value)
+{
+    writeU32(buf, (uint32_t)value);
+    writeU32(buf, (uint32_t)(value >> 32));
+}
+
+static size_t mapSlot(ObjectMap *map, Obj *object)
+{
+    size_t slot = ((uintptr_t)object >> 4) & (map->capacity - 1);
+    while (map->objects[slot] != NULL && map->objects[slot] != object) {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+
+    return slot;
+}
+
+// References are an object's index plus one, 0 is NULL
+static void writeRef(Buffer *buf, ObjectMap *map, Obj *object)
+{
+    writeU32(buf, object == NULL ? 0 : map->indices[mapSlot(map, object)] + 1);
+}
+
+static void writeValue(Buffer *buf, ObjectMap *map, Value value)
+{
+    writeByte(buf, (uint8_t)value.type);
+    switch (value.type) {
+        case VAL_NIL:       break;
+        case VAL_BOOL:      writeByte(buf, AS_BOOL(value)); break;
+        case VAL_NUMBER: {
+            uint64_t bits;
+            double number = AS_NUMBER(value);
+            memcpy(&bits, &number, sizeof(bits));
+            writeU64(buf, bits);
+        } break;
+        case VAL_OBJ:       writeRef(buf, map, AS_OBJ(value)); break;
+    }
+}
+
+static void writeTable(Buffer *buf, ObjectMap *map, Table *table)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) count++;
+    }
+
+    writeU32(buf, count);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+
+        writeRef(buf, map, (Obj *)entry->key);
+        writeValue(buf, map, entry->value);
+    }
+}
+
+// What the object's constructor needs, read back before anything else
+static void writeShell(Buffer *buf, ObjectMap *map, Obj *object)
+{
+    writeByte(buf, (uint8_t)objType(object));
+    switch (objType(object)) {
+        case OBJ_STRING: {
+            ObjString *string = (ObjString *)object;
+            writeU32(buf, string->length);
+            writeBytes(buf, string->chars, string->length);
+        } break;
+        case OBJ_NATIVE: {
+            ObjNative *native = (ObjNative *)object;
+            writeRef(buf, map, (Obj *)native->name);
+            writeU32(buf, (uint32_t)native->arity);
+        } break;
+        case OBJ_FUNCTION:  writeU32(buf, ((ObjFunction *)object)->upvalueCount); break;
+        case OBJ_CLASS:     writeRef(buf, map, (Obj *)((ObjClass *)object)->name); break;
+        case OBJ_CLOSURE:   writeRef(buf, map, (Obj *)((ObjClosure *)object)->function); break;
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *)object;
+            writeRef(buf, map, (Obj *)instance->class);
+            writeU32(buf, instance->inlineCapacity);
+        } break;
+        default: break;
+    }
+}
+
+/*
+ * Inline caches are kept, everything they point at is alive. Traces
+ * aren't, they're native code with addresses baked in, so each loop
+ * starts cold again.
+*/
+static void writeChunkImage(Buffer *buf, ObjectMap *map, Chunk *chunk)
+{
+    writeU32(buf, chunk->count);
+    writeBytes(buf, chunk->code, chunk->count);
+    for (int i = 0; i < chunk->count; i++) writeU32(buf, (uint32_t)chunk->lines[i]);
+
+    writeU32(buf, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(buf, map, chunk->constants.values[i]);
+    }
+
+    writeU32(buf, chunk->cacheCount);
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache *cache = &chunk->caches[i];
+        writeU32(buf, cache->epoch);
+        writeU32(buf, cache->count);
+        for (int j = 0; j < cache->count; j++) {
+            CacheEntry *entry = &cache->entries[j];
+            writeRef(buf, map, (Obj *)entry->shape);
+            writeRef(buf, map, (Obj *)entry->klass);
+            writeRef(buf, map, (Obj *)entry->transition);
+            writeRef(buf, map, (Obj *)entry->method);
+            writeU32(buf, (uint32_t)entry->slot);
+        }
+    }
+
+    writeU32(buf, chunk->loopCount);
+}
+
+static void writeBody(Buffer *buf, ObjectMap *map, Obj *object)
+{
+    switch (objType(object)) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod *bound = (ObjBoundMethod *)object;
+            writeValue(buf, map, bound->receiver);
+            writeRef(buf, map, (Obj *)bound->method);
+        } break;
+        case OBJ_CLASS: {
+            ObjClass *class = (ObjClass *)object;
+            writeU32(buf, class->fieldHint);
+            writeTable(buf, map, &class->methods);
+        } break;
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *)object;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                writeValue(buf, map, closure->upvalues[i]);
+            }
+        } break;
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *)object;
+            writeU32(buf, function->arity);
+            writeRef(buf, map, (Obj *)function->name);
+            writeRef(buf, map, (Obj *)function->closure);
+            writeChunkImage(buf, map, &function->chunk);
+        } break;
+        case OBJ_INSTANCE: {
+            // Slots past the shape's fields were never written
+            ObjInstance *instance = (ObjInstance *)object;
+            int fieldCount = instance->shape != NULL ? instance->shape->fieldCount : 0;
+            writeRef(buf, map, (Obj *)instance->shape);
+            writeByte(buf, instance->fields == instance->inlineFields);
+            writeU32(buf, instance->fieldCapacity);
+            for (int i = 0; i < fieldCount; i++) writeValue(buf, map, instance->fields[i]);
+            writeTable(buf, map, &instance->dictionary);
+        } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            writeU32(buf, shape->fieldCount);
+            for (int i = 0; i < shape->fieldCount; i++) writeRef(buf, map, (Obj *)shape->names[i]);
+            writeTable(buf, map, &shape->transitions);
+        } break;
+        case OBJ_UPVALUE:   writeValue(buf, map, ((ObjUpvalue *)object)->closed); break;
+        default: break;
+    }
+}
+
+bool writeSnapshot(const char *path)
+{
+    // With no frames left, what survives a collection is what the roots reach
+    collectGarbage();
+
+    size_t count = 0;
+    for (Obj *object = vm.objects; object != NULL; object = objNext(object)) {
+        ObjUpvalue *upvalue = (ObjUpvalue *)object;
+        if (objType(object) == OBJ_UPVALUE && upvalue->location != &upvalue->closed) return false;
+        count++;
+    }
+
+    ObjectMap map;
+    map.capacity = 16;
+    while (map.capacity < count * 2) map.capacity *= 2;
+    map.objects = (Obj **)calloc(map.capacity, sizeof(Obj *));
+    map.indices = (uint32_t *)malloc(sizeof(uint32_t) * map.capacity);
+    Obj **objects = (Obj **)malloc(sizeof(Obj *) * (count + 1));
+    if (map.objects == NULL || map.indices == NULL || objects == NULL) exit(1);
+
+    uint32_t index = 0;
+    for (int i = 0; i < TYPE_COUNT; i++) {
+        for (Obj *object = vm.objects; object != NULL; object = objNext(object)) {
+            if (objType(object) != creationOrder[i]) continue;
+
+            size_t slot = mapSlot(&map, object);
+            map.objects[slot] = object;
+            map.indices[slot] = index;
+            objects[index++] = object;
+        }
+    }
+
+    Buffer body = {NULL, 0, 0};
+    writeU32(&body, (uint32_t)count);
+    for (size_t i = 0; i < count; i++) writeShell(&body, &map, objects[i]);
+    for (size_t i = 0; i < count; i++) writeBody(&body, &map, objects[i]);
+
+    writeTable(&body, &map, &vm.globals);
+    writeRef(&body, &map, (Obj *)vm.initString);
+    writeRef(&body, &map, (Obj *)vm.rootShape);
+    writeU32(&body, vm.cacheEpoch);
+
+    Buffer header = {NULL, 0, 0};
+    writeBytes(&header, SNAPSHOT_MAGIC, 4);
+    writeByte(&header, SNAPSHOT_VERSION & 0xff);
+    writeByte(&header, SNAPSHOT_VERSION >> 8);
+    writeByte(&header, OP_RETURN + 1);  // Catches the opcodes changing without a version bump
+    writeByte(&header, 0);
+    writeU32(&header, (uint32_t)body.count);
+    writeU64(&header, hashBytes(body.bytes, body.count));
+
+    FILE *file = fopen(path, "wb");
+    bool written = file != NULL &&
+                   fwrite(header.bytes, 1, header.count, file) == header.count &&
+                   fwrite(body.bytes, 1, body.count, file) == body.count;
+    if (file != NULL && fclose(file) != 0) written = false;
+
+    free(map.objects);
+    free(map.indices);
+    free(objects);
+    free(header.bytes);
+    free(body.bytes);
+    return written;
+}
+
+static const uint8_t *readBytes(Reader *reader, size_t count)
+{
+    if (reader->failed || reader->count - reader->offset < count) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->bytes + reader->offset;
+    reader->offset += count;
+    return bytes;
+}
+
+static uint8_t readByte(Reader *reader)
+{
+    const uint8_t *byte = readBytes(reader, 1);
+    return byte != NULL ? *byte : 0;
+}
+
+static uint32_t readU32(Reader *reader)
+{
+    const uint8_t *bytes = readBytes(reader, 4);
+    if (bytes == NULL) return 0;
+
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint64_t readU64(Reader *reader)
+{
+    uint64_t low = readU32(reader);
+    return low | (uint64_t)readU32(reader) << 32;
+}
+
+// A count of things at least 'size' bytes each, no more than the rest of
+// the image can hold, so a damaged count can't ask for a huge allocation.
+static int readCount(Reader *reader, size_t size)
+{
+    uint32_t count = readU32(reader);
+    if (count > INT32_MAX || (reader->count - reader->offset) / size < count) {
+        reader->failed = true;
+        return 0;
+    }
+
+    return (int)count;
+}
+
+// An object created so far, of the given type, or NULL where 'nullable'
+static Obj *readRef(Reader *reader, ObjType type, bool nullable)
+{
+    uint32_t ref = readU32(reader);
+    if (ref == 0 && nullable) return NULL;
+
+    if (ref == 0 || ref > (uint32_t)loadedCount || objType(loaded[ref - 1]) != type) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    return loaded[ref - 1];
+}
+
+static Value readValue(Reader *reader)
+{
+    switch (readByte(reader)) {
+        case VAL_NIL:       return NIL_VAL;
+        case VAL_BOOL:      return BOOL_VAL(readByte(reader) != 0);
+        case VAL_NUMBER: {
+            uint64_t bits = readU64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case VAL_OBJ: {
+            uint32_t ref = readU32(reader);
+            if (ref != 0 && ref <= (uint32_t)loadedCount) return OBJ_VAL(loaded[ref - 1]);
+        } break;
+    }
+
+    reader->failed = true;
+    return NIL_VAL;
+}
+
+static void readTable(Reader *reader, Table *table)
+{
+    int count = readCount(reader, 5);
+    for (int i = 0; i < count && !reader->failed; i++) {
+        ObjString *key = (ObjString *)readRef(reader, OBJ_STRING, false);
+        Value value = readValue(reader);
+        if (!reader->failed) tableSet(table, key, value);
+    }
+}
+
+static Obj *readShell(Reader *reader)
+{
+    switch (readByte(reader)) {
+        case OBJ_STRING: {
+            int length = readCount(reader, 1);
+            const uint8_t *chars = readBytes(reader, length);
+            return chars != NULL ? (Obj *)copyString((const char *)chars, length) : NULL;
+        }
+        case OBJ_NATIVE: {
+            ObjString *name = (ObjString *)readRef(reader, OBJ_STRING, false);
+            int arity = (int32_t)readU32(reader);
+            NativeFn function = name != NULL ? findNative(name->chars) : NULL;
+            return function != NULL ? (Obj *)newNative(function, name, arity) : NULL;
+        }
+        case OBJ_FUNCTION: {
+            uint32_t upvalueCount = readU32(reader);
+            if (upvalueCount > UINT8_COUNT) return NULL;
+
+            ObjFunction *function = newFunction();
+            function->upvalueCount = (int)upvalueCount;
+            return (Obj *)function;
+        }
+        case OBJ_CLASS: {
+            ObjString *name = (ObjString *)readRef(reader, OBJ_STRING, false);
+            return name != NULL ? (Obj *)newClass(name) : NULL;
+        }
+        case OBJ_SHAPE:     return (Obj *)newShape();
+        case OBJ_CLOSURE: {
+            ObjFunction *function = (ObjFunction *)readRef(reader, OBJ_FUNCTION, false);
+            return function != NULL ? (Obj *)newClosure(function) : NULL;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue *upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            return (Obj *)upvalue;
+        }
+        case OBJ_INSTANCE: {
+            ObjClass *class = (ObjClass *)readRef(reader, OBJ_CLASS, false);
+            uint32_t inlineCapacity = readU32(reader);
+            if (class == NULL || inlineCapacity > SHAPE_MAX_FIELDS) return NULL;
+
+            // The hint is what newInstance() sizes the inline fields by,
+            // the class' own is read with the rest of it
+            class->fieldHint = (int)inlineCapacity;
+            ObjInstance *instance = newInstance(class);
+            instance->shape = NULL;
+            return (Obj *)instance;
+        }
+        case OBJ_BOUND_METHOD:  return (Obj *)newBoundMethod(NIL_VAL, NULL);
+        default:                return NULL;
+    }
+}
+
+static void readChunkImage(Reader *reader, Chunk *chunk)
+{
+    int count = readCount(reader, 5);
+    const uint8_t *code = readBytes(reader, count);
+    if (code == NULL) return;
+
+    uint8_t *bytes = ALLOCATE(uint8_t, count);
+    int *lines = ALLOCATE(int, count);
+    memcpy(bytes, code, count);
+    for (int i = 0; i < count; i++) lines[i] = (int32_t)readU32(reader);
+    chunk->code = bytes;
+    chunk->lines = lines;
+    chunk->count = chunk->capacity = count;
+
+    int constants = readCount(reader, 1);
+    for (int i = 0; i < constants && !reader->failed; i++) {
+        writeValueArray(&chunk->constants, readValue(reader));
+    }
+
+    // The count is only set once the entries are, the GC marks through them
+    int caches = readCount(reader, 8);
+    chunk->caches = ALLOCATE(InlineCache, caches);
+    chunk->cacheCapacity = caches;
+    for (int i = 0; i < caches && !reader->failed; i++) {
+        InlineCache *cache = &chunk->caches[i];
+        cache->epoch = readU32(reader);
+        uint32_t entries = readU32(reader);
+        if (entries > IC_WAYS) {
+            reader->failed = true;
+            break;
+        }
+
+        for (uint32_t j = 0; j < entries; j++) {
+            CacheEntry *entry = &cache->entries[j];
+            entry->shape = (ObjShape *)readRef(reader, OBJ_SHAPE, true);
+            entry->klass = (ObjClass *)readRef(reader, OBJ_CLASS, true);
+            entry->transition = (ObjShape *)readRef(reader, OBJ_SHAPE, true);
+            entry->method = (ObjClosure *)readRef(reader, OBJ_CLOSURE, true);
+            if (entry->method != NULL && entry->klass != NULL) entry->klass->methodsCached = true;
+            entry->slot = (int32_t)readU32(reader);
+        }
+        cache->count = (int)entries;
+        chunk->cacheCount = i + 1;
+    }
+
+    int loops = (int)readU32(reader);
+    if (loops > UINT16_MAX + 1) reader->failed = true;
+    for (int i = 0; i < loops && !reader->failed; i++) addLoop(chunk);
+}
+
+/*
+ * Fields are filled in before the pointers that make the GC look at
+ * them: an instance's shape, a shape's field count.
+*/
+static void readBody(Reader *reader, Obj *object)
+{
+    switch (objType(object)) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod *bound = (ObjBoundMethod *)object;
+            bound->receiver = readValue(reader);
+            bound->method = (ObjClosure *)readRef(reader, OBJ_CLOSURE, false);
+        } break;
+        case OBJ_CLASS: {
+            ObjClass *class = (ObjClass *)object;
+            class->fieldHint = (int)readU32(reader);
+            if (class->fieldHint > SHAPE_MAX_FIELDS) reader->failed = true;
+            readTable(reader, &class->methods);
+        } break;
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *)object;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = readValue(reader);
+            }
+        } break;
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *)object;
+            function->arity = (int32_t)readU32(reader);
+            function->name = (ObjString *)readRef(reader, OBJ_STRING, true);
+            function->closure = (ObjClosure *)readRef(reader, OBJ_CLOSURE, true);
+            readChunkImage(reader, &function->chunk);
+        } break;
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *)object;
+            ObjShape *shape = (ObjShape *)readRef(reader, OBJ_SHAPE, true);
+            bool inlined = readByte(reader) != 0;
+            uint32_t capacity = readU32(reader);
+            int fieldCount = shape != NULL ? shape->fieldCount : 0;
+            if (capacity > SHAPE_MAX_FIELDS || (int)capacity < fieldCount ||
+                (inlined && (int)capacity != instance->inlineCapacity)) {
+                reader->failed = true;
+                break;
+            }
+
+            Value *fields = inlined ? instance->inlineFields : ALLOCATE(Value, capacity);
+            for (uint32_t i = 0; i < capacity; i++) {
+                fields[i] = (int)i < fieldCount ? readValue(reader) : NIL_VAL;
+            }
+            instance->fields = fields;
+            instance->fieldCapacity = (int)capacity;
+            instance->shape = shape;
+            readTable(reader, &instance->dictionary);
+        } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            int fieldCount = readCount(reader, 4);
+            ObjString **names = ALLOCATE(ObjString *, fieldCount);
+            for (int i = 0; i < fieldCount; i++) {
+                names[i] = (ObjString *)readRef(reader, OBJ_STRING, false);
+            }
+            shape->names = names;
+            shape->fieldCount = reader->failed ? 0 : fieldCount;
+            readTable(reader, &shape->transitions);
+        } break;
+        case OBJ_UPVALUE:   ((ObjUpvalue *)object)->closed = readValue(reader); break;
+        default: break;
+    }
+}
+
+static bool readImage(const uint8_t *bytes, size_t size)
+{
+    Reader reader = {bytes, size, 0, false};
+    const uint8_t *magic = readBytes(&reader, 4);
+    int version = readByte(&reader);
+    version |= readByte(&reader) << 8;
+    int opcodes = readByte(&reader);
+    readByte(&reader);
+    uint32_t length = readU32(&reader);
+    uint64_t hash = readU64(&reader);
+
+    if (reader.failed || memcmp(magic, SNAPSHOT_MAGIC, 4) || version != SNAPSHOT_VERSION ||
+        opcodes != OP_RETURN + 1 || length != size - HEADER_SIZE ||
+        hash != hashBytes(bytes + HEADER_SIZE, length)) {
+        return false;
+    }
+
+    int count = readCount(&reader, 1);
+    loaded = (Obj **)malloc(sizeof(Obj *) * (count + 1));
+    if (loaded == NULL) exit(1);
+
+    // Every object first, then what they point at, relocated
+    for (int i = 0; i < count && !reader.failed; i++) {
+        Obj *object = readShell(&reader);
+        if (object == NULL) {
+            reader.failed = true;
+            break;
+        }
+        loaded[loadedCount++] = object;
+    }
+
+    for (int i = 0; i < loadedCount && !reader.failed; i++) readBody(&reader, loaded[i]);
+
+    readTable(&reader, &vm.globals);
+    vm.initString = (ObjString *)readRef(&reader, OBJ_STRING, false);
+    vm.rootShape = (ObjShape *)readRef(&reader, OBJ_SHAPE, false);
+    vm.cacheEpoch = readU32(&reader);
+
+    free(loaded);
+    loaded = NULL;
+    loadedCount = 0;
+    return !reader.failed && reader.offset == reader.count;
+}
+
+bool loadSnapshot(const char *path)
+{
+#ifdef SNAPSHOT_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) return false;
+
+    bool loadedImage = readImage((const uint8_t *)bytes, size);
+    munmap(bytes, size);
+    return loadedImage;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    uint8_t *bytes = size >= HEADER_SIZE ? (uint8_t *)malloc(size) : NULL;
+    bool loadedImage = bytes != NULL && fread(bytes, 1, size, file) == (size_t)size &&
+                       readImage(bytes, size);
+    fclose(file);
+    free(bytes);
+    return loadedImage;
+#endif // SNAPSHOT_MMAP
+}
+
+void markSnapshotRoots()
+{
+    for (int i = 0; i < loadedCount; i++) markObject(loaded[i]);
+}
@@ -0,0 +1,26 @@
+#ifndef CLOX_SNAPSHOT_H
+#define CLOX_SNAPSHOT_H
+
+#include "clox_common.h"
+
+/*
+ * A snapshot is an image of the heap once a script has run: every object
+ * the globals, vm.initString and vm.rootShape reach, with their pointers
+ * written as indices into the image. Loading one maps the file, creates
+ * the objects, then relocates the indices to the new objects, so a prelude
+ * doesn't have to be compiled or run again. Natives are bound by name, as
+ * their addresses change from one run to the next.
+*/
+
+// Writes the heap to 'path'. Collects garbage first, so only what the roots
+// reach is written. Fails if the file can't be written.
+bool writeSnapshot(const char *path);
+
+// Fills a VM without a heap from the image at 'path'. Fails if the image
+// is damaged or was written by another build of clox.
+bool loadSnapshot(const char *path);
+
+// Keeps what a loadSnapshot() in progress has created alive
+void markSnapshotRoots();
+
+#endif // CLOX_SNAPSHOT_H
@@ -79,6 +79,14 @@ bool tableGet(Table *table, ObjString *key, Value *value)
     return true;
 }
 
+Entry *tableEntry(Table *table, ObjString *key)
+{
+    if (table->count == 0) return NULL;
+
+    Entry *entry = findEntry(table->entries, table->capacity, key);
+    return entry->key == NULL ? NULL : entry;
+}
+
 bool tableSet(Table *table, ObjString *key, Value value)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
@@ -145,7 +153,7 @@ void tableRemoveWhite(Table *table)
 {
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && !objIsMarked(&entry->key->obj)) {
             tableDelete(table, entry->key);
         }
     }
@@ -18,6 +18,8 @@ typedef struct {
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
+// The entry holding 'key', or NULL. It moves when the table grows.
+Entry *tableEntry(Table *table, ObjString *key);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
@@ -0,0 +1,1494 @@
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS isn't part of C99
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox_object.h"
+#include "clox_table.h"
+#include "clox_trace.h"
+#include "clox_vm.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define TRACE_NATIVE
+#include <sys/mman.h>
+#endif
+
+#define MAX_IR              1024    // IR instructions in a trace
+#define MAX_RECORDED        1024    // Bytecode instructions in a recording
+#define MAX_SNAPSHOTS       256
+#define MAX_SNAPSHOT_REFS   4096
+#define MAX_TRACE_GLOBALS   32
+#define MAX_TRACE_SLOTS     256     // Stack slots a trace may use above the frame's
+#define MAX_ENTRY_FAILS     16      // Entries failing a type check before a trace is dropped
+
+typedef uint16_t IrRef;     // Index into the IR, 0 is no value
+
+typedef enum {
+    // Constants, materialized where they are used
+    IR_NIL,
+    IR_BOOL,        // a: the boolean
+    IR_NUM,         // a: index into the constants
+    IR_STR,         // a: index into the constants
+
+    IR_SLOAD,       // a: frame slot, snapshot: for the type guard
+    IR_GLOAD,       // a: global
+    IR_SSTORE,      // a: frame slot, b: value
+    IR_GSTORE,      // a: global, b: value
+
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_NEG,
+    IR_LT,
+    IR_GT,
+    IR_EQ,          // Operands of the same type
+    IR_NOT,
+    IR_CONCAT,
+    IR_PRINT,
+
+    IR_GUARD,       // a: value, b: its truthiness when recorded, snapshot: the exit
+    IR_HEAD,        // Start of the loop, after the hoisted instructions
+    IR_LOOP,        // Back to IR_HEAD
+} IrOp;
+
+typedef enum {
+    TY_NIL,
+    TY_BOOL,
+    TY_NUM,
+    TY_STR,
+    TY_NONE,        // No result, or a value traces don't handle
+} IrType;
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;
+    IrRef a;
+    IrRef b;
+    uint16_t snapshot;
+} IrIns;
+
+/*
+ * The state an exit leaves run() in: the instruction at 'pc', with the
+ * 'count' values from 'start' in the snapshot refs pushed above the slots
+ * the loop started with, for a stack 'depth' slots deep.
+*/
+typedef struct {
+    int pc;
+    int depth;
+    int start;
+    int count;
+} Snapshot;
+
+typedef int (*TraceFn)(Value *slots, uint64_t *data);
+
+struct Trace {
+    uint8_t *code;
+    size_t size;
+
+    uint64_t *data;         // Entries of the globals, then the constants
+    int dataCount;
+    ObjString **globals;
+    int globalCount;
+
+    Snapshot *snapshots;    // Snapshot 0 is the loop header, left before anything ran
+    int snapshotCount;
+    int stackNeeded;        // Slots used above frame->slots
+    int entryFails;
+};
+
+typedef enum {
+    RECORD_OK,
+    RECORD_DONE,
+    RECORD_ABORT,           // The instruction was left unexecuted
+} RecordStatus;
+
+typedef struct {
+    CallFrame *frame;
+    Chunk *chunk;
+    int header;
+    int base;               // Stack depth at the header
+    int maxDepth;
+    bool failed;
+
+    IrIns ir[MAX_IR + 2];   // Room for IR_HEAD and IR_LOOP
+    int irCount;
+    uint64_t constants[MAX_IR + 1];
+    int constantCount;
+
+    IrRef slots[MAX_TRACE_SLOTS];   // Value of each frame slot, 0 until it's loaded
+    ObjString *globals[MAX_TRACE_GLOBALS];
+    IrRef globalRefs[MAX_TRACE_GLOBALS];
+    int globalCount;
+
+    Snapshot snapshots[MAX_SNAPSHOTS];
+    int snapshotCount;
+    IrRef snapshotRefs[MAX_SNAPSHOT_REFS];
+    int snapshotRefCount;
+} Recorder;
+
+static bool isFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static IrType typeOf(Value value)
+{
+    switch (value.type) {
+        case VAL_NIL:       return TY_NIL;
+        case VAL_BOOL:      return TY_BOOL;
+        case VAL_NUMBER:    return TY_NUM;
+        default:            return IS_STRING(value) ? TY_STR : TY_NONE;
+    }
+}
+
+static bool isConstant(IrIns *ins)
+{
+    return ins->op <= IR_STR;
+}
+
+static IrRef emitIr(Recorder *rec, IrOp op, IrType type, int a, int b, int snapshot)
+{
+    if (rec->irCount == MAX_IR) {
+        rec->failed = true;
+        return 0;
+    }
+
+    IrIns *ins = &rec->ir[rec->irCount];
+    ins->op = op;
+    ins->type = type;
+    ins->a = a;
+    ins->b = b;
+    ins->snapshot = snapshot;
+    return rec->irCount++;
+}
+
+static IrRef constantRef(Recorder *rec, Value value)
+{
+    if (IS_NIL(value)) return emitIr(rec, IR_NIL, TY_NIL, 0, 0, 0);
+    if (IS_BOOL(value)) return emitIr(rec, IR_BOOL, TY_BOOL, AS_BOOL(value), 0, 0);
+
+    uint64_t bits;
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        memcpy(&bits, &number, sizeof(bits));
+    } else {
+        bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    }
+
+    int index = 0;
+    while (index < rec->constantCount && rec->constants[index] != bits) index++;
+    if (index == rec->constantCount) {
+        if (rec->constantCount == MAX_IR) {
+            rec->failed = true;
+            return 0;
+        }
+        rec->constants[rec->constantCount++] = bits;
+    }
+
+    return emitIr(rec, IS_NUMBER(value) ? IR_NUM : IR_STR, typeOf(value), index, 0, 0);
+}
+
+static int takeSnapshot(Recorder *rec, int pc)
+{
+    int depth = (int)(vm.stackTop - rec->frame->slots);
+    int count = depth - rec->base;
+    if (rec->snapshotCount == MAX_SNAPSHOTS || rec->snapshotRefCount + count > MAX_SNAPSHOT_REFS) {
+        rec->failed = true;
+        return 0;
+    }
+
+    Snapshot *snapshot = &rec->snapshots[rec->snapshotCount];
+    snapshot->pc = pc;
+    snapshot->depth = depth;
+    snapshot->start = rec->snapshotRefCount;
+    snapshot->count = count;
+
+    for (int i = rec->base; i < depth; i++) {
+        rec->snapshotRefs[rec->snapshotRefCount++] = rec->slots[i];
+    }
+
+    return rec->snapshotCount++;
+}
+
+static void pushValue(Recorder *rec, Value value, IrRef ref)
+{
+    int depth = (int)(vm.stackTop - rec->frame->slots);
+    rec->slots[depth] = ref;
+    if (depth + 1 > rec->maxDepth) rec->maxDepth = depth + 1;
+    push(value);
+}
+
+static void popValue(Recorder *rec)
+{
+    pop();
+    if (vm.stackTop - rec->frame->slots < rec->base) rec->failed = true;
+}
+
+static IrRef topRef(Recorder *rec, int distance)
+{
+    return rec->slots[vm.stackTop - rec->frame->slots - 1 - distance];
+}
+
+static IrRef slotRef(Recorder *rec, int slot, int pc)
+{
+    if (rec->slots[slot] != 0) return rec->slots[slot];
+
+    IrType type = typeOf(rec->frame->slots[slot]);
+    if (type == TY_NONE) return 0;
+
+    rec->slots[slot] = emitIr(rec, IR_SLOAD, type, slot, 0, takeSnapshot(rec, pc));
+    return rec->slots[slot];
+}
+
+static void setSlot(Recorder *rec, int slot, IrRef ref)
+{
+    // Slots pushed during the iteration are only written back on an exit
+    if (slot < rec->base) emitIr(rec, IR_SSTORE, TY_NONE, slot, ref, 0);
+    rec->slots[slot] = ref;
+}
+
+static int globalIndex(Recorder *rec, ObjString *name)
+{
+    for (int i = 0; i < rec->globalCount; i++) {
+        if (rec->globals[i] == name) return i;
+    }
+
+    if (rec->globalCount == MAX_TRACE_GLOBALS) return -1;
+    rec->globals[rec->globalCount] = name;
+    rec->globalRefs[rec->globalCount] = 0;
+    return rec->globalCount++;
+}
+
+static IrRef globalRef(Recorder *rec, ObjString *name, Value value, int pc)
+{
+    int index = globalIndex(rec, name);
+    if (index == -1) return 0;
+    if (rec->globalRefs[index] != 0) return rec->globalRefs[index];
+
+    IrType type = typeOf(value);
+    if (type == TY_NONE) return 0;
+
+    rec->globalRefs[index] = emitIr(rec, IR_GLOAD, type, index, 0, takeSnapshot(rec, pc));
+    return rec->globalRefs[index];
+}
+
+static bool addOp(Value a, Value b, IrOp *op)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        *op = IR_ADD;
+    } else if (IS_STRING(a) && IS_STRING(b)) {
+        *op = IR_CONCAT;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Records and executes an operator on the two values on top of the stack,
+ * whose types the caller has checked.
+*/
+static void recordBinary(Recorder *rec, IrOp op)
+{
+    Value b = vm.stackTop[-1];
+    Value a = vm.stackTop[-2];
+    IrRef rb = topRef(rec, 0);
+    IrRef ra = topRef(rec, 1);
+
+    Value result;
+    IrType type = TY_NUM;
+    switch (op) {
+        case IR_ADD:    result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); break;
+        case IR_SUB:    result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)); break;
+        case IR_MUL:    result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b)); break;
+        case IR_DIV:    result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)); break;
+        case IR_LT:     result = BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)); type = TY_BOOL; break;
+        case IR_GT:     result = BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b)); type = TY_BOOL; break;
+        case IR_EQ:     result = BOOL_VAL(valuesEqual(a, b)); type = TY_BOOL; break;
+        default: {
+            // Both strings are still on the stack while the result is allocated
+            result = OBJ_VAL(concatStrings(AS_STRING(a), AS_STRING(b)));
+            type = TY_STR;
+        } break;
+    }
+
+    IrRef ref;
+    if (op == IR_EQ && (a.type != b.type || IS_NIL(a))) {
+        // The loads are guarded, so the types compare the same every iteration
+        ref = constantRef(rec, result);
+    } else {
+        ref = emitIr(rec, op, type, ra, rb, 0);
+    }
+
+    popValue(rec);
+    popValue(rec);
+    pushValue(rec, result, ref);
+}
+
+static RecordStatus recordInstruction(Recorder *rec)
+{
+    CallFrame *frame = rec->frame;
+    uint8_t *ip = frame->ip;
+    int pc = (int)(ip - rec->chunk->code);
+    Value *constants = rec->chunk->constants.values;
+
+    // Room for the two values an instruction may push
+    if (vm.stackTop - frame->slots + 2 > MAX_TRACE_SLOTS) return RECORD_ABORT;
+
+    switch (*ip) {
+        case OP_CONSTANT: {
+            Value value = constants[ip[1]];
+            if (typeOf(value) == TY_NONE) return RECORD_ABORT;
+            pushValue(rec, value, constantRef(rec, value));
+        } break;
+        case OP_NIL:        pushValue(rec, NIL_VAL, constantRef(rec, NIL_VAL)); break;
+        case OP_TRUE:       pushValue(rec, BOOL_VAL(true), constantRef(rec, BOOL_VAL(true))); break;
+        case OP_FALSE:      pushValue(rec, BOOL_VAL(false), constantRef(rec, BOOL_VAL(false))); break;
+        case OP_POP:        popValue(rec); break;
+        case OP_GET_LOCAL: {
+            IrRef ref = slotRef(rec, ip[1], pc);
+            if (ref == 0) return RECORD_ABORT;
+            pushValue(rec, frame->slots[ip[1]], ref);
+        } break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP: {
+            setSlot(rec, ip[1], topRef(rec, 0));
+            frame->slots[ip[1]] = vm.stackTop[-1];
+            if (*ip == OP_SET_LOCAL_POP) popValue(rec);
+        } break;
+        case OP_GET_GLOBAL: {
+            ObjString *name = AS_STRING(constants[ip[1]]);
+            Value value;
+            if (!tableGet(&vm.globals, name, &value)) return RECORD_ABORT;
+
+            IrRef ref = globalRef(rec, name, value, pc);
+            if (ref == 0) return RECORD_ABORT;
+            pushValue(rec, value, ref);
+        } break;
+        case OP_SET_GLOBAL: {
+            ObjString *name = AS_STRING(constants[ip[1]]);
+            Value value;
+            int index = globalIndex(rec, name);
+            if (index == -1 || !tableGet(&vm.globals, name, &value)) return RECORD_ABORT;
+
+            emitIr(rec, IR_GSTORE, TY_NONE, index, topRef(rec, 0), 0);
+            rec->globalRefs[index] = topRef(rec, 0);
+            tableSet(&vm.globals, name, vm.stackTop[-1]);
+        } break;
+        case OP_EQUAL:
+        case OP_EQUAL_GENERIC:
+        case OP_EQUAL_NUM:  recordBinary(rec, IR_EQ); break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            if (!IS_NUMBER(vm.stackTop[-1]) || !IS_NUMBER(vm.stackTop[-2])) return RECORD_ABORT;
+
+            IrOp op = *ip == OP_GREATER ? IR_GT :
+                      *ip == OP_LESS ? IR_LT :
+                      *ip == OP_SUBTRACT ? IR_SUB :
+                      *ip == OP_MULTIPLY ? IR_MUL : IR_DIV;
+            recordBinary(rec, op);
+        } break;
+        case OP_ADD:
+        case OP_ADD_GENERIC:
+        case OP_ADD_NUM:
+        case OP_ADD_STR: {
+            IrOp op;
+            if (!addOp(vm.stackTop[-2], vm.stackTop[-1], &op)) return RECORD_ABORT;
+            recordBinary(rec, op);
+        } break;
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT: {
+            bool local = *ip == OP_ADD_LOCAL_LOCAL;
+            Value a = frame->slots[ip[1]];
+            Value b = local ? frame->slots[ip[2]] : constants[ip[2]];
+
+            IrOp op = IR_LT;
+            if (*ip == OP_LESS_LOCAL_CONSTANT) {
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) return RECORD_ABORT;
+            } else if (!addOp(a, b, &op)) {
+                return RECORD_ABORT;
+            }
+
+            // Recorded as the instructions the superinstruction replaced
+            IrRef ra = slotRef(rec, ip[1], pc);
+            IrRef rb = local ? slotRef(rec, ip[2], pc) : constantRef(rec, b);
+            pushValue(rec, a, ra);
+            pushValue(rec, b, rb);
+            recordBinary(rec, op);
+        } break;
+        case OP_NOT: {
+            Value value = vm.stackTop[-1];
+            IrRef ref = topRef(rec, 0);
+            Value result = BOOL_VAL(isFalsey(value));
+
+            // Only a boolean computed in the trace isn't known when recording
+            IrRef not = IS_BOOL(value) && !isConstant(&rec->ir[ref]) ?
+                emitIr(rec, IR_NOT, TY_BOOL, ref, 0, 0) : constantRef(rec, result);
+            popValue(rec);
+            pushValue(rec, result, not);
+        } break;
+        case OP_NEGATE: {
+            if (!IS_NUMBER(vm.stackTop[-1])) return RECORD_ABORT;
+
+            IrRef ref = emitIr(rec, IR_NEG, TY_NUM, topRef(rec, 0), 0, 0);
+            Value result = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+            popValue(rec);
+            pushValue(rec, result, ref);
+        } break;
+        case OP_INCREMENT:
+        case OP_DECREMENT: {
+            if (!IS_NUMBER(vm.stackTop[-1])) return RECORD_ABORT;
+
+            pushValue(rec, NUMBER_VAL(1), constantRef(rec, NUMBER_VAL(1)));
+            recordBinary(rec, *ip == OP_INCREMENT ? IR_ADD : IR_SUB);
+        } break;
+        case OP_PRINT: {
+            emitIr(rec, IR_PRINT, TY_NONE, topRef(rec, 0), 0, 0);
+            printValue(vm.stackTop[-1]);
+            printf("\n");
+            popValue(rec);
+        } break;
+        case OP_JUMP: {
+            frame->ip = ip + 3 + ((ip[1] << 8) | ip[2]);
+            return RECORD_OK;
+        }
+        case OP_JUMP_IF_FALSE: {
+            bool falsey = isFalsey(vm.stackTop[-1]);
+            IrRef ref = topRef(rec, 0);
+
+            // Any other condition goes the same way every iteration
+            if (rec->ir[ref].type == TY_BOOL && !isConstant(&rec->ir[ref])) {
+                emitIr(rec, IR_GUARD, TY_NONE, ref, !falsey, takeSnapshot(rec, pc));
+            }
+
+            frame->ip = ip + 3 + (falsey ? ((ip[1] << 8) | ip[2]) : 0);
+            return RECORD_OK;
+        }
+        case OP_LOOP: {
+            uint8_t *target = ip + 5 - ((ip[1] << 8) | ip[2]);
+            HotLoop *loop = &rec->chunk->loops[(ip[3] << 8) | ip[4]];
+
+            if (target - rec->chunk->code == rec->header) {
+                if (vm.stackTop - frame->slots != rec->base) return RECORD_ABORT;
+                frame->ip = target;
+                return RECORD_DONE;
+            }
+
+            // An inner loop with a trace of its own isn't unrolled into this one
+            if (loop->trace != NULL) return RECORD_ABORT;
+            frame->ip = target;
+            return RECORD_OK;
+        }
+        default: return RECORD_ABORT;
+    }
+
+    frame->ip = ip + instructionLength(rec->chunk, pc);
+    return RECORD_OK;
+}
+
+static bool usesA(IrOp op)
+{
+    return op >= IR_ADD && op <= IR_GUARD;
+}
+
+static bool usesB(IrOp op)
+{
+    return op == IR_SSTORE || op == IR_GSTORE || (op >= IR_ADD && op <= IR_CONCAT && op != IR_NEG &&
+                                                  op != IR_NOT);
+}
+
+/*
+ * Loop-invariant code motion: constants, loads of slots and globals the
+ * trace never stores, and arithmetic on those only, move ahead of IR_HEAD
+ * and run once per entry instead of once per iteration. None of them can
+ * exit, so running them early is safe.
+*/
+static void hoistInvariants(Recorder *rec)
+{
+    bool storedSlots[MAX_TRACE_SLOTS] = { false };
+    bool storedGlobals[MAX_TRACE_GLOBALS] = { false };
+    bool invariant[MAX_IR] = { false };
+    IrRef map[MAX_IR];
+
+    for (int i = 1; i < rec->irCount; i++) {
+        IrIns *ins = &rec->ir[i];
+        if (ins->op == IR_SSTORE) storedSlots[ins->a] = true;
+        if (ins->op == IR_GSTORE) storedGlobals[ins->a] = true;
+    }
+
+    for (int i = 1; i < rec->irCount; i++) {
+        IrIns *ins = &rec->ir[i];
+        switch (ins->op) {
+            case IR_NIL:
+            case IR_BOOL:
+            case IR_NUM:
+            case IR_STR:    invariant[i] = true; break;
+            case IR_SLOAD:  invariant[i] = !storedSlots[ins->a]; break;
+            case IR_GLOAD:  invariant[i] = !storedGlobals[ins->a]; break;
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV:
+            case IR_LT:
+            case IR_GT:
+            case IR_EQ:     invariant[i] = invariant[ins->a] && invariant[ins->b]; break;
+            case IR_NEG:
+            case IR_NOT:    invariant[i] = invariant[ins->a]; break;
+            default: break;
+        }
+    }
+
+    IrIns *ir = (IrIns *)malloc(sizeof(IrIns) * (MAX_IR + 2));
+    if (ir == NULL) exit(1);
+
+    int count = 1;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            ir[count].op = IR_HEAD;
+            ir[count++].type = TY_NONE;
+        }
+
+        for (int i = 1; i < rec->irCount; i++) {
+            if (invariant[i] != (pass == 0)) continue;
+
+            map[i] = count;
+            ir[count] = rec->ir[i];
+            if (usesA(ir[count].op)) ir[count].a = map[ir[count].a];
+            if (usesB(ir[count].op)) ir[count].b = map[ir[count].b];
+            count++;
+        }
+    }
+    ir[count].op = IR_LOOP;
+    ir[count++].type = TY_NONE;
+
+    for (int i = 0; i < rec->snapshotRefCount; i++) {
+        rec->snapshotRefs[i] = map[rec->snapshotRefs[i]];
+    }
+
+    memcpy(rec->ir, ir, sizeof(IrIns) * count);
+    rec->irCount = count;
+    free(ir);
+}
+
+static void tracePrint(Value *value)
+{
+    printValue(*value);
+    printf("\n");
+}
+
+#ifdef TRACE_NATIVE
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define SLOTS       R12     // frame->slots
+#define DATA        R13     // Trace.data
+#define XMM0        0       // xmm0 and xmm1 are scratch registers
+#define XMM1        1
+
+// Condition codes of Jcc and SETcc
+#define CC_E        0x4
+#define CC_NE       0x5
+#define CC_BE       0x6
+#define CC_A        0x7
+#define CC_P        0xa
+#define CC_NP       0xb
+#define CC_ALWAYS   -1
+
+static const int gprRegs[] = { RBX, R14, R15 };     // Callee-saved, they survive helper calls
+static const int xmmRegs[] = { 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+#define GPR_COUNT   ((int)(sizeof(gprRegs) / sizeof(gprRegs[0])))
+#define XMM_COUNT   ((int)(sizeof(xmmRegs) / sizeof(xmmRegs[0])))
+
+#define VALUE_SIZE  ((int)sizeof(Value))
+#define PAYLOAD     ((int)offsetof(Value, as))
+#define SPILL(ref)  (16 + 8 * (ref))    // The first 16 bytes box PRINT's operand
+
+typedef struct {
+    int jumps[2];
+    int jumpCount;
+    int snapshot;
+    IrRef known;            // A fused comparison, which exits with 'value'
+    bool value;
+    int locations;          // Register of each snapshot ref at the jump, -1 if spilled
+} ExitStub;
+
+typedef struct {
+    Recorder *rec;
+    IrIns *ir;
+
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    int head;
+    int headLabel;
+    int rootBase;
+    int maxRoots;
+
+    int8_t reg[MAX_IR + 2];
+    int8_t headReg[MAX_IR + 2];
+    bool spilled[MAX_IR + 2];
+    bool fused[MAX_IR + 2];
+    int lastUse[MAX_IR + 2];
+    IrRef owner[32];        // Value held by each GPR, then by each XMM register
+
+    IrType slotStores[MAX_TRACE_SLOTS];
+    IrType globalStores[MAX_TRACE_GLOBALS];
+
+    ExitStub stubs[MAX_SNAPSHOTS];
+    int stubCount;
+    int8_t locations[MAX_SNAPSHOT_REFS];
+    int entryJumps[2 * MAX_IR];
+    int entryJumpCount;
+} Codegen;
+
+static void emitByte(Codegen *cg, uint8_t byte)
+{
+    if (cg->capacity < cg->count + 1) {
+        cg->capacity = cg->capacity < 256 ? 256 : cg->capacity * 2;
+        cg->code = (uint8_t *)realloc(cg->code, cg->capacity);
+        if (cg->code == NULL) exit(1);
+    }
+
+    cg->code[cg->count++] = byte;
+}
+
+static void emit32(Codegen *cg, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) emitByte(cg, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Codegen *cg, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) emitByte(cg, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(Codegen *cg, int at, int32_t value)
+{
+    uint32_t bits = (uint32_t)value;
+    for (int i = 0; i < 4; i++) cg->code[at + i] = (bits >> (8 * i)) & 0xff;
+}
+
+// REX prefix for a ModRM 'reg' and 'rm', left out when no bit is set
+static void emitRex(Codegen *cg, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg & 8 ? 0x04 : 0) | (rm & 8 ? 0x01 : 0);
+    if (rex != 0x40) emitByte(cg, rex);
+}
+
+// ModRM for [base + disp32], RSP and R12 as a base need a SIB byte
+static void emitAddress(Codegen *cg, int reg, int base, int32_t disp)
+{
+    emitByte(cg, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) emitByte(cg, 0x24);
+    emit32(cg, (uint32_t)disp);
+}
+
+static void emitMem(Codegen *cg, bool wide, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    emitRex(cg, wide, reg, base);
+    emitByte(cg, opcode);
+    emitAddress(cg, reg, base, disp);
+}
+
+static void emitRR(Codegen *cg, bool wide, uint8_t opcode, int reg, int rm)
+{
+    emitRex(cg, wide, reg, rm);
+    emitByte(cg, opcode);
+    emitByte(cg, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// SSE instructions, the mandatory prefix goes before any REX prefix
+static void emitSseRM(Codegen *cg, uint8_t prefix, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    emitByte(cg, prefix);
+    emitRex(cg, false, reg, base);
+    emitByte(cg, 0x0f);
+    emitByte(cg, opcode);
+    emitAddress(cg, reg, base, disp);
+}
+
+static void emitSseRR(Codegen *cg, uint8_t prefix, uint8_t opcode, int reg, int rm)
+{
+    emitByte(cg, prefix);
+    emitRex(cg, false, reg, rm);
+    emitByte(cg, 0x0f);
+    emitByte(cg, opcode);
+    emitByte(cg, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void emitMovImm32(Codegen *cg, int reg, uint32_t value)
+{
+    emitRex(cg, false, 0, reg);
+    emitByte(cg, 0xb8 | (reg & 7));
+    emit32(cg, value);
+}
+
+static void emitMovImm64(Codegen *cg, int reg, uint64_t value)
+{
+    emitRex(cg, true, 0, reg);
+    emitByte(cg, 0xb8 | (reg & 7));
+    emit64(cg, value);
+}
+
+static void emitSetcc(Codegen *cg, int cc, int reg)
+{
+    emitRex(cg, false, 0, reg);
+    emitByte(cg, 0x0f);
+    emitByte(cg, 0x90 | cc);
+    emitByte(cg, 0xc0 | (reg & 7));
+}
+
+static void emitCall(Codegen *cg, uint64_t function)
+{
+    emitMovImm64(cg, RAX, function);
+    emitByte(cg, 0xff);     // call rax
+    emitByte(cg, 0xd0);
+}
+
+// Emits a jump and returns the offset of its rel32
+static int emitJump(Codegen *cg, int cc)
+{
+    if (cc == CC_ALWAYS) {
+        emitByte(cg, 0xe9);
+    } else {
+        emitByte(cg, 0x0f);
+        emitByte(cg, 0x80 | cc);
+    }
+    emit32(cg, 0);
+
+    return cg->count - 4;
+}
+
+static void patchJump(Codegen *cg, int at, int target)
+{
+    patch32(cg, at, target - (at + 4));
+}
+
+static int dataConstant(Codegen *cg, int index)
+{
+    return 8 * (cg->rec->globalCount + index);
+}
+
+static bool inXmm(Codegen *cg, IrRef ref)
+{
+    return cg->ir[ref].type == TY_NUM;
+}
+
+static IrRef *ownerOf(Codegen *cg, IrRef ref, int reg)
+{
+    return &cg->owner[inXmm(cg, ref) ? 16 + reg : reg];
+}
+
+static void releaseReg(Codegen *cg, IrRef ref)
+{
+    if (cg->reg[ref] < 0) return;
+
+    *ownerOf(cg, ref, cg->reg[ref]) = 0;
+    cg->reg[ref] = -1;
+}
+
+static void spill(Codegen *cg, IrRef ref)
+{
+    int reg = cg->reg[ref];
+    if (reg < 0) return;
+
+    // Values are never redefined, so one store serves every later reload
+    if (!cg->spilled[ref]) {
+        if (inXmm(cg, ref)) {
+            emitSseRM(cg, 0xf2, 0x11, reg, RSP, SPILL(ref));
+        } else {
+            emitMem(cg, true, 0x89, reg, RSP, SPILL(ref));
+        }
+        cg->spilled[ref] = true;
+    }
+    releaseReg(cg, ref);
+}
+
+// Frees the registers of the values that aren't used after instruction 'at'
+static void releaseDead(Codegen *cg, int at)
+{
+    for (int i = 0; i < 32; i++) {
+        IrRef ref = cg->owner[i];
+        if (ref != 0 && cg->lastUse[ref] <= at) releaseReg(cg, ref);
+    }
+}
+
+static void spillXmm(Codegen *cg)
+{
+    for (int i = 0; i < XMM_COUNT; i++) {
+        IrRef ref = cg->owner[16 + xmmRegs[i]];
+        if (ref != 0) spill(cg, ref);
+    }
+}
+
+/*
+ * Picks a register for 'ref'. With none free, the value whose last use is
+ * furthest away is spilled, other than the operands 'keepA' and 'keepB'.
+*/
+static int allocReg(Codegen *cg, IrRef ref, IrRef keepA, IrRef keepB)
+{
+    bool xmm = inXmm(cg, ref);
+    const int *regs = xmm ? xmmRegs : gprRegs;
+    int count = xmm ? XMM_COUNT : GPR_COUNT;
+    IrRef *owner = xmm ? &cg->owner[16] : cg->owner;
+
+    int victim = -1;
+    for (int i = 0; i < count && victim == -1; i++) {
+        if (owner[regs[i]] == 0) victim = regs[i];
+    }
+
+    if (victim == -1) {
+        for (int i = 0; i < count; i++) {
+            IrRef held = owner[regs[i]];
+            if (held == keepA || held == keepB) continue;
+            if (victim == -1 || cg->lastUse[held] > cg->lastUse[owner[victim]]) victim = regs[i];
+        }
+        spill(cg, owner[victim]);
+    }
+
+    owner[victim] = ref;
+    cg->reg[ref] = victim;
+    return victim;
+}
+
+// The register holding a number, loading it into 'scratch' if it isn't in one
+static int useXmm(Codegen *cg, IrRef ref, int scratch)
+{
+    IrIns *ins = &cg->ir[ref];
+    if (ins->op == IR_NUM) {
+        emitSseRM(cg, 0xf2, 0x10, scratch, DATA, dataConstant(cg, ins->a));
+        return scratch;
+    }
+
+    if (cg->reg[ref] >= 0) return cg->reg[ref];
+    emitSseRM(cg, 0xf2, 0x10, scratch, RSP, SPILL(ref));
+    return scratch;
+}
+
+// The register holding a boolean or a string, loading it into 'scratch' if needed
+static int useGpr(Codegen *cg, IrRef ref, int scratch)
+{
+    IrIns *ins = &cg->ir[ref];
+    switch (ins->op) {
+        case IR_NIL:
+        case IR_BOOL:   emitMovImm32(cg, scratch, ins->op == IR_BOOL && ins->a); return scratch;
+        case IR_STR:    emitMovImm64(cg, scratch, cg->rec->constants[ins->a]); return scratch;
+        default: break;
+    }
+
+    if (cg->reg[ref] >= 0) return cg->reg[ref];
+    emitMem(cg, true, 0x8b, scratch, RSP, SPILL(ref));
+    return scratch;
+}
+
+static void moveGpr(Codegen *cg, int dest, IrRef ref)
+{
+    int reg = useGpr(cg, ref, dest);
+    if (reg != dest) emitRR(cg, true, 0x89, reg, dest);
+}
+
+static ValueType valueType(IrType type)
+{
+    switch (type) {
+        case TY_NIL:    return VAL_NIL;
+        case TY_BOOL:   return VAL_BOOL;
+        case TY_NUM:    return VAL_NUMBER;
+        default:        return VAL_OBJ;
+    }
+}
+
+/*
+ * Boxes 'ref' into the Value at [base + disp]. 'reg' is where the value
+ * is, -1 if spilled. RCX and XMM0 are clobbered, so 'base' may be RAX.
+*/
+static void storeValue(Codegen *cg, int base, int disp, IrRef ref, int reg)
+{
+    IrIns *ins = &cg->ir[ref];
+
+    if (ins->type == TY_NUM) {
+        if (ins->op == IR_NUM) {
+            reg = XMM0;
+            emitSseRM(cg, 0xf2, 0x10, XMM0, DATA, dataConstant(cg, ins->a));
+        } else if (reg < 0) {
+            reg = XMM0;
+            emitSseRM(cg, 0xf2, 0x10, XMM0, RSP, SPILL(ref));
+        }
+        emitSseRM(cg, 0xf2, 0x11, reg, base, disp + PAYLOAD);
+    } else if (ins->op == IR_NIL || ins->op == IR_BOOL) {
+        emitMem(cg, true, 0xc7, 0, base, disp + PAYLOAD);
+        emit32(cg, ins->op == IR_BOOL && ins->a);
+    } else {
+        if (ins->op == IR_STR) {
+            reg = RCX;
+            emitMovImm64(cg, RCX, cg->rec->constants[ins->a]);
+        } else if (reg < 0) {
+            reg = RCX;
+            emitMem(cg, true, 0x8b, RCX, RSP, SPILL(ref));
+        }
+        emitMem(cg, true, 0x89, reg, base, disp + PAYLOAD);
+    }
+
+    emitMem(cg, false, 0xc7, 0, base, disp);
+    emit32(cg, valueType(ins->type));
+}
+
+/*
+ * Compares the type of the Value at [base + disp] with 'type', adding the
+ * jumps taken on a mismatch to 'jumps'. Returns how many it added.
+*/
+static int emitTypeCheck(Codegen *cg, int base, int disp, IrType type, int *jumps)
+{
+    emitMem(cg, false, 0x83, 7, base, disp);
+    emitByte(cg, valueType(type));
+    jumps[0] = emitJump(cg, CC_NE);
+    if (type != TY_STR) return 1;
+
+    // The object type is the seventh byte of its header
+    emitMem(cg, true, 0x8b, RCX, base, disp + PAYLOAD);
+    emitMem(cg, false, 0x80, 7, RCX, OBJ_TYPE_SHIFT / 8);
+    emitByte(cg, OBJ_STRING);
+    jumps[1] = emitJump(cg, CC_NE);
+    return 2;
+}
+
+// Where the snapshot refs are right now, for an exit taken from here
+static ExitStub *newStub(Codegen *cg, int snapshot)
+{
+    ExitStub *stub = &cg->stubs[cg->stubCount++];
+    Snapshot *snap = &cg->rec->snapshots[snapshot];
+    stub->jumpCount = 0;
+    stub->snapshot = snapshot;
+    stub->known = 0;
+    stub->locations = snap->start;
+
+    for (int i = 0; i < snap->count; i++) {
+        cg->locations[snap->start + i] = cg->reg[cg->rec->snapshotRefs[snap->start + i]];
+    }
+
+    return stub;
+}
+
+static void loadAddress(Codegen *cg, IrIns *ins, int *base, int *disp)
+{
+    if (ins->op == IR_SLOAD) {
+        *base = SLOTS;
+        *disp = VALUE_SIZE * ins->a;
+    } else {
+        emitMem(cg, true, 0x8b, RAX, DATA, 8 * ins->a);
+        *base = RAX;
+        *disp = (int)offsetof(Entry, value);
+    }
+}
+
+static void emitLoad(Codegen *cg, int at)
+{
+    IrIns *ins = &cg->ir[at];
+    IrType stored = ins->op == IR_SLOAD ? cg->slotStores[ins->a] : cg->globalStores[ins->a];
+
+    int base;
+    int disp;
+    loadAddress(cg, ins, &base, &disp);
+
+    // Checked on entry, so only a store of another type makes a guard necessary
+    if (at > cg->head && stored != ins->type) {
+        ExitStub *stub = newStub(cg, ins->snapshot);
+        stub->jumpCount = emitTypeCheck(cg, base, disp, ins->type, stub->jumps);
+    }
+
+    if (ins->type == TY_NIL) return;
+
+    int reg = allocReg(cg, at, 0, 0);
+    switch (ins->type) {
+        case TY_NUM:    emitSseRM(cg, 0xf2, 0x10, reg, base, disp + PAYLOAD); break;
+        case TY_BOOL:   emitRex(cg, false, reg, base);      // movzx reg, byte
+                        emitByte(cg, 0x0f);
+                        emitByte(cg, 0xb6);
+                        emitAddress(cg, reg, base, disp + PAYLOAD); break;
+        default:        emitMem(cg, true, 0x8b, reg, base, disp + PAYLOAD); break;
+    }
+}
+
+static void emitArithmetic(Codegen *cg, int at)
+{
+    static const uint8_t opcodes[] = { 0x58, 0x5c, 0x59, 0x5e };    // add, sub, mul, div
+    IrIns *ins = &cg->ir[at];
+    uint8_t opcode = opcodes[ins->op - IR_ADD];
+
+    int a = useXmm(cg, ins->a, XMM0);
+    bool constant = cg->ir[ins->b].op == IR_NUM;
+    int b = constant ? -1 : useXmm(cg, ins->b, XMM1);
+
+    // An operand dying here may hand its register to the result
+    releaseDead(cg, at);
+    int reg = allocReg(cg, at, ins->a, ins->b);
+
+    int dest = reg == b && reg != a ? XMM0 : reg;
+    if (dest != a) emitSseRR(cg, 0x66, 0x28, dest, a);     // movapd
+    if (constant) {
+        emitSseRM(cg, 0xf2, opcode, dest, DATA, dataConstant(cg, cg->ir[ins->b].a));
+    } else {
+        emitSseRR(cg, 0xf2, opcode, dest, b);
+    }
+    if (dest != reg) emitSseRR(cg, 0x66, 0x28, reg, dest);
+}
+
+static void emitNegate(Codegen *cg, int at, int signMask)
+{
+    IrIns *ins = &cg->ir[at];
+    int a = useXmm(cg, ins->a, XMM0);
+    releaseDead(cg, at);
+    int reg = allocReg(cg, at, ins->a, 0);
+
+    if (reg != a) emitSseRR(cg, 0x66, 0x28, reg, a);
+    emitSseRM(cg, 0xf2, 0x10, XMM1, DATA, dataConstant(cg, signMask));
+    emitSseRR(cg, 0x66, 0x57, reg, XMM1);  // xorpd
+}
+
+/*
+ * Sets the flags for a comparison. 'a < b' is tested as 'b > a', so NaN
+ * operands fail every ordered comparison as they do in C. A comparison
+ * only feeding the guard after it leaves the flags for the guard's jump.
+*/
+static void emitCompare(Codegen *cg, int at)
+{
+    IrIns *ins = &cg->ir[at];
+    bool number = cg->ir[ins->a].type == TY_NUM;
+
+    if (number) {
+        int a = useXmm(cg, ins->a, XMM0);
+        int b = useXmm(cg, ins->b, XMM1);
+        if (ins->op == IR_LT) {
+            emitSseRR(cg, 0x66, 0x2e, b, a);
+        } else {
+            emitSseRR(cg, 0x66, 0x2e, a, b);
+        }
+    } else {
+        // Strings are interned, so equal strings are the same object
+        int a = useGpr(cg, ins->a, RCX);
+        int b = useGpr(cg, ins->b, RDX);
+        emitRR(cg, true, 0x39, b, a);
+    }
+
+    if (cg->fused[at]) return;
+
+    // Neither spills nor mov change the flags
+    releaseDead(cg, at);
+    int reg = allocReg(cg, at, 0, 0);
+    emitMovImm32(cg, reg, 0);
+    if (ins->op != IR_EQ) {
+        emitSetcc(cg, CC_A, reg);
+    } else if (!number) {
+        emitSetcc(cg, CC_E, reg);
+    } else {
+        emitSetcc(cg, CC_E, reg);
+        emitSetcc(cg, CC_NP, RAX);
+        emitRR(cg, false, 0x20, RAX, reg);  // and reg8, al
+    }
+}
+
+static void emitGuard(Codegen *cg, int at)
+{
+    IrIns *ins = &cg->ir[at];
+    IrIns *cond = &cg->ir[ins->a];
+    bool expected = ins->b;
+    ExitStub *stub = newStub(cg, ins->snapshot);
+
+    if (!cg->fused[ins->a]) {
+        int reg = useGpr(cg, ins->a, RCX);
+        emitRR(cg, true, 0x85, reg, reg);   // test
+        stub->jumps[stub->jumpCount++] = emitJump(cg, expected ? CC_E : CC_NE);
+        return;
+    }
+
+    // The comparison isn't in a register, but an exit knows its value
+    stub->known = ins->a;
+    stub->value = !expected;
+
+    if (cond->op != IR_EQ) {
+        stub->jumps[stub->jumpCount++] = emitJump(cg, expected ? CC_BE : CC_A);
+    } else if (cg->ir[cond->a].type != TY_NUM) {
+        stub->jumps[stub->jumpCount++] = emitJump(cg, expected ? CC_NE : CC_E);
+    } else if (expected) {
+        // Equal is ZF without PF, which marks NaN
+        stub->jumps[stub->jumpCount++] = emitJump(cg, CC_NE);
+        stub->jumps[stub->jumpCount++] = emitJump(cg, CC_P);
+    } else {
+        int unordered = emitJump(cg, CC_P);
+        stub->jumps[stub->jumpCount++] = emitJump(cg, CC_E);
+        patchJump(cg, unordered, cg->count);
+    }
+}
+
+/*
+ * Strings held only in registers must be reachable when a helper
+ * allocates, so every live one is boxed above the trace's slots and
+ * vm.stackTop moved past them for the GC to find.
+*/
+static void rootStrings(Codegen *cg, int at)
+{
+    int roots = 0;
+    for (IrRef ref = 1; ref < at; ref++) {
+        IrIns *ins = &cg->ir[ref];
+        if (ins->type != TY_STR || isConstant(ins) || cg->lastUse[ref] < at) continue;
+        storeValue(cg, SLOTS, VALUE_SIZE * (cg->rootBase + roots++), ref, cg->reg[ref]);
+    }
+
+    if (roots > cg->maxRoots) cg->maxRoots = roots;
+    emitMem(cg, true, 0x8d, RAX, SLOTS, VALUE_SIZE * (cg->rootBase + roots));
+    emitMovImm64(cg, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitMem(cg, true, 0x89, RAX, RCX, 0);
+}
+
+static void emitConcat(Codegen *cg, int at)
+{
+    IrIns *ins = &cg->ir[at];
+    spillXmm(cg);
+    rootStrings(cg, at);
+
+    moveGpr(cg, RDI, ins->a);
+    moveGpr(cg, RSI, ins->b);
+    emitCall(cg, (uint64_t)(uintptr_t)concatStrings);
+
+    releaseDead(cg, at);
+    int reg = allocReg(cg, at, 0, 0);
+    emitRR(cg, true, 0x89, RAX, reg);
+}
+
+static void emitPrint(Codegen *cg, int at)
+{
+    IrIns *ins = &cg->ir[at];
+    storeValue(cg, RSP, 0, ins->a, cg->reg[ins->a]);
+    spillXmm(cg);
+
+    emitMem(cg, true, 0x8d, RDI, RSP, 0);
+    emitCall(cg, (uint64_t)(uintptr_t)tracePrint);
+}
+
+// Values used across the backedge go back to the registers they had at IR_HEAD
+static void emitBackedge(Codegen *cg, int at)
+{
+    for (IrRef ref = 1; ref < cg->head; ref++) {
+        int reg = cg->headReg[ref];
+        if (cg->lastUse[ref] != at || reg < 0 || cg->reg[ref] == reg) continue;
+
+        if (inXmm(cg, ref)) {
+            emitSseRM(cg, 0xf2, 0x10, reg, RSP, SPILL(ref));
+        } else {
+            emitMem(cg, true, 0x8b, reg, RSP, SPILL(ref));
+        }
+    }
+
+    patchJump(cg, emitJump(cg, CC_ALWAYS), cg->headLabel);
+}
+
+static void computeLiveness(Codegen *cg)
+{
+    Recorder *rec = cg->rec;
+    int count = rec->irCount;
+    int loop = count - 1;
+
+    while (cg->ir[cg->head].op != IR_HEAD) cg->head++;
+
+    for (int i = 1; i < count; i++) {
+        IrIns *ins = &cg->ir[i];
+        cg->lastUse[i] = i;
+        if (usesA(ins->op)) cg->lastUse[ins->a] = i;
+        if (usesB(ins->op)) cg->lastUse[ins->b] = i;
+
+        bool exits = ins->op == IR_GUARD || ((ins->op == IR_SLOAD || ins->op == IR_GLOAD) && i > cg->head);
+        if (!exits) continue;
+
+        Snapshot *snapshot = &rec->snapshots[ins->snapshot];
+        for (int j = 0; j < snapshot->count; j++) {
+            cg->lastUse[rec->snapshotRefs[snapshot->start + j]] = i;
+        }
+    }
+
+    // Hoisted values are used again by the next iteration
+    for (int i = 1; i < cg->head; i++) {
+        if (cg->lastUse[i] > cg->head) cg->lastUse[i] = loop;
+    }
+
+    for (int i = 1; i < count; i++) {
+        IrIns *ins = &cg->ir[i];
+        cg->fused[i] = (ins->op == IR_LT || ins->op == IR_GT || ins->op == IR_EQ) &&
+                       cg->ir[i + 1].op == IR_GUARD && cg->ir[i + 1].a == i && cg->lastUse[i] == i + 1;
+        if (ins->op == IR_SSTORE) cg->slotStores[ins->a] = cg->ir[ins->b].type;
+        if (ins->op == IR_GSTORE) cg->globalStores[ins->a] = cg->ir[ins->b].type;
+    }
+}
+
+static void emitPrologue(Codegen *cg, int frameSize)
+{
+    static const int saved[] = { RBP, RBX, R12, R13, R14, R15 };
+    for (int i = 0; i < 6; i++) {
+        emitRex(cg, false, 0, saved[i]);
+        emitByte(cg, 0x50 | (saved[i] & 7));
+    }
+    emitRR(cg, true, 0x81, 5, RSP);     // sub rsp, frameSize
+    emit32(cg, frameSize);
+    emitRR(cg, true, 0x89, RDI, SLOTS);
+    emitRR(cg, true, 0x89, RSI, DATA);
+
+    // Every slot and global the trace reads must still have its recorded type
+    for (int i = 1; i < cg->rec->irCount; i++) {
+        IrIns *ins = &cg->ir[i];
+        if (ins->op != IR_SLOAD && ins->op != IR_GLOAD) continue;
+
+        int base;
+        int disp;
+        loadAddress(cg, ins, &base, &disp);
+        cg->entryJumpCount += emitTypeCheck(cg, base, disp, ins->type,
+                                            &cg->entryJumps[cg->entryJumpCount]);
+    }
+}
+
+static int emitEpilogue(Codegen *cg, int frameSize)
+{
+    static const int saved[] = { R15, R14, R13, R12, RBX, RBP };
+    int epilogue = cg->count;
+
+    emitRR(cg, true, 0x81, 0, RSP);     // add rsp, frameSize
+    emit32(cg, frameSize);
+    for (int i = 0; i < 6; i++) {
+        emitRex(cg, false, 0, saved[i]);
+        emitByte(cg, 0x58 | (saved[i] & 7));
+    }
+    emitByte(cg, 0xc3);
+
+    return epilogue;
+}
+
+/*
+ * Each exit boxes the values the interpreter would have had on its stack
+ * and returns the number of its snapshot.
+*/
+static void emitExits(Codegen *cg, int epilogue)
+{
+    Recorder *rec = cg->rec;
+
+    for (int i = 0; i < cg->entryJumpCount; i++) patchJump(cg, cg->entryJumps[i], cg->count);
+    emitMovImm32(cg, RAX, 0);
+    patchJump(cg, emitJump(cg, CC_ALWAYS), epilogue);
+
+    for (int i = 0; i < cg->stubCount; i++) {
+        ExitStub *stub = &cg->stubs[i];
+        Snapshot *snapshot = &rec->snapshots[stub->snapshot];
+        for (int j = 0; j < stub->jumpCount; j++) patchJump(cg, stub->jumps[j], cg->count);
+
+        for (int j = 0; j < snapshot->count; j++) {
+            IrRef ref = rec->snapshotRefs[snapshot->start + j];
+            int disp = VALUE_SIZE * (rec->base + j);
+
+            if (ref == stub->known) {
+                emitMem(cg, true, 0xc7, 0, SLOTS, disp + PAYLOAD);
+                emit32(cg, stub->value);
+                emitMem(cg, false, 0xc7, 0, SLOTS, disp);
+                emit32(cg, VAL_BOOL);
+            } else {
+                storeValue(cg, SLOTS, disp, ref, cg->locations[stub->locations + j]);
+            }
+        }
+
+        emitMovImm32(cg, RAX, stub->snapshot);
+        patchJump(cg, emitJump(cg, CC_ALWAYS), epilogue);
+    }
+}
+
+static Trace *compileTrace(Recorder *rec)
+{
+    bool negates = false;
+    for (int i = 1; i < rec->irCount; i++) {
+        if (rec->ir[i].op == IR_NEG) negates = true;
+    }
+
+    int signMask = rec->constantCount;
+    if (negates) rec->constants[rec->constantCount++] = UINT64_C(1) << 63;
+
+    hoistInvariants(rec);
+
+    Codegen *cg = (Codegen *)malloc(sizeof(Codegen));
+    if (cg == NULL) exit(1);
+    memset(cg, 0, sizeof(Codegen));
+    cg->rec = rec;
+    cg->head = 1;
+    cg->ir = rec->ir;
+    cg->rootBase = rec->maxDepth;
+    memset(cg->reg, -1, sizeof(cg->reg));
+    for (int i = 0; i < MAX_TRACE_SLOTS; i++) cg->slotStores[i] = TY_NONE;
+    for (int i = 0; i < MAX_TRACE_GLOBALS; i++) cg->globalStores[i] = TY_NONE;
+    computeLiveness(cg);
+
+    // Keeps rsp 16-byte aligned for the helper calls
+    int frameSize = SPILL(rec->irCount);
+    if (frameSize % 16 == 0) frameSize += 8;
+
+    emitPrologue(cg, frameSize);
+    for (int i = 1; i < rec->irCount; i++) {
+        IrIns *ins = &cg->ir[i];
+
+        switch (ins->op) {
+            case IR_SLOAD:
+            case IR_GLOAD:      emitLoad(cg, i); break;
+            case IR_SSTORE: {
+                storeValue(cg, SLOTS, VALUE_SIZE * ins->a, ins->b, cg->reg[ins->b]);
+            } break;
+            case IR_GSTORE: {
+                emitMem(cg, true, 0x8b, RAX, DATA, 8 * ins->a);
+                storeValue(cg, RAX, (int)offsetof(Entry, value), ins->b, cg->reg[ins->b]);
+            } break;
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV:        emitArithmetic(cg, i); break;
+            case IR_NEG:        emitNegate(cg, i, signMask); break;
+            case IR_LT:
+            case IR_GT:
+            case IR_EQ:         emitCompare(cg, i); break;
+            case IR_NOT: {
+                int a = useGpr(cg, ins->a, RCX);
+                releaseDead(cg, i);
+                int reg = allocReg(cg, i, ins->a, 0);
+                if (reg != a) emitRR(cg, true, 0x89, a, reg);
+                emitRR(cg, true, 0x83, 6, reg);     // xor reg, 1
+                emitByte(cg, 1);
+            } break;
+            case IR_CONCAT:     emitConcat(cg, i); break;
+            case IR_PRINT:      emitPrint(cg, i); break;
+            case IR_GUARD:      emitGuard(cg, i); break;
+            case IR_HEAD: {
+                memcpy(cg->headReg, cg->reg, sizeof(cg->reg));
+                cg->headLabel = cg->count;
+            } break;
+            case IR_LOOP:       emitBackedge(cg, i); break;
+            default: break;     // Constants are used in place
+        }
+
+        releaseDead(cg, i);
+    }
+
+    int epilogue = emitEpilogue(cg, frameSize);
+    emitExits(cg, epilogue);
+
+    Trace *trace = NULL;
+    void *code = mmap(NULL, cg->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        // Writable and executable are never both set
+        memcpy(code, cg->code, cg->count);
+        mprotect(code, cg->count, PROT_READ | PROT_EXEC);
+
+        trace = (Trace *)malloc(sizeof(Trace));
+        if (trace == NULL) exit(1);
+        trace->code = (uint8_t *)code;
+        trace->size = cg->count;
+        trace->globalCount = rec->globalCount;
+        trace->dataCount = rec->globalCount + rec->constantCount;
+        trace->data = (uint64_t *)malloc(sizeof(uint64_t) * (trace->dataCount + 1));
+        trace->globals = (ObjString **)malloc(sizeof(ObjString *) * (rec->globalCount + 1));
+        trace->snapshotCount = rec->snapshotCount;
+        trace->snapshots = (Snapshot *)malloc(sizeof(Snapshot) * rec->snapshotCount);
+        if (trace->data == NULL || trace->globals == NULL || trace->snapshots == NULL) exit(1);
+
+        memcpy(trace->globals, rec->globals, sizeof(ObjString *) * rec->globalCount);
+        memcpy(trace->data + rec->globalCount, rec->constants, sizeof(uint64_t) * rec->constantCount);
+        memcpy(trace->snapshots, rec->snapshots, sizeof(Snapshot) * rec->snapshotCount);
+        trace->stackNeeded = cg->rootBase + cg->maxRoots;
+        trace->entryFails = 0;
+    }
+
+    free(cg->code);
+    free(cg);
+    return trace;
+}
+
+#else
+
+// No code generator for this target, every loop stays in the interpreter
+static Trace *compileTrace(Recorder *rec)
+{
+    return NULL;
+}
+
+#endif // TRACE_NATIVE
+
+void recordTrace(CallFrame *frame, HotLoop *loop)
+{
+    Recorder *rec = (Recorder *)malloc(sizeof(Recorder));
+    if (rec == NULL) exit(1);
+
+    rec->frame = frame;
+    rec->chunk = &frame->closure->function->chunk;
+    rec->header = (int)(frame->ip - rec->chunk->code);
+    rec->base = (int)(vm.stackTop - frame->slots);
+    rec->maxDepth = rec->base;
+    rec->failed = rec->base + 2 > MAX_TRACE_SLOTS;
+    rec->irCount = 1;
+    rec->constantCount = 0;
+    rec->globalCount = 0;
+    rec->snapshotCount = 0;
+    rec->snapshotRefCount = 0;
+    memset(rec->slots, 0, sizeof(rec->slots));
+    takeSnapshot(rec, rec->header);
+
+    RecordStatus status = RECORD_OK;
+    for (int count = 0; status == RECORD_OK && !rec->failed && count < MAX_RECORDED; count++) {
+        status = recordInstruction(rec);
+    }
+
+    Trace *trace = status == RECORD_DONE && !rec->failed ? compileTrace(rec) : NULL;
+    if (trace != NULL) {
+        loop->trace = trace;
+    } else {
+        loop->hotness = 0;
+        loop->aborts++;
+    }
+
+    free(rec);
+}
+
+void runTrace(CallFrame *frame, HotLoop *loop)
+{
+    Trace *trace = loop->trace;
+    if (vm.stackEnd - frame->slots < trace->stackNeeded) return;
+
+    // The entries don't move while the trace runs, it never defines a global
+    for (int i = 0; i < trace->globalCount; i++) {
+        Entry *entry = tableEntry(&vm.globals, trace->globals[i]);
+        if (entry == NULL) return;
+        trace->data[i] = (uint64_t)(uintptr_t)entry;
+    }
+
+    TraceFn native = (TraceFn)(uintptr_t)trace->code;
+    Snapshot *exit = &trace->snapshots[native(frame->slots, trace->data)];
+    frame->ip = frame->closure->function->chunk.code + exit->pc;
+    vm.stackTop = frame->slots + exit->depth;
+
+    // Types that keep failing the entry checks get a new recording
+    if (exit == trace->snapshots && ++trace->entryFails == MAX_ENTRY_FAILS) {
+        freeTrace(trace);
+        loop->trace = NULL;
+        loop->hotness = 0;
+    }
+}
+
+void freeTrace(Trace *trace)
+{
+    if (trace == NULL) return;
+
+#ifdef TRACE_NATIVE
+    munmap(trace->code, trace->size);
+#endif
+    free(trace->data);
+    free(trace->globals);
+    free(trace->snapshots);
+    free(trace);
+}
@@ -0,0 +1,32 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "clox_chunk.h"
+#include "clox_common.h"
+#include "clox_vm.h"
+
+// Backedges a loop takes before it is recorded, and how many recordings
+// may fail before it is left to the interpreter for good.
+#define HOT_LOOP 56
+#define MAX_ABORTS 4
+
+typedef struct Trace Trace;
+
+/*
+ * A trace is one iteration of a hot loop, recorded as it runs and compiled
+ * to x86-64 that loops back on itself. Values are unboxed for the length of
+ * the trace, but locals and globals are written back to the VM as they are
+ * assigned, so a side exit only has to box the temporaries on the stack
+ * before run() resumes at the instruction that left the recorded path.
+*/
+
+// Records one iteration of the loop starting at frame->ip, executing it as
+// it goes. On return frame->ip is wherever the recording stopped.
+void recordTrace(CallFrame *frame, HotLoop *loop);
+
+// Runs the loop's trace from frame->ip until one of its exits
+void runTrace(CallFrame *frame, HotLoop *loop);
+
+void freeTrace(Trace *trace);
+
+#endif // CLOX_TRACE_H
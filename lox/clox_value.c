@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -11,7 +12,6 @@ bool valuesEqual(Value a, Value b)
     switch (a.type) {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:       return true;
-        case VAL_BAD:       return false;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
         default:            return false; // Unreachable
@@ -36,8 +36,13 @@ void printValue(Value value)
     switch (value.type) {
         case VAL_BOOL:      printf(AS_BOOL(value) ? "true" : "false"); break;
         case VAL_NIL:       printf("nil"); break;
-        case VAL_BAD:       return; // Bad value, handled by error reporting
-        case VAL_NUMBER:    printf("%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER: {
+            // Which NaN an operation returns depends on the order the C compiler
+            // put its operands in, which traces can't match, so the sign is dropped
+            double number = AS_NUMBER(value);
+            if (isnan(number)) printf("nan");
+            else printf("%g", number);
+        } break;
         case VAL_OBJ:       printObject(value); break;
         // default:            return; // Unreachable
     }
@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -8,22 +9,39 @@
 #include "clox_common.h"
 #include "clox_debug.h"
 #include "clox_memory.h"
+#include "clox_perf.h"
+#include "clox_snapshot.h"
+#include "clox_trace.h"
 #include "clox_vm.h"
 
 VM vm;
 
-static Value clockNative(int argCount, Value *args, ...)
-{
-    if (argCount > 0) {
-        runtimeError("clock() native function takes exactly 0 arguments.");
-        return BAD_VAL;
-    }
+#define TRACE_FRAMES 16
 
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(int argCount, Value *args, Value *result)
+{
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
+typedef struct {
+    const char *name;
+    NativeFn function;
+    int arity;
+} NativeDef;
+
+static const NativeDef natives[] = {
+    {"clock", clockNative, 0},
+};
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
+
 static void resetStack()
 {
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        vm.upvalueSlots[upvalue->location - vm.stack] = NULL;
+    }
+
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
@@ -38,6 +56,13 @@ void runtimeError(const char *fmt, ...)
     fputs("\n", stderr);
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        // Deep recursion would bury the error, so only the innermost and
+        // outermost frames of a long trace are shown.
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
+
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
@@ -53,18 +78,27 @@ void runtimeError(const char *fmt, ...)
     resetStack();
 }
 
-static void defineNative(const char *name, NativeFn function)
+static void defineNative(const char *name, NativeFn function, int arity)
 {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
+    push(OBJ_VAL(newNative(function, AS_STRING(vm.stack[0]), arity)));
     tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
     pop();
     pop();
 }
 
-void initVM()
+NativeFn findNative(const char *name)
+{
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        if (!strcmp(natives[i].name, name)) return natives[i].function;
+    }
+
+    return NULL;
+}
+
+// Everything but the heap
+static void initRuntime()
 {
-    resetStack();
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
     vm.objects = NULL;
@@ -73,25 +107,101 @@ void initVM()
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
+    vm.frames = (CallFrame *)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.frameLimit = FRAMES_LIMIT_DEFAULT;
+
+    vm.stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+    vm.stackEnd = vm.stack + STACK_INITIAL;
+    vm.upvalueSlots = (ObjUpvalue **)calloc(STACK_INITIAL, sizeof(ObjUpvalue *));
+    if (vm.frames == NULL || vm.stack == NULL || vm.upvalueSlots == NULL) exit(1);
+    resetStack();
+
     initTable(&vm.globals);
     initTable(&vm.strings);
 
     vm.initString = NULL;
+    vm.rootShape = NULL;
+    vm.cacheEpoch = 1;  // Fresh caches start at epoch 0, so they're flushed on first use
+    vm.jit = false;
+    vm.perfMap = false;
+    vm.perfDepth = 0;
+}
+
+void initVM()
+{
+    initRuntime();
     vm.initString = copyString("init", 4);
+    vm.rootShape = newShape();
+
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        defineNative(natives[i].name, natives[i].function, natives[i].arity);
+    }
+}
 
-    defineNative("clock", clockNative);
+bool initVMFromSnapshot(const char *path)
+{
+    initRuntime();
+    return loadSnapshot(path);
 }
 
 void freeVM()
 {
+#ifdef DEBUG_PROFILE_OPCODES
+    printProfile();
+#endif // DEBUG_PROFILE_OPCODES
+
     freeTable(&vm.globals);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.rootShape = NULL;
     freeObjects();
+
+    free(vm.frames);
+    free(vm.stack);
+    free(vm.upvalueSlots);
+    if (vm.perfMap) freePerfMap();
+    vm.frames = NULL;
+    vm.stack = NULL;
+    vm.upvalueSlots = NULL;
+}
+
+/*
+ * Moves the value stack into a buffer twice the size. Frame slots, open
+ * upvalues and the stack top all point into the stack, so they're rebased.
+ * The stack is not GC managed memory: growing it must never collect, as
+ * the value being pushed isn't rooted yet.
+*/
+static void growStack()
+{
+    int oldCapacity = (int)(vm.stackEnd - vm.stack);
+    int capacity = oldCapacity * 2;
+    Value *stack = (Value *)malloc(sizeof(Value) * capacity);
+    ObjUpvalue **upvalueSlots = (ObjUpvalue **)realloc(vm.upvalueSlots, sizeof(ObjUpvalue *) * capacity);
+    if (stack == NULL || upvalueSlots == NULL) exit(1);
+
+    memset(upvalueSlots + oldCapacity, 0, sizeof(ObjUpvalue *) * (capacity - oldCapacity));
+    vm.upvalueSlots = upvalueSlots;
+
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+    vm.stackEnd = stack + capacity;
+    free(vm.stack);
+    vm.stack = stack;
 }
 
 void push(Value value)
 {
+    if (vm.stackTop == vm.stackEnd) growStack();
     *vm.stackTop = value;
     vm.stackTop++;
 }
@@ -114,11 +224,25 @@ static bool call(ObjClosure *closure, int argCount)
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount >= vm.frameLimit) {
         runtimeError("Stack overflow!");
         return false;
     }
 
+    if (vm.frameCount == vm.frameCapacity) {
+        int capacity = vm.frameCapacity * 2;
+        if (capacity > vm.frameLimit) capacity = vm.frameLimit;
+
+        CallFrame *frames = (CallFrame *)realloc(vm.frames, sizeof(CallFrame) * capacity);
+        if (frames == NULL) exit(1);
+        vm.frames = frames;
+        vm.frameCapacity = capacity;
+    }
+
+    // Make room for the callee's locals up front, so pushes within the
+    // frame rarely have to grow the stack themselves.
+    if (vm.stackEnd - vm.stackTop < UINT8_COUNT) growStack();
+
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -151,10 +275,16 @@ static bool callValue(Value callee, int argCount)
             } break;
             case OBJ_CLOSURE:   return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                ObjNative *native = AS_NATIVE(callee);
+                if (native->arity != NATIVE_VARIADIC && argCount != native->arity) {
+                    runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+                    return false;
+                }
+
+                // The result goes straight into the callee's slot
+                Value *args = vm.stackTop - argCount;
+                if (!native->function(argCount, args, &args[-1])) return false;
+                vm.stackTop = args;
                 return true;
             } break;
             default: break; // Non-callable object type
@@ -165,18 +295,141 @@ static bool callValue(Value callee, int argCount)
     return false;
 }
 
-static bool invokeFromClass(ObjClass *class, ObjString *name, int argCount)
+static CacheEntry *cacheLookup(InlineCache *cache, ObjShape *shape, ObjClass *class)
+{
+    if (cache->epoch != vm.cacheEpoch) {
+        // A method table changed since this cache was filled
+        cache->epoch = vm.cacheEpoch;
+        cache->count = 0;
+        return NULL;
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        CacheEntry *entry = &cache->entries[i];
+        if (entry->shape == shape && entry->klass == class) return entry;
+    }
+
+    return NULL;
+}
+
+static CacheEntry *cacheAdd(InlineCache *cache, ObjShape *shape, ObjClass *class)
+{
+    // Megamorphic sites stay on the slow path
+    if (cache->count == IC_WAYS) return NULL;
+
+    CacheEntry *entry = &cache->entries[cache->count++];
+    entry->shape = shape;
+    entry->klass = class;
+    entry->transition = NULL;
+    entry->method = NULL;
+    entry->slot = -1;
+    return entry;
+}
+
+static void cacheMethod(CacheEntry *entry, ObjClosure *method)
 {
+    entry->method = method;
+    entry->klass->methodsCached = true;
+}
+
+/*
+ * Looks up a property through the inline cache. A field sets *value and
+ * leaves *method NULL, while a method from the class sets *method.
+*/
+static bool resolveProperty(ObjInstance *instance, ObjString *name, InlineCache *cache,
+                            Value *value, ObjClosure **method)
+{
+    *method = NULL;
+
+    // Dictionary mode instances have no shape to key the cache on
+    if (instance->shape == NULL) {
+        if (instanceGetField(instance, name, value)) return true;
+
+        Value found;
+        if (!tableGet(&instance->class->methods, name, &found)) return false;
+        *method = AS_CLOSURE(found);
+        return true;
+    }
+
+    CacheEntry *entry = cacheLookup(cache, instance->shape, instance->class);
+    if (entry != NULL) {
+        if (entry->method == NULL) {
+            *value = instance->fields[entry->slot];
+        } else {
+            *method = entry->method;
+        }
+        return true;
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+        *value = instance->fields[slot];
+        entry = cacheAdd(cache, instance->shape, instance->class);
+        if (entry != NULL) entry->slot = slot;
+        return true;
+    }
+
+    Value found;
+    if (!tableGet(&instance->class->methods, name, &found)) return false;
+
+    *method = AS_CLOSURE(found);
+    entry = cacheAdd(cache, instance->shape, instance->class);
+    if (entry != NULL) cacheMethod(entry, *method);
+    return true;
+}
+
+static void setProperty(ObjInstance *instance, ObjString *name, Value value, InlineCache *cache)
+{
+    ObjShape *shape = instance->shape;
+    if (shape == NULL) {
+        instanceSetField(instance, name, value);
+        return;
+    }
+
+    CacheEntry *entry = cacheLookup(cache, shape, instance->class);
+    if (entry != NULL) {
+        if (entry->transition == NULL) {
+            instance->fields[entry->slot] = value;
+            return;
+        }
+
+        if (entry->slot < instance->fieldCapacity) {
+            instance->fields[entry->slot] = value;
+            instance->shape = entry->transition;
+            if (entry->slot + 1 > instance->class->fieldHint) {
+                instance->class->fieldHint = entry->slot + 1;
+            }
+            return;
+        }
+    }
+
+    instanceSetField(instance, name, value);
+    if (instance->shape == NULL) return;    // Overflowed into dictionary mode
+
+    if (entry == NULL) entry = cacheAdd(cache, shape, instance->class);
+    if (entry != NULL) {
+        entry->slot = shapeSlot(instance->shape, name);
+        entry->transition = instance->shape != shape ? instance->shape : NULL;
+    }
+}
+
+static bool invokeFromClass(ObjClass *class, ObjString *name, int argCount, InlineCache *cache)
+{
+    CacheEntry *entry = cacheLookup(cache, NULL, class);
+    if (entry != NULL) return call(entry->method, argCount);
+
     Value method;
     if (!tableGet(&class->methods, name, &method)) {
         runtimeError("Undefined property: '%s'.", name->chars);
         return false;
     }
 
+    entry = cacheAdd(cache, NULL, class);
+    if (entry != NULL) cacheMethod(entry, AS_CLOSURE(method));
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount)
+static bool invoke(ObjString *name, int argCount, InlineCache *cache)
 {
     Value receiver = peek(argCount);
 
@@ -188,12 +441,16 @@ static bool invoke(ObjString *name, int argCount)
     ObjInstance *instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    ObjClosure *method;
+    if (!resolveProperty(instance, name, cache, &value, &method)) {
+        runtimeError("Undefined property: '%s'.", name->chars);
+        return false;
     }
 
-    return invokeFromClass(instance->class, name, argCount);
+    if (method != NULL) return call(method, argCount);
+
+    vm.stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
 }
 
 static bool bindMethod(ObjClass *class, ObjString *name)
@@ -212,19 +469,22 @@ static bool bindMethod(ObjClass *class, ObjString *name)
 
 static ObjUpvalue *captureUpvalue(Value *local)
 {
+    // Open upvalues are indexed by stack slot, so finding an existing one
+    // doesn't have to walk the list.
+    ObjUpvalue **slot = &vm.upvalueSlots[local - vm.stack];
+    if (*slot != NULL) return *slot;
+
+    ObjUpvalue *createdUpvalue = newUpvalue(local);
+    *slot = createdUpvalue;
+
+    // The list stays sorted by location for closeUpvalues()
     ObjUpvalue *prevUpvalue = NULL;
     ObjUpvalue *upvalue = vm.openUpvalues;
-
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
     }
 
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
-
-    ObjUpvalue *createdUpvalue = newUpvalue(local);
     createdUpvalue->next = upvalue;
 
     if (prevUpvalue == NULL) {
@@ -240,17 +500,44 @@ static void closeUpvalues(Value *last)
 {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue *upvalue = vm.openUpvalues;
+        vm.upvalueSlots[upvalue->location - vm.stack] = NULL;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
         vm.openUpvalues = upvalue->next;
     }
 }
 
+/*
+ * Finishes a call in tail position. If the callee pushed a frame on top
+ * of the caller's, the caller is done with its locals: the callee's slots
+ * are slid down over them and the callee takes over the caller's frame.
+*/
+static void reuseFrame(int caller)
+{
+    if (vm.frameCount - 1 == caller) return;  // Native call, no frame pushed
+
+    CallFrame *frame = &vm.frames[caller];
+    CallFrame *callee = &vm.frames[caller + 1];
+    closeUpvalues(frame->slots);
+
+    int slotCount = (int)(vm.stackTop - callee->slots);
+    memmove(frame->slots, callee->slots, sizeof(Value) * slotCount);
+    vm.stackTop = frame->slots + slotCount;
+
+    frame->closure = callee->closure;
+    frame->ip = callee->ip;
+    vm.frameCount--;
+}
+
 static void defineMethod(ObjString *name)
 {
     Value method = peek(0);
     ObjClass *class = AS_CLASS(peek(1));
     tableSet(&class->methods, name, method);
+
+    // Only a class whose methods were cached can leave stale entries,
+    // defining the methods of a new class flushes nothing.
+    if (class->methodsCached) vm.cacheEpoch++;
     pop();
 }
 
@@ -261,22 +548,32 @@ static bool isFalsey(Value value)
 
 static void concatenate()
 {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString *result = takeString(chars, length);
+    ObjString *result = concatStrings(AS_STRING(peek(1)), AS_STRING(peek(0)));
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run()
+static InterpretResult run(int base);
+
+/*
+ * Under --perf-map, a call that pushed a frame is run to its return by a
+ * run() of its own, entered through the callee's trampoline, so the native
+ * stack perf samples says which function is being interpreted. Tail calls
+ * reuse the caller's frame and stay under the caller's trampoline.
+*/
+static bool enterCallee(int caller)
+{
+    if (!vm.perfMap || vm.frameCount - 1 == caller || vm.perfDepth == PERF_MAX_DEPTH) return true;
+
+    vm.perfDepth++;
+    InterpretResult result = perfTrampoline(vm.frames[caller + 1].closure->function, run, caller + 1);
+    vm.perfDepth--;
+    return result == INTERPRET_OK;
+}
+
+// Runs until the frame count drops back to 'base', leaving the result pushed
+static InterpretResult run(int base)
 {
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
@@ -291,6 +588,19 @@ static InterpretResult run()
 
 #define READ_STRING()       AS_STRING(READ_CONSTANT())
 
+#define READ_CACHE()                                                \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+#define READ_LOOP()                                                 \
+    (&frame->closure->function->chunk.loops[READ_SHORT()])
+
+// Rewrites the instruction 'length' bytes behind ip and dispatches it again
+#define QUICKEN(op, length)                                         \
+    do {                                                            \
+        frame->ip -= (length);                                      \
+        *frame->ip = (op);                                          \
+    } while (false)
+
 #define BINARY_OP(valueType, op)                                    \
     do {                                                            \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {           \
@@ -317,6 +627,11 @@ static InterpretResult run()
                                (int)(frame->ip - frame->closure->function->chunk.code));
 #endif // DEBUG_TRACE_EXECUTION
 
+#ifdef DEBUG_PROFILE_OPCODES
+        profileInstruction(&frame->closure->function->chunk,
+                           (int)(frame->ip - frame->closure->function->chunk.code));
+#endif // DEBUG_PROFILE_OPCODES
+
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
@@ -335,6 +650,10 @@ static InterpretResult run()
                 uint8_t slot = READ_BYTE();
                 frame->slots[slot] = peek(0);
             } break;
+            case OP_SET_LOCAL_POP: {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = pop();
+            } break;
             case OP_GET_GLOBAL: {
                 ObjString *name = READ_STRING();
                 Value value;
@@ -359,13 +678,18 @@ static InterpretResult run()
             } break;
             case OP_GET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+                push(*AS_UPVALUE(frame->closure->upvalues[slot])->location);
+            } break;
+            case OP_GET_UPVALUE_FLAT: {
+                uint8_t slot = READ_BYTE();
+                push(frame->closure->upvalues[slot]);
             } break;
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                *AS_UPVALUE(frame->closure->upvalues[slot])->location = peek(0);
             } break;
-            case OP_GET_PROPERTY: {
+            case OP_GET_PROPERTY:
+            case OP_GET_PROPERTY_GENERIC: {
                 if (!IS_INSTANCE(peek(0))) {
                     runtimeError("Properties can only be accessed from instances of a class.");
                     return INTERPRET_RUNTIME_ERROR;
@@ -373,17 +697,38 @@ static InterpretResult run()
 
                 ObjInstance *instance = AS_INSTANCE(peek(0));
                 ObjString *name = READ_STRING();
+                InlineCache *cache = READ_CACHE();
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();  // Instance
-                    push(value);
-                    break;
+                ObjClosure *method;
+                if (!resolveProperty(instance, name, cache, &value, &method)) {
+                    runtimeError("Undefined property: '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
                 }
 
-                if (!bindMethod(instance->class, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (instruction == OP_GET_PROPERTY) {
+                    // Only a field load on a single shape is worth specializing
+                    bool field = method == NULL && instance->shape != NULL && cache->count == 1;
+                    frame->ip[-4] = field ? OP_GET_FIELD : OP_GET_PROPERTY_GENERIC;
                 }
+
+                if (method != NULL) value = OBJ_VAL(newBoundMethod(peek(0), method));
+                pop();  // Instance
+                push(value);
+            } break;
+            case OP_GET_FIELD: {
+                frame->ip++;    // Name
+                InlineCache *cache = READ_CACHE();
+
+                // The entry is never evicted, only OP_GET_PROPERTY_GENERIC
+                // would look this cache up again.
+                CacheEntry *entry = &cache->entries[0];
+                if (!IS_INSTANCE(peek(0)) || AS_INSTANCE(peek(0))->shape != entry->shape) {
+                    QUICKEN(OP_GET_PROPERTY_GENERIC, 4);
+                    break;
+                }
+
+                vm.stackTop[-1] = AS_INSTANCE(peek(0))->fields[entry->slot];
             } break;
             case OP_GET_PROPERTY_NOPOP: {
                 if (!IS_INSTANCE(peek(0))) {
@@ -393,15 +738,21 @@ static InterpretResult run()
 
                 ObjInstance *instance = AS_INSTANCE(peek(0));
                 ObjString *name = READ_STRING();
+                InlineCache *cache = READ_CACHE();
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    push(value);
-                    break;
+                ObjClosure *method;
+                if (!resolveProperty(instance, name, cache, &value, &method)) {
+                    runtimeError("Undefined property: '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
                 }
 
-                if (bindMethod(instance->class, name)) {
-                    break;
+                if (method != NULL) {
+                    ObjBoundMethod *bound = newBoundMethod(peek(0), method);
+                    pop();  // Instance
+                    push(OBJ_VAL(bound));
+                } else {
+                    push(value);
                 }
             } break;
             case OP_SET_PROPERTY: {
@@ -411,7 +762,8 @@ static InterpretResult run()
                 }
 
                 ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjString *name = READ_STRING();
+                setProperty(instance, name, peek(0), READ_CACHE());
                 Value value = pop();
                 pop();
                 push(value);
@@ -425,13 +777,78 @@ static InterpretResult run()
                 }
             } break;
             case OP_EQUAL: {
+                QUICKEN(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)) ? OP_EQUAL_NUM : OP_EQUAL_GENERIC, 1);
+            } break;
+            case OP_EQUAL_GENERIC: {
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
             } break;
+            case OP_EQUAL_NUM: {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    QUICKEN(OP_EQUAL_GENERIC, 1);
+                    break;
+                }
+
+                double b = AS_NUMBER(pop());
+                vm.stackTop[-1] = BOOL_VAL(AS_NUMBER(vm.stackTop[-1]) == b);
+            } break;
             case OP_GREATER:        BINARY_OP(BOOL_VAL, >); break;
             case OP_LESS:           BINARY_OP(BOOL_VAL, <); break;
+            case OP_LESS_LOCAL_CONSTANT: {
+                Value a = frame->slots[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)));
+            } break;
             case OP_ADD: {
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    QUICKEN(OP_ADD_NUM, 1);
+                } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    QUICKEN(OP_ADD_STR, 1);
+                } else {
+                    QUICKEN(OP_ADD_GENERIC, 1);
+                }
+            } break;
+            case OP_ADD_NUM: {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    QUICKEN(OP_ADD_GENERIC, 1);
+                    break;
+                }
+
+                double b = AS_NUMBER(pop());
+                vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) + b);
+            } break;
+            case OP_ADD_STR: {
+                if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                    QUICKEN(OP_ADD_GENERIC, 1);
+                    break;
+                }
+
+                concatenate();
+            } break;
+            case OP_ADD_LOCAL_LOCAL:
+            case OP_ADD_LOCAL_CONSTANT: {
+                Value a = frame->slots[READ_BYTE()];
+                uint8_t operand = READ_BYTE();
+                Value b = instruction == OP_ADD_LOCAL_LOCAL ?
+                    frame->slots[operand] : frame->closure->function->chunk.constants.values[operand];
+
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    push(a);
+                    push(b);
+                    concatenate();
+                } else {
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } break;
+            case OP_ADD_GENERIC: {
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
@@ -516,30 +933,62 @@ static InterpretResult run()
             } break;
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
+                HotLoop *loop = READ_LOOP();
                 frame->ip -= offset;
+
+                if (!vm.jit) break;
+                if (loop->trace != NULL) {
+                    runTrace(frame, loop);
+                } else if (loop->aborts < MAX_ABORTS && ++loop->hotness == HOT_LOOP) {
+                    recordTrace(frame, loop);
+                }
             } break;
             case OP_CALL: {
                 int argCount = READ_BYTE();
+                int caller = vm.frameCount - 1;
+                if (!callValue(peek(argCount), argCount) || !enterCallee(caller)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                frame = &vm.frames[vm.frameCount - 1];
+            } break;
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                int caller = vm.frameCount - 1;
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
+                reuseFrame(caller);
                 frame = &vm.frames[vm.frameCount - 1];
             } break;
             case OP_INVOKE: {
                 ObjString *method = READ_STRING();
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                int caller = vm.frameCount - 1;
+                if (!invoke(method, argCount, READ_CACHE()) || !enterCallee(caller)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
                 frame = &vm.frames[vm.frameCount - 1];
             } break;
+            case OP_TAIL_INVOKE: {
+                ObjString *method = READ_STRING();
+                int argCount = READ_BYTE();
+                int caller = vm.frameCount - 1;
+                if (!invoke(method, argCount, READ_CACHE())) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                reuseFrame(caller);
+                frame = &vm.frames[vm.frameCount - 1];
+            } break;
             case OP_SUPER_INVOKE: {
                 ObjString *method = READ_STRING();
                 int argCount = READ_BYTE();
                 ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
+                int caller = vm.frameCount - 1;
+                if (!invokeFromClass(superclass, method, argCount, READ_CACHE()) || !enterCallee(caller)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
@@ -547,16 +996,27 @@ static InterpretResult run()
             } break;
             case OP_CLOSURE: {
                 ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+
+                // Without captures every closure would be identical
+                if (function->upvalueCount == 0) {
+                    if (function->closure == NULL) function->closure = newClosure(function);
+                    push(OBJ_VAL(function->closure));
+                    break;
+                }
+
                 ObjClosure *closure = newClosure(function);
                 push(OBJ_VAL(closure));
 
                 for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
+                    uint8_t capture = READ_BYTE();
                     uint8_t index = READ_BYTE();
 
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    if (capture & UPVALUE_FLAT) {
+                        closure->upvalues[i] = frame->slots[index];
+                    } else if (capture & UPVALUE_LOCAL) {
+                        closure->upvalues[i] = OBJ_VAL(captureUpvalue(frame->slots + index));
                     } else {
+                        // Either a boxed upvalue or a flat copy, both are passed on as is
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
@@ -577,6 +1037,7 @@ static InterpretResult run()
 
                 ObjClass *subclass = AS_CLASS(peek(0));
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                if (subclass->methodsCached) vm.cacheEpoch++;
                 pop();  // Subclass
             } break;
             case OP_METHOD: {
@@ -596,6 +1057,7 @@ static InterpretResult run()
 
                 vm.stackTop = frame->slots;
                 push(result);
+                if (vm.frameCount == base) return INTERPRET_OK;
                 frame = &vm.frames[vm.frameCount - 1];
             } break;
         }
@@ -605,6 +1067,9 @@ static InterpretResult run()
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_CACHE
+#undef READ_LOOP
+#undef QUICKEN
 #undef BINARY_OP
 }
 
@@ -621,5 +1086,6 @@ InterpretResult interpret(const char *source)
 
     call(closure, 0);
 
-    return run();
+    if (vm.perfMap) return perfTrampoline(function, run, 0);
+    return run(0);
 }
@@ -6,8 +6,11 @@
 #include "clox_table.h"
 #include "clox_value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The call frames and value stack start small and grow on demand, up to
+// vm.frameLimit frames deep.
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL UINT8_COUNT
+#define FRAMES_LIMIT_DEFAULT 100000
 
 typedef struct {
     ObjClosure *closure;
@@ -17,16 +20,29 @@ typedef struct {
 
 typedef struct {
     // Call Frames
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
+    int frameLimit;
 
     // VM stack
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stackTop;
+    Value *stackEnd;
     Table globals;
     Table strings;
     ObjString *initString;
+    ObjShape *rootShape;
+    uint32_t cacheEpoch;
     ObjUpvalue *openUpvalues;
+    ObjUpvalue **upvalueSlots;  // Open upvalue for each stack slot, parallel to the stack
+
+    // Record and compile hot loops to native code
+    bool jit;
+
+    // Run calls through per-function trampolines perf can name
+    bool perfMap;
+    int perfDepth;
 
     // Manage GC timing
     size_t bytesAllocated;
@@ -49,6 +65,10 @@ extern VM vm;
 
 void runtimeError(const char *fmt, ...);
 void initVM();
+// Initializes the VM with the heap a snapshot was taken of instead of a fresh one
+bool initVMFromSnapshot(const char *path);
+// The native function registered under 'name', or NULL
+NativeFn findNative(const char *name);
 void freeVM();
 InterpretResult interpret(const char *source);
 void push(Value value);
@@ -0,0 +1,770 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "aot.h"
+#include "bcompiler.h"
+#include "chunk.h"
+#include "infer.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+// Where the runtime headers and liblaxrt.a are, set by the Makefile
+#ifndef LAX_HOME
+#define LAX_HOME "."
+#endif
+
+typedef struct {
+    Chunk *chunk;
+    FILE *out;
+    int *depths;        // Stack depth before each instruction, -1 if unreachable
+    bool *targets;      // Instructions something jumps to
+    int *worklist;
+    int workCount;
+    int maxDepth;
+    bool failed;
+
+    ObjString **globals;    // Each global's name, numbered by first use
+    int globalCount;
+} Lowering;
+
+static void
+emit(Lowering *low, const char *fmt, ...)
+{
+    fputs("    ", low->out);
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(low->out, fmt, args);
+    va_end(args);
+    fputs("\n", low->out);
+}
+
+/*
+ * Writes 'chars' as a C string literal. Anything but plain
+ * ASCII is escaped in octal, '?' too so no trigraph forms.
+*/
+static void
+emitString(FILE *out, const char *chars, int length)
+{
+    fputc('"', out);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = chars[i];
+        if (c < ' ' || c > '~' || c == '"' || c == '\\' || c == '?') {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * A C expression for exactly 'number', as a double. Finite
+ * numbers are hex floats, which round-trip and can't be read
+ * as ints, so -0 keeps its sign and 1/2 isn't 0. A NaN is
+ * written by its bits, which keeps its sign as well.
+*/
+static void
+formatNumber(double number, char *buf, size_t size)
+{
+    if (isnan(number)) {
+        union { double number; uint64_t bits; } nan = { number };
+        snprintf(buf, size, "((union { uint64_t bits; double number; }){ 0x%016llxull }).number",
+                 (unsigned long long)nan.bits);
+    } else if (isinf(number)) {
+        snprintf(buf, size, number > 0 ? "HUGE_VAL" : "(-HUGE_VAL)");
+    } else if (signbit(number)) {
+        snprintf(buf, size, "(%a)", number);
+    } else {
+        snprintf(buf, size, "%a", number);
+    }
+}
+
+/*
+ * A C expression for constant 'index'. Numbers are written
+ * out for the C compiler to fold, strings are made at startup.
+*/
+static void
+formatConstant(Lowering *low, int index, char *buf, size_t size)
+{
+    Value value = low->chunk->constants.values[index];
+    char number[128];
+
+    switch (value.type) {
+        case VAL_BOOL:      snprintf(buf, size, "BOOL_VAL(%s)", AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_NULL:      snprintf(buf, size, "NULL_VAL"); break;
+        case VAL_NUMBER: {
+            formatNumber(AS_NUMBER(value), number, sizeof(number));
+            snprintf(buf, size, "NUMBER_VAL(%s)", number);
+        } break;
+        default:            snprintf(buf, size, "OBJ_VAL(k%d)", index); break;
+    }
+}
+
+/*
+ * An RK operand as a C expression for its number, which
+ * register instructions have proven it to be.
+*/
+static void
+formatRK(Lowering *low, uint8_t operand, char *buf, size_t size)
+{
+    Value value = low->chunk->constants.values[operand & ~RK_CONSTANT];
+
+    if (!(operand & RK_CONSTANT)) {
+        snprintf(buf, size, "AS_NUMBER(s%d)", operand);
+    } else if (IS_NUMBER(value)) {
+        formatNumber(AS_NUMBER(value), buf, size);
+    } else {
+        char constant[160];
+        formatConstant(low, operand & ~RK_CONSTANT, constant, sizeof(constant));
+        snprintf(buf, size, "AS_NUMBER(%s)", constant);
+    }
+}
+
+static int
+globalIndex(Lowering *low, int constant)
+{
+    ObjString *name = AS_STRING(low->chunk->constants.values[constant]);
+    for (int i = 0; i < low->globalCount; i++) {
+        if (low->globals[i] == name) return i;
+    }
+
+    low->globals[low->globalCount] = name;
+    return low->globalCount++;
+}
+
+/*
+ * How many values the instruction at 'offset' leaves on the
+ * stack, less how many it takes.
+*/
+static int
+stackEffect(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULUS:
+        case OP_POWER:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_SET_LOCAL_POP:
+        case OP_ECHO:
+            return -1;
+        case OP_BUILD_STRING:
+            return 1 - chunk->code[offset + 1];
+        default:
+            return 0;
+    }
+}
+
+static void
+flowTo(Lowering *low, int target, int depth)
+{
+    if (target < 0 || target >= low->chunk->count) {
+        low->failed = true;
+    } else if (low->depths[target] == -1) {
+        low->depths[target] = depth;
+        low->worklist[low->workCount++] = target;
+    } else if (low->depths[target] != depth) {
+        // The bytecode compilers never merge paths with different stacks
+        low->failed = true;
+    }
+}
+
+static void
+jumpTo(Lowering *low, int target, int depth)
+{
+    flowTo(low, target, depth);
+    if (!low->failed) low->targets[target] = true;
+}
+
+/*
+ * Follows every way out of the instruction at 'offset', with
+ * 'depth' values on the stack after it.
+*/
+static void
+flowFrom(Lowering *low, int offset, int depth)
+{
+    Chunk *chunk = low->chunk;
+    uint8_t *ip = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+    int jump = (ip[1] << 8) | ip[2];
+
+    switch (ip[0]) {
+        case OP_RETURN: return;
+        case OP_JUMP:   jumpTo(low, next + jump, depth); return;
+        case OP_LOOP:   jumpTo(low, next - jump, depth); return;
+        case OP_JUMP_FALSE: jumpTo(low, next + jump, depth); break;
+        case OP_JUMP_LESS:
+        case OP_JUMP_NLESS: jumpTo(low, next + ((ip[3] << 8) | ip[4]), depth); break;
+        case OP_FOR_RANGE:  jumpTo(low, next - ((ip[3] << 8) | ip[4]), depth); break;
+        case OP_JUMP_TABLE: {
+            for (int i = 0; i <= ip[4]; i++) {
+                jumpTo(low, next - ((ip[5 + 2 * i] << 8) | ip[6 + 2 * i]), depth);
+            }
+        } break;
+        case OP_JUMP_LOOKUP: {
+            JumpTable *table = &chunk->jumpTables[ip[2]];
+            for (int i = 0; i < table->numberCount; i++) jumpTo(low, table->numberTargets[i], depth);
+            for (int i = 0; i < table->strings.capacity; i++) {
+                Entry *entry = &table->strings.entries[i];
+                if (entry->key != NULL) jumpTo(low, (int)AS_NUMBER(entry->value), depth);
+            }
+            if (table->trueTarget != -1) jumpTo(low, table->trueTarget, depth);
+            if (table->falseTarget != -1) jumpTo(low, table->falseTarget, depth);
+            if (table->nullTarget != -1) jumpTo(low, table->nullTarget, depth);
+        } break;
+        default: break;
+    }
+
+    flowTo(low, next, depth);
+}
+
+/*
+ * The highest stack slot the instruction at 'offset' names
+ * directly, -1 if none. Register instructions may use slots
+ * above the stack's depth for their temporaries.
+*/
+static int
+highestSlot(Chunk *chunk, int offset)
+{
+    uint8_t *ip = &chunk->code[offset];
+    int highest = -1;
+
+#define SLOT(operand)   if ((operand) > highest) highest = (operand)
+#define RK_SLOT(operand) if (!((operand) & RK_CONSTANT)) SLOT(operand)
+    switch (ip[0]) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT:
+        case OP_JUMP_TABLE:
+        case OP_JUMP_LOOKUP:    SLOT(ip[1]); break;
+        case OP_ADD_LOCAL_LOCAL: SLOT(ip[1]); SLOT(ip[2]); break;
+        case OP_MOVE:           SLOT(ip[1]); RK_SLOT(ip[2]); break;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:      SLOT(ip[1]); RK_SLOT(ip[2]); RK_SLOT(ip[3]); break;
+        case OP_JUMP_LESS:
+        case OP_JUMP_NLESS:     RK_SLOT(ip[1]); RK_SLOT(ip[2]); break;
+        case OP_FOR_RANGE:      SLOT(ip[1]); RK_SLOT(ip[2]); break;
+        default: break;
+    }
+#undef SLOT
+#undef RK_SLOT
+
+    return highest;
+}
+
+/*
+ * Finds the stack depth at each instruction, which turns every
+ * stack slot into a fixed C local.
+*/
+static bool
+findDepths(Lowering *low)
+{
+    flowTo(low, 0, 0);
+
+    while (low->workCount > 0 && !low->failed) {
+        int offset = low->worklist[--low->workCount];
+        int depth = low->depths[offset] + stackEffect(low->chunk, offset);
+
+        if (low->depths[offset] > low->maxDepth) low->maxDepth = low->depths[offset];
+        if (depth > low->maxDepth) low->maxDepth = depth;
+        if (highestSlot(low->chunk, offset) >= low->maxDepth) {
+            low->maxDepth = highestSlot(low->chunk, offset) + 1;
+        }
+        flowFrom(low, offset, depth);
+    }
+
+    return !low->failed;
+}
+
+static void
+checkNumbers(Lowering *low, int a, int b, int line)
+{
+    emit(low, "if (!IS_NUMBER(s%d) || !IS_NUMBER(s%d)) programError(%d, \"Operands must be numbers.\");",
+         a, b, line);
+}
+
+static void
+checkNumber(Lowering *low, int a, int line)
+{
+    emit(low, "if (!IS_NUMBER(s%d)) programError(%d, \"Operand must be a number.\");", a, line);
+}
+
+static void
+lowerInteger(Lowering *low, uint8_t instruction, int a, int b, int line)
+{
+    const char *result;
+    switch (instruction) {
+        case OP_MODULUS:    result = "a % b";       break;
+        case OP_POWER:      result = "pow(a, b)";   break;
+        case OP_BAND:       result = "a & b";       break;
+        case OP_BOR:        result = "a | b";       break;
+        case OP_BXOR:       result = "a ^ b";       break;
+        case OP_SHL:        result = "a << b";      break;
+        default:            result = "a >> b";      break;
+    }
+
+    // The same conversions as BINARY_INT and POW in run()
+    checkNumbers(low, a, b, line);
+    emit(low, "{");
+    emit(low, "    int b = round((int)AS_NUMBER(s%d));", b);
+    emit(low, "    int a = round((int)AS_NUMBER(s%d));", a);
+    emit(low, "    s%d = NUMBER_VAL(%s);", a, result);
+    emit(low, "}");
+}
+
+static void
+lowerLookup(Lowering *low, int slot, JumpTable *table, int index)
+{
+    char number[128];
+
+    if (table->trueTarget != -1) emit(low, "if (IS_BOOL(s%d) && AS_BOOL(s%d)) goto L%d;", slot, slot, table->trueTarget);
+    if (table->falseTarget != -1) emit(low, "if (IS_BOOL(s%d) && !AS_BOOL(s%d)) goto L%d;", slot, slot, table->falseTarget);
+    if (table->nullTarget != -1) emit(low, "if (IS_NULL(s%d)) goto L%d;", slot, table->nullTarget);
+
+    for (int i = 0; i < table->numberCount; i++) {
+        formatNumber(table->numbers[i], number, sizeof(number));
+        emit(low, "if (IS_NUMBER(s%d) && AS_NUMBER(s%d) == %s) goto L%d;", slot, slot, number, table->numberTargets[i]);
+    }
+
+    for (int i = 0; i < table->strings.capacity; i++) {
+        Entry *entry = &table->strings.entries[i];
+        if (entry->key == NULL) continue;
+        emit(low, "if (IS_OBJ(s%d) && AS_OBJ(s%d) == (Obj *)t%d_%d) goto L%d;",
+             slot, slot, index, i, (int)AS_NUMBER(entry->value));
+    }
+}
+
+static void
+lowerInstruction(Lowering *low, int offset)
+{
+    Chunk *chunk = low->chunk;
+    uint8_t *ip = &chunk->code[offset];
+    int depth = low->depths[offset];
+    int line = chunk->lines[offset];
+    int next = offset + instructionLength(chunk, offset);
+    int a = depth - 2;
+    int b = depth - 1;
+    char x[160];
+    char y[160];
+
+    switch (ip[0]) {
+        case OP_CONSTANT: {
+            formatConstant(low, ip[1], x, sizeof(x));
+            emit(low, "s%d = %s;", depth, x);
+        } break;
+        case OP_NULL:           emit(low, "s%d = NULL_VAL;", depth); break;
+        case OP_TRUE:           emit(low, "s%d = BOOL_VAL(true);", depth); break;
+        case OP_FALSE:          emit(low, "s%d = BOOL_VAL(false);", depth); break;
+        case OP_POP:            break;
+        case OP_GET_LOCAL:      emit(low, "s%d = s%d;", depth, ip[1]); break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:  emit(low, "s%d = s%d;", ip[1], b); break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            int global = globalIndex(low, ip[1]);
+            ObjString *name = low->globals[global];
+
+            fprintf(low->out, "    if (!g%dDefined) programError(%d, \"Undefined variable '\" ", global, line);
+            emitString(low->out, name->chars, name->length);
+            fprintf(low->out, " \"'.\");\n");
+
+            if (ip[0] == OP_GET_GLOBAL) {
+                emit(low, "s%d = g%d;", depth, global);
+            } else {
+                emit(low, "g%d = s%d;", global, b);
+            }
+        } break;
+        case OP_DEFINE_GLOBAL: {
+            int global = globalIndex(low, ip[1]);
+            emit(low, "g%d = s%d;", global, b);
+            emit(low, "g%dDefined = true;", global);
+        } break;
+        case OP_EQUAL:          emit(low, "s%d = BOOL_VAL(programEqual(s%d, s%d));", a, a, b); break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM: {
+            const char *op;
+            bool compare = false;
+            switch (ip[0]) {
+                case OP_GREATER:
+                case OP_GREATER_NUM:    op = ">"; compare = true; break;
+                case OP_LESS:
+                case OP_LESS_NUM:       op = "<"; compare = true; break;
+                case OP_ADD_NUM:        op = "+"; break;
+                case OP_SUBTRACT:
+                case OP_SUBTRACT_NUM:   op = "-"; break;
+                case OP_MULTIPLY:
+                case OP_MULTIPLY_NUM:   op = "*"; break;
+                default:                op = "/"; break;
+            }
+
+            if (ip[0] < OP_GREATER_NUM) checkNumbers(low, a, b, line);
+            emit(low, "s%d = %s(AS_NUMBER(s%d) %s AS_NUMBER(s%d));", a, compare ? "BOOL_VAL" : "NUMBER_VAL",
+                 a, op, b);
+        } break;
+        case OP_ADD: {
+            emit(low, "if (IS_NUMBER(s%d) && IS_NUMBER(s%d)) {", a, b);
+            emit(low, "    s%d = NUMBER_VAL(AS_NUMBER(s%d) + AS_NUMBER(s%d));", a, a, b);
+            emit(low, "} else {");
+            emit(low, "    s%d = programConcat(vm, s%d, s%d, %d);", a, a, b, line);
+            emit(low, "}");
+        } break;
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT: {
+            snprintf(x, sizeof(x), "s%d", ip[1]);
+            if (ip[0] == OP_ADD_LOCAL_LOCAL) {
+                snprintf(y, sizeof(y), "s%d", ip[2]);
+            } else {
+                formatConstant(low, ip[2], y, sizeof(y));
+            }
+
+            emit(low, "if (IS_NUMBER(%s) && IS_NUMBER(%s)) {", x, y);
+            emit(low, "    s%d = NUMBER_VAL(AS_NUMBER(%s) + AS_NUMBER(%s));", depth, x, y);
+            emit(low, "} else {");
+            emit(low, "    s%d = programConcat(vm, %s, %s, %d);", depth, x, y, line);
+            emit(low, "}");
+        } break;
+        case OP_LESS_LOCAL_CONSTANT: {
+            Value constant = chunk->constants.values[ip[2]];
+            if (!IS_NUMBER(constant)) {
+                emit(low, "programError(%d, \"Operands must be numbers.\");", line);
+                break;
+            }
+
+            formatNumber(AS_NUMBER(constant), x, sizeof(x));
+            emit(low, "if (!IS_NUMBER(s%d)) programError(%d, \"Operands must be numbers.\");", ip[1], line);
+            emit(low, "s%d = BOOL_VAL(AS_NUMBER(s%d) < %s);", depth, ip[1], x);
+        } break;
+        case OP_MODULUS:
+        case OP_POWER:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_SHL:
+        case OP_SHR:            lowerInteger(low, ip[0], a, b, line); break;
+        case OP_NOT:            emit(low, "s%d = BOOL_VAL(programFalsey(s%d));", b, b); break;
+        case OP_NEGATE:
+        case OP_INCREMENT:
+        case OP_DECREMENT:
+        case OP_NEGATE_NUM:
+        case OP_INCREMENT_NUM:
+        case OP_DECREMENT_NUM: {
+            if (ip[0] < OP_BUILD_STRING) checkNumber(low, b, line);
+
+            if (ip[0] == OP_NEGATE || ip[0] == OP_NEGATE_NUM) {
+                emit(low, "s%d = NUMBER_VAL(-AS_NUMBER(s%d));", b, b);
+            } else {
+                bool increment = ip[0] == OP_INCREMENT || ip[0] == OP_INCREMENT_NUM;
+                emit(low, "s%d = NUMBER_VAL(AS_NUMBER(s%d) %s 1);", b, b, increment ? "+" : "-");
+            }
+        } break;
+        case OP_CHECK_TYPE: {
+            const char *test = ip[1] == TYPE_NUMBER ? "IS_NUMBER" :
+                               ip[1] == TYPE_BOOL ? "IS_BOOL" : "IS_STRING";
+            ObjString *name = AS_STRING(chunk->constants.values[ip[2]]);
+
+            fprintf(low->out, "    if (!%s(s%d)) programError(%d, \"Type mismatch: '\" ", test, b, line);
+            emitString(low->out, name->chars, name->length);
+            fprintf(low->out, " \"' is declared '%s'.\");\n", typeName(ip[1]));
+        } break;
+        case OP_BUILD_STRING: {
+            int count = ip[1];
+            int first = depth - count;
+            if (count == 0) {
+                emit(low, "s%d = OBJ_VAL(buildString(vm, NULL, 0));", depth);
+                break;
+            }
+
+            fprintf(low->out, "    {\n        Value pieces[] = { ");
+            for (int i = 0; i < count; i++) fprintf(low->out, "%ss%d", i > 0 ? ", " : "", first + i);
+            fprintf(low->out, " };\n");
+            emit(low, "    s%d = OBJ_VAL(buildString(vm, pieces, %d));", first, count);
+            emit(low, "}");
+        } break;
+        case OP_MOVE: {
+            if (ip[2] & RK_CONSTANT) {
+                formatConstant(low, ip[2] & ~RK_CONSTANT, x, sizeof(x));
+                emit(low, "s%d = %s;", ip[1], x);
+            } else {
+                emit(low, "s%d = s%d;", ip[1], ip[2]);
+            }
+        } break;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK: {
+            const char *ops[] = { "+", "-", "*", "/" };
+            formatRK(low, ip[2], x, sizeof(x));
+            formatRK(low, ip[3], y, sizeof(y));
+            emit(low, "s%d = NUMBER_VAL(%s %s %s);", ip[1], x, ops[ip[0] - OP_ADD_RK], y);
+        } break;
+        case OP_JUMP_LESS:
+        case OP_JUMP_NLESS: {
+            formatRK(low, ip[1], x, sizeof(x));
+            formatRK(low, ip[2], y, sizeof(y));
+            emit(low, "if (%s(%s < %s)) goto L%d;", ip[0] == OP_JUMP_LESS ? "" : "!", x, y,
+                 next + ((ip[3] << 8) | ip[4]));
+        } break;
+        case OP_FOR_RANGE: {
+            Value *limit = ip[2] & RK_CONSTANT ? &chunk->constants.values[ip[2] & ~RK_CONSTANT] : NULL;
+
+            checkNumber(low, ip[1], line);
+            emit(low, "s%d = NUMBER_VAL(AS_NUMBER(s%d) + 1);", ip[1], ip[1]);
+
+            // The limit is read after the increment, it may be the counter
+            if (limit == NULL) {
+                emit(low, "if (!IS_NUMBER(s%d)) programError(%d, \"Operands must be numbers.\");", ip[2], line);
+            } else if (!IS_NUMBER(*limit)) {
+                emit(low, "programError(%d, \"Operands must be numbers.\");", line);
+                break;
+            }
+
+            formatRK(low, ip[2], x, sizeof(x));
+            emit(low, "if (AS_NUMBER(s%d) < %s) goto L%d;", ip[1], x, next - ((ip[3] << 8) | ip[4]));
+        } break;
+        case OP_JUMP_TABLE: {
+            int min = (int16_t)((ip[2] << 8) | ip[3]);
+            int span = ip[4] + 1;
+
+            emit(low, "if (IS_NUMBER(s%d)) {", ip[1]);
+            emit(low, "    double index = AS_NUMBER(s%d) - %d;", ip[1], min);
+            emit(low, "    if (index >= 0 && index < %d && index == (int)index) {", span);
+            emit(low, "        switch ((int)index) {");
+            for (int i = 0; i < span; i++) {
+                emit(low, "            case %d: goto L%d;", i, next - ((ip[5 + 2 * i] << 8) | ip[6 + 2 * i]));
+            }
+            emit(low, "        }");
+            emit(low, "    }");
+            emit(low, "}");
+        } break;
+        case OP_JUMP_LOOKUP:    lowerLookup(low, ip[1], &chunk->jumpTables[ip[2]], ip[2]); break;
+        case OP_ECHO: {
+            emit(low, "printValue(s%d);", b);
+            emit(low, "printf(\"\\n\");");
+        } break;
+        case OP_JUMP:           emit(low, "goto L%d;", next + ((ip[1] << 8) | ip[2])); break;
+        case OP_JUMP_FALSE:     emit(low, "if (programFalsey(s%d)) goto L%d;", b, next + ((ip[1] << 8) | ip[2])); break;
+        case OP_LOOP:           emit(low, "goto L%d;", next - ((ip[1] << 8) | ip[2])); break;
+        case OP_RETURN:         emit(low, "return;"); break;
+        default:                low->failed = true; break;
+    }
+}
+
+static void
+emitProgram(Lowering *low, const char *name)
+{
+    Chunk *chunk = low->chunk;
+    FILE *out = low->out;
+
+    fprintf(out, "/*\n * Built by 'lax build' from %s, with each bytecode\n", name);
+    fprintf(out, " * instruction lowered in place and the stack in locals.\n*/\n");
+    fprintf(out, "#include <math.h>\n#include <stdio.h>\n\n#include \"runtime.h\"\n\n");
+    fprintf(out, "static VM *vm;\n\n");
+
+    // The body first, it numbers the globals
+    FILE *declarations = out;
+    low->out = tmpfile();
+    if (low->out == NULL) {
+        low->failed = true;
+        return;
+    }
+
+    fprintf(low->out, "static void\nprogram()\n{\n");
+    if (low->maxDepth > 0) {
+        fprintf(low->out, "    Value s0");
+        for (int i = 1; i < low->maxDepth; i++) fprintf(low->out, ", s%d", i);
+        fprintf(low->out, ";\n\n");
+    }
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (low->depths[offset] == -1) continue;
+        if (low->targets[offset]) fprintf(low->out, "L%d: ;\n", offset);
+        lowerInstruction(low, offset);
+    }
+    fprintf(low->out, "}\n\n");
+
+    FILE *body = low->out;
+    low->out = declarations;
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (IS_STRING(chunk->constants.values[i])) fprintf(out, "static ObjString *k%d;\n", i);
+    }
+    for (int i = 0; i < chunk->jumpTableCount; i++) {
+        Table *strings = &chunk->jumpTables[i].strings;
+        for (int j = 0; j < strings->capacity; j++) {
+            if (strings->entries[j].key != NULL) fprintf(out, "static ObjString *t%d_%d;\n", i, j);
+        }
+    }
+    for (int i = 0; i < low->globalCount; i++) {
+        fprintf(out, "static Value g%d;         // %s\n", i, low->globals[i]->chars);
+        fprintf(out, "static bool g%dDefined;\n", i);
+    }
+    fprintf(out, "\n");
+
+    rewind(body);
+    int c;
+    while ((c = fgetc(body)) != EOF) fputc(c, out);
+    fclose(body);
+
+    fprintf(out, "int\nmain()\n{\n    vm = initVM();\n");
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (!IS_STRING(value)) continue;
+
+        fprintf(out, "    k%d = copyString(vm, ", i);
+        emitString(out, AS_STRING(value)->chars, AS_STRING(value)->length);
+        fprintf(out, ", %d);\n", AS_STRING(value)->length);
+    }
+    for (int i = 0; i < chunk->jumpTableCount; i++) {
+        Table *strings = &chunk->jumpTables[i].strings;
+        for (int j = 0; j < strings->capacity; j++) {
+            ObjString *key = strings->entries[j].key;
+            if (key == NULL) continue;
+
+            fprintf(out, "    t%d_%d = copyString(vm, ", i, j);
+            emitString(out, key->chars, key->length);
+            fprintf(out, ", %d);\n", key->length);
+        }
+    }
+    fprintf(out, "\n    program();\n    freeVM(vm);\n    return 0;\n}\n");
+}
+
+static BuildResult
+lowerChunk(Chunk *chunk, const char *name, const char *path)
+{
+    Lowering low;
+    low.chunk = chunk;
+    low.depths = (int *)malloc(sizeof(int) * chunk->count);
+    low.targets = (bool *)calloc(chunk->count, sizeof(bool));
+    low.worklist = (int *)malloc(sizeof(int) * chunk->count);
+    low.globals = (ObjString **)malloc(sizeof(ObjString *) * (chunk->constants.count + 1));
+    low.workCount = 0;
+    low.maxDepth = 0;
+    low.globalCount = 0;
+    low.failed = false;
+    for (int i = 0; i < chunk->count; i++) low.depths[i] = -1;
+
+    BuildResult result = BUILD_OK;
+    if (!findDepths(&low)) {
+        laxlog(ERROR, "'%s' compiled to bytecode that can't be lowered to C.", name);
+        result = BUILD_COMPILE_ERROR;
+    } else if ((low.out = fopen(path, "w")) == NULL) {
+        laxlog(ERROR, "Could not write '%s'.", path);
+        result = BUILD_TOOLCHAIN_ERROR;
+    } else {
+        emitProgram(&low, name);
+        if (fclose(low.out) != 0 || low.failed) {
+            laxlog(ERROR, "Could not write '%s'.", path);
+            result = BUILD_TOOLCHAIN_ERROR;
+        }
+    }
+
+    free(low.depths);
+    free(low.targets);
+    free(low.worklist);
+    free(low.globals);
+    return result;
+}
+
+static BuildResult
+runCompiler(const char *source, const char *output)
+{
+    const char *cc = getenv("CC");
+    const char *home = getenv("LAX_HOME");
+    if (cc == NULL || *cc == '\0') cc = "cc";
+    if (home == NULL || *home == '\0') home = LAX_HOME;
+
+    char library[1024];
+    snprintf(library, sizeof(library), "%s/build/release/liblaxrt.a", home);
+    FILE *file = fopen(library, "rb");
+    if (file == NULL) {
+        laxlog(ERROR, "Could not find the runtime library '%s', build it with 'make' or set LAX_HOME.", library);
+        return BUILD_TOOLCHAIN_ERROR;
+    }
+    fclose(file);
+
+    char command[4096];
+    int length = snprintf(command, sizeof(command), "%s -std=c99 -O2 -I\"%s/src\" -o \"%s\" \"%s\" \"%s\" -lm",
+                          cc, home, output, source, library);
+    if (length >= (int)sizeof(command) || system(command) != 0) {
+        laxlog(ERROR, "Could not build '%s' from '%s'.", output, source);
+        return BUILD_TOOLCHAIN_ERROR;
+    }
+
+    return BUILD_OK;
+}
+
+BuildResult
+buildProgram(VM *vm, const char *src, const char *name, const char *output, bool emitOnly)
+{
+    Chunk chunk;
+    initChunk(&chunk);
+
+    bool compiled = vm->optimize && compileOptimized(vm, src, &chunk);
+    if (!compiled && !compile(vm, src, &chunk)) {
+        freeChunk(&chunk);
+        return BUILD_COMPILE_ERROR;
+    }
+
+    BuildResult result;
+    if (emitOnly) {
+        result = lowerChunk(&chunk, name, output);
+    } else {
+        size_t length = strlen(output);
+        char *source = (char *)malloc(length + 3);
+        memcpy(source, output, length);
+        memcpy(source + length, ".c", 3);
+
+        // The C is kept if it fails to build, to see why
+        result = lowerChunk(&chunk, name, source);
+        if (result == BUILD_OK) result = runCompiler(source, output);
+        if (result == BUILD_OK) remove(source);
+        free(source);
+    }
+
+    freeChunk(&chunk);
+    return result;
+}
@@ -0,0 +1,25 @@
+#ifndef LAX_AOT_H
+#define LAX_AOT_H
+
+#include "common.h"
+#include "vm.h"
+
+typedef enum {
+    BUILD_OK,
+    BUILD_COMPILE_ERROR,
+    BUILD_TOOLCHAIN_ERROR,
+} BuildResult;
+
+/*
+ * Compiles 'src' and lowers its bytecode to one C function,
+ * with a local per stack slot and a goto per jump, so nothing
+ * is dispatched when it runs. The C goes to 'output'.c and is
+ * built with the system C compiler ($CC, or cc) against
+ * liblaxrt.a into the executable 'output'. With 'emitOnly',
+ * the C is written to 'output' itself and not built.
+ * 'name' is only used to say where the program came from.
+*/
+BuildResult
+buildProgram(VM *vm, const char *src, const char *name, const char *output, bool emitOnly);
+
+#endif // LAX_AOT_H
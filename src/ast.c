@@ -0,0 +1,831 @@
+#include <string.h>
+
+#include "ast.h"
+#include "bcompiler.h"
+#include "infer.h"
+#include "memory.h"
+#include "object.h"
+#include "opt.h"
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+typedef struct {
+    Var *var;
+    int depth;          // -1 while its initializer is being parsed
+} Scoped;
+
+typedef struct {
+    Ast *ast;
+    Lexer lexer;
+    Token current;
+    Token previous;
+    bool hadError;
+
+    Scoped locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;
+    int loopDepth;
+    int switchDepth;
+} AstParser;
+
+void *
+arenaAlloc(Arena *arena, size_t size)
+{
+    // Keep every allocation aligned for doubles and pointers
+    size = (size + 7) & ~(size_t)7;
+
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->used + size > block->capacity) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *)reallocate(NULL, 0, sizeof(ArenaBlock) + capacity);
+        block->next = arena->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->blocks = block;
+    }
+
+    void *result = block->data + block->used;
+    block->used += size;
+    memset(result, 0, size);
+    return result;
+}
+
+void
+freeArena(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        reallocate(block, sizeof(ArenaBlock) + block->capacity, 0);
+        block = next;
+    }
+
+    arena->blocks = NULL;
+}
+
+Node *
+newNode(Ast *ast, NodeType type, int line)
+{
+    Node *node = (Node *)arenaAlloc(&ast->arena, sizeof(Node));
+    node->type = type;
+    node->line = line;
+    return node;
+}
+
+Var *
+newVar(Ast *ast, Token name, bool isGlobal)
+{
+    Var *var = (Var *)arenaAlloc(&ast->arena, sizeof(Var));
+    var->name = name;
+    var->isGlobal = isGlobal;
+    var->declared = TYPE_ANY;
+    var->slot = -1;
+    var->next = ast->vars;
+    ast->vars = var;
+    return var;
+}
+
+static void
+error(AstParser *parser)
+{
+    // Stop at the first error, the single-pass compiler will report it
+    parser->hadError = true;
+    parser->current.type = TK_EOF;
+}
+
+static void
+advance(AstParser *parser)
+{
+    parser->previous = parser->current;
+    if (parser->hadError) return;
+
+    parser->current = scanToken(&parser->lexer);
+    if (parser->current.type == TK_ERROR) error(parser);
+}
+
+static bool
+check(AstParser *parser, TokenType type)
+{
+    return parser->current.type == type;
+}
+
+static bool
+match(AstParser *parser, TokenType type)
+{
+    if (!check(parser, type)) return false;
+    advance(parser);
+    return true;
+}
+
+static void
+consume(AstParser *parser, TokenType type)
+{
+    if (!match(parser, type)) error(parser);
+}
+
+static bool
+identifiersEqual(Token *a, Token *b)
+{
+    if (a->length != b->length) return false;
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+static Var *
+globalVar(AstParser *parser, Token *name)
+{
+    for (Var *var = parser->ast->vars; var != NULL; var = var->next) {
+        if (var->isGlobal && identifiersEqual(&var->name, name)) return var;
+    }
+
+    return newVar(parser->ast, *name, true);
+}
+
+static Var *
+resolve(AstParser *parser, Token *name)
+{
+    for (int i = parser->localCount - 1; i >= 0; i--) {
+        Scoped *local = &parser->locals[i];
+        if (identifiersEqual(name, &local->var->name)) {
+            if (local->depth == -1) error(parser);
+            return local->var;
+        }
+    }
+
+    return globalVar(parser, name);
+}
+
+static Var *
+declareLocal(AstParser *parser, Token *name)
+{
+    for (int i = parser->localCount - 1; i >= 0; i--) {
+        Scoped *local = &parser->locals[i];
+        if (local->depth != -1 && local->depth < parser->scopeDepth) break;
+        if (identifiersEqual(name, &local->var->name)) error(parser);
+    }
+
+    if (parser->localCount == UINT8_COUNT) {
+        error(parser);
+        return parser->locals[0].var;
+    }
+
+    Scoped *local = &parser->locals[parser->localCount++];
+    local->var = newVar(parser->ast, *name, false);
+    local->depth = -1;
+    return local->var;
+}
+
+static void
+endScope(AstParser *parser)
+{
+    parser->scopeDepth--;
+    while (parser->localCount > 0 &&
+           parser->locals[parser->localCount - 1].depth > parser->scopeDepth) {
+        parser->localCount--;
+    }
+}
+
+static Node *
+expression(AstParser *parser);
+
+static Node *
+statement(AstParser *parser);
+
+static Node *
+declaration(AstParser *parser);
+
+static Precedence
+infixPrecedence(TokenType type)
+{
+    switch (type) {
+        case TK_OR:         return PREC_OR;
+        case TK_AND:        return PREC_AND;
+        case TK_BAND:
+        case TK_BOR:
+        case TK_BXOR:
+        case TK_SHL:
+        case TK_SHR:        return PREC_BITWISE;
+        case TK_BANGEQ:
+        case TK_EQEQ:       return PREC_EQUALITY;
+        case TK_GREATER:
+        case TK_GTEQ:
+        case TK_LESS:
+        case TK_LTEQ:       return PREC_COMPARISON;
+        case TK_MINUS:
+        case TK_PLUS:       return PREC_TERM;
+        case TK_SLASH:
+        case TK_STAR:
+        case TK_MODULUS:    return PREC_FACTOR;
+        case TK_POWER:      return PREC_UNARY;
+        default:            return PREC_NONE;
+    }
+}
+
+static Node *
+parsePrecedence(AstParser *parser, Precedence precedence);
+
+/*
+ * The types an expression is known to produce by the rules
+ * the single-pass compiler checks annotations with, so the
+ * two accept the same programs. inferTypes() is finer.
+*/
+static uint8_t
+staticType(Node *node)
+{
+    switch (node->type) {
+        case NODE_LITERAL:  return valueType(node->as.literal);
+        case NODE_VARIABLE: {
+            Var *var = node->as.variable;
+            return var->isConst ? valueType(var->constant) : var->declared;
+        }
+        case NODE_ASSIGN:   return staticType(node->as.assign.value);
+        case NODE_UNARY:    return node->as.unary.op == TK_MINUS ? TYPE_NUMBER : TYPE_BOOL;
+        case NODE_BINARY: {
+            return binaryType(node->as.binary.op, staticType(node->as.binary.left),
+                              staticType(node->as.binary.right));
+        }
+        case NODE_LOGICAL:  return staticType(node->as.binary.left) | staticType(node->as.binary.right);
+        case NODE_INTERPOLATION: return TYPE_STRING;
+        default:            return TYPE_NUMBER;     // NODE_INCREMENT
+    }
+}
+
+/*
+ * A value that can't have the declared type is an error,
+ * one that only may is checked when it's stored, so what's
+ * assigned afterwards has the declared type.
+*/
+static void
+storeType(AstParser *parser, Var *var, uint8_t type)
+{
+    var->assigned |= type & var->declared;
+    if (type != 0 && (type & var->declared) == 0) error(parser);
+}
+
+static Node *
+variable(AstParser *parser, bool canAssign)
+{
+    Token name = parser->previous;
+    Var *var = resolve(parser, &name);
+
+    if (canAssign && var->isConst &&
+        (check(parser, TK_EQ) || check(parser, TK_INC) || check(parser, TK_DEC))) {
+        error(parser);
+    }
+
+    if (canAssign && match(parser, TK_EQ)) {
+        Node *value = expression(parser);
+        Node *node = newNode(parser->ast, NODE_ASSIGN, parser->previous.line);
+        node->as.assign.var = var;
+        node->as.assign.value = value;
+        storeType(parser, var, staticType(value));
+        return node;
+    }
+
+    if (canAssign && (match(parser, TK_INC) || match(parser, TK_DEC))) {
+        Node *node = newNode(parser->ast, NODE_INCREMENT, parser->previous.line);
+        node->as.incr.var = var;
+        node->as.incr.delta = parser->previous.type == TK_INC ? 1 : -1;
+        storeType(parser, var, TYPE_NUMBER);
+        return node;
+    }
+
+    Node *node = newNode(parser->ast, NODE_VARIABLE, parser->previous.line);
+    node->as.variable = var;
+    return node;
+}
+
+static Node *
+interpolation(AstParser *parser)
+{
+    Node *node = newNode(parser->ast, NODE_INTERPOLATION, parser->previous.line);
+    Node *pieces[UINT8_COUNT];
+    int count = 0;
+
+    for (;;) {
+        // Empty literal pieces are left out
+        Token token = parser->previous;
+        Value piece = stringLiteral(parser->ast->vm, &token);
+        if (AS_STRING(piece)->length > 0 && count < UINT8_COUNT) {
+            pieces[count] = newNode(parser->ast, NODE_LITERAL, token.line);
+            pieces[count++]->as.literal = piece;
+        }
+        if (token.type == TK_STRING) break;
+
+        Node *expr = expression(parser);
+        if (count < UINT8_COUNT) pieces[count++] = expr;
+        if (!match(parser, TK_INTERPOLATION)) consume(parser, TK_STRING);
+        if (parser->hadError) break;
+    }
+
+    if (count > UINT8_MAX) error(parser);
+    node->as.interpolation.pieces = (Node **)arenaAlloc(&parser->ast->arena,
+                                                        sizeof(Node *) * count);
+    memcpy(node->as.interpolation.pieces, pieces, sizeof(Node *) * count);
+    node->as.interpolation.count = count;
+    return node;
+}
+
+static Node *
+prefix(AstParser *parser, bool canAssign)
+{
+    Token token = parser->previous;
+
+    switch (token.type) {
+        case TK_LPAREN: {
+            Node *node = expression(parser);
+            consume(parser, TK_RPAREN);
+            return node;
+        }
+        case TK_MINUS:
+        case TK_BANG: {
+            Node *operand = parsePrecedence(parser, PREC_UNARY);
+            Node *node = newNode(parser->ast, NODE_UNARY, parser->previous.line);
+            node->as.unary.op = token.type;
+            node->as.unary.operand = operand;
+            return node;
+        }
+        case TK_IDENTIFIER:     return variable(parser, canAssign);
+        case TK_INTERPOLATION:  return interpolation(parser);
+        default: break;
+    }
+
+    Node *node = newNode(parser->ast, NODE_LITERAL, token.line);
+    switch (token.type) {
+        case TK_NUMBER: node->as.literal = NUMBER_VAL(strtod(token.start, NULL)); break;
+        case TK_STRING: node->as.literal = stringLiteral(parser->ast->vm, &token); break;
+        case TK_TRUE:   node->as.literal = BOOL_VAL(true); break;
+        case TK_FALSE:  node->as.literal = BOOL_VAL(false); break;
+        case TK_NULL:   node->as.literal = NULL_VAL; break;
+        default: {
+            error(parser);
+            node->as.literal = NULL_VAL;
+        } break;
+    }
+
+    return node;
+}
+
+static Node *
+parsePrecedence(AstParser *parser, Precedence precedence)
+{
+    advance(parser);
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    Node *left = prefix(parser, canAssign);
+
+    while (precedence <= infixPrecedence(parser->current.type)) {
+        advance(parser);
+        TokenType op = parser->previous.type;
+
+        Precedence next = op == TK_AND ? PREC_AND :
+                          op == TK_OR  ? PREC_OR  : infixPrecedence(op) + 1;
+        Node *right = parsePrecedence(parser, next);
+
+        Node *node = newNode(parser->ast,
+                             op == TK_AND || op == TK_OR ? NODE_LOGICAL : NODE_BINARY,
+                             parser->previous.line);
+        node->as.binary.op = op;
+        node->as.binary.left = left;
+        node->as.binary.right = right;
+        left = node;
+    }
+
+    // Invalid assignment target
+    if (canAssign && check(parser, TK_EQ)) error(parser);
+
+    return left;
+}
+
+static Node *
+expression(AstParser *parser)
+{
+    return parsePrecedence(parser, PREC_ASSIGNMENT);
+}
+
+static Node *
+varDeclaration(AstParser *parser)
+{
+    consume(parser, TK_IDENTIFIER);
+    Token name = parser->previous;
+
+    Var *var;
+    if (parser->scopeDepth > 0) {
+        var = declareLocal(parser, &name);
+    } else {
+        var = globalVar(parser, &name);
+        if (var->isConst) error(parser);
+    }
+
+    // A global's annotation covers what was stored to it before
+    if (match(parser, TK_COLON)) {
+        consume(parser, TK_IDENTIFIER);
+        uint8_t type = namedType(&parser->previous);
+        if (type == 0 || (var->declared != TYPE_ANY && var->declared != type) ||
+            (var->assigned & ~type)) {
+            error(parser);
+        }
+        var->declared = type;
+    }
+
+    Node *init = NULL;
+    if (match(parser, TK_EQ)) init = expression(parser);
+    storeType(parser, var, init == NULL ? TYPE_NULL : staticType(init));
+    consume(parser, TK_SEMICOLON);
+
+    if (parser->scopeDepth > 0 && !parser->hadError) {
+        parser->locals[parser->localCount - 1].depth = parser->scopeDepth;
+    }
+
+    Node *node = newNode(parser->ast, NODE_VAR, parser->previous.line);
+    node->as.var.var = var;
+    node->as.var.init = init;
+    return node;
+}
+
+/*
+ * Evaluates the initializer of a 'const' or of an 'enum'
+ * member, which may only refer to literals and to other
+ * constants. Returns false if it isn't constant.
+*/
+static bool
+evalConstant(AstParser *parser, Node *node, Value *value)
+{
+    switch (node->type) {
+        case NODE_LITERAL: {
+            *value = node->as.literal;
+            return true;
+        }
+        case NODE_VARIABLE: {
+            Var *var = node->as.variable;
+            if (!var->isConst) return false;
+            *value = var->constant;
+            return true;
+        }
+        case NODE_UNARY: {
+            Value operand;
+            return evalConstant(parser, node->as.unary.operand, &operand) &&
+                   foldUnary(node->as.unary.op, operand, value);
+        }
+        case NODE_BINARY: {
+            Value left, right;
+            return evalConstant(parser, node->as.binary.left, &left) &&
+                   evalConstant(parser, node->as.binary.right, &right) &&
+                   foldBinary(parser->ast->vm, node->as.binary.op, left, right, value);
+        }
+        case NODE_INTERPOLATION: {
+            Value pieces[UINT8_COUNT];
+            for (int i = 0; i < node->as.interpolation.count; i++) {
+                if (!evalConstant(parser, node->as.interpolation.pieces[i], &pieces[i])) {
+                    return false;
+                }
+            }
+
+            *value = OBJ_VAL(buildString(parser->ast->vm, pieces, node->as.interpolation.count));
+            return true;
+        }
+        case NODE_LOGICAL: {
+            Value left, falsey;
+            if (!evalConstant(parser, node->as.binary.left, &left)) return false;
+
+            // 'and' and 'or' yield one of their operands
+            foldUnary(TK_BANG, left, &falsey);
+            if (AS_BOOL(falsey) == (node->as.binary.op == TK_AND)) {
+                *value = left;
+                return true;
+            }
+            return evalConstant(parser, node->as.binary.right, value);
+        }
+        default: return false;
+    }
+}
+
+/*
+ * Declares 'name' as a constant holding 'value'. The
+ * declaration is kept as a NODE_VAR with a literal init,
+ * constant propagation then replaces every later read.
+*/
+static Node *
+constant(AstParser *parser, Token *name, Value value, int line)
+{
+    Var *var;
+    if (parser->scopeDepth > 0) {
+        var = declareLocal(parser, name);
+        if (!parser->hadError) parser->locals[parser->localCount - 1].depth = parser->scopeDepth;
+    } else {
+        // A global that was already used or declared can't turn constant
+        for (Var *global = parser->ast->vars; global != NULL; global = global->next) {
+            if (global->isGlobal && identifiersEqual(&global->name, name)) error(parser);
+        }
+        var = newVar(parser->ast, *name, true);
+    }
+
+    var->isConst = true;
+    var->constant = value;
+
+    Node *init = newNode(parser->ast, NODE_LITERAL, line);
+    init->as.literal = value;
+
+    Node *node = newNode(parser->ast, NODE_VAR, line);
+    node->as.var.var = var;
+    node->as.var.init = init;
+    return node;
+}
+
+static Node *
+constDeclaration(AstParser *parser)
+{
+    consume(parser, TK_IDENTIFIER);
+    Token name = parser->previous;
+    consume(parser, TK_EQ);
+
+    Value value = NULL_VAL;
+    Node *init = expression(parser);
+    if (!parser->hadError && !evalConstant(parser, init, &value)) error(parser);
+    consume(parser, TK_SEMICOLON);
+
+    return constant(parser, &name, value, parser->previous.line);
+}
+
+/*
+ * An 'enum' declares one constant per member, chained
+ * through 'next' like the statements of a block.
+*/
+static Node *
+enumDeclaration(AstParser *parser)
+{
+    match(parser, TK_IDENTIFIER);
+    consume(parser, TK_LBRACE);
+
+    Node *members = NULL;
+    Node **tail = &members;
+    double next = 0;
+
+    while (!parser->hadError && !check(parser, TK_RBRACE)) {
+        consume(parser, TK_IDENTIFIER);
+        Token name = parser->previous;
+
+        if (match(parser, TK_EQ)) {
+            Value value;
+            Node *init = expression(parser);
+            if (parser->hadError) break;
+            if (!evalConstant(parser, init, &value) || !IS_NUMBER(value)) {
+                error(parser);
+                break;
+            }
+            next = AS_NUMBER(value);
+        }
+
+        *tail = constant(parser, &name, NUMBER_VAL(next), name.line);
+        tail = &(*tail)->next;
+        next++;
+
+        if (!match(parser, TK_COMMA)) break;
+    }
+    consume(parser, TK_RBRACE);
+
+    // An empty enum declares nothing
+    if (members == NULL) members = newNode(parser->ast, NODE_BLOCK, parser->previous.line);
+    return members;
+}
+
+static Node *
+expressionStatement(AstParser *parser)
+{
+    Node *expr = expression(parser);
+    consume(parser, TK_SEMICOLON);
+
+    Node *node = newNode(parser->ast, NODE_EXPRESSION, parser->previous.line);
+    node->as.expression = expr;
+    return node;
+}
+
+static Node *
+block(AstParser *parser)
+{
+    Node *node = newNode(parser->ast, NODE_BLOCK, parser->previous.line);
+    Node **tail = &node->as.block;
+
+    parser->scopeDepth++;
+    while (!check(parser, TK_RBRACE) && !check(parser, TK_EOF)) {
+        *tail = declaration(parser);
+        while (*tail != NULL) tail = &(*tail)->next;
+    }
+    consume(parser, TK_RBRACE);
+    endScope(parser);
+
+    return node;
+}
+
+static Node *
+forStatement(AstParser *parser)
+{
+    Node *node = newNode(parser->ast, NODE_LOOP, parser->previous.line);
+
+    parser->scopeDepth++;
+    consume(parser, TK_LPAREN);
+    if (match(parser, TK_SEMICOLON)) {
+        // No initializer
+    } else if (match(parser, TK_VAR)) {
+        node->as.loop.init = varDeclaration(parser);
+    } else {
+        node->as.loop.init = expressionStatement(parser);
+    }
+
+    if (!match(parser, TK_SEMICOLON)) {
+        node->as.loop.condition = expression(parser);
+        consume(parser, TK_SEMICOLON);
+    }
+
+    if (!match(parser, TK_RPAREN)) {
+        node->as.loop.increment = expression(parser);
+        consume(parser, TK_RPAREN);
+    }
+
+    parser->loopDepth++;
+    node->as.loop.body = statement(parser);
+    parser->loopDepth--;
+    endScope(parser);
+    return node;
+}
+
+static Node *
+whileStatement(AstParser *parser)
+{
+    Node *node = newNode(parser->ast, NODE_LOOP, parser->previous.line);
+    consume(parser, TK_LPAREN);
+    node->as.loop.condition = expression(parser);
+    consume(parser, TK_RPAREN);
+    parser->loopDepth++;
+    node->as.loop.body = statement(parser);
+    parser->loopDepth--;
+    return node;
+}
+
+static Node *
+ifStatement(AstParser *parser)
+{
+    Node *node = newNode(parser->ast, NODE_IF, parser->previous.line);
+    consume(parser, TK_LPAREN);
+    node->as.branch.condition = expression(parser);
+    consume(parser, TK_RPAREN);
+    node->as.branch.thenBranch = statement(parser);
+    if (match(parser, TK_ELSE)) node->as.branch.elseBranch = statement(parser);
+    return node;
+}
+
+/*
+ * The statements of a switch arm run up to the next
+ * 'case', 'default' or the end of the switch, in their
+ * own scope as if they were a block.
+*/
+static Node *
+armBody(AstParser *parser)
+{
+    Node *node = newNode(parser->ast, NODE_BLOCK, parser->previous.line);
+    Node **tail = &node->as.block;
+
+    parser->scopeDepth++;
+    while (!check(parser, TK_CASE) && !check(parser, TK_DEFAULT) &&
+           !check(parser, TK_RBRACE) && !check(parser, TK_EOF)) {
+        *tail = declaration(parser);
+        while (*tail != NULL) tail = &(*tail)->next;
+    }
+    endScope(parser);
+
+    return node;
+}
+
+static Node *
+switchStatement(AstParser *parser)
+{
+    Node *node = newNode(parser->ast, NODE_SWITCH, parser->previous.line);
+    consume(parser, TK_LPAREN);
+    node->as.switchStmt.subject = expression(parser);
+    consume(parser, TK_RPAREN);
+    consume(parser, TK_LBRACE);
+
+    Value labels[UINT8_COUNT];
+    int labelCount = 0;
+    bool hasDefault = false;
+    Node **tail = &node->as.switchStmt.arms;
+
+    parser->switchDepth++;
+    while (!check(parser, TK_RBRACE) && !check(parser, TK_EOF)) {
+        Node *arm = newNode(parser->ast, NODE_CASE, parser->current.line);
+        int first = labelCount;
+
+        if (match(parser, TK_DEFAULT)) {
+            if (hasDefault) error(parser);
+            hasDefault = true;
+            arm->as.arm.isDefault = true;
+        } else {
+            consume(parser, TK_CASE);
+            do {
+                Value label;
+                Node *expr = expression(parser);
+                if (parser->hadError) break;
+                if (!evalConstant(parser, expr, &label) || labelCount == UINT8_COUNT) {
+                    error(parser);
+                    break;
+                }
+
+                for (int i = 0; i < labelCount; i++) {
+                    if (valuesEqual(labels[i], label)) error(parser);
+                }
+                labels[labelCount++] = label;
+            } while (match(parser, TK_COMMA));
+        }
+        consume(parser, TK_COLON);
+
+        arm->as.arm.labelCount = labelCount - first;
+        arm->as.arm.labels = (Value *)arenaAlloc(&parser->ast->arena,
+                                                 sizeof(Value) * arm->as.arm.labelCount);
+        memcpy(arm->as.arm.labels, labels + first, sizeof(Value) * arm->as.arm.labelCount);
+        arm->as.arm.body = armBody(parser);
+
+        *tail = arm;
+        tail = &arm->next;
+    }
+    parser->switchDepth--;
+    consume(parser, TK_RBRACE);
+
+    return node;
+}
+
+static Node *
+statement(AstParser *parser)
+{
+    if (match(parser, TK_ECHO)) {
+        Node *expr = expression(parser);
+        consume(parser, TK_SEMICOLON);
+
+        Node *node = newNode(parser->ast, NODE_ECHO, parser->previous.line);
+        node->as.expression = expr;
+        return node;
+    }
+
+    if (match(parser, TK_BREAK) || match(parser, TK_CONTINUE)) {
+        Node *node = newNode(parser->ast,
+                             parser->previous.type == TK_BREAK ? NODE_BREAK : NODE_CONTINUE,
+                             parser->previous.line);
+        // A 'break' also leaves a switch, 'continue' needs a loop
+        if (parser->loopDepth == 0 &&
+            (node->type == NODE_CONTINUE || parser->switchDepth == 0)) {
+            error(parser);
+        }
+        consume(parser, TK_SEMICOLON);
+        return node;
+    }
+
+    if (match(parser, TK_FOR))      return forStatement(parser);
+    if (match(parser, TK_IF))       return ifStatement(parser);
+    if (match(parser, TK_SWITCH))   return switchStatement(parser);
+    if (match(parser, TK_WHILE))    return whileStatement(parser);
+    if (match(parser, TK_LBRACE))   return block(parser);
+
+    return expressionStatement(parser);
+}
+
+static Node *
+declaration(AstParser *parser)
+{
+    if (match(parser, TK_VAR))      return varDeclaration(parser);
+    if (match(parser, TK_CONST))    return constDeclaration(parser);
+    if (match(parser, TK_ENUM))     return enumDeclaration(parser);
+    return statement(parser);
+}
+
+bool
+parseAst(VM *vm, const char *src, Ast *ast)
+{
+    ast->vm = vm;
+    ast->arena.blocks = NULL;
+    ast->statements = NULL;
+    ast->vars = NULL;
+
+    AstParser parser;
+    parser.ast = ast;
+    parser.hadError = false;
+    parser.localCount = 0;
+    parser.scopeDepth = 0;
+    parser.loopDepth = 0;
+    parser.switchDepth = 0;
+    initLexer(&parser.lexer, src);
+
+    advance(&parser);
+
+    Node **tail = &ast->statements;
+    while (!parser.hadError && !match(&parser, TK_EOF)) {
+        *tail = declaration(&parser);
+        while (*tail != NULL) tail = &(*tail)->next;
+    }
+
+    return !parser.hadError;
+}
+
+void
+freeAst(Ast *ast)
+{
+    freeArena(&ast->arena);
+    ast->statements = NULL;
+    ast->vars = NULL;
+}
@@ -0,0 +1,191 @@
+#ifndef LAX_AST_H
+#define LAX_AST_H
+
+#include "common.h"
+#include "lexer.h"
+#include "value.h"
+#include "vm.h"
+
+/*
+ * Bump allocator backing every Node and Var of an Ast.
+ * Everything is released at once by freeArena().
+*/
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;
+} Arena;
+
+typedef enum {
+    // Expressions
+    NODE_LITERAL,
+    NODE_VARIABLE,
+    NODE_ASSIGN,
+    NODE_INCREMENT,     // Postfix '++' or '--', as.incr.delta is +1 or -1
+    NODE_UNARY,
+    NODE_BINARY,
+    NODE_LOGICAL,       // 'and' and 'or'
+    NODE_INTERPOLATION, // '"a ${x} b"', the pieces are joined into one string
+
+    // Statements
+    NODE_EXPRESSION,
+    NODE_ECHO,
+    NODE_VAR,
+    NODE_BLOCK,
+    NODE_IF,
+    NODE_LOOP,          // Both 'while' and 'for' loops
+    NODE_BREAK,
+    NODE_CONTINUE,
+    NODE_SWITCH,
+    NODE_CASE,          // One arm of a 'switch', chained through 'next'
+} NodeType;
+
+/*
+ * Set of the types an expression may evaluate to,
+ * as computed by inferTypes(). Zero means it never
+ * produces a value (it is unreachable or always fails).
+*/
+#define TYPE_NUMBER 0x01
+#define TYPE_STRING 0x02
+#define TYPE_BOOL   0x04
+#define TYPE_NULL   0x08
+#define TYPE_ANY    (TYPE_NUMBER | TYPE_STRING | TYPE_BOOL | TYPE_NULL)
+
+/*
+ * A declared variable. Every reference to it points
+ * at the same Var, so shadowing is resolved once by
+ * the parser and the passes can count uses directly.
+*/
+typedef struct Var {
+    Token name;
+    bool isGlobal;
+    bool isHidden;      // Introduced by an optimization pass
+    bool isConst;       // Declared by 'const' or 'enum', its init is a literal
+    int defines;        // Number of 'var' declarations (globals can be redeclared)
+    int reads;
+    int writes;         // Assignments, '++' and '--' after the declaration
+    uint8_t declared;   // TYPE_* bits of its annotation, TYPE_ANY without one
+    uint8_t assigned;   // Static types of everything stored to it so far, as checked
+    bool isNumber;      // Only ever holds numbers
+    bool isConstant;    // 'constant' may replace every read after the declaration
+    Value constant;
+    int index;          // Position in the type environment of inferTypes()
+    int loop;           // Last loop found to declare or write it (LICM)
+    int slot;           // Stack slot or name constant, assigned during code generation
+    struct Var *next;
+} Var;
+
+typedef struct Node Node;
+
+struct Node {
+    NodeType type;
+    int line;
+    uint8_t types;      // TYPE_* bits of an expression's possible values
+    Node *next;         // Next statement in a block
+
+    union {
+        Value literal;
+        Var *variable;
+        struct {
+            Var *var;
+            Node *value;
+        } assign;
+        struct {
+            Var *var;
+            int delta;
+            uint8_t operand;    // TYPE_* bits of the variable before the update
+        } incr;
+        struct {
+            TokenType op;
+            Node *operand;
+        } unary;
+        struct {
+            TokenType op;
+            Node *left;
+            Node *right;
+        } binary;
+        struct {
+            Node **pieces;
+            int count;
+        } interpolation;
+        Node *expression;
+        struct {
+            Var *var;
+            Node *init;         // NULL declares it as 'null'
+        } var;
+        Node *block;
+        struct {
+            Node *condition;
+            Node *thenBranch;
+            Node *elseBranch;
+        } branch;
+        struct {
+            Node *init;         // 'for' initializer, scoped to the loop
+            Node *hoisted;      // Declarations moved out of the loop body
+            Node *condition;    // NULL loops forever
+            Node *increment;
+            Node *body;
+        } loop;
+        struct {
+            Node *subject;
+            Node *arms;
+        } switchStmt;
+        struct {
+            Value *labels;      // Values of the case labels, folded by the parser
+            int labelCount;
+            bool isDefault;
+            Node *body;         // NODE_BLOCK scoping the arm, NULL if empty
+        } arm;
+    } as;
+};
+
+typedef struct {
+    VM *vm;
+    Arena arena;
+    Node *statements;
+    Var *vars;
+} Ast;
+
+/*
+ * Allocates zeroed memory from the arena.
+*/
+void *
+arenaAlloc(Arena *arena, size_t size);
+
+/*
+ * Releases every block owned by the arena.
+*/
+void
+freeArena(Arena *arena);
+
+Node *
+newNode(Ast *ast, NodeType type, int line);
+
+/*
+ * Creates a Var and links it into the Ast's list of
+ * variables. Passes use it for hidden temporaries.
+*/
+Var *
+newVar(Ast *ast, Token name, bool isGlobal);
+
+/*
+ * Parses the source into an Ast. The parser is silent:
+ * it returns false on any syntax or scoping error, or on
+ * a construct it doesn't support, so the caller can fall
+ * back to the single-pass compiler which reports errors.
+*/
+bool
+parseAst(VM *vm, const char *src, Ast *ast);
+
+/*
+ * Releases the Ast and its arena.
+*/
+void
+freeAst(Ast *ast);
+
+#endif // LAX_AST_H
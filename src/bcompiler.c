@@ -1,10 +1,14 @@
 #include <string.h>
 
+#include "ast.h"
 #include "bcompiler.h"
 #include "common.h"
+#include "gen.h"
+#include "infer.h"
 #include "lexer.h"
 #include "memory.h"
 #include "object.h"
+#include "opt.h"
 #include "table.h"
 #include "value.h"
 
@@ -104,6 +108,79 @@ emitBytes(Compiler *compiler, uint8_t byte, uint8_t byte2)
     emitByte(compiler, byte2);
 }
 
+/*
+ * Emits an instruction that emitFused() may fold into a
+ * superinstruction, remembering where it starts.
+*/
+static void
+emitFusible(Compiler *compiler, uint8_t byte, uint8_t byte2)
+{
+    compiler->fusible[0] = compiler->fusible[1];
+    compiler->fusible[1] = currentChunk(compiler)->count;
+    emitBytes(compiler, byte, byte2);
+}
+
+/*
+ * Returns the current offset as a jump target. Nothing
+ * is fused across it, as the jump would land inside.
+*/
+static int
+jumpTarget(Compiler *compiler)
+{
+    compiler->lastTarget = currentChunk(compiler)->count;
+    return compiler->lastTarget;
+}
+
+/*
+ * Emits 'op', folding it and the instructions before it into
+ * one of the superinstructions for the sequences that dominate
+ * the bench/ corpus (see bench/superops.py).
+*/
+static void
+emitFused(Compiler *compiler, uint8_t op)
+{
+    Chunk *chunk = currentChunk(compiler);
+    int first = compiler->fusible[0];
+    int last = compiler->fusible[1];
+
+    // SET_LOCAL POP
+    if (op == OP_POP && last == chunk->count - 2 && last >= compiler->lastTarget &&
+        chunk->code[last] == OP_SET_LOCAL) {
+
+        chunk->code[last] = OP_SET_LOCAL_POP;
+        compiler->fusible[1] = -1;
+        return;
+    }
+
+    // GET_LOCAL GET_LOCAL ADD, GET_LOCAL CONSTANT ADD and GET_LOCAL CONSTANT LESS
+    int fused = -1;
+    if (first == chunk->count - 4 && last == chunk->count - 2 &&
+        first >= compiler->lastTarget && chunk->code[first] == OP_GET_LOCAL) {
+
+        bool add = op == OP_ADD || op == OP_ADD_NUM;
+        if (add && chunk->code[last] == OP_GET_LOCAL) {
+            fused = OP_ADD_LOCAL_LOCAL;
+        } else if (add && chunk->code[last] == OP_CONSTANT) {
+            fused = OP_ADD_LOCAL_CONSTANT;
+        } else if ((op == OP_LESS || op == OP_LESS_NUM) && chunk->code[last] == OP_CONSTANT) {
+            fused = OP_LESS_LOCAL_CONSTANT;
+        }
+    }
+
+    if (fused == -1) {
+        emitByte(compiler, op);
+        return;
+    }
+
+    chunk->code[first] = fused;
+    chunk->code[first + 2] = chunk->code[last + 1];
+    chunk->count = first + 3;
+    for (int i = first; i < chunk->count; i++) {
+        chunk->lines[i] = compiler->parser->previous.line;
+    }
+    compiler->fusible[0] = compiler->fusible[1] = -1;
+}
+
 static void
 emitLoop(Compiler *compiler, int loopStart)
 {
@@ -147,14 +224,14 @@ makeConstant(Compiler *compiler, Value value)
 static void
 emitConstant(Compiler *compiler, Value value)
 {
-    emitBytes(compiler, OP_CONSTANT, makeConstant(compiler, value));
+    emitFusible(compiler, OP_CONSTANT, makeConstant(compiler, value));
 }
 
 static void
 patchJump(Compiler *compiler, int offset)
 {
     // -2 to adjust for the jump offset in the bytecode chunk
-    int jump = currentChunk(compiler)->count - offset - 2;
+    int jump = jumpTarget(compiler) - offset - 2;
 
     if (jump > UINT16_MAX) {
         error(compiler->parser, "Too much code to jump over.");
@@ -171,6 +248,13 @@ initCompiler(Parser *parser, Compiler *compiler, Chunk *chunk)
     compiler->compiling = chunk;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->constCount = 0;
+    compiler->loop = NULL;
+    compiler->globalTypeCount = 0;
+    compiler->type = TYPE_ANY;
+    compiler->comparison.start = -1;
+    compiler->fusible[0] = compiler->fusible[1] = -1;
+    compiler->lastTarget = 0;
 }
 
 static void
@@ -204,6 +288,11 @@ endScope(Compiler *compiler)
         emitByte(compiler, OP_POP);
         compiler->localCount--;
     }
+
+    while (compiler->constCount > 0 &&
+           compiler->consts[compiler->constCount - 1].depth > compiler->scopeDepth) {
+        compiler->constCount--;
+    }
 }
 
 static void
@@ -227,6 +316,12 @@ identifierConstant(Compiler *compiler, Token *name);
 static int
 resolveLocal(Compiler *compiler, Token *name);
 
+static int
+resolveConst(Compiler *compiler, Token *name, int local);
+
+static bool
+identifiersEqual(Token *a, Token *b);
+
 static void
 addLocal(Compiler *compiler, Token name);
 
@@ -236,24 +331,82 @@ parseVariable(Compiler *compiler, const char *message);
 static void
 defineVariable(Compiler *compiler, uint8_t global);
 
+/*
+ * The RK form of the operand pushed by the instruction at
+ * 'offset', if it's a local or a constant that fits one.
+*/
+static bool
+rkOperand(Chunk *chunk, int offset, uint8_t *rk)
+{
+    uint8_t operand = chunk->code[offset + 1];
+    if (operand >= RK_CONSTANT) return false;
+
+    switch (chunk->code[offset]) {
+        case OP_GET_LOCAL:  *rk = operand; return true;
+        case OP_CONSTANT:   *rk = RK_CONSTANT | operand; return true;
+        default:            return false;
+    }
+}
+
+/*
+ * Remembers a comparison of two numbers about to be emitted,
+ * if its operands were each pushed by one instruction that
+ * an RK operand can stand for.
+*/
+static bool
+noteComparison(Compiler *compiler, TokenType op)
+{
+    Chunk *chunk = currentChunk(compiler);
+    Comparison *comparison = &compiler->comparison;
+    int first = compiler->fusible[0];
+    int last = compiler->fusible[1];
+    uint8_t left, right;
+
+    if (first != chunk->count - 4 || last != chunk->count - 2 || first < compiler->lastTarget ||
+        !rkOperand(chunk, first, &left) || !rkOperand(chunk, last, &right)) {
+        return false;
+    }
+
+    // '<=' and '>=' are compiled as '!(a > b)' and '!(a < b)'
+    switch (op) {
+        case TK_LESS:       comparison->exitOp = OP_JUMP_NLESS; comparison->b = left; comparison->c = right; break;
+        case TK_GREATER:    comparison->exitOp = OP_JUMP_NLESS; comparison->b = right; comparison->c = left; break;
+        case TK_LTEQ:       comparison->exitOp = OP_JUMP_LESS; comparison->b = right; comparison->c = left; break;
+        case TK_GTEQ:       comparison->exitOp = OP_JUMP_LESS; comparison->b = left; comparison->c = right; break;
+        default:            return false;
+    }
+
+    comparison->start = first;
+    return true;
+}
+
+/*
+ * Operands proven to be numbers get the unchecked opcodes.
+*/
 static void
 binary(Compiler *compiler, bool canAssign)
 {
     TokenType opType = compiler->parser->previous.type;
     ParseRule *rule = getRule(opType);
+    uint8_t left = compiler->type;
     parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
 
+    uint8_t right = compiler->type;
+    bool numbers = left == TYPE_NUMBER && right == TYPE_NUMBER;
+    bool compared = numbers && noteComparison(compiler, opType);
+    compiler->type = binaryType(opType, left, right);
+
     switch (opType) {
         case TK_BANGEQ:     emitBytes(compiler, OP_EQUAL, OP_NOT);      break;
         case TK_EQEQ:       emitByte(compiler, OP_EQUAL);               break;
-        case TK_GREATER:    emitByte(compiler, OP_GREATER);             break;
-        case TK_GTEQ:       emitBytes(compiler, OP_LESS, OP_NOT);       break;
-        case TK_LESS:       emitByte(compiler, OP_LESS);                break;
-        case TK_LTEQ:       emitBytes(compiler, OP_GREATER, OP_NOT);    break;
-        case TK_PLUS:       emitByte(compiler, OP_ADD);                 break;
-        case TK_MINUS:      emitByte(compiler, OP_SUBTRACT);            break;
-        case TK_STAR:       emitByte(compiler, OP_MULTIPLY);            break;
-        case TK_SLASH:      emitByte(compiler, OP_DIVIDE);              break;
+        case TK_GREATER:    emitByte(compiler, numbers ? OP_GREATER_NUM : OP_GREATER); break;
+        case TK_GTEQ:       emitBytes(compiler, numbers ? OP_LESS_NUM : OP_LESS, OP_NOT); break;
+        case TK_LESS:       emitFused(compiler, numbers ? OP_LESS_NUM : OP_LESS); break;
+        case TK_LTEQ:       emitBytes(compiler, numbers ? OP_GREATER_NUM : OP_GREATER, OP_NOT); break;
+        case TK_PLUS:       emitFused(compiler, numbers ? OP_ADD_NUM : OP_ADD); break;
+        case TK_MINUS:      emitByte(compiler, numbers ? OP_SUBTRACT_NUM : OP_SUBTRACT); break;
+        case TK_STAR:       emitByte(compiler, numbers ? OP_MULTIPLY_NUM : OP_MULTIPLY); break;
+        case TK_SLASH:      emitByte(compiler, numbers ? OP_DIVIDE_NUM : OP_DIVIDE); break;
         case TK_MODULUS:    emitByte(compiler, OP_MODULUS);             break;
         case TK_POWER:      emitByte(compiler, OP_POWER);               break;
         case TK_BAND:       emitByte(compiler, OP_BAND);                break;
@@ -263,6 +416,8 @@ binary(Compiler *compiler, bool canAssign)
         case TK_SHR:        emitByte(compiler, OP_SHR);                 break;
         default:            return; // Unreachable
     }
+
+    if (compared) compiler->comparison.end = currentChunk(compiler)->count;
 }
 
 static void
@@ -274,6 +429,8 @@ literal(Compiler *compiler, bool canAssign)
         case TK_TRUE:       emitByte(compiler, OP_TRUE);  break;
         default:            return; // Unreachable
     }
+
+    compiler->type = compiler->parser->previous.type == TK_NULL ? TYPE_NULL : TYPE_BOOL;
 }
 
 static void
@@ -288,10 +445,11 @@ number(Compiler *compiler, bool canAssign)
 {
     double value = strtod(compiler->parser->previous.start, NULL);
     emitConstant(compiler, NUMBER_VAL(value));
+    compiler->type = TYPE_NUMBER;
 }
 
 static int
-escapeSequence(Parser *parser, char *string, int length)
+escapeSequence(char *string, int length)
 {
     for (int i = 0; i < length - 1; i++) {
         if (string[i] == '\\') {
@@ -303,6 +461,7 @@ escapeSequence(Parser *parser, char *string, int length)
                 case 't':   string[i + 1] = '\t';   break;
                 case 'v':   string[i + 1] = '\v';   break;
                 case '"':   break;
+                case '$':   break;
                 default:    continue;
             }
             memmove(&string[i], &string[i + 1], length - i);
@@ -313,21 +472,20 @@ escapeSequence(Parser *parser, char *string, int length)
     return length;
 }
 
-static Value
-parseString(Compiler *compiler, bool canAssign)
+Value
+stringLiteral(VM *vm, Token *token)
 {
-    Parser *parser = compiler->parser;
-    int strLen = parser->previous.length - 2;
+    int strLen = token->length - 2;
     char *string = ALLOCATE(char, strLen + 1);
 
-    memcpy(string, parser->previous.start + 1, strLen);
-    int length = escapeSequence(parser, string, strLen);
+    memcpy(string, token->start + 1, strLen);
+    int length = escapeSequence(string, strLen);
 
     if (length != strLen) {
         string = GROW_ARRAY(char, string, strLen + 1, length + 1);
     }
     string[length] = '\0';
-    return OBJ_VAL(takeString(parser->vm, string, length));
+    return OBJ_VAL(takeString(vm, string, length));
 }
 
 static void
@@ -337,7 +495,129 @@ string(Compiler *compiler, bool canAssign)
     //     copyString(compiler->parser->vm, 
     //                compiler->parser->previous.start + 1,
     //                compiler->parser->previous.length - 2)));
-    emitConstant(compiler, parseString(compiler, canAssign));
+    emitConstant(compiler, stringLiteral(compiler->parser->vm, &compiler->parser->previous));
+    compiler->type = TYPE_STRING;
+}
+
+/*
+ * Each piece of '"a ${x} b"' is pushed and the pieces are
+ * joined by a single OP_BUILD_STRING. Empty literal pieces
+ * are left out.
+*/
+static void
+interpolation(Compiler *compiler, bool canAssign)
+{
+    VM *vm = compiler->parser->vm;
+    int count = 0;
+
+    do {
+        Value piece = stringLiteral(vm, &compiler->parser->previous);
+        if (AS_STRING(piece)->length > 0) {
+            emitConstant(compiler, piece);
+            count++;
+        }
+
+        expression(compiler);
+        count++;
+    } while (match(compiler, TK_INTERPOLATION));
+
+    consume(compiler, TK_STRING, "Expected '}' after interpolated expression.");
+    if (compiler->parser->previous.type != TK_STRING) return;
+
+    Value piece = stringLiteral(vm, &compiler->parser->previous);
+    if (AS_STRING(piece)->length > 0) {
+        emitConstant(compiler, piece);
+        count++;
+    }
+
+    if (count > UINT8_MAX) {
+        error(compiler->parser, "Too many pieces in one interpolated string.");
+        return;
+    }
+    emitBytes(compiler, OP_BUILD_STRING, (uint8_t)count);
+    compiler->type = TYPE_STRING;
+}
+
+/*
+ * Finds the annotation of the global 'name', adding an
+ * unannotated entry for it if 'add' is set.
+*/
+static GlobalType *
+globalType(Compiler *compiler, Token *name, bool add)
+{
+    for (int i = 0; i < compiler->globalTypeCount; i++) {
+        if (identifiersEqual(name, &compiler->globalTypes[i].name)) return &compiler->globalTypes[i];
+    }
+    if (!add) return NULL;
+
+    if (compiler->globalTypeCount == UINT8_COUNT) {
+        error(compiler->parser, "Too many global variables.");
+        return NULL;
+    }
+
+    GlobalType *global = &compiler->globalTypes[compiler->globalTypeCount++];
+    global->name = *name;
+    global->declared = TYPE_ANY;
+    global->assigned = 0;
+    return global;
+}
+
+static void
+typeError(Compiler *compiler, const char *format, Token *name, uint8_t declared)
+{
+    char message[160];
+    snprintf(message, sizeof(message), format, name->length, name->start, typeName(declared));
+    error(compiler->parser, message);
+}
+
+/*
+ * Checks a value of 'type' stored in a variable of type
+ * 'declared'. A value that can't have the declared type is
+ * a compile error. One that may have another type as well,
+ * such as an unannotated variable's, is checked by an
+ * OP_CHECK_TYPE before it's stored.
+*/
+static void
+checkType(Compiler *compiler, Token *name, uint8_t declared, uint8_t type)
+{
+    if ((type & ~declared) == 0) return;
+
+    if ((type & declared) == 0) {
+        typeError(compiler, "Type mismatch: '%.*s' is declared '%s'.", name, declared);
+        return;
+    }
+
+    emitBytes(compiler, OP_CHECK_TYPE, declared);
+    emitByte(compiler, identifierConstant(compiler, name));
+}
+
+/*
+ * Checks a value of 'type' stored in the variable 'name',
+ * the local at index 'local' or a global if that's -1.
+*/
+static void
+storeType(Compiler *compiler, Token *name, int local, uint8_t type)
+{
+    if (local != -1) {
+        checkType(compiler, name, compiler->locals[local].type, type);
+        return;
+    }
+
+    GlobalType *global = globalType(compiler, name, true);
+    if (global == NULL) return;
+
+    // What gets past the check has the declared type
+    global->assigned |= type & global->declared;
+    checkType(compiler, name, global->declared, type);
+}
+
+static uint8_t
+loadType(Compiler *compiler, Token *name, int local)
+{
+    if (local != -1) return compiler->locals[local].type;
+
+    GlobalType *global = globalType(compiler, name, false);
+    return global == NULL ? TYPE_ANY : global->declared;
 }
 
 static void
@@ -345,6 +625,18 @@ namedVariable(Compiler *compiler, Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
     int arg = resolveLocal(compiler, &name);
+    int constant = resolveConst(compiler, &name, arg);
+    int local = arg;
+
+    if (constant != -1) {
+        if (canAssign && (check(compiler, TK_EQ) || check(compiler, TK_INC) ||
+                          check(compiler, TK_DEC))) {
+            error(compiler->parser, "Can't assign to a constant.");
+        }
+        emitConstant(compiler, compiler->consts[constant].value);
+        compiler->type = valueType(compiler->consts[constant].value);
+        return;
+    }
 
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
@@ -357,17 +649,23 @@ namedVariable(Compiler *compiler, Token name, bool canAssign)
 
     if (canAssign && match(compiler, TK_EQ)) {
         expression(compiler);
-        emitBytes(compiler, setOp, (uint8_t)arg);
-    } else if (canAssign && match(compiler, TK_INC)) {
+        storeType(compiler, &name, local, compiler->type);
+        emitFusible(compiler, setOp, (uint8_t)arg);
+    } else if (canAssign && (match(compiler, TK_INC) || match(compiler, TK_DEC))) {
+        bool increment = compiler->parser->previous.type == TK_INC;
         namedVariable(compiler, name, false);
-        emitByte(compiler, OP_INCREMENT);
-        emitBytes(compiler, setOp, (uint8_t)arg);
-    } else if (canAssign && match(compiler, TK_DEC)) {
-        namedVariable(compiler, name, false);
-        emitByte(compiler, OP_DECREMENT);
-        emitBytes(compiler, setOp, (uint8_t)arg);
+        if (compiler->type == TYPE_NUMBER) {
+            emitByte(compiler, increment ? OP_INCREMENT_NUM : OP_DECREMENT_NUM);
+        } else {
+            emitByte(compiler, increment ? OP_INCREMENT : OP_DECREMENT);
+        }
+
+        compiler->type = TYPE_NUMBER;
+        storeType(compiler, &name, local, compiler->type);
+        emitFusible(compiler, setOp, (uint8_t)arg);
     } else {
-        emitBytes(compiler, getOp, (uint8_t)arg);
+        emitFusible(compiler, getOp, (uint8_t)arg);
+        compiler->type = loadType(compiler, &name, local);
     }
 }
 
@@ -385,8 +683,14 @@ unary(Compiler *compiler, bool canAssign)
     parsePrecedence(compiler, PREC_UNARY);
 
     switch (opType) {
-        case TK_MINUS:  emitByte(compiler, OP_NEGATE);  break;
-        case TK_BANG:   emitByte(compiler, OP_NOT);     break;
+        case TK_MINUS: {
+            emitByte(compiler, compiler->type == TYPE_NUMBER ? OP_NEGATE_NUM : OP_NEGATE);
+            compiler->type = TYPE_NUMBER;
+        } break;
+        case TK_BANG: {
+            emitByte(compiler, OP_NOT);
+            compiler->type = TYPE_BOOL;
+        } break;
         default:        return; // Unreachable
     }
 }
@@ -407,27 +711,398 @@ block(Compiler *compiler)
     consume(compiler, TK_RBRACE, "Expected '}' after block.");
 }
 
+/*
+ * Parses the optional ': type' after a variable's name. A
+ * global keeps its annotation for the rest of the program,
+ * so what was assigned to it before must fit it too.
+*/
+static uint8_t
+typeAnnotation(Compiler *compiler, Token *name)
+{
+    if (!match(compiler, TK_COLON)) return TYPE_ANY;
+
+    consume(compiler, TK_IDENTIFIER, "Expected a type after ':'.");
+    uint8_t type = namedType(&compiler->parser->previous);
+    if (type == 0) {
+        error(compiler->parser, "Unknown type, expected 'num', 'str' or 'bool'.");
+        return TYPE_ANY;
+    }
+    if (compiler->scopeDepth > 0) return type;
+
+    GlobalType *global = globalType(compiler, name, true);
+    if (global == NULL) return type;
+
+    // The stores compiled before this weren't checked, they have to be proven
+    if (global->declared != TYPE_ANY && global->declared != type) {
+        error(compiler->parser, "Already a global with this name of another type.");
+    } else if ((global->assigned & type) == 0 && global->assigned != 0) {
+        typeError(compiler, "Type mismatch: '%.*s' is declared '%s'.", name, type);
+    } else if (global->assigned & ~type) {
+        typeError(compiler, "Can't prove what's stored in '%.*s' before this is a '%s'.", name, type);
+    }
+    global->declared = type;
+    return type;
+}
+
 static void
 varDeclaration(Compiler *compiler)
 {
     uint8_t global = parseVariable(compiler, "Expected variable name.");
+    Token name = compiler->parser->previous;
+    uint8_t declared = typeAnnotation(compiler, &name);
 
     if (match(compiler, TK_EQ)) {
         expression(compiler);
     } else {
         emitByte(compiler, OP_NULL);
+        compiler->type = TYPE_NULL;
     }
 
+    int local = -1;
+    if (compiler->scopeDepth > 0) {
+        local = compiler->localCount - 1;
+        compiler->locals[local].type = declared;
+    }
+    storeType(compiler, &name, local, compiler->type);
+
     consume(compiler, TK_SEMICOLON, "Expected ';' after variable declaration.");
     defineVariable(compiler, global);
 }
 
+/*
+ * Runs the code just compiled for a constant initializer,
+ * from 'start' to the end of the chunk. Only literals,
+ * constants and operators on them are allowed, and every
+ * operation is folded exactly as the optimizer folds it.
+*/
+static bool
+evalConstant(Compiler *compiler, int start, Value *result)
+{
+    Chunk *chunk = currentChunk(compiler);
+    Value stack[UINT8_COUNT];
+    int count = 0;
+
+    for (int ip = start; ip < chunk->count; ip += instructionLength(chunk, ip)) {
+        uint8_t instruction = chunk->code[ip];
+        TokenType op;
+        if (count == UINT8_COUNT) return false;
+
+        switch (instruction) {
+            case OP_CONSTANT:   stack[count++] = chunk->constants.values[chunk->code[ip + 1]]; break;
+            case OP_NULL:       stack[count++] = NULL_VAL; break;
+            case OP_TRUE:       stack[count++] = BOOL_VAL(true); break;
+            case OP_FALSE:      stack[count++] = BOOL_VAL(false); break;
+            case OP_POP:        count--; break;
+            case OP_BUILD_STRING: {
+                int pieces = chunk->code[ip + 1];
+                count -= pieces;
+                stack[count] = OBJ_VAL(buildString(compiler->parser->vm, &stack[count], pieces));
+                count++;
+            } break;
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_NEGATE_NUM: {
+                op = instruction == OP_NOT ? TK_BANG : TK_MINUS;
+                if (!foldUnary(op, stack[count - 1], &stack[count - 1])) return false;
+            } break;
+            case OP_JUMP:
+            case OP_JUMP_FALSE: {
+                Value falsey = BOOL_VAL(true);
+                if (instruction == OP_JUMP_FALSE) foldUnary(TK_BANG, stack[count - 1], &falsey);
+                if (AS_BOOL(falsey)) {
+                    ip += (uint16_t)(chunk->code[ip + 1] << 8 | chunk->code[ip + 2]);
+                }
+            } break;
+            default: {
+                switch (instruction) {
+                    case OP_EQUAL:      op = TK_EQEQ; break;
+                    case OP_GREATER:
+                    case OP_GREATER_NUM: op = TK_GREATER; break;
+                    case OP_LESS:
+                    case OP_LESS_NUM:   op = TK_LESS; break;
+                    case OP_ADD:
+                    case OP_ADD_NUM:    op = TK_PLUS; break;
+                    case OP_SUBTRACT:
+                    case OP_SUBTRACT_NUM: op = TK_MINUS; break;
+                    case OP_MULTIPLY:
+                    case OP_MULTIPLY_NUM: op = TK_STAR; break;
+                    case OP_DIVIDE:
+                    case OP_DIVIDE_NUM: op = TK_SLASH; break;
+                    case OP_MODULUS:    op = TK_MODULUS; break;
+                    case OP_POWER:      op = TK_POWER; break;
+                    case OP_BAND:       op = TK_BAND; break;
+                    case OP_BOR:        op = TK_BOR; break;
+                    case OP_BXOR:       op = TK_BXOR; break;
+                    case OP_SHL:        op = TK_SHL; break;
+                    case OP_SHR:        op = TK_SHR; break;
+                    default:            return false;   // Reads a variable
+                }
+
+                count--;
+                if (!foldBinary(compiler->parser->vm, op, stack[count - 1], stack[count],
+                                &stack[count - 1])) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    *result = stack[0];
+    return count == 1;
+}
+
+/*
+ * Compiles a constant expression and evaluates it, then
+ * drops its code. Returns false, having reported 'message',
+ * if it isn't constant.
+*/
+static bool
+constantExpression(Compiler *compiler, Value *value, const char *message)
+{
+    Chunk *chunk = currentChunk(compiler);
+    int start = chunk->count;
+    int constants = chunk->constants.count;
+    int lastTarget = compiler->lastTarget;
+
+    expression(compiler);
+    bool isConstant = !compiler->parser->hadError && evalConstant(compiler, start, value);
+
+    chunk->count = start;
+    chunk->constants.count = constants;
+    compiler->lastTarget = lastTarget;
+    compiler->fusible[0] = compiler->fusible[1] = -1;
+
+    if (!isConstant && !compiler->parser->hadError) {
+        error(compiler->parser, message);
+    }
+    return isConstant;
+}
+
+static void
+addConst(Compiler *compiler, Token name, Value value)
+{
+    for (int i = compiler->constCount - 1; i >= 0; i--) {
+        Constant *constant = &compiler->consts[i];
+        if (constant->depth < compiler->scopeDepth) break;
+
+        if (identifiersEqual(&name, &constant->name)) {
+            errorAt(compiler->parser, name, "Already a constant with this name in this scope.");
+        }
+    }
+
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+        Local *local = &compiler->locals[i];
+        if (local->depth < compiler->scopeDepth) break;
+
+        if (identifiersEqual(&name, &local->name)) {
+            errorAt(compiler->parser, name, "Already a variable with this name in this scope.");
+        }
+    }
+
+    if (compiler->constCount == UINT8_COUNT) {
+        error(compiler->parser, "Too many constants in one scope.");
+        return;
+    }
+
+    Constant *constant = &compiler->consts[compiler->constCount++];
+    constant->name = name;
+    constant->depth = compiler->scopeDepth;
+    constant->value = value;
+}
+
+static void
+constDeclaration(Compiler *compiler)
+{
+    consume(compiler, TK_IDENTIFIER, "Expected constant name.");
+    Token name = compiler->parser->previous;
+    consume(compiler, TK_EQ, "Expected '=' after constant name.");
+
+    Value value;
+    if (constantExpression(compiler, &value, "Const initializer must be a constant expression.")) {
+        addConst(compiler, name, value);
+    }
+
+    consume(compiler, TK_SEMICOLON, "Expected ';' after constant declaration.");
+}
+
+/*
+ * Each member of an enum is a numeric constant, counting
+ * up from 0 or from the last explicit value.
+*/
+static void
+enumDeclaration(Compiler *compiler)
+{
+    match(compiler, TK_IDENTIFIER);
+    consume(compiler, TK_LBRACE, "Expected '{' before enum body.");
+
+    double next = 0;
+    while (!check(compiler, TK_RBRACE) && !check(compiler, TK_EOF)) {
+        consume(compiler, TK_IDENTIFIER, "Expected enum member name.");
+        Token name = compiler->parser->previous;
+
+        if (match(compiler, TK_EQ)) {
+            Value value;
+            if (!constantExpression(compiler, &value,
+                                    "Enum value must be a constant expression.")) {
+                break;
+            }
+            if (!IS_NUMBER(value)) {
+                error(compiler->parser, "Enum value must be a number.");
+                break;
+            }
+            next = AS_NUMBER(value);
+        }
+
+        addConst(compiler, name, NUMBER_VAL(next));
+        next++;
+
+        if (!match(compiler, TK_COMMA)) break;
+    }
+
+    consume(compiler, TK_RBRACE, "Expected '}' after enum body.");
+}
+
+/*
+ * Compiles a condition and the jump taken when it's false,
+ * returning the jump to patch. A comparison of two proven
+ * numbers that are locals or constants becomes that one jump,
+ * an OP_JUMP_NLESS or OP_JUMP_LESS, and sets '*fused'. Anything
+ * else is left for an OP_JUMP_FALSE, and both paths pop it.
+*/
+static int
+condition(Compiler *compiler, bool *fused)
+{
+    Chunk *chunk = currentChunk(compiler);
+    Comparison *comparison = &compiler->comparison;
+
+    comparison->start = -1;
+    expression(compiler);
+
+    *fused = comparison->start != -1 && comparison->end == chunk->count &&
+             comparison->start >= compiler->lastTarget;
+    if (!*fused) {
+        int jump = emitJump(compiler, OP_JUMP_FALSE);
+        emitByte(compiler, OP_POP);
+        return jump;
+    }
+
+    chunk->count = comparison->start;
+    compiler->fusible[0] = compiler->fusible[1] = -1;
+    emitBytes(compiler, comparison->exitOp, comparison->b);
+
+    // The offset follows C as it follows the opcode of a plain jump
+    return emitJump(compiler, comparison->c);
+}
+
 static void
 expressionStatement(Compiler *compiler)
 {
     expression(compiler);
     consume(compiler, TK_SEMICOLON, "Expected ';' after expression or loop initializer.");
-    emitByte(compiler, OP_POP);
+    emitFused(compiler, OP_POP);
+}
+
+static void
+beginLoop(Compiler *compiler, Loop *loop, int start)
+{
+    loop->enclosing = compiler->loop;
+    loop->isSwitch = false;
+    loop->scopeDepth = compiler->scopeDepth;
+    loop->start = start;
+    loop->breakCount = 0;
+    loop->continueCount = 0;
+    compiler->loop = loop;
+}
+
+static void
+endLoop(Compiler *compiler)
+{
+    Loop *loop = compiler->loop;
+    for (int i = 0; i < loop->breakCount; i++) patchJump(compiler, loop->breaks[i]);
+
+    compiler->loop = loop->enclosing;
+}
+
+static void
+jumpStatement(Compiler *compiler)
+{
+    bool isBreak = compiler->parser->previous.type == TK_BREAK;
+    Loop *loop = compiler->loop;
+    while (!isBreak && loop != NULL && loop->isSwitch) loop = loop->enclosing;
+
+    if (loop == NULL) {
+        error(compiler->parser, isBreak ?
+              "Can't use 'break' outside of a loop." :
+              "Can't use 'continue' outside of a loop.");
+    }
+    consume(compiler, TK_SEMICOLON, isBreak ?
+            "Expected ';' after 'break'." :
+            "Expected ';' after 'continue'.");
+    if (loop == NULL) return;
+
+    // The locals stay declared, the code after the jump still sees them
+    for (int i = compiler->localCount - 1;
+         i >= 0 && compiler->locals[i].depth > loop->scopeDepth; i--) {
+        emitByte(compiler, OP_POP);
+    }
+
+    if (!isBreak && loop->start != -1) {
+        emitLoop(compiler, loop->start);
+        return;
+    }
+
+    int *jumps = isBreak ? loop->breaks : loop->continues;
+    int *count = isBreak ? &loop->breakCount : &loop->continueCount;
+    if (*count == UINT8_COUNT) {
+        error(compiler->parser, "Too many jumps out of one loop.");
+        return;
+    }
+    jumps[(*count)++] = emitJump(compiler, OP_JUMP);
+}
+
+/*
+ * Matches a loop condition 'i < n' and increment 'i++' on a
+ * local 'i', where 'n' is a local or a constant, from the code
+ * compiled for them. Such a loop ends in an OP_FOR_RANGE,
+ * which increments, compares and branches in one dispatch.
+*/
+static bool
+countedLoop(Compiler *compiler, int condition, int conditionEnd, int increment,
+            uint8_t *counter, uint8_t *limit)
+{
+    Chunk *chunk = currentChunk(compiler);
+    uint8_t *code = chunk->code;
+
+    // GET_LOCAL i, INCREMENT or INCREMENT_NUM, SET_LOCAL_POP i
+    if (chunk->count - increment != 5 || code[increment] != OP_GET_LOCAL ||
+        (code[increment + 2] != OP_INCREMENT && code[increment + 2] != OP_INCREMENT_NUM) ||
+        code[increment + 3] != OP_SET_LOCAL_POP || code[increment + 4] != code[increment + 1]) {
+        return false;
+    }
+    *counter = code[increment + 1];
+    if (*counter >= RK_CONSTANT) return false;
+
+    // JUMP_NLESS i n, for typed operands
+    if (conditionEnd - condition == 5 && code[condition] == OP_JUMP_NLESS &&
+        code[condition + 1] == *counter) {
+        *limit = code[condition + 2];
+        return true;
+    }
+
+    // LESS_LOCAL_CONSTANT i n, or GET_LOCAL i, GET_LOCAL n, LESS
+    if (conditionEnd - condition == 3 && code[condition] == OP_LESS_LOCAL_CONSTANT &&
+        code[condition + 1] == *counter && code[condition + 2] < RK_CONSTANT) {
+        *limit = RK_CONSTANT | code[condition + 2];
+        return true;
+    }
+    if (conditionEnd - condition == 5 && code[condition] == OP_GET_LOCAL &&
+        code[condition + 1] == *counter && code[condition + 2] == OP_GET_LOCAL &&
+        code[condition + 3] < RK_CONSTANT && code[condition + 4] == OP_LESS) {
+        *limit = code[condition + 3];
+        return true;
+    }
+
+    return false;
 }
 
 static void
@@ -443,37 +1118,74 @@ forStatement(Compiler *compiler)
         expressionStatement(compiler);
     }
 
-    int loopStart = currentChunk(compiler)->count;
+    int loopStart = jumpTarget(compiler);
     int exitJump = -1;
+    int conditionEnd = -1;
+    bool fused = false;
     if (!match(compiler, TK_SEMICOLON)) {
-        expression(compiler);
+        // Jump out of the loop if the condition is false
+        exitJump = condition(compiler, &fused);
+        conditionEnd = fused ? exitJump + 2 : exitJump - 1;
         consume(compiler, TK_SEMICOLON, "Expected ';' after loop condition.");
-
-        // Jump out of the loop of the condition is false
-        exitJump = emitJump(compiler, OP_JUMP_FALSE);
-        emitByte(compiler, OP_POP); // Condition
     }
 
+    bool counted = false;
+    uint8_t counter, limit;
     if (!match(compiler, TK_RPAREN)) {
         int bodyJump = emitJump(compiler, OP_JUMP);
-        int incrementStart = currentChunk(compiler)->count;
+        int incrementStart = jumpTarget(compiler);
         expression(compiler);
-        emitByte(compiler, OP_POP);
+        emitFused(compiler, OP_POP);
         consume(compiler, TK_RPAREN, "Expected ')' after for clauses.");
 
-        emitLoop(compiler, loopStart);
-        loopStart = incrementStart;
-        patchJump(compiler, bodyJump);
+        counted = exitJump != -1 &&
+            countedLoop(compiler, loopStart, conditionEnd, incrementStart, &counter, &limit);
+
+        if (counted) {
+            // The condition only runs once, OP_FOR_RANGE replaces it and the increment
+            currentChunk(compiler)->count = bodyJump - 1;
+            compiler->fusible[0] = compiler->fusible[1] = -1;
+            loopStart = -1;
+        } else {
+            emitLoop(compiler, loopStart);
+            loopStart = incrementStart;
+            patchJump(compiler, bodyJump);
+        }
     }
 
+    Loop loop;
+    beginLoop(compiler, &loop, loopStart);
+    int bodyStart = jumpTarget(compiler);
     statement(compiler);
-    emitLoop(compiler, loopStart);
 
-    if (exitJump != -1) {
-        patchJump(compiler, exitJump);
-        emitByte(compiler, OP_POP);
+    if (counted) {
+        for (int i = 0; i < loop.continueCount; i++) patchJump(compiler, loop.continues[i]);
+
+        int offset = currentChunk(compiler)->count + 5 - bodyStart;
+        if (offset > UINT16_MAX) error(compiler->parser, "Loop body is too large.");
+        emitBytes(compiler, OP_FOR_RANGE, counter);
+        emitBytes(compiler, limit, (offset >> 8) & 0xff);
+        emitByte(compiler, offset & 0xff);
+
+        if (fused) {
+            patchJump(compiler, exitJump);
+        } else {
+            // Only the first test leaves its condition to pop
+            int endJump = emitJump(compiler, OP_JUMP);
+            patchJump(compiler, exitJump);
+            emitByte(compiler, OP_POP);
+            patchJump(compiler, endJump);
+        }
+    } else {
+        emitLoop(compiler, loopStart);
+
+        if (exitJump != -1) {
+            patchJump(compiler, exitJump);
+            if (!fused) emitByte(compiler, OP_POP);
+        }
     }
 
+    endLoop(compiler);
     endScope(compiler);
 }
 
@@ -481,15 +1193,14 @@ static void
 ifStatement(Compiler *compiler)
 {
     consume(compiler, TK_LPAREN, "Expected '(' after 'if'.");
-    expression(compiler);
+    bool fused;
+    int thenJump = condition(compiler, &fused);
     consume(compiler, TK_RPAREN, "Expected ')' after condition.");
 
-    int thenJump = emitJump(compiler, OP_JUMP_FALSE);
-    emitByte(compiler, OP_POP);
     statement(compiler);
     int elseJump = emitJump(compiler, OP_JUMP);
     patchJump(compiler, thenJump);
-    emitByte(compiler, OP_POP);
+    if (!fused) emitByte(compiler, OP_POP);
 
     if (match(compiler, TK_ELSE)) statement(compiler);
     patchJump(compiler, elseJump);
@@ -506,18 +1217,105 @@ echoStatement(Compiler *compiler)
 static void
 whileStatement(Compiler *compiler)
 {
-    int loopStart = currentChunk(compiler)->count;
+    int loopStart = jumpTarget(compiler);
     consume(compiler, TK_LPAREN, "Expected '(' after 'while'.");
-    expression(compiler);
+    bool fused;
+    int exitJump = condition(compiler, &fused);
     consume(compiler, TK_RPAREN, "Expected ')' after condition.");
 
-    int exitJump = emitJump(compiler, OP_JUMP_FALSE);
-    emitByte(compiler, OP_POP);
+    Loop loop;
+    beginLoop(compiler, &loop, loopStart);
     statement(compiler);
     emitLoop(compiler, loopStart);
 
     patchJump(compiler, exitJump);
-    emitByte(compiler, OP_POP);
+    if (!fused) emitByte(compiler, OP_POP);
+    endLoop(compiler);
+}
+
+/*
+ * Arms don't fall through. The arms are compiled first and
+ * the dispatch on the subject, kept in a hidden local, jumps
+ * back to them, so every case label is known by then.
+*/
+static void
+switchStatement(Compiler *compiler)
+{
+    int line = compiler->parser->previous.line;
+    consume(compiler, TK_LPAREN, "Expected '(' after 'switch'.");
+    beginScope(compiler);
+    expression(compiler);
+    consume(compiler, TK_RPAREN, "Expected ')' after switch value.");
+
+    Token subject = { TK_IDENTIFIER, "", 0, line };
+    addLocal(compiler, subject);
+    compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
+    uint8_t slot = (uint8_t)(compiler->localCount - 1);
+
+    consume(compiler, TK_LBRACE, "Expected '{' before switch body.");
+    int dispatchJump = emitJump(compiler, OP_JUMP);
+
+    Loop loop;
+    beginLoop(compiler, &loop, -1);
+    loop.isSwitch = true;
+
+    Value labels[UINT8_COUNT];
+    int targets[UINT8_COUNT];
+    int labelCount = 0;
+    int defaultTarget = -1;
+
+    while (!check(compiler, TK_RBRACE) && !check(compiler, TK_EOF)) {
+        int target = jumpTarget(compiler);
+
+        if (match(compiler, TK_DEFAULT)) {
+            if (defaultTarget != -1) error(compiler->parser, "Multiple default cases in one switch.");
+            defaultTarget = target;
+        } else {
+            consume(compiler, TK_CASE, "Expected 'case' or 'default' in switch body.");
+            do {
+                Value label;
+                if (!constantExpression(compiler, &label, "Case value must be a constant expression.")) {
+                    break;
+                }
+
+                for (int i = 0; i < labelCount; i++) {
+                    if (valuesEqual(labels[i], label)) error(compiler->parser, "Duplicate case value.");
+                }
+                if (labelCount == UINT8_COUNT) {
+                    error(compiler->parser, "Too many cases in one switch.");
+                    break;
+                }
+                labels[labelCount] = label;
+                targets[labelCount++] = target;
+            } while (match(compiler, TK_COMMA));
+        }
+        consume(compiler, TK_COLON, "Expected ':' after case.");
+
+        beginScope(compiler);
+        while (!check(compiler, TK_CASE) && !check(compiler, TK_DEFAULT) &&
+               !check(compiler, TK_RBRACE) && !check(compiler, TK_EOF)) {
+            declaration(compiler);
+        }
+        endScope(compiler);
+
+        // The end of an arm is a 'break'
+        if (loop.breakCount == UINT8_COUNT) {
+            error(compiler->parser, "Too many jumps out of one switch.");
+        } else {
+            loop.breaks[loop.breakCount++] = emitJump(compiler, OP_JUMP);
+        }
+    }
+    consume(compiler, TK_RBRACE, "Expected '}' after switch body.");
+
+    patchJump(compiler, dispatchJump);
+    if (!writeSwitch(currentChunk(compiler), slot, labels, targets, labelCount,
+                     compiler->parser->previous.line)) {
+        error(compiler->parser, "Too much code to jump over.");
+    }
+    if (defaultTarget != -1) emitLoop(compiler, defaultTarget);
+
+    endLoop(compiler);
+    endScope(compiler);
 }
 
 static void
@@ -529,16 +1327,20 @@ synchronize(Parser *parser)
         if (parser->previous.type == TK_SEMICOLON) return;
         switch (parser->current.type) {
             case TK_BREAK:
+            case TK_CASE:
             case TK_CLASS:
             case TK_CONST:
             case TK_CONTINUE:
+            case TK_DEFAULT:
             case TK_ECHO:
+            case TK_ENUM:
             case TK_FN:
             case TK_FOR:
             case TK_IF:
             case TK_INCLUDE:
             case TK_MODULE:
             case TK_RETURN:
+            case TK_SWITCH:
             case TK_VAR:
             case TK_WHILE:
                 return;
@@ -555,6 +1357,10 @@ declaration(Compiler *compiler)
 {
     if (match(compiler, TK_VAR)) {
         varDeclaration(compiler);
+    } else if (match(compiler, TK_CONST)) {
+        constDeclaration(compiler);
+    } else if (match(compiler, TK_ENUM)) {
+        enumDeclaration(compiler);
     } else {
         statement(compiler);
     }
@@ -567,10 +1373,14 @@ statement(Compiler *compiler)
 {
     if (match(compiler, TK_ECHO)) {
         echoStatement(compiler);
+    } else if (match(compiler, TK_BREAK) || match(compiler, TK_CONTINUE)) {
+        jumpStatement(compiler);
     } else if (match(compiler, TK_FOR)) {
         forStatement(compiler);
     } else if (match(compiler, TK_IF)) {
         ifStatement(compiler);
+    } else if (match(compiler, TK_SWITCH)) {
+        switchStatement(compiler);
     } else if (match(compiler, TK_WHILE)) {
         whileStatement(compiler);
     } else if (match(compiler, TK_LBRACE)) {
@@ -585,10 +1395,12 @@ statement(Compiler *compiler)
 static void
 _and(Compiler *compiler, bool canAssign)
 {
+    uint8_t left = compiler->type;
     int endJump = emitJump(compiler, OP_JUMP_FALSE);
     emitByte(compiler, OP_POP);
     parsePrecedence(compiler, PREC_AND);
     patchJump(compiler, endJump);
+    compiler->type |= left;
 }
 
 static void
@@ -597,11 +1409,13 @@ _or(Compiler *compiler, bool canAssign)
     int elseJump = emitJump(compiler, OP_JUMP_FALSE);
     int endJump = emitJump(compiler, OP_JUMP);
 
+    uint8_t left = compiler->type;
     patchJump(compiler, elseJump);
     emitByte(compiler, OP_POP);
 
     parsePrecedence(compiler, PREC_OR);
     patchJump(compiler, endJump);
+    compiler->type |= left;
 }
 
 ParseRule rules[] = {
@@ -643,15 +1457,19 @@ ParseRule rules[] = {
     [TK_EQ]         = { NULL,       NULL,       PREC_NONE },
     [TK_IDENTIFIER] = { variable,   NULL,       PREC_NONE },
     [TK_STRING]     = { string,     NULL,       PREC_NONE },
+    [TK_INTERPOLATION] = { interpolation, NULL, PREC_NONE },
     [TK_NUMBER]     = { number,     NULL,       PREC_NONE },
     [TK_AND]        = { NULL,       _and,       PREC_AND },
     [TK_BREAK]      = { NULL,       NULL,       PREC_NONE },
+    [TK_CASE]       = { NULL,       NULL,       PREC_NONE },
     [TK_CLASS]      = { NULL,       NULL,       PREC_NONE },
     [TK_CONST]      = { NULL,       NULL,       PREC_NONE },
     [TK_CONTINUE]   = { NULL,       NULL,       PREC_NONE },
+    [TK_DEFAULT]    = { NULL,       NULL,       PREC_NONE },
     [TK_DO]         = { NULL,       NULL,       PREC_NONE },
     [TK_ELSE]       = { NULL,       NULL,       PREC_NONE },
     [TK_ECHO]       = { NULL,       NULL,       PREC_NONE },
+    [TK_ENUM]       = { NULL,       NULL,       PREC_NONE },
     [TK_FALSE]      = { literal,    NULL,       PREC_NONE },
     [TK_FOR]        = { NULL,       NULL,       PREC_NONE },
     [TK_FN]         = { NULL,       NULL,       PREC_NONE },
@@ -663,6 +1481,7 @@ ParseRule rules[] = {
     [TK_RETURN]     = { NULL,       NULL,       PREC_NONE },
     [TK_SELF]       = { NULL,       NULL,       PREC_NONE },
     [TK_SUPER]      = { NULL,       NULL,       PREC_NONE },
+    [TK_SWITCH]     = { NULL,       NULL,       PREC_NONE },
     [TK_TRUE]       = { literal,    NULL,       PREC_NONE },
     [TK_VAR]        = { NULL,       NULL,       PREC_NONE },
     [TK_WHILE]      = { NULL,       NULL,       PREC_NONE },
@@ -733,6 +1552,28 @@ resolveLocal(Compiler *compiler, Token *name)
     return -1;
 }
 
+/*
+ * Returns the innermost constant named 'name', unless the
+ * local at index 'local' is declared in a deeper scope.
+*/
+static int
+resolveConst(Compiler *compiler, Token *name, int local)
+{
+    int depth = -1;
+    if (local != -1) {
+        depth = compiler->locals[local].depth;
+        if (depth == -1) depth = compiler->scopeDepth;
+    }
+
+    for (int i = compiler->constCount - 1; i >= 0; i--) {
+        Constant *constant = &compiler->consts[i];
+        if (constant->depth < depth) break;
+        if (identifiersEqual(name, &constant->name)) return i;
+    }
+
+    return -1;
+}
+
 static void
 addLocal(Compiler *compiler, Token name)
 {
@@ -744,14 +1585,24 @@ addLocal(Compiler *compiler, Token name)
     Local *local = &compiler->locals[compiler->localCount++];
     local->name = name;
     local->depth = -1;
+    local->type = TYPE_ANY;
 }
 
 static void
 declareVariable(Compiler *compiler)
 {
+    Token *name = &compiler->parser->previous;
+    for (int i = compiler->constCount - 1; i >= 0; i--) {
+        Constant *constant = &compiler->consts[i];
+        if (constant->depth < compiler->scopeDepth) break;
+
+        if (identifiersEqual(name, &constant->name)) {
+            error(compiler->parser, "Already a constant with this name in this scope.");
+        }
+    }
+
     if (compiler->scopeDepth == 0) return;
 
-    Token *name = &compiler->parser->previous;
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local *local = &compiler->locals[i];
 
@@ -820,3 +1671,20 @@ compile(VM *vm, const char *src, Chunk *chunk)
 
     return !compiler.parser->hadError;
 }
+
+bool
+compileOptimized(VM *vm, const char *src, Chunk *chunk)
+{
+    Ast ast;
+    bool success = parseAst(vm, src, &ast);
+
+    if (success) {
+        optimizeAst(&ast);
+        inferTypes(&ast);
+        success = generate(&ast, chunk);
+    }
+
+    freeAst(&ast);
+    if (!success) freeChunk(chunk);
+    return success;
+}
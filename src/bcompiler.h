@@ -32,8 +32,55 @@ typedef enum {
 typedef struct {
     Token name;
     int depth;
+    uint8_t type;       // TYPE_* bits it's annotated with, TYPE_ANY without one
 } Local;
 
+/*
+ * A global's annotation, and the types of everything
+ * assigned to it so far, so one annotating it late still
+ * covers the assignments compiled before it.
+*/
+typedef struct {
+    Token name;
+    uint8_t declared;
+    uint8_t assigned;
+} GlobalType;
+
+/*
+ * The latest comparison of two proven numbers that are each
+ * a local or a constant. A condition ending with it branches
+ * on the operands instead of pushing a bool.
+*/
+typedef struct {
+    int start;          // Offset of its code, -1 if there's none
+    int end;
+    uint8_t exitOp;     // OP_JUMP_LESS or OP_JUMP_NLESS, taken when it's false
+    uint8_t b;          // RK operands of exitOp
+    uint8_t c;
+} Comparison;
+
+typedef struct {
+    Token name;
+    int depth;
+    Value value;
+} Constant;
+
+/*
+ * An enclosing loop or 'switch', for 'break' and 'continue'.
+ * Jumps whose target isn't known yet are patched at the end.
+*/
+typedef struct Loop {
+    struct Loop *enclosing;
+    bool isSwitch;      // Only 'break' applies, 'continue' goes to the enclosing loop
+    int scopeDepth;     // Locals deeper than this are popped when jumping out
+    int start;          // Target of 'continue', -1 if it follows the body
+
+    int breaks[UINT8_COUNT];
+    int breakCount;
+    int continues[UINT8_COUNT];
+    int continueCount;
+} Loop;
+
 typedef struct Compiler {
     // Parser & currently compiling Chunk
     Parser *parser;
@@ -44,6 +91,22 @@ typedef struct Compiler {
     int localCount;
 
     int scopeDepth; // Depth of variable scope. 0 = global
+
+    // Names declared by 'const' and 'enum', replaced by their value
+    Constant consts[UINT8_COUNT];
+    int constCount;
+
+    Loop *loop;     // Innermost loop being compiled
+
+    // Static types, from literals, operators and annotations
+    GlobalType globalTypes[UINT8_COUNT];
+    int globalTypeCount;
+    uint8_t type;   // TYPE_* bits of the value the latest expression leaves
+    Comparison comparison;
+
+    // Peephole state for superinstructions
+    int fusible[2]; // Offsets of the latest two variable or constant ops
+    int lastTarget; // Offset of the latest jump target
 } Compiler;
 
 typedef void (*ParseFn)(Compiler *compiler, bool canAssign);
@@ -54,6 +117,13 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+/*
+ * Converts a string literal token (quotes included)
+ * to an interned string, expanding escape sequences.
+*/
+Value
+stringLiteral(VM *vm, Token *token);
+
 /*
  * Initializes the Lexer, Parser, and Compiler,
  * and compiles the input source code to
@@ -62,4 +132,14 @@ typedef struct {
 bool
 compile(VM *vm, const char *src, Chunk *chunk);
 
+/*
+ * Compiles through the multi-pass front end: the source
+ * is parsed to an Ast, optimized, then lowered to Lax
+ * Bytecode. Returns false without reporting anything if
+ * the program can't be compiled this way, so the caller
+ * can fall back to compile() for its diagnostics.
+*/
+bool
+compileOptimized(VM *vm, const char *src, Chunk *chunk);
+
 #endif // LAX_BCOMPILER_H
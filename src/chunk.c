@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
 void
@@ -9,6 +10,8 @@ initChunk(Chunk *chunk)
     chunk->lines = NULL;
     chunk->count = 0;
     chunk->capacity = 0;
+    chunk->jumpTables = NULL;
+    chunk->jumpTableCount = 0;
     initValueArray(&chunk->constants);
 }
 
@@ -18,6 +21,15 @@ freeChunk(Chunk *chunk)
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+
+    for (int i = 0; i < chunk->jumpTableCount; i++) {
+        JumpTable *table = &chunk->jumpTables[i];
+        freeTable(&table->strings);
+        FREE_ARRAY(double, table->numbers, table->numberCount);
+        FREE_ARRAY(int, table->numberTargets, table->numberCount);
+    }
+    FREE_ARRAY(JumpTable, chunk->jumpTables, chunk->jumpTableCount);
+
     initChunk(chunk);
 }
 
@@ -42,3 +54,198 @@ addConstant(Chunk *chunk, Value value)
     appendValueArray(&chunk->constants, value);
     return chunk->constants.count - 1;
 }
+
+int
+instructionLength(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_LOCAL_POP:
+        case OP_BUILD_STRING:
+            return 2;
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT:
+        case OP_MOVE:
+        case OP_CHECK_TYPE:
+        case OP_JUMP:
+        case OP_JUMP_FALSE:
+        case OP_LOOP:
+            return 3;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+            return 4;
+        case OP_JUMP_LOOKUP:
+            return 3;
+        case OP_JUMP_LESS:
+        case OP_JUMP_NLESS:
+        case OP_FOR_RANGE:
+            return 5;
+        case OP_JUMP_TABLE:
+            return 5 + 2 * (chunk->code[offset + 4] + 1);
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Integers that an OP_JUMP_TABLE can index, its lowest
+ * case is a signed 16-bit operand.
+*/
+static bool
+tableIndex(Value value, int *index)
+{
+    if (!IS_NUMBER(value)) return false;
+
+    double number = AS_NUMBER(value);
+    if (!(number >= INT16_MIN && number <= INT16_MAX) || number != (int)number) return false;
+
+    *index = (int)number;
+    return true;
+}
+
+static JumpTable *
+newJumpTable(Chunk *chunk)
+{
+    chunk->jumpTables = GROW_ARRAY(JumpTable, chunk->jumpTables,
+                                   chunk->jumpTableCount, chunk->jumpTableCount + 1);
+
+    JumpTable *table = &chunk->jumpTables[chunk->jumpTableCount++];
+    initTable(&table->strings);
+    table->numbers = NULL;
+    table->numberTargets = NULL;
+    table->numberCount = 0;
+    table->trueTarget = table->falseTarget = table->nullTarget = -1;
+    return table;
+}
+
+bool
+writeSwitch(Chunk *chunk, uint8_t slot, Value *labels, int *targets, int count, int line)
+{
+    if (count == 0) return true;
+
+    // Integer cases go in a jump table if it would be at least half full
+    int min = INT16_MAX, max = INT16_MIN, integers = 0;
+    for (int i = 0; i < count; i++) {
+        int index;
+        if (!tableIndex(labels[i], &index)) continue;
+
+        if (index < min) min = index;
+        if (index > max) max = index;
+        integers++;
+    }
+
+    bool dense = integers >= 4 && max - min < 256 && max - min + 1 <= 2 * integers;
+    if (dense) {
+        int span = max - min + 1;
+        int start = chunk->count;
+        int end = start + 5 + 2 * span;
+
+        appendChunk(chunk, OP_JUMP_TABLE, line);
+        appendChunk(chunk, slot, line);
+        appendChunk(chunk, ((uint16_t)min >> 8) & 0xff, line);
+        appendChunk(chunk, (uint16_t)min & 0xff, line);
+        appendChunk(chunk, span - 1, line);
+
+        // A hole jumps back by 0, falling through
+        for (int i = 0; i < 2 * span; i++) appendChunk(chunk, 0, line);
+
+        for (int i = 0; i < count; i++) {
+            int index;
+            if (!tableIndex(labels[i], &index)) continue;
+
+            int jump = end - targets[i];
+            if (jump > UINT16_MAX) return false;
+
+            uint8_t *entry = &chunk->code[start + 5 + 2 * (index - min)];
+            entry[0] = (jump >> 8) & 0xff;
+            entry[1] = jump & 0xff;
+        }
+
+        if (integers == count) return true;
+    }
+
+    JumpTable *table = newJumpTable(chunk);
+    int index = chunk->jumpTableCount - 1;
+    if (index > UINT8_MAX) return false;
+
+    for (int i = 0; i < count; i++) {
+        int unused;
+        if (IS_NUMBER(labels[i]) && !(dense && tableIndex(labels[i], &unused))) {
+            table->numberCount++;
+        }
+    }
+    table->numbers = ALLOCATE(double, table->numberCount);
+    table->numberTargets = ALLOCATE(int, table->numberCount);
+
+    int numbers = 0;
+    for (int i = 0; i < count; i++) {
+        Value label = labels[i];
+        int unused;
+        if (dense && tableIndex(label, &unused)) continue;
+
+        if (IS_STRING(label)) {
+            tableSet(&table->strings, AS_STRING(label), NUMBER_VAL(targets[i]));
+        } else if (IS_NUMBER(label)) {
+            // Insertion sort, there are only a few cases
+            int j = numbers++;
+            for (; j > 0 && table->numbers[j - 1] > AS_NUMBER(label); j--) {
+                table->numbers[j] = table->numbers[j - 1];
+                table->numberTargets[j] = table->numberTargets[j - 1];
+            }
+            table->numbers[j] = AS_NUMBER(label);
+            table->numberTargets[j] = targets[i];
+        } else if (IS_BOOL(label)) {
+            if (AS_BOOL(label)) table->trueTarget = targets[i];
+            else table->falseTarget = targets[i];
+        } else {
+            table->nullTarget = targets[i];
+        }
+    }
+
+    appendChunk(chunk, OP_JUMP_LOOKUP, line);
+    appendChunk(chunk, slot, line);
+    appendChunk(chunk, (uint8_t)index, line);
+    return true;
+}
+
+int
+findJump(JumpTable *table, Value value)
+{
+    switch (value.type) {
+        case VAL_BOOL:  return AS_BOOL(value) ? table->trueTarget : table->falseTarget;
+        case VAL_NULL:  return table->nullTarget;
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(value);
+            int low = 0, high = table->numberCount - 1;
+
+            while (low <= high) {
+                int mid = low + (high - low) / 2;
+                if (table->numbers[mid] < number) {
+                    low = mid + 1;
+                } else if (table->numbers[mid] > number) {
+                    high = mid - 1;
+                } else if (table->numbers[mid] == number) {
+                    return table->numberTargets[mid];
+                } else {
+                    break;  // NaN, which no label equals
+                }
+            }
+            return -1;
+        }
+        default: {
+            Value target;
+            if (!IS_STRING(value) || !tableGet(&table->strings, AS_STRING(value), &target)) {
+                return -1;
+            }
+            return (int)AS_NUMBER(target);
+        }
+    }
+}
@@ -2,8 +2,17 @@
 #define LAX_CHUNK_H
 
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
+/*
+ * Register instructions address locals directly by their
+ * stack slot. Source operands are 'RK' bytes, as in Lua:
+ * a slot below RK_CONSTANT, or a constant index with the
+ * RK_CONSTANT bit set.
+*/
+#define RK_CONSTANT 0x80
+
 /*
  * Enum of all of the OpCodes used to emit the 
  * correct bytes for compilation.
@@ -37,6 +46,44 @@ typedef enum {
     OP_NEGATE,
     OP_INCREMENT,
     OP_DECREMENT,
+    OP_BUILD_STRING,    // N        push(the top N values joined into one string)
+
+    // Unchecked variants, emitted when the operands are proven numbers
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_NEGATE_NUM,
+    OP_INCREMENT_NUM,
+    OP_DECREMENT_NUM,
+
+    // Guards a store to an annotated variable of a value not proven to fit
+    OP_CHECK_TYPE,      // T K      fail unless the top value has a TYPE_* in T, K names the variable
+
+    // Register instructions, arithmetic operands are proven numbers
+    OP_MOVE,            // A B      R[A] = RK(B)
+    OP_ADD_RK,          // A B C    R[A] = RK(B) + RK(C)
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    OP_JUMP_LESS,       // B C J    if (RK(B) < RK(C)) ip += J
+    OP_JUMP_NLESS,      // B C J    if (!(RK(B) < RK(C))) ip += J
+
+    // Superinstructions picked with bench/superops.py
+    OP_SET_LOCAL_POP,       // A        R[A] = pop()
+    OP_ADD_LOCAL_LOCAL,     // A B      push(R[A] + R[B])
+    OP_ADD_LOCAL_CONSTANT,  // A K      push(R[A] + K)
+    OP_LESS_LOCAL_CONSTANT, // A K      push(R[A] < K)
+
+    // Back edge of 'for (...; i < n; i++)', operands are checked
+    OP_FOR_RANGE,       // A B J    R[A] += 1; if (R[A] < RK(B)) ip -= J
+
+    // Dispatch of a 'switch' on R[A], falling through without a match
+    OP_JUMP_TABLE,      // A M N J*     ip -= J[R[A] - M] for an integer in M..M+N
+    OP_JUMP_LOOKUP,     // A T          ip = jumpTables[T] entry for R[A]
+
     OP_ECHO,
     OP_JUMP,
     OP_JUMP_FALSE,
@@ -44,6 +91,20 @@ typedef enum {
     OP_RETURN
 } OpCode;
 
+/*
+ * The cases of a 'switch' that don't fit an OP_JUMP_TABLE,
+ * mapped to the code offsets of their arms.
+*/
+typedef struct {
+    Table strings;          // Interned strings to NUMBER_VAL(offset)
+    double *numbers;        // Sorted, for a binary search
+    int *numberTargets;
+    int numberCount;
+    int trueTarget;         // -1 without a 'true' case, and so on
+    int falseTarget;
+    int nullTarget;
+} JumpTable;
+
 /*
  * 8-bit Dynamic Array (Array of Bytes)
 */
@@ -53,6 +114,9 @@ typedef struct {
     int *lines;
     int count;
     int capacity;
+
+    JumpTable *jumpTables;
+    int jumpTableCount;
 } Chunk;
 
 /*
@@ -79,4 +143,28 @@ appendChunk(Chunk *chunk, uint8_t byte, int line);
 int
 addConstant(Chunk *chunk, Value value);
 
+/*
+ * Returns the length in bytes of the instruction
+ * at 'offset', its operands included.
+*/
+int
+instructionLength(Chunk *chunk, int offset);
+
+/*
+ * Appends the dispatch of a 'switch' on local 'slot', where
+ * the case labels[i] jumps back to the arm at targets[i].
+ * Dense integer cases get an OP_JUMP_TABLE, the others an
+ * OP_JUMP_LOOKUP. Without a match, execution falls through.
+ * Returns false if an arm is too far back to jump to.
+*/
+bool
+writeSwitch(Chunk *chunk, uint8_t slot, Value *labels, int *targets, int count, int line);
+
+/*
+ * Returns the code offset a JumpTable maps 'value' to,
+ * or -1 if none of its cases match.
+*/
+int
+findJump(JumpTable *table, Value value);
+
 #endif // CHUNK_H
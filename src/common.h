@@ -10,6 +10,7 @@
 
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PROFILE_OPCODES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
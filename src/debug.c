@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "debug.h"
+#include "infer.h"
 #include "log.h"
 #include "object.h"
 
@@ -38,6 +39,107 @@ jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static void
+printOperand(Chunk *chunk, uint8_t operand)
+{
+    if (operand & RK_CONSTANT) {
+        printf(" K%d '", operand & ~RK_CONSTANT);
+        printValue(chunk->constants.values[operand & ~RK_CONSTANT]);
+        printf("'");
+    } else {
+        printf(" R%d", operand);
+    }
+}
+
+// Register Instructions
+static int
+registerInstruction(const char *name, int operands, Chunk *chunk, int offset)
+{
+    printf("%-16s R%d", name, chunk->code[offset + 1]);
+    for (int i = 2; i <= operands; i++) printOperand(chunk, chunk->code[offset + i]);
+    printf("\n");
+    return offset + 1 + operands;
+}
+
+static int
+compareJumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
+{
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+
+    printf("%-16s", name);
+    printOperand(chunk, chunk->code[offset + 1]);
+    printOperand(chunk, chunk->code[offset + 2]);
+    printf(" %d -> %d\n", offset, offset + 5 + sign * jump);
+    return offset + 5;
+}
+
+// Superinstructions over a local and a local or a constant
+static int
+localInstruction(const char *name, bool constant, Chunk *chunk, int offset)
+{
+    uint8_t operand = chunk->code[offset + 2];
+
+    printf("%-16s R%d", name, chunk->code[offset + 1]);
+    if (constant) {
+        // The whole byte indexes the constants, there's no RK bit
+        printf(" K%d '", operand);
+        printValue(chunk->constants.values[operand]);
+        printf("'\n");
+    } else {
+        printf(" R%d\n", operand);
+    }
+    return offset + 3;
+}
+
+// Switch dispatch, one line per case
+static int
+jumpTableInstruction(Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    int min = (int16_t)((code[2] << 8) | code[3]);
+    int span = code[4] + 1;
+    int end = offset + 5 + 2 * span;
+
+    printf("%-16s R%d %d..%d\n", "OP_JUMP_TABLE", code[1], min, min + span - 1);
+    for (int i = 0; i < span; i++) {
+        uint16_t jump = (uint16_t)((code[5 + 2 * i] << 8) | code[6 + 2 * i]);
+        if (jump != 0) printf("%20d -> %d\n", min + i, end - jump);
+    }
+    return end;
+}
+
+static int
+jumpLookupInstruction(Chunk *chunk, int offset)
+{
+    JumpTable *table = &chunk->jumpTables[chunk->code[offset + 2]];
+    printf("%-16s R%d T%d\n", "OP_JUMP_LOOKUP", chunk->code[offset + 1], chunk->code[offset + 2]);
+
+    for (int i = 0; i < table->numberCount; i++) {
+        printf("%20g -> %d\n", table->numbers[i], table->numberTargets[i]);
+    }
+    for (int i = 0; i < table->strings.capacity; i++) {
+        Entry *entry = &table->strings.entries[i];
+        if (entry->key == NULL) continue;
+        printf("%20s -> %d\n", entry->key->chars, (int)AS_NUMBER(entry->value));
+    }
+    if (table->trueTarget != -1) printf("%20s -> %d\n", "true", table->trueTarget);
+    if (table->falseTarget != -1) printf("%20s -> %d\n", "false", table->falseTarget);
+    if (table->nullTarget != -1) printf("%20s -> %d\n", "null", table->nullTarget);
+    return offset + 3;
+}
+
+static int
+checkTypeInstruction(Chunk *chunk, int offset)
+{
+    uint8_t name = chunk->code[offset + 2];
+
+    printf("%-16s %s %4d '", "OP_CHECK_TYPE", typeName(chunk->code[offset + 1]), name);
+    printValue(chunk->constants.values[name]);
+    printf("'\n");
+    return offset + 3;
+}
+
 // Two Byte Instructions
 static int
 constantInstruction(const char *name, Chunk *chunk, int offset)
@@ -100,6 +202,34 @@ disassembleInstruction(Chunk *chunk, int offset)
         case OP_NEGATE:         return simpleInstruction("OP_NEGATE", offset);
         case OP_INCREMENT:      return simpleInstruction("OP_INCREMENT", offset);
         case OP_DECREMENT:      return simpleInstruction("OP_DECREMENT", offset);
+        case OP_BUILD_STRING:   return byteInstruction("OP_BUILD_STRING", chunk, offset);
+        case OP_GREATER_NUM:    return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:       return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_ADD_NUM:        return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:   return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:   return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:     return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_NEGATE_NUM:     return simpleInstruction("OP_NEGATE_NUM", offset);
+        case OP_INCREMENT_NUM:  return simpleInstruction("OP_INCREMENT_NUM", offset);
+        case OP_DECREMENT_NUM:  return simpleInstruction("OP_DECREMENT_NUM", offset);
+        case OP_CHECK_TYPE:     return checkTypeInstruction(chunk, offset);
+        case OP_MOVE:           return registerInstruction("OP_MOVE", 2, chunk, offset);
+        case OP_ADD_RK:         return registerInstruction("OP_ADD_RK", 3, chunk, offset);
+        case OP_SUBTRACT_RK:    return registerInstruction("OP_SUBTRACT_RK", 3, chunk, offset);
+        case OP_MULTIPLY_RK:    return registerInstruction("OP_MULTIPLY_RK", 3, chunk, offset);
+        case OP_DIVIDE_RK:      return registerInstruction("OP_DIVIDE_RK", 3, chunk, offset);
+        case OP_JUMP_LESS:      return compareJumpInstruction("OP_JUMP_LESS", 1, chunk, offset);
+        case OP_JUMP_NLESS:     return compareJumpInstruction("OP_JUMP_NLESS", 1, chunk, offset);
+        case OP_SET_LOCAL_POP:  return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_ADD_LOCAL_LOCAL:
+            return localInstruction("OP_ADD_LOCAL_LOCAL", false, chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return localInstruction("OP_ADD_LOCAL_CONSTANT", true, chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT:
+            return localInstruction("OP_LESS_LOCAL_CONSTANT", true, chunk, offset);
+        case OP_FOR_RANGE:      return compareJumpInstruction("OP_FOR_RANGE", -1, chunk, offset);
+        case OP_JUMP_TABLE:     return jumpTableInstruction(chunk, offset);
+        case OP_JUMP_LOOKUP:    return jumpLookupInstruction(chunk, offset);
         case OP_ECHO:           return simpleInstruction("OP_ECHO", offset);
         case OP_JUMP:           return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_FALSE:     return jumpInstruction("OP_JUMP_FALSE", 1, chunk, offset);
@@ -107,3 +237,67 @@ disassembleInstruction(Chunk *chunk, int offset)
         case OP_RETURN:         return simpleInstruction("OP_RETURN", offset);
     }
 }
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define TRIPLE_MAX 4096
+
+typedef struct {
+    uint32_t key;
+    uint64_t count;
+} TripleCount;
+
+static uint64_t executed;
+static uint64_t pairs[UINT8_COUNT][UINT8_COUNT];
+static TripleCount triples[TRIPLE_MAX];
+
+// The instructions that ran last and where the latest one ends
+static Chunk *lastChunk;
+static int lastEnd = -1;
+static int lastOps[2];
+static int run;
+
+void
+profileInstruction(Chunk *chunk, int offset)
+{
+    uint8_t op = chunk->code[offset];
+    executed++;
+
+    // A taken jump starts a new straight-line run
+    if (chunk != lastChunk || offset != lastEnd) run = 0;
+
+    if (run >= 1) pairs[lastOps[1]][op]++;
+    if (run >= 2) {
+        uint32_t key = (uint32_t)lastOps[0] << 16 | (uint32_t)lastOps[1] << 8 | op;
+        uint32_t index = (key * 2654435761u) % TRIPLE_MAX;
+        while (triples[index].count != 0 && triples[index].key != key) {
+            index = (index + 1) % TRIPLE_MAX;
+        }
+        triples[index].key = key;
+        triples[index].count++;
+    }
+
+    lastChunk = chunk;
+    lastEnd = offset + instructionLength(chunk, offset);
+    lastOps[0] = lastOps[1];
+    lastOps[1] = op;
+    if (run < 2) run++;
+}
+
+void
+printProfile()
+{
+    fprintf(stderr, "executed %lu\n", (unsigned long)executed);
+    for (int a = 0; a < UINT8_COUNT; a++) {
+        for (int b = 0; b < UINT8_COUNT; b++) {
+            if (pairs[a][b] == 0) continue;
+            fprintf(stderr, "pair %d %d %lu\n", a, b, (unsigned long)pairs[a][b]);
+        }
+    }
+    for (int i = 0; i < TRIPLE_MAX; i++) {
+        if (triples[i].count == 0) continue;
+        uint32_t key = triples[i].key;
+        fprintf(stderr, "triple %u %u %u %lu\n",
+                key >> 16, (key >> 8) & 0xff, key & 0xff, (unsigned long)triples[i].count);
+    }
+}
+#endif // DEBUG_PROFILE_OPCODES
@@ -17,4 +17,21 @@ disassembleChunk(Chunk *chunk, const char *name);
 int
 disassembleInstruction(Chunk *chunk, int offset);
 
+#ifdef DEBUG_PROFILE_OPCODES
+/*
+ * Counts the instruction at 'offset' along with the one
+ * or two instructions that ran straight before it, when
+ * they fell through into it without a jump.
+*/
+void
+profileInstruction(Chunk *chunk, int offset);
+
+/*
+ * Prints the opcode pair and triple counts to stderr
+ * for bench/superops.py, one 'pair'/'triple' per line.
+*/
+void
+printProfile();
+#endif // DEBUG_PROFILE_OPCODES
+
 #endif // LAX_DEBUG_H
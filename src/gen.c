@@ -0,0 +1,783 @@
+#include <string.h>
+
+#include "gen.h"
+#include "object.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif // DEBUG_PRINT_CODE
+
+/*
+ * The increment follows the body, so both 'break' and
+ * 'continue' jump forward and are patched once the loop
+ * has been generated. A switch is a Loop that only takes
+ * 'break', a 'continue' goes on to the enclosing loop.
+*/
+typedef struct Loop {
+    struct Loop *enclosing;
+    bool isSwitch;
+    int localCount;     // Locals declared inside the body are popped when jumping out
+
+    int breaks[UINT8_COUNT];
+    int breakCount;
+    int continues[UINT8_COUNT];
+    int continueCount;
+} Loop;
+
+typedef struct {
+    Ast *ast;
+    Chunk *chunk;
+    int localCount;
+    Loop *loop;
+    bool hadError;
+} Generator;
+
+static void
+emitByte(Generator *gen, uint8_t byte, int line)
+{
+    appendChunk(gen->chunk, byte, line);
+}
+
+static void
+emitBytes(Generator *gen, uint8_t byte, uint8_t byte2, int line)
+{
+    emitByte(gen, byte, line);
+    emitByte(gen, byte2, line);
+}
+
+static int
+emitJump(Generator *gen, uint8_t instruction, int line)
+{
+    emitByte(gen, instruction, line);
+    emitByte(gen, 0xff, line);
+    emitByte(gen, 0xff, line);
+
+    return gen->chunk->count - 2;
+}
+
+static void
+patchJump(Generator *gen, int offset)
+{
+    int jump = gen->chunk->count - offset - 2;
+    if (jump > UINT16_MAX) gen->hadError = true;
+
+    gen->chunk->code[offset] = (jump >> 8) & 0xff;
+    gen->chunk->code[offset + 1] = jump & 0xff;
+}
+
+static void
+emitLoop(Generator *gen, int loopStart, int line)
+{
+    emitByte(gen, OP_LOOP, line);
+
+    int offset = gen->chunk->count - loopStart + 2;
+    if (offset > UINT16_MAX) gen->hadError = true;
+
+    emitByte(gen, (offset >> 8) & 0xff, line);
+    emitByte(gen, offset & 0xff, line);
+}
+
+static bool
+sameConstant(Value a, Value b)
+{
+    // Compare numbers bitwise so '0' and '-0' stay distinct
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return memcmp(&AS_NUMBER(a), &AS_NUMBER(b), sizeof(double)) == 0;
+    }
+
+    return valuesEqual(a, b);
+}
+
+/*
+ * Constants are shared, the whole program lives in a
+ * single chunk and the pool only has 256 entries.
+*/
+static uint8_t
+makeConstant(Generator *gen, Value value)
+{
+    ValueArray *constants = &gen->chunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (sameConstant(constants->values[i], value)) return (uint8_t)i;
+    }
+
+    int constant = addConstant(gen->chunk, value);
+    if (constant > UINT8_MAX) {
+        gen->hadError = true;
+        return 0;
+    }
+
+    return (uint8_t)constant;
+}
+
+/*
+ * Globals are looked up by name. Every reference to a
+ * global shares a single name constant, kept in its slot.
+*/
+static uint8_t
+nameConstant(Generator *gen, Var *var)
+{
+    if (var->slot == -1) {
+        ObjString *name = copyString(gen->ast->vm, var->name.start, var->name.length);
+        var->slot = makeConstant(gen, OBJ_VAL(name));
+    }
+
+    return (uint8_t)var->slot;
+}
+
+static void
+emitGet(Generator *gen, Var *var, int line)
+{
+    if (var->isGlobal) {
+        emitBytes(gen, OP_GET_GLOBAL, nameConstant(gen, var), line);
+    } else {
+        emitBytes(gen, OP_GET_LOCAL, (uint8_t)var->slot, line);
+    }
+}
+
+static void
+emitSet(Generator *gen, Var *var, int line)
+{
+    if (var->isGlobal) {
+        emitBytes(gen, OP_SET_GLOBAL, nameConstant(gen, var), line);
+    } else {
+        emitBytes(gen, OP_SET_LOCAL, (uint8_t)var->slot, line);
+    }
+}
+
+/*
+ * The check before a store to an annotated variable of a
+ * value inference couldn't prove has the declared type.
+*/
+static bool
+needsCheck(Var *var, Node *value)
+{
+    return value != NULL && (value->types & ~var->declared) != 0;
+}
+
+static void
+emitCheck(Generator *gen, Var *var, Node *value, int line)
+{
+    if (!needsCheck(var, value)) return;
+
+    ObjString *name = copyString(gen->ast->vm, var->name.start, var->name.length);
+    emitBytes(gen, OP_CHECK_TYPE, var->declared, line);
+    emitByte(gen, makeConstant(gen, OBJ_VAL(name)), line);
+}
+
+static void
+endScope(Generator *gen, int localCount, int line)
+{
+    while (gen->localCount > localCount) {
+        emitByte(gen, OP_POP, line);
+        gen->localCount--;
+    }
+}
+
+#define NUMERIC(op) (numeric ? OP_##op##_NUM : OP_##op)
+
+static void
+genExpr(Generator *gen, Node *node)
+{
+    switch (node->type) {
+        case NODE_LITERAL: {
+            Value value = node->as.literal;
+            if (IS_NULL(value)) {
+                emitByte(gen, OP_NULL, node->line);
+            } else if (IS_BOOL(value)) {
+                emitByte(gen, AS_BOOL(value) ? OP_TRUE : OP_FALSE, node->line);
+            } else {
+                emitBytes(gen, OP_CONSTANT, makeConstant(gen, value), node->line);
+            }
+        } break;
+        case NODE_VARIABLE: emitGet(gen, node->as.variable, node->line); break;
+        case NODE_ASSIGN: {
+            genExpr(gen, node->as.assign.value);
+            emitCheck(gen, node->as.assign.var, node->as.assign.value, node->line);
+            emitSet(gen, node->as.assign.var, node->line);
+        } break;
+        case NODE_INCREMENT: {
+            bool numeric = node->as.incr.operand == TYPE_NUMBER;
+            uint8_t op = node->as.incr.delta > 0 ?
+                (numeric ? OP_INCREMENT_NUM : OP_INCREMENT) :
+                (numeric ? OP_DECREMENT_NUM : OP_DECREMENT);
+
+            emitGet(gen, node->as.incr.var, node->line);
+            emitByte(gen, op, node->line);
+            emitSet(gen, node->as.incr.var, node->line);
+        } break;
+        case NODE_UNARY: {
+            Node *operand = node->as.unary.operand;
+            genExpr(gen, operand);
+
+            if (node->as.unary.op == TK_BANG) {
+                emitByte(gen, OP_NOT, node->line);
+            } else {
+                emitByte(gen, operand->types == TYPE_NUMBER ? OP_NEGATE_NUM : OP_NEGATE, node->line);
+            }
+        } break;
+        case NODE_BINARY: {
+            genExpr(gen, node->as.binary.left);
+            genExpr(gen, node->as.binary.right);
+
+            // Operands proven to be numbers skip the type checks
+            bool numeric = node->as.binary.left->types == TYPE_NUMBER &&
+                           node->as.binary.right->types == TYPE_NUMBER;
+            int line = node->line;
+
+            switch (node->as.binary.op) {
+                case TK_BANGEQ:     emitBytes(gen, OP_EQUAL, OP_NOT, line);         break;
+                case TK_EQEQ:       emitByte(gen, OP_EQUAL, line);                  break;
+                case TK_GREATER:    emitByte(gen, NUMERIC(GREATER), line);          break;
+                case TK_GTEQ:       emitBytes(gen, NUMERIC(LESS), OP_NOT, line);    break;
+                case TK_LESS:       emitByte(gen, NUMERIC(LESS), line);             break;
+                case TK_LTEQ:       emitBytes(gen, NUMERIC(GREATER), OP_NOT, line); break;
+                case TK_PLUS:       emitByte(gen, NUMERIC(ADD), line);              break;
+                case TK_MINUS:      emitByte(gen, NUMERIC(SUBTRACT), line);         break;
+                case TK_STAR:       emitByte(gen, NUMERIC(MULTIPLY), line);         break;
+                case TK_SLASH:      emitByte(gen, NUMERIC(DIVIDE), line);           break;
+                case TK_MODULUS:    emitByte(gen, OP_MODULUS, line);                break;
+                case TK_POWER:      emitByte(gen, OP_POWER, line);                  break;
+                case TK_BAND:       emitByte(gen, OP_BAND, line);                   break;
+                case TK_BOR:        emitByte(gen, OP_BOR, line);                    break;
+                case TK_BXOR:       emitByte(gen, OP_BXOR, line);                   break;
+                case TK_SHL:        emitByte(gen, OP_SHL, line);                    break;
+                case TK_SHR:        emitByte(gen, OP_SHR, line);                    break;
+                default:            return; // Unreachable
+            }
+        } break;
+        case NODE_LOGICAL: {
+            genExpr(gen, node->as.binary.left);
+
+            if (node->as.binary.op == TK_AND) {
+                int endJump = emitJump(gen, OP_JUMP_FALSE, node->line);
+                emitByte(gen, OP_POP, node->line);
+                genExpr(gen, node->as.binary.right);
+                patchJump(gen, endJump);
+            } else {
+                int elseJump = emitJump(gen, OP_JUMP_FALSE, node->line);
+                int endJump = emitJump(gen, OP_JUMP, node->line);
+                patchJump(gen, elseJump);
+                emitByte(gen, OP_POP, node->line);
+                genExpr(gen, node->as.binary.right);
+                patchJump(gen, endJump);
+            }
+        } break;
+        case NODE_INTERPOLATION: {
+            for (int i = 0; i < node->as.interpolation.count; i++) {
+                genExpr(gen, node->as.interpolation.pieces[i]);
+            }
+            emitBytes(gen, OP_BUILD_STRING, (uint8_t)node->as.interpolation.count, node->line);
+        } break;
+        default: return; // Unreachable
+    }
+}
+
+#undef NUMERIC
+
+static bool
+isLeaf(Node *node)
+{
+    return node->type == NODE_LITERAL || node->type == NODE_VARIABLE;
+}
+
+static int
+registerTemps(Generator *gen, Node *node);
+
+/*
+ * Number of temporaries needed to compute both operands of a
+ * register instruction, or -1 if either can't be computed.
+ * A computed left operand is held while the right one is.
+*/
+static int
+operandTemps(Generator *gen, Node *left, Node *right)
+{
+    int leftTemps = registerTemps(gen, left);
+    int rightTemps = registerTemps(gen, right);
+    if (leftTemps < 0 || rightTemps < 0) return -1;
+
+    if (!isLeaf(left)) leftTemps++;
+    if (!isLeaf(right)) rightTemps++;
+
+    int held = isLeaf(left) ? 0 : 1;
+    return leftTemps > held + rightTemps ? leftTemps : held + rightTemps;
+}
+
+/*
+ * Number of temporaries needed to compute the expression into
+ * a register, or -1 if it can't be: only numeric arithmetic
+ * over locals and constants within RK range qualifies.
+*/
+static int
+registerTemps(Generator *gen, Node *node)
+{
+    switch (node->type) {
+        case NODE_LITERAL: {
+            int constant = makeConstant(gen, node->as.literal);
+            return constant < RK_CONSTANT ? 0 : -1;
+        }
+        case NODE_VARIABLE: {
+            Var *var = node->as.variable;
+            return !var->isGlobal && var->slot < RK_CONSTANT ? 0 : -1;
+        }
+        case NODE_BINARY: {
+            Node *left = node->as.binary.left;
+            Node *right = node->as.binary.right;
+            if (left->types != TYPE_NUMBER || right->types != TYPE_NUMBER) return -1;
+
+            switch (node->as.binary.op) {
+                case TK_PLUS:
+                case TK_MINUS:
+                case TK_STAR:
+                case TK_SLASH:  return operandTemps(gen, left, right);
+                default:        return -1;
+            }
+        }
+        default: return -1;
+    }
+}
+
+static void
+emitRegister(Generator *gen, Node *node, int dest, int temp);
+
+static uint8_t
+emitOperand(Generator *gen, Node *node, int temp)
+{
+    if (node->type == NODE_LITERAL) {
+        return RK_CONSTANT | makeConstant(gen, node->as.literal);
+    }
+    if (node->type == NODE_VARIABLE) return (uint8_t)node->as.variable->slot;
+
+    emitRegister(gen, node, temp, temp + 1);
+    return (uint8_t)temp;
+}
+
+/*
+ * Computes a binary expression into register 'dest', with
+ * the registers from 'temp' up free for intermediate values.
+*/
+static void
+emitRegister(Generator *gen, Node *node, int dest, int temp)
+{
+    Node *left = node->as.binary.left;
+    uint8_t b = emitOperand(gen, left, temp);
+    uint8_t c = emitOperand(gen, node->as.binary.right, isLeaf(left) ? temp : temp + 1);
+
+    uint8_t op;
+    switch (node->as.binary.op) {
+        case TK_PLUS:   op = OP_ADD_RK;         break;
+        case TK_MINUS:  op = OP_SUBTRACT_RK;    break;
+        case TK_STAR:   op = OP_MULTIPLY_RK;    break;
+        default:        op = OP_DIVIDE_RK;      break;
+    }
+
+    emitBytes(gen, op, (uint8_t)dest, node->line);
+    emitBytes(gen, b, c, node->line);
+}
+
+/*
+ * Compiles an expression whose value is discarded straight
+ * to register instructions. At statement level the stack
+ * holds exactly the locals, so the slots above them are free
+ * as temporaries. Returns false, emitting nothing, if the
+ * expression doesn't fit the register instructions.
+*/
+static bool
+genEffect(Generator *gen, Node *node)
+{
+    switch (node->type) {
+        case NODE_ASSIGN: {
+            Var *var = node->as.assign.var;
+            Node *value = node->as.assign.value;
+            if (var->isGlobal || needsCheck(var, value)) return false;
+
+            int temps = registerTemps(gen, value);
+            if (temps < 0 || gen->localCount + temps > RK_CONSTANT) return false;
+
+            if (isLeaf(value)) {
+                emitBytes(gen, OP_MOVE, (uint8_t)var->slot, node->line);
+                emitByte(gen, emitOperand(gen, value, 0), node->line);
+            } else {
+                emitRegister(gen, value, var->slot, gen->localCount);
+            }
+            return true;
+        }
+        case NODE_INCREMENT: {
+            Var *var = node->as.incr.var;
+            if (var->isGlobal || node->as.incr.operand != TYPE_NUMBER) return false;
+
+            int one = makeConstant(gen, NUMBER_VAL(1));
+            if (var->slot >= RK_CONSTANT || one >= RK_CONSTANT) return false;
+
+            uint8_t op = node->as.incr.delta > 0 ? OP_ADD_RK : OP_SUBTRACT_RK;
+            emitBytes(gen, op, (uint8_t)var->slot, node->line);
+            emitBytes(gen, (uint8_t)var->slot, RK_CONSTANT | one, node->line);
+            return true;
+        }
+        default: return false;
+    }
+}
+
+/*
+ * Emits a jump taken when the condition is false and returns
+ * it for patching. A numeric comparison becomes one compare
+ * and jump instruction that leaves nothing on the stack, and
+ * 'fused' is set. Otherwise the condition is left on the stack
+ * for OP_JUMP_FALSE and must be popped on both paths.
+*/
+static int
+genCondition(Generator *gen, Node *node, bool *fused)
+{
+    *fused = false;
+
+    if (node->type == NODE_BINARY &&
+        node->as.binary.left->types == TYPE_NUMBER &&
+        node->as.binary.right->types == TYPE_NUMBER) {
+        TokenType op = node->as.binary.op;
+        Node *left = node->as.binary.left;
+        Node *right = node->as.binary.right;
+
+        bool compare = op == TK_LESS || op == TK_GREATER || op == TK_LTEQ || op == TK_GTEQ;
+        int temps = compare ? operandTemps(gen, left, right) : -1;
+
+        if (temps >= 0 && gen->localCount + temps <= RK_CONSTANT) {
+            uint8_t b = emitOperand(gen, left, gen->localCount);
+            uint8_t c = emitOperand(gen, right, gen->localCount + (isLeaf(left) ? 0 : 1));
+
+            // 'a > b' is 'b < a', 'a >= b' is '!(a < b)' and 'a <= b' is '!(b < a)'
+            bool swap = op == TK_GREATER || op == TK_LTEQ;
+            bool strict = op == TK_LESS || op == TK_GREATER;
+
+            emitBytes(gen, strict ? OP_JUMP_NLESS : OP_JUMP_LESS, swap ? c : b, node->line);
+            emitByte(gen, swap ? b : c, node->line);
+            emitBytes(gen, 0xff, 0xff, node->line);
+
+            *fused = true;
+            return gen->chunk->count - 2;
+        }
+    }
+
+    genExpr(gen, node);
+    int jump = emitJump(gen, OP_JUMP_FALSE, node->line);
+    emitByte(gen, OP_POP, node->line);
+    return jump;
+}
+
+static void
+genStmt(Generator *gen, Node *node);
+
+static void
+genList(Generator *gen, Node *list)
+{
+    for (; list != NULL; list = list->next) genStmt(gen, list);
+}
+
+static void
+genJump(Generator *gen, Node *node)
+{
+    bool isBreak = node->type == NODE_BREAK;
+    Loop *loop = gen->loop;
+    while (!isBreak && loop->isSwitch) loop = loop->enclosing;
+
+    for (int i = gen->localCount; i > loop->localCount; i--) {
+        emitByte(gen, OP_POP, node->line);
+    }
+
+    int *jumps = isBreak ? loop->breaks : loop->continues;
+    int *count = isBreak ? &loop->breakCount : &loop->continueCount;
+    if (*count == UINT8_COUNT) {
+        gen->hadError = true;
+        return;
+    }
+    jumps[(*count)++] = emitJump(gen, OP_JUMP, node->line);
+}
+
+/*
+ * Returns the variable stepped by one by the increment of a
+ * loop, 'i++' or 'i = i + 1'. The latter only qualifies when
+ * 'i' is proven to be a number, as OP_FOR_RANGE would report
+ * a different error than the addition.
+*/
+static Var *
+loopCounter(Node *increment)
+{
+    if (increment->type == NODE_INCREMENT) {
+        return increment->as.incr.delta == 1 ? increment->as.incr.var : NULL;
+    }
+    if (increment->type != NODE_ASSIGN) return NULL;
+
+    Var *var = increment->as.assign.var;
+    Node *value = increment->as.assign.value;
+    if (value->type != NODE_BINARY || value->as.binary.op != TK_PLUS) return NULL;
+
+    Node *left = value->as.binary.left;
+    Node *right = value->as.binary.right;
+    if (left->type != NODE_VARIABLE || left->as.variable != var ||
+        left->types != TYPE_NUMBER || right->type != NODE_LITERAL ||
+        !IS_NUMBER(right->as.literal) || AS_NUMBER(right->as.literal) != 1) {
+        return NULL;
+    }
+
+    return var;
+}
+
+/*
+ * Matches 'for (...; i < n; i++)' on a local 'i', where 'n' is
+ * a local or a constant, so the loop can end in OP_FOR_RANGE.
+*/
+static bool
+countedLoop(Generator *gen, Node *node, uint8_t *counter, uint8_t *limit)
+{
+    Node *condition = node->as.loop.condition;
+    Node *increment = node->as.loop.increment;
+    if (condition == NULL || increment == NULL ||
+        condition->type != NODE_BINARY || condition->as.binary.op != TK_LESS) {
+        return false;
+    }
+
+    Node *left = condition->as.binary.left;
+    Node *right = condition->as.binary.right;
+    Var *var = loopCounter(increment);
+    if (var == NULL || left->type != NODE_VARIABLE || left->as.variable != var ||
+        var->isGlobal || var->slot >= RK_CONSTANT) {
+        return false;
+    }
+
+    if (right->type == NODE_LITERAL) {
+        int constant = makeConstant(gen, right->as.literal);
+        if (constant >= RK_CONSTANT) return false;
+        *limit = RK_CONSTANT | constant;
+    } else if (right->type == NODE_VARIABLE && !right->as.variable->isGlobal &&
+               right->as.variable->slot < RK_CONSTANT) {
+        *limit = right->as.variable->slot;
+    } else {
+        return false;
+    }
+
+    *counter = var->slot;
+    return true;
+}
+
+/*
+ * Unlike the single-pass compiler, the increment is placed
+ * after the body, so an iteration ends in a single backward
+ * jump instead of jumping around the increment. A counted
+ * loop only tests its condition on entry and then ends in
+ * OP_FOR_RANGE, which does the increment and the test.
+*/
+static void
+genLoop(Generator *gen, Node *node)
+{
+    int localCount = gen->localCount;
+    int line = node->line;
+
+    if (node->as.loop.init != NULL) genStmt(gen, node->as.loop.init);
+    genList(gen, node->as.loop.hoisted);
+
+    uint8_t counter, limit;
+    bool counted = countedLoop(gen, node, &counter, &limit);
+
+    int loopStart = gen->chunk->count;
+    int exitJump = -1;
+    bool fused = false;
+    if (node->as.loop.condition != NULL) {
+        exitJump = genCondition(gen, node->as.loop.condition, &fused);
+    }
+
+    Loop loop;
+    loop.enclosing = gen->loop;
+    loop.isSwitch = false;
+    loop.localCount = gen->localCount;
+    loop.breakCount = 0;
+    loop.continueCount = 0;
+    gen->loop = &loop;
+
+    int bodyStart = gen->chunk->count;
+    if (node->as.loop.body != NULL) genStmt(gen, node->as.loop.body);
+    for (int i = 0; i < loop.continueCount; i++) patchJump(gen, loop.continues[i]);
+
+    if (counted) {
+        int offset = gen->chunk->count + 5 - bodyStart;
+        if (offset > UINT16_MAX) gen->hadError = true;
+
+        emitBytes(gen, OP_FOR_RANGE, counter, line);
+        emitBytes(gen, limit, (offset >> 8) & 0xff, line);
+        emitByte(gen, offset & 0xff, line);
+
+        // Only the entry test can leave its condition to pop
+        if (!fused) {
+            int endJump = emitJump(gen, OP_JUMP, line);
+            patchJump(gen, exitJump);
+            emitByte(gen, OP_POP, line);
+            patchJump(gen, endJump);
+        } else {
+            patchJump(gen, exitJump);
+        }
+    } else {
+        Node *increment = node->as.loop.increment;
+        if (increment != NULL && !genEffect(gen, increment)) {
+            genExpr(gen, increment);
+            emitByte(gen, OP_POP, line);
+        }
+        emitLoop(gen, loopStart, line);
+
+        if (exitJump != -1) {
+            patchJump(gen, exitJump);
+            if (!fused) emitByte(gen, OP_POP, line);
+        }
+    }
+
+    for (int i = 0; i < loop.breakCount; i++) patchJump(gen, loop.breaks[i]);
+    gen->loop = loop.enclosing;
+
+    endScope(gen, localCount, line);
+}
+
+/*
+ * Same layout as the single-pass compiler: the subject is
+ * kept in a hidden local, the arms come first and each one
+ * ends with a 'break', then the dispatch reads the local and
+ * jumps back to the matching arm or falls into 'default'.
+*/
+static void
+genSwitch(Generator *gen, Node *node)
+{
+    int localCount = gen->localCount;
+    int line = node->line;
+
+    genExpr(gen, node->as.switchStmt.subject);
+    if (gen->localCount == UINT8_COUNT) {
+        gen->hadError = true;
+        return;
+    }
+    uint8_t slot = (uint8_t)gen->localCount++;
+    int dispatchJump = emitJump(gen, OP_JUMP, line);
+
+    Loop loop;
+    loop.enclosing = gen->loop;
+    loop.isSwitch = true;
+    loop.localCount = gen->localCount;
+    loop.breakCount = 0;
+    loop.continueCount = 0;
+    gen->loop = &loop;
+
+    // The parser allows at most UINT8_COUNT labels per switch
+    Value labels[UINT8_COUNT];
+    int targets[UINT8_COUNT];
+    int labelCount = 0;
+    int defaultTarget = -1;
+
+    for (Node *arm = node->as.switchStmt.arms; arm != NULL; arm = arm->next) {
+        int target = gen->chunk->count;
+        if (arm->as.arm.isDefault) defaultTarget = target;
+        for (int i = 0; i < arm->as.arm.labelCount; i++) {
+            labels[labelCount] = arm->as.arm.labels[i];
+            targets[labelCount++] = target;
+        }
+
+        if (arm->as.arm.body != NULL) genStmt(gen, arm->as.arm.body);
+        if (loop.breakCount == UINT8_COUNT) {
+            gen->hadError = true;
+        } else {
+            loop.breaks[loop.breakCount++] = emitJump(gen, OP_JUMP, line);
+        }
+    }
+
+    patchJump(gen, dispatchJump);
+    if (!writeSwitch(gen->chunk, slot, labels, targets, labelCount, line)) {
+        gen->hadError = true;
+    }
+    if (defaultTarget != -1) emitLoop(gen, defaultTarget, line);
+
+    for (int i = 0; i < loop.breakCount; i++) patchJump(gen, loop.breaks[i]);
+    gen->loop = loop.enclosing;
+
+    endScope(gen, localCount, line);
+}
+
+static void
+genStmt(Generator *gen, Node *node)
+{
+    switch (node->type) {
+        case NODE_EXPRESSION: {
+            if (genEffect(gen, node->as.expression)) break;
+
+            genExpr(gen, node->as.expression);
+            emitByte(gen, OP_POP, node->line);
+        } break;
+        case NODE_ECHO: {
+            genExpr(gen, node->as.expression);
+            emitByte(gen, OP_ECHO, node->line);
+        } break;
+        case NODE_VAR: {
+            // Every read of a global constant was folded, it never exists at runtime
+            Var *var = node->as.var.var;
+            if (var->isConst && var->isGlobal) break;
+
+            if (node->as.var.init != NULL) {
+                genExpr(gen, node->as.var.init);
+                emitCheck(gen, var, node->as.var.init, node->line);
+            } else {
+                emitByte(gen, OP_NULL, node->line);
+            }
+
+            if (var->isGlobal) {
+                emitBytes(gen, OP_DEFINE_GLOBAL, nameConstant(gen, var), node->line);
+            } else if (gen->localCount == UINT8_COUNT) {
+                gen->hadError = true;
+            } else {
+                var->slot = gen->localCount++;
+            }
+        } break;
+        case NODE_BLOCK: {
+            int localCount = gen->localCount;
+            genList(gen, node->as.block);
+            endScope(gen, localCount, node->line);
+        } break;
+        case NODE_IF: {
+            bool fused;
+            int thenJump = genCondition(gen, node->as.branch.condition, &fused);
+            if (node->as.branch.thenBranch != NULL) genStmt(gen, node->as.branch.thenBranch);
+
+            // A fused condition leaves nothing to pop on the else path
+            if (fused && node->as.branch.elseBranch == NULL) {
+                patchJump(gen, thenJump);
+                break;
+            }
+
+            int elseJump = emitJump(gen, OP_JUMP, node->line);
+            patchJump(gen, thenJump);
+            if (!fused) emitByte(gen, OP_POP, node->line);
+            if (node->as.branch.elseBranch != NULL) genStmt(gen, node->as.branch.elseBranch);
+            patchJump(gen, elseJump);
+        } break;
+        case NODE_LOOP: genLoop(gen, node); break;
+        case NODE_SWITCH: genSwitch(gen, node); break;
+        case NODE_BREAK:
+        case NODE_CONTINUE: genJump(gen, node); break;
+        default: return; // Unreachable
+    }
+}
+
+bool
+generate(Ast *ast, Chunk *chunk)
+{
+    Generator gen;
+    gen.ast = ast;
+    gen.chunk = chunk;
+    gen.localCount = 0;
+    gen.loop = NULL;
+    gen.hadError = false;
+
+    int line = 1;
+    for (Node *node = ast->statements; node != NULL; node = node->next) {
+        genStmt(&gen, node);
+        line = node->line;
+    }
+    emitByte(&gen, OP_RETURN, line);
+
+#ifdef DEBUG_PRINT_CODE
+    if (!gen.hadError) disassembleChunk(chunk, "Optimized Code");
+#endif // DEBUG_PRINT_CODE
+
+    return !gen.hadError;
+}
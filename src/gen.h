@@ -0,0 +1,15 @@
+#ifndef LAX_GEN_H
+#define LAX_GEN_H
+
+#include "ast.h"
+#include "chunk.h"
+
+/*
+ * Generates Lax Bytecode for the Ast into the chunk.
+ * Returns false if the program exceeds a limit of the
+ * bytecode format (locals, constants or jump distance).
+*/
+bool
+generate(Ast *ast, Chunk *chunk);
+
+#endif // LAX_GEN_H
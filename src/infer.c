@@ -0,0 +1,300 @@
+#include <string.h>
+
+#include "infer.h"
+#include "memory.h"
+#include "object.h"
+
+/*
+ * The analysis walks the Ast in execution order carrying an
+ * environment with the current type set of every variable.
+ * Each assignment starts a new definition, and control flow
+ * only merges after an 'if', a 'switch', an 'and'/'or' or at
+ * a loop head, so joining the environments there does the work
+ * of SSA phi nodes without building a separate IR. Loops are
+ * iterated until their head environment stops growing. A 'break'
+ * joins its environment into the loop or switch exit, a
+ * 'continue' into the increment.
+ *
+ * A failing operation stops the program, so the result of an
+ * arithmetic operator is always a number when it is produced.
+*/
+
+typedef struct {
+    int varCount;
+    uint8_t *breaks;        // Environments reaching the exit of the innermost loop
+    uint8_t *continues;     // Environments reaching its increment
+} Inferrer;
+
+static uint8_t *
+newEnv(Inferrer *inf, uint8_t *from)
+{
+    uint8_t *env = ALLOCATE(uint8_t, inf->varCount);
+    memcpy(env, from, inf->varCount);
+    return env;
+}
+
+static uint8_t *
+emptyEnv(Inferrer *inf)
+{
+    uint8_t *env = ALLOCATE(uint8_t, inf->varCount);
+    memset(env, 0, inf->varCount);
+    return env;
+}
+
+static void
+freeEnv(Inferrer *inf, uint8_t *env)
+{
+    FREE_ARRAY(uint8_t, env, inf->varCount);
+}
+
+/*
+ * Merges 'from' into 'env', returns true if 'env' grew.
+*/
+static bool
+joinEnv(Inferrer *inf, uint8_t *env, uint8_t *from)
+{
+    bool grew = false;
+    for (int i = 0; i < inf->varCount; i++) {
+        if ((env[i] | from[i]) != env[i]) {
+            env[i] |= from[i];
+            grew = true;
+        }
+    }
+
+    return grew;
+}
+
+uint8_t
+valueType(Value value)
+{
+    switch (value.type) {
+        case VAL_BOOL:      return TYPE_BOOL;
+        case VAL_NULL:      return TYPE_NULL;
+        case VAL_NUMBER:    return TYPE_NUMBER;
+        default:            return TYPE_STRING;
+    }
+}
+
+uint8_t
+binaryType(TokenType op, uint8_t left, uint8_t right)
+{
+    switch (op) {
+        case TK_PLUS: {
+            uint8_t types = 0;
+            if ((left & TYPE_NUMBER) && (right & TYPE_NUMBER)) types |= TYPE_NUMBER;
+            if ((left & TYPE_STRING) && (right & TYPE_STRING)) types |= TYPE_STRING;
+            return types;
+        }
+        case TK_BANGEQ:
+        case TK_EQEQ:
+        case TK_GREATER:
+        case TK_GTEQ:
+        case TK_LESS:
+        case TK_LTEQ:   return TYPE_BOOL;
+        default:        return TYPE_NUMBER;
+    }
+}
+
+uint8_t
+namedType(Token *name)
+{
+    if (name->length == 3 && !memcmp(name->start, "num", 3)) return TYPE_NUMBER;
+    if (name->length == 3 && !memcmp(name->start, "str", 3)) return TYPE_STRING;
+    if (name->length == 4 && !memcmp(name->start, "bool", 4)) return TYPE_BOOL;
+    return 0;
+}
+
+const char *
+typeName(uint8_t type)
+{
+    switch (type) {
+        case TYPE_NUMBER:   return "num";
+        case TYPE_STRING:   return "str";
+        case TYPE_BOOL:     return "bool";
+        default:            return "any";
+    }
+}
+
+static uint8_t
+inferExpr(Inferrer *inf, Node *node, uint8_t *env)
+{
+    uint8_t types;
+
+    switch (node->type) {
+        case NODE_LITERAL:  types = valueType(node->as.literal); break;
+        case NODE_VARIABLE: types = env[node->as.variable->index]; break;
+        case NODE_ASSIGN: {
+            // A store to an annotated variable fails unless the value fits
+            types = inferExpr(inf, node->as.assign.value, env) & node->as.assign.var->declared;
+            env[node->as.assign.var->index] = types;
+        } break;
+        case NODE_INCREMENT: {
+            node->as.incr.operand |= env[node->as.incr.var->index];
+            types = TYPE_NUMBER;
+            env[node->as.incr.var->index] = types;
+        } break;
+        case NODE_UNARY: {
+            inferExpr(inf, node->as.unary.operand, env);
+            types = node->as.unary.op == TK_MINUS ? TYPE_NUMBER : TYPE_BOOL;
+        } break;
+        case NODE_BINARY: {
+            uint8_t left = inferExpr(inf, node->as.binary.left, env);
+            uint8_t right = inferExpr(inf, node->as.binary.right, env);
+            types = binaryType(node->as.binary.op, left, right);
+        } break;
+        case NODE_LOGICAL: {
+            types = inferExpr(inf, node->as.binary.left, env);
+
+            // The right operand may be skipped
+            uint8_t *right = newEnv(inf, env);
+            types |= inferExpr(inf, node->as.binary.right, right);
+            joinEnv(inf, env, right);
+            freeEnv(inf, right);
+        } break;
+        case NODE_INTERPOLATION: {
+            for (int i = 0; i < node->as.interpolation.count; i++) {
+                inferExpr(inf, node->as.interpolation.pieces[i], env);
+            }
+            types = TYPE_STRING;
+        } break;
+        default: types = TYPE_ANY; break;   // Unreachable
+    }
+
+    // A node inside a loop is visited once per iteration of the analysis
+    node->types |= types;
+    return types;
+}
+
+static void
+inferStmt(Inferrer *inf, Node *node, uint8_t *env);
+
+static void
+inferList(Inferrer *inf, Node *list, uint8_t *env)
+{
+    for (; list != NULL; list = list->next) inferStmt(inf, list, env);
+}
+
+static void
+inferLoop(Inferrer *inf, Node *node, uint8_t *env)
+{
+    if (node->as.loop.init != NULL) inferStmt(inf, node->as.loop.init, env);
+    inferList(inf, node->as.loop.hoisted, env);
+
+    uint8_t *breaks = inf->breaks;
+    uint8_t *continues = inf->continues;
+    inf->breaks = emptyEnv(inf);
+    inf->continues = emptyEnv(inf);
+
+    uint8_t *iteration = newEnv(inf, env);
+    for (;;) {
+        if (node->as.loop.condition != NULL) {
+            inferExpr(inf, node->as.loop.condition, iteration);
+        }
+        if (node->as.loop.body != NULL) inferStmt(inf, node->as.loop.body, iteration);
+        joinEnv(inf, iteration, inf->continues);
+        if (node->as.loop.increment != NULL) {
+            inferExpr(inf, node->as.loop.increment, iteration);
+        }
+
+        // 'env' is the loop head, it joins the entry and the back edge
+        if (!joinEnv(inf, env, iteration)) break;
+        memcpy(iteration, env, inf->varCount);
+    }
+    freeEnv(inf, iteration);
+
+    // The loop exits after the condition is evaluated, or at a 'break'
+    if (node->as.loop.condition != NULL) {
+        inferExpr(inf, node->as.loop.condition, env);
+    }
+    joinEnv(inf, env, inf->breaks);
+
+    freeEnv(inf, inf->breaks);
+    freeEnv(inf, inf->continues);
+    inf->breaks = breaks;
+    inf->continues = continues;
+}
+
+/*
+ * Every arm starts from the environment after the subject.
+ * The end of an arm is a 'break', so the switch exits with
+ * the join of its breaks, and of the entry if no 'default'
+ * catches the values none of the cases match.
+*/
+static void
+inferSwitch(Inferrer *inf, Node *node, uint8_t *env)
+{
+    inferExpr(inf, node->as.switchStmt.subject, env);
+
+    uint8_t *breaks = inf->breaks;
+    inf->breaks = emptyEnv(inf);
+
+    bool hasDefault = false;
+    uint8_t *armEnv = newEnv(inf, env);
+    for (Node *arm = node->as.switchStmt.arms; arm != NULL; arm = arm->next) {
+        if (arm->as.arm.isDefault) hasDefault = true;
+
+        memcpy(armEnv, env, inf->varCount);
+        if (arm->as.arm.body != NULL) inferStmt(inf, arm->as.arm.body, armEnv);
+        joinEnv(inf, inf->breaks, armEnv);
+    }
+    freeEnv(inf, armEnv);
+
+    if (hasDefault) memset(env, 0, inf->varCount);
+    joinEnv(inf, env, inf->breaks);
+
+    freeEnv(inf, inf->breaks);
+    inf->breaks = breaks;
+}
+
+static void
+inferStmt(Inferrer *inf, Node *node, uint8_t *env)
+{
+    switch (node->type) {
+        case NODE_EXPRESSION:
+        case NODE_ECHO:     inferExpr(inf, node->as.expression, env); break;
+        case NODE_VAR: {
+            Node *init = node->as.var.init;
+            uint8_t types = init == NULL ? TYPE_NULL : inferExpr(inf, init, env);
+            env[node->as.var.var->index] = types & node->as.var.var->declared;
+        } break;
+        case NODE_BLOCK:    inferList(inf, node->as.block, env); break;
+        case NODE_IF: {
+            inferExpr(inf, node->as.branch.condition, env);
+
+            uint8_t *elseEnv = newEnv(inf, env);
+            if (node->as.branch.thenBranch != NULL) {
+                inferStmt(inf, node->as.branch.thenBranch, env);
+            }
+            if (node->as.branch.elseBranch != NULL) {
+                inferStmt(inf, node->as.branch.elseBranch, elseEnv);
+            }
+            joinEnv(inf, env, elseEnv);
+            freeEnv(inf, elseEnv);
+        } break;
+        case NODE_LOOP:     inferLoop(inf, node, env); break;
+        case NODE_SWITCH:   inferSwitch(inf, node, env); break;
+        case NODE_BREAK:    joinEnv(inf, inf->breaks, env); break;
+        case NODE_CONTINUE: joinEnv(inf, inf->continues, env); break;
+        default: break;
+    }
+}
+
+void
+inferTypes(Ast *ast)
+{
+    Inferrer inf;
+    inf.varCount = 0;
+    inf.breaks = NULL;
+    inf.continues = NULL;
+
+    for (Var *var = ast->vars; var != NULL; var = var->next) {
+        var->index = inf.varCount++;
+    }
+    if (inf.varCount == 0) inf.varCount = 1;
+
+    // Nothing is defined yet, reading a global here fails
+    uint8_t *env = ALLOCATE(uint8_t, inf.varCount);
+    memset(env, 0, inf.varCount);
+    inferList(&inf, ast->statements, env);
+    freeEnv(&inf, env);
+}
@@ -0,0 +1,36 @@
+#ifndef LAX_INFER_H
+#define LAX_INFER_H
+
+#include "ast.h"
+
+/*
+ * Flow-sensitive type inference. Every expression node
+ * gets the set of types it may evaluate to, so the code
+ * generator can emit unchecked opcodes where operands
+ * are proven to be numbers.
+*/
+void
+inferTypes(Ast *ast);
+
+/*
+ * The rules both front ends type annotated variables by:
+ * the TYPE_* bit of a literal, and the types 'left op right'
+ * may produce, given the types of its operands.
+*/
+uint8_t
+valueType(Value value);
+
+uint8_t
+binaryType(TokenType op, uint8_t left, uint8_t right);
+
+/*
+ * The type an annotation names, 'num', 'str' or 'bool',
+ * 0 for anything else. typeName() goes the other way.
+*/
+uint8_t
+namedType(Token *name);
+
+const char *
+typeName(uint8_t type);
+
+#endif // LAX_INFER_H
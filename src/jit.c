@@ -0,0 +1,1024 @@
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS isn't part of C99
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "infer.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+/*
+ * The native code follows the System V AMD64 ABI. While it
+ * runs, callee-saved registers hold the interpreter state:
+ * the top of the stack lives in TOP rather than in vm->stackTop,
+ * and is written back whenever control returns to C.
+*/
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define SLOTS       RBX     // vm->stack
+#define TOP         R12     // vm->stackTop
+#define VM_REG      R13
+#define ENTRIES     R14     // JitCode.entries
+#define CONSTANTS   R15     // vm->chunk->constants.values
+
+// Condition codes of Jcc and SETcc
+#define CC_E        0x4
+#define CC_NE       0x5
+#define CC_BE       0x6
+#define CC_A        0x7
+#define CC_NP       0xb
+#define CC_ALWAYS   -1
+
+// Scalar double opcodes, after an 0xf2 prefix
+#define SSE_LOAD    0x10
+#define SSE_STORE   0x11
+#define SSE_ADD     0x58
+#define SSE_MUL     0x59
+#define SSE_SUB     0x5c
+#define SSE_DIV     0x5e
+
+typedef enum {
+    JIT_EXIT,
+    JIT_RETURN,
+} JitStatus;
+
+typedef int (*NativeFn)(VM *vm, void *entry);
+
+/*
+ * Slow paths are C functions taking the top of the stack
+ * and returning it updated. Returning NULL leaves the
+ * instruction, stack untouched, to the interpreter.
+*/
+typedef Value *(*Helper)(VM *vm, Value *top, int operand);
+
+typedef enum {
+    FIXUP_BRANCH,       // To the instruction at 'target'
+    FIXUP_EXIT,         // Hands the instruction at 'target' to the interpreter
+    FIXUP_EPILOGUE,
+} FixupKind;
+
+typedef struct {
+    FixupKind kind;
+    int at;             // Offset of the rel32 to patch
+    int target;
+} Fixup;
+
+typedef struct {
+    Chunk *chunk;
+    uint8_t *code;
+    int count;
+    int capacity;
+    int *starts;        // Native offset of each instruction, -1 within one
+    Fixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    bool failed;
+} Assembler;
+
+/*
+ * A Value in memory at [base + disp].
+*/
+typedef struct {
+    int base;
+    int disp;
+} Operand;
+
+#define TYPE(op)    (op).base, (op).disp
+#define PAYLOAD(op) (op).base, (op).disp + (int)offsetof(Value, as)
+
+static Value *
+helperGetGlobal(VM *vm, Value *top, int constant)
+{
+    ObjString *name = AS_STRING(vm->chunk->constants.values[constant]);
+    if (!tableGet(&vm->globals, name, top)) return NULL;
+    return top + 1;
+}
+
+static Value *
+helperSetGlobal(VM *vm, Value *top, int constant)
+{
+    ObjString *name = AS_STRING(vm->chunk->constants.values[constant]);
+    Value value;
+    if (!tableGet(&vm->globals, name, &value)) return NULL;
+
+    tableSet(&vm->globals, name, top[-1]);
+    return top;
+}
+
+static Value *
+helperDefineGlobal(VM *vm, Value *top, int constant)
+{
+    ObjString *name = AS_STRING(vm->chunk->constants.values[constant]);
+    tableSet(&vm->globals, name, top[-1]);
+    return top - 1;
+}
+
+static Value *
+helperEqual(VM *vm, Value *top, int operand)
+{
+    top[-2] = BOOL_VAL(valuesEqual(top[-2], top[-1]));
+    return top - 1;
+}
+
+static Value *
+helperAdd(VM *vm, Value *top, int operand)
+{
+    // Numbers are added inline, anything else but strings fails
+    if (!IS_STRING(top[-2]) || !IS_STRING(top[-1])) return NULL;
+
+    top[-2] = OBJ_VAL(buildString(vm, top - 2, 2));
+    return top - 1;
+}
+
+static Value *
+helperInteger(VM *vm, Value *top, int instruction)
+{
+    if (!IS_NUMBER(top[-2]) || !IS_NUMBER(top[-1])) return NULL;
+
+    // The same conversions as BINARY_INT and POW in run()
+    int b = round((int)AS_NUMBER(top[-1]));
+    int a = round((int)AS_NUMBER(top[-2]));
+
+    double result;
+    switch (instruction) {
+        case OP_MODULUS:    result = a % b;     break;
+        case OP_POWER:      result = pow(a, b); break;
+        case OP_BAND:       result = a & b;     break;
+        case OP_BOR:        result = a | b;     break;
+        case OP_BXOR:       result = a ^ b;     break;
+        case OP_SHL:        result = a << b;    break;
+        default:            result = a >> b;    break;
+    }
+
+    top[-2] = NUMBER_VAL(result);
+    return top - 1;
+}
+
+static Value *
+helperBuildString(VM *vm, Value *top, int count)
+{
+    ObjString *string = buildString(vm, top - count, count);
+    top -= count;
+    *top = OBJ_VAL(string);
+    return top + 1;
+}
+
+static Value *
+helperEcho(VM *vm, Value *top, int operand)
+{
+    printValue(top[-1]);
+    printf("\n");
+    return top - 1;
+}
+
+/*
+ * Returns the offset the switch dispatch at 'offset'
+ * continues at, decoded as run() does.
+*/
+static int
+helperSwitch(VM *vm, Value *top, int offset)
+{
+    Chunk *chunk = vm->chunk;
+    uint8_t *ip = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+    Value subject = vm->stack[ip[1]];
+
+    if (ip[0] == OP_JUMP_LOOKUP) {
+        int target = findJump(&chunk->jumpTables[ip[2]], subject);
+        return target != -1 ? target : next;
+    }
+
+    int min = (int16_t)((ip[2] << 8) | ip[3]);
+    int span = ip[4] + 1;
+    if (!IS_NUMBER(subject)) return next;
+
+    double index = AS_NUMBER(subject) - min;
+    if (!(index >= 0 && index < span) || index != (int)index) return next;
+
+    uint8_t *jump = &ip[5 + 2 * (int)index];
+    return next - ((jump[0] << 8) | jump[1]);
+}
+
+static void
+emitByte(Assembler *as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+
+    as->code[as->count++] = byte;
+}
+
+static void
+emit32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void
+emit64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void
+patch32(Assembler *as, int at, int32_t value)
+{
+    uint32_t bits = (uint32_t)value;
+    for (int i = 0; i < 4; i++) as->code[at + i] = (bits >> (8 * i)) & 0xff;
+}
+
+/*
+ * REX prefix for a ModRM 'reg' and 'rm', left out when
+ * none of its bits are needed.
+*/
+static void
+emitRex(Assembler *as, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg & 8 ? 0x04 : 0) | (rm & 8 ? 0x01 : 0);
+    if (rex != 0x40) emitByte(as, rex);
+}
+
+/*
+ * ModRM for [base + disp32]. A base of RSP or R12
+ * can only be encoded with a SIB byte.
+*/
+static void
+emitAddress(Assembler *as, int reg, int base, int32_t disp)
+{
+    emitByte(as, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) emitByte(as, 0x24);
+    emit32(as, (uint32_t)disp);
+}
+
+static void
+emitMem(Assembler *as, bool wide, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    emitRex(as, wide, reg, base);
+    emitByte(as, opcode);
+    emitAddress(as, reg, base, disp);
+}
+
+static void
+emitMem0F(Assembler *as, bool wide, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    emitRex(as, wide, reg, base);
+    emitByte(as, 0x0f);
+    emitByte(as, opcode);
+    emitAddress(as, reg, base, disp);
+}
+
+/*
+ * SSE instruction on an xmm register and memory. The
+ * mandatory prefix comes before any REX prefix.
+*/
+static void
+emitSse(Assembler *as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp)
+{
+    emitByte(as, prefix);
+    emitMem0F(as, false, opcode, xmm, base, disp);
+}
+
+static void
+emitSseReg(Assembler *as, uint8_t prefix, uint8_t opcode, int dest, int src)
+{
+    emitByte(as, prefix);
+    emitByte(as, 0x0f);
+    emitByte(as, opcode);
+    emitByte(as, 0xc0 | dest << 3 | src);
+}
+
+static void
+emitMovReg(Assembler *as, int dest, int src)
+{
+    emitRex(as, true, src, dest);
+    emitByte(as, 0x89);
+    emitByte(as, 0xc0 | (src & 7) << 3 | (dest & 7));
+}
+
+static void
+emitMovImm32(Assembler *as, int reg, uint32_t value)
+{
+    emitRex(as, false, 0, reg);
+    emitByte(as, 0xb8 | (reg & 7));
+    emit32(as, value);
+}
+
+static void
+emitMovImm64(Assembler *as, int reg, uint64_t value)
+{
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0xb8 | (reg & 7));
+    emit64(as, value);
+}
+
+static void
+emitPush(Assembler *as, int reg)
+{
+    emitRex(as, false, 0, reg);
+    emitByte(as, 0x50 | (reg & 7));
+}
+
+static void
+emitPop(Assembler *as, int reg)
+{
+    emitRex(as, false, 0, reg);
+    emitByte(as, 0x58 | (reg & 7));
+}
+
+/*
+ * Emits a jump, conditional unless 'cc' is CC_ALWAYS, and
+ * returns the offset of its rel32 for patching.
+*/
+static int
+emitJump(Assembler *as, int cc)
+{
+    if (cc == CC_ALWAYS) {
+        emitByte(as, 0xe9);
+    } else {
+        emitByte(as, 0x0f);
+        emitByte(as, 0x80 | cc);
+    }
+    emit32(as, 0);
+
+    return as->count - 4;
+}
+
+static void
+patchJump(Assembler *as, int at)
+{
+    patch32(as, at, as->count - (at + 4));
+}
+
+static void
+addFixup(Assembler *as, FixupKind kind, int at, int target)
+{
+    if (as->fixupCapacity < as->fixupCount + 1) {
+        int oldCapacity = as->fixupCapacity;
+        as->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        as->fixups = GROW_ARRAY(Fixup, as->fixups, oldCapacity, as->fixupCapacity);
+    }
+
+    Fixup *fixup = &as->fixups[as->fixupCount++];
+    fixup->kind = kind;
+    fixup->at = at;
+    fixup->target = target;
+}
+
+static void
+emitBranch(Assembler *as, int cc, int target)
+{
+    addFixup(as, FIXUP_BRANCH, emitJump(as, cc), target);
+}
+
+static void
+emitExit(Assembler *as, int cc, int offset)
+{
+    addFixup(as, FIXUP_EXIT, emitJump(as, cc), offset);
+}
+
+static Operand
+slot(int index)
+{
+    Operand op = { SLOTS, index * (int)sizeof(Value) };
+    return op;
+}
+
+static Operand
+constant(int index)
+{
+    Operand op = { CONSTANTS, index * (int)sizeof(Value) };
+    return op;
+}
+
+static Operand
+rk(uint8_t operand)
+{
+    return operand & RK_CONSTANT ? constant(operand & ~RK_CONSTANT) : slot(operand);
+}
+
+/*
+ * top(-1) is the value on top of the stack, top(0)
+ * the free slot above it.
+*/
+static Operand
+top(int index)
+{
+    Operand op = { TOP, index * (int)sizeof(Value) };
+    return op;
+}
+
+static void
+adjustTop(Assembler *as, int values)
+{
+    emitMem(as, true, 0x8d, TOP, TOP, values * (int)sizeof(Value));  // lea
+}
+
+static void
+copyValue(Assembler *as, Operand dest, Operand src)
+{
+    emitSse(as, 0xf3, 0x6f, 0, TYPE(src));     // movdqu xmm0, src
+    emitSse(as, 0xf3, 0x7f, 0, TYPE(dest));    // movdqu dest, xmm0
+}
+
+static void
+setType(Assembler *as, Operand op, ValueType type)
+{
+    emitMem(as, false, 0xc7, 0, TYPE(op));
+    emit32(as, type);
+}
+
+static void
+setPayload(Assembler *as, Operand op, int32_t value)
+{
+    emitMem(as, true, 0xc7, 0, PAYLOAD(op));
+    emit32(as, (uint32_t)value);
+}
+
+static void
+compareType(Assembler *as, Operand op, ValueType type)
+{
+    emitMem(as, false, 0x83, 7, TYPE(op));
+    emitByte(as, type);
+}
+
+static bool
+isNumberConstant(Assembler *as, Operand op)
+{
+    return op.base == CONSTANTS &&
+           IS_NUMBER(as->chunk->constants.values[op.disp / (int)sizeof(Value)]);
+}
+
+/*
+ * Type guard, hands the instruction at 'offset' to the
+ * interpreter unless the value is a number.
+*/
+static void
+guardNumber(Assembler *as, Operand op, int offset)
+{
+    if (isNumberConstant(as, op)) return;
+
+    compareType(as, op, VAL_NUMBER);
+    emitExit(as, CC_NE, offset);
+}
+
+static void
+loadNumber(Assembler *as, int xmm, Operand op)
+{
+    emitSse(as, 0xf2, SSE_LOAD, xmm, PAYLOAD(op));
+}
+
+static void
+storeNumber(Assembler *as, Operand op, int xmm)
+{
+    emitSse(as, 0xf2, SSE_STORE, xmm, PAYLOAD(op));
+    setType(as, op, VAL_NUMBER);
+}
+
+static void
+loadOne(Assembler *as, int xmm)
+{
+    double one = 1;
+    uint64_t bits;
+    memcpy(&bits, &one, sizeof(bits));
+
+    emitMovImm64(as, RAX, bits);
+    emitByte(as, 0x66);         // movq xmm, rax
+    emitRex(as, true, xmm, RAX);
+    emitByte(as, 0x0f);
+    emitByte(as, 0x6e);
+    emitByte(as, 0xc0 | xmm << 3 | RAX);
+}
+
+/*
+ * ucomisd of two numbers. 'a > b' sets CC_A, which is false
+ * for NaN, so 'a < b' is tested as 'b > a'.
+*/
+static void
+compareNumbers(Assembler *as, Operand a, Operand b)
+{
+    loadNumber(as, 0, a);
+    emitSse(as, 0x66, 0x2e, 0, PAYLOAD(b));
+}
+
+static void
+storeCondition(Assembler *as, Operand op, int cc)
+{
+    // Neither mov changes the flags
+    setType(as, op, VAL_BOOL);
+    setPayload(as, op, 0);
+    emitMem0F(as, false, 0x90 | cc, 0, PAYLOAD(op));
+}
+
+/*
+ * Calls a C function with the VM, the top of the stack
+ * 'values' above TOP and an operand.
+*/
+static void
+emitCall(Assembler *as, uint64_t function, int values, int operand)
+{
+    emitMovReg(as, RDI, VM_REG);
+    emitMem(as, true, 0x8d, RSI, TOP, values * (int)sizeof(Value));
+    emitMovImm32(as, RDX, (uint32_t)operand);
+    emitMovImm64(as, RAX, function);
+    emitByte(as, 0xff);     // call rax
+    emitByte(as, 0xd0);
+}
+
+/*
+ * Calls a helper and takes the top it returns. If the helper
+ * can fail, a NULL exits at 'offset', otherwise it is -1.
+*/
+static void
+emitHelper(Assembler *as, Helper helper, int values, int operand, int offset)
+{
+    emitCall(as, (uint64_t)(uintptr_t)helper, values, operand);
+    if (offset != -1) {
+        emitByte(as, 0x48);     // test rax, rax
+        emitByte(as, 0x85);
+        emitByte(as, 0xc0);
+        emitExit(as, CC_E, offset);
+    }
+    emitMovReg(as, TOP, RAX);
+}
+
+/*
+ * Adds two numbers inline, calling helperAdd for anything
+ * else. The operands are copied above the stack first if
+ * they aren't already on top of it.
+*/
+static void
+emitAdd(Assembler *as, Operand a, Operand b, Operand dest, int push, int offset)
+{
+    int slow[2];
+    int slowCount = 0;
+    if (!isNumberConstant(as, a)) {
+        compareType(as, a, VAL_NUMBER);
+        slow[slowCount++] = emitJump(as, CC_NE);
+    }
+    if (!isNumberConstant(as, b)) {
+        compareType(as, b, VAL_NUMBER);
+        slow[slowCount++] = emitJump(as, CC_NE);
+    }
+
+    loadNumber(as, 0, a);
+    emitSse(as, 0xf2, SSE_ADD, 0, PAYLOAD(b));
+    storeNumber(as, dest, 0);
+    adjustTop(as, push);
+    int done = emitJump(as, CC_ALWAYS);
+
+    for (int i = 0; i < slowCount; i++) patchJump(as, slow[i]);
+    if (push > 0) {
+        copyValue(as, top(0), a);
+        copyValue(as, top(1), b);
+        emitHelper(as, helperAdd, 2, 0, offset);
+    } else {
+        emitHelper(as, helperAdd, 0, 0, offset);
+    }
+    patchJump(as, done);
+}
+
+/*
+ * Number arithmetic on the two values on top of the stack.
+*/
+static void
+emitArithmetic(Assembler *as, uint8_t opcode, bool guarded, int offset)
+{
+    if (guarded) {
+        guardNumber(as, top(-2), offset);
+        guardNumber(as, top(-1), offset);
+    }
+
+    loadNumber(as, 0, top(-2));
+    emitSse(as, 0xf2, opcode, 0, PAYLOAD(top(-1)));
+    emitSse(as, 0xf2, SSE_STORE, 0, PAYLOAD(top(-2)));
+    adjustTop(as, -1);
+}
+
+static void
+emitComparison(Assembler *as, bool less, bool guarded, int offset)
+{
+    if (guarded) {
+        guardNumber(as, top(-2), offset);
+        guardNumber(as, top(-1), offset);
+    }
+
+    if (less) {
+        compareNumbers(as, top(-1), top(-2));
+    } else {
+        compareNumbers(as, top(-2), top(-1));
+    }
+    storeCondition(as, top(-2), CC_A);
+    adjustTop(as, -1);
+}
+
+static void
+emitStep(Assembler *as, uint8_t opcode, bool guarded, int offset)
+{
+    if (guarded) guardNumber(as, top(-1), offset);
+
+    loadNumber(as, 0, top(-1));
+    loadOne(as, 1);
+    emitSseReg(as, 0xf2, opcode, 0, 1);
+    emitSse(as, 0xf2, SSE_STORE, 0, PAYLOAD(top(-1)));
+}
+
+/*
+ * Jumps to the returned rel32s if the value is falsey.
+ * Returns how many jumps it emitted into 'jumps'.
+*/
+static int
+emitFalsey(Assembler *as, Operand op, int *jumps)
+{
+    compareType(as, op, VAL_NULL);
+    jumps[0] = emitJump(as, CC_E);
+    compareType(as, op, VAL_BOOL);
+    int truthy = emitJump(as, CC_NE);
+
+    emitMem(as, false, 0x80, 7, PAYLOAD(op));   // cmp byte, 0
+    emitByte(as, 0);
+    jumps[1] = emitJump(as, CC_E);
+    patchJump(as, truthy);
+    return 2;
+}
+
+static void
+emitInstruction(Assembler *as, int offset)
+{
+    uint8_t *ip = &as->chunk->code[offset];
+
+    switch (ip[0]) {
+        case OP_CONSTANT: {
+            copyValue(as, top(0), constant(ip[1]));
+            adjustTop(as, 1);
+        } break;
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            setType(as, top(0), ip[0] == OP_NULL ? VAL_NULL : VAL_BOOL);
+            setPayload(as, top(0), ip[0] == OP_TRUE);
+            adjustTop(as, 1);
+        } break;
+        case OP_POP:        adjustTop(as, -1); break;
+        case OP_GET_LOCAL: {
+            copyValue(as, top(0), slot(ip[1]));
+            adjustTop(as, 1);
+        } break;
+        case OP_SET_LOCAL:  copyValue(as, slot(ip[1]), top(-1)); break;
+        case OP_SET_LOCAL_POP: {
+            copyValue(as, slot(ip[1]), top(-1));
+            adjustTop(as, -1);
+        } break;
+        case OP_GET_GLOBAL:     emitHelper(as, helperGetGlobal, 0, ip[1], offset); break;
+        case OP_SET_GLOBAL:     emitHelper(as, helperSetGlobal, 0, ip[1], offset); break;
+        case OP_DEFINE_GLOBAL:  emitHelper(as, helperDefineGlobal, 0, ip[1], -1); break;
+        case OP_EQUAL: {
+            compareType(as, top(-2), VAL_NUMBER);
+            int slowLeft = emitJump(as, CC_NE);
+            compareType(as, top(-1), VAL_NUMBER);
+            int slowRight = emitJump(as, CC_NE);
+
+            // Equal is ZF without PF, which marks NaN
+            compareNumbers(as, top(-2), top(-1));
+            emitByte(as, 0x0f);     // sete al
+            emitByte(as, 0x90 | CC_E);
+            emitByte(as, 0xc0);
+            emitByte(as, 0x0f);     // setnp cl
+            emitByte(as, 0x90 | CC_NP);
+            emitByte(as, 0xc1);
+            emitByte(as, 0x20);     // and al, cl
+            emitByte(as, 0xc8);
+            setType(as, top(-2), VAL_BOOL);
+            setPayload(as, top(-2), 0);
+            emitMem(as, false, 0x88, RAX, PAYLOAD(top(-2)));
+            adjustTop(as, -1);
+            int done = emitJump(as, CC_ALWAYS);
+
+            patchJump(as, slowLeft);
+            patchJump(as, slowRight);
+            emitHelper(as, helperEqual, 0, 0, -1);
+            patchJump(as, done);
+        } break;
+        case OP_GREATER:    emitComparison(as, false, true, offset); break;
+        case OP_LESS:       emitComparison(as, true, true, offset); break;
+        case OP_ADD:        emitAdd(as, top(-2), top(-1), top(-2), -1, offset); break;
+        case OP_SUBTRACT:   emitArithmetic(as, SSE_SUB, true, offset); break;
+        case OP_MULTIPLY:   emitArithmetic(as, SSE_MUL, true, offset); break;
+        case OP_DIVIDE:     emitArithmetic(as, SSE_DIV, true, offset); break;
+        case OP_MODULUS:
+        case OP_POWER:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_SHL:
+        case OP_SHR:        emitHelper(as, helperInteger, 0, ip[0], offset); break;
+        case OP_NOT: {
+            int falsey[2];
+            emitMovImm32(as, RAX, 0);
+            int count = emitFalsey(as, top(-1), falsey);
+            int done = emitJump(as, CC_ALWAYS);
+
+            for (int i = 0; i < count; i++) patchJump(as, falsey[i]);
+            emitMovImm32(as, RAX, 1);
+            patchJump(as, done);
+
+            setType(as, top(-1), VAL_BOOL);
+            emitMem(as, true, 0x89, RAX, PAYLOAD(top(-1)));
+        } break;
+        case OP_NEGATE:
+        case OP_NEGATE_NUM: {
+            if (ip[0] == OP_NEGATE) guardNumber(as, top(-1), offset);
+            emitMem0F(as, true, 0xba, 7, PAYLOAD(top(-1)));    // btc qword, 63
+            emitByte(as, 63);
+        } break;
+        case OP_INCREMENT:      emitStep(as, SSE_ADD, true, offset); break;
+        case OP_DECREMENT:      emitStep(as, SSE_SUB, true, offset); break;
+        case OP_INCREMENT_NUM:  emitStep(as, SSE_ADD, false, offset); break;
+        case OP_DECREMENT_NUM:  emitStep(as, SSE_SUB, false, offset); break;
+        case OP_BUILD_STRING:   emitHelper(as, helperBuildString, 0, ip[1], -1); break;
+        case OP_CHECK_TYPE: {
+            // An annotation names one type, the interpreter reports a mismatch
+            ValueType type = ip[1] == TYPE_NUMBER ? VAL_NUMBER :
+                             ip[1] == TYPE_BOOL ? VAL_BOOL : VAL_OBJ;
+            compareType(as, top(-1), type);
+            emitExit(as, CC_NE, offset);
+        } break;
+        case OP_GREATER_NUM:    emitComparison(as, false, false, offset); break;
+        case OP_LESS_NUM:       emitComparison(as, true, false, offset); break;
+        case OP_ADD_NUM:        emitArithmetic(as, SSE_ADD, false, offset); break;
+        case OP_SUBTRACT_NUM:   emitArithmetic(as, SSE_SUB, false, offset); break;
+        case OP_MULTIPLY_NUM:   emitArithmetic(as, SSE_MUL, false, offset); break;
+        case OP_DIVIDE_NUM:     emitArithmetic(as, SSE_DIV, false, offset); break;
+        case OP_MOVE:           copyValue(as, slot(ip[1]), rk(ip[2])); break;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK: {
+            uint8_t opcode = ip[0] == OP_ADD_RK ? SSE_ADD :
+                             ip[0] == OP_SUBTRACT_RK ? SSE_SUB :
+                             ip[0] == OP_MULTIPLY_RK ? SSE_MUL : SSE_DIV;
+
+            loadNumber(as, 0, rk(ip[2]));
+            emitSse(as, 0xf2, opcode, 0, PAYLOAD(rk(ip[3])));
+            storeNumber(as, slot(ip[1]), 0);
+        } break;
+        case OP_JUMP_LESS:
+        case OP_JUMP_NLESS: {
+            int target = offset + 5 + ((ip[3] << 8) | ip[4]);
+            compareNumbers(as, rk(ip[2]), rk(ip[1]));
+            emitBranch(as, ip[0] == OP_JUMP_LESS ? CC_A : CC_BE, target);
+        } break;
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT: {
+            Operand b = ip[0] == OP_ADD_LOCAL_LOCAL ? slot(ip[2]) : constant(ip[2]);
+            emitAdd(as, slot(ip[1]), b, top(0), 1, offset);
+        } break;
+        case OP_LESS_LOCAL_CONSTANT: {
+            guardNumber(as, slot(ip[1]), offset);
+            guardNumber(as, constant(ip[2]), offset);
+            compareNumbers(as, constant(ip[2]), slot(ip[1]));
+            storeCondition(as, top(0), CC_A);
+            adjustTop(as, 1);
+        } break;
+        case OP_FOR_RANGE: {
+            Operand counter = slot(ip[1]);
+            Operand limit = rk(ip[2]);
+            int target = offset + 5 - ((ip[3] << 8) | ip[4]);
+
+            // Both guards come first, so an exit happens before the increment
+            guardNumber(as, counter, offset);
+            guardNumber(as, limit, offset);
+
+            loadNumber(as, 0, counter);
+            loadOne(as, 1);
+            emitSseReg(as, 0xf2, SSE_ADD, 0, 1);
+            emitSse(as, 0xf2, SSE_STORE, 0, PAYLOAD(counter));
+
+            // The limit is read after the store, it may be the counter
+            loadNumber(as, 1, limit);
+            emitSseReg(as, 0x66, 0x2e, 1, 0);
+            emitBranch(as, CC_A, target);
+        } break;
+        case OP_JUMP_TABLE:
+        case OP_JUMP_LOOKUP: {
+            emitCall(as, (uint64_t)(uintptr_t)helperSwitch, 0, offset);
+            emitByte(as, 0x48);     // movsxd rax, eax
+            emitByte(as, 0x63);
+            emitByte(as, 0xc0);
+            emitByte(as, 0x49);     // mov rax, [ENTRIES + rax * 8]
+            emitByte(as, 0x8b);
+            emitByte(as, 0x04);
+            emitByte(as, 0xc6);
+            emitByte(as, 0xff);     // jmp rax
+            emitByte(as, 0xe0);
+        } break;
+        case OP_ECHO:       emitHelper(as, helperEcho, 0, 0, -1); break;
+        case OP_JUMP: {
+            emitBranch(as, CC_ALWAYS, offset + 3 + ((ip[1] << 8) | ip[2]));
+        } break;
+        case OP_JUMP_FALSE: {
+            int target = offset + 3 + ((ip[1] << 8) | ip[2]);
+            int falsey[2];
+            int count = emitFalsey(as, top(-1), falsey);
+            for (int i = 0; i < count; i++) addFixup(as, FIXUP_BRANCH, falsey[i], target);
+        } break;
+        case OP_LOOP: {
+            emitBranch(as, CC_ALWAYS, offset + 3 - ((ip[1] << 8) | ip[2]));
+        } break;
+        case OP_RETURN: {
+            emitMovImm32(as, RAX, JIT_RETURN);
+            addFixup(as, FIXUP_EPILOGUE, emitJump(as, CC_ALWAYS), 0);
+        } break;
+        default: as->failed = true; break;
+    }
+}
+
+static void
+emitPrologue(Assembler *as, void **entries)
+{
+    emitPush(as, RBP);
+    emitMovReg(as, RBP, RSP);
+    emitPush(as, RBX);
+    emitPush(as, R12);
+    emitPush(as, R13);
+    emitPush(as, R14);
+    emitPush(as, R15);
+    emitByte(as, 0x48);     // sub rsp, 8 to realign the stack for calls
+    emitByte(as, 0x83);
+    emitByte(as, 0xec);
+    emitByte(as, 0x08);
+
+    emitMovReg(as, VM_REG, RDI);
+    emitMem(as, true, 0x8d, SLOTS, RDI, offsetof(VM, stack));
+    emitMem(as, true, 0x8b, TOP, RDI, offsetof(VM, stackTop));
+    emitMem(as, true, 0x8b, RAX, RDI, offsetof(VM, chunk));
+    emitMem(as, true, 0x8b, CONSTANTS, RAX, offsetof(Chunk, constants) + offsetof(ValueArray, values));
+    emitMovImm64(as, ENTRIES, (uint64_t)(uintptr_t)entries);
+
+    emitByte(as, 0xff);     // jmp rsi, the entry point
+    emitByte(as, 0xe6);
+}
+
+/*
+ * Emits the exit path, which takes the bytecode offset to
+ * resume at in ESI, followed by the epilogue. Returns the
+ * offset of the epilogue.
+*/
+static int
+emitEpilogue(Assembler *as, int *exit)
+{
+    *exit = as->count;
+    emitMem(as, true, 0x8b, RAX, VM_REG, offsetof(VM, chunk));
+    emitMem(as, true, 0x8b, RAX, RAX, offsetof(Chunk, code));
+    emitByte(as, 0x48);     // add rax, rsi
+    emitByte(as, 0x01);
+    emitByte(as, 0xf0);
+    emitMem(as, true, 0x89, RAX, VM_REG, offsetof(VM, ip));
+    emitMovImm32(as, RAX, JIT_EXIT);
+
+    int epilogue = as->count;
+    emitMem(as, true, 0x89, TOP, VM_REG, offsetof(VM, stackTop));
+    emitByte(as, 0x48);     // add rsp, 8
+    emitByte(as, 0x83);
+    emitByte(as, 0xc4);
+    emitByte(as, 0x08);
+    emitPop(as, R15);
+    emitPop(as, R14);
+    emitPop(as, R13);
+    emitPop(as, R12);
+    emitPop(as, RBX);
+    emitPop(as, RBP);
+    emitByte(as, 0xc3);     // ret
+
+    return epilogue;
+}
+
+static void
+freeAssembler(Assembler *as, int count)
+{
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    FREE_ARRAY(int, as->starts, count + 1);
+    FREE_ARRAY(Fixup, as->fixups, as->fixupCapacity);
+}
+
+bool
+jitCompile(Chunk *chunk, JitCode *jit)
+{
+    // The templates copy a Value as 16 bytes and test a 32-bit tag
+    if (sizeof(Value) != 16 || sizeof(ValueType) != 4) return false;
+
+    Assembler as;
+    as.chunk = chunk;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.starts = ALLOCATE(int, chunk->count + 1);
+    as.fixups = NULL;
+    as.fixupCount = 0;
+    as.fixupCapacity = 0;
+    as.failed = false;
+
+    jit->entryCount = chunk->count + 1;
+    jit->entries = ALLOCATE(void *, jit->entryCount);
+    for (int i = 0; i <= chunk->count; i++) as.starts[i] = -1;
+
+    emitPrologue(&as, jit->entries);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        as.starts[offset] = as.count;
+        emitInstruction(&as, offset);
+    }
+
+    int exit;
+    int epilogue = emitEpilogue(&as, &exit);
+
+    // Exit stubs pass the instruction to resume at
+    int fixupCount = as.fixupCount;
+    for (int i = 0; i < fixupCount && !as.failed; i++) {
+        Fixup *fixup = &as.fixups[i];
+        int destination;
+
+        switch (fixup->kind) {
+            case FIXUP_BRANCH:      destination = as.starts[fixup->target]; break;
+            case FIXUP_EPILOGUE:    destination = epilogue; break;
+            default: {
+                destination = as.count;
+                emitMovImm32(&as, RSI, (uint32_t)fixup->target);
+                int jump = emitJump(&as, CC_ALWAYS);
+                patch32(&as, jump, exit - as.count);
+            } break;
+        }
+
+        // A branch into the middle of an instruction can't be translated
+        if (destination == -1) as.failed = true;
+        patch32(&as, fixup->at, destination - (fixup->at + 4));
+    }
+
+    jit->size = (size_t)as.count;
+    jit->code = as.failed ? MAP_FAILED :
+        mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (jit->code == MAP_FAILED) {
+        freeAssembler(&as, chunk->count);
+        FREE_ARRAY(void *, jit->entries, jit->entryCount);
+        return false;
+    }
+
+    // Writable and executable are never both set
+    memcpy(jit->code, as.code, jit->size);
+    mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC);
+
+    for (int i = 0; i <= chunk->count; i++) {
+        jit->entries[i] = as.starts[i] == -1 ? NULL : jit->code + as.starts[i];
+    }
+
+    freeAssembler(&as, chunk->count);
+    return true;
+}
+
+bool
+jitRun(VM *vm, JitCode *jit)
+{
+    NativeFn native = (NativeFn)(uintptr_t)jit->code;
+    return native(vm, jit->entries[vm->ip - vm->chunk->code]) == JIT_RETURN;
+}
+
+void
+freeJit(JitCode *jit)
+{
+    munmap(jit->code, jit->size);
+    FREE_ARRAY(void *, jit->entries, jit->entryCount);
+}
+
+#else
+
+/*
+ * No code generator for this target, every
+ * program runs in the interpreter.
+*/
+bool
+jitCompile(Chunk *chunk, JitCode *jit)
+{
+    return false;
+}
+
+bool
+jitRun(VM *vm, JitCode *jit)
+{
+    return false;
+}
+
+void
+freeJit(JitCode *jit)
+{
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef LAX_JIT_H
+#define LAX_JIT_H
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Baseline x86-64 code for a whole Chunk, made by pasting a
+ * machine code template per instruction. Values stay in the
+ * VM's stack exactly as the interpreter keeps them, so native
+ * code can hand over to run() at any instruction boundary.
+*/
+typedef struct {
+    uint8_t *code;      // Executable mapping
+    size_t size;
+    void **entries;     // Native address of each instruction, by bytecode offset
+    int entryCount;
+} JitCode;
+
+/*
+ * Translates the chunk. Returns false, leaving it to the
+ * interpreter, on other architectures or if the code can't
+ * be mapped executable.
+*/
+bool
+jitCompile(Chunk *chunk, JitCode *jit);
+
+/*
+ * Runs the native code from vm->ip. Returns true once the
+ * program returns. A failed type guard or a failing operation
+ * returns false with vm->ip and vm->stackTop at the start of
+ * that instruction, for the interpreter to carry on from there.
+*/
+bool
+jitRun(VM *vm, JitCode *jit);
+
+void
+freeJit(JitCode *jit);
+
+#endif // LAX_JIT_H
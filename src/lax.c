@@ -1,7 +1,10 @@
+#include "aot.h"
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "laxc.h"
 #include "read.h"
+#include "serve.h"
 #include "vm.h"
 
 // Very simple REPL for interpreting code.
@@ -27,31 +30,270 @@ repl(VM *vm)
     }
 }
 
+/*
+ * Runs a source file, or a .laxc written by '--compile-only'.
+ * Sources are compiled through the cache unless 'cache' is off.
+*/
 static void
-runFile(VM *vm, const char *path)
+runFile(VM *vm, const char *path, bool cache)
 {
-    char *src = readFile(path);
-    InterpretResult result = interpret(vm, src);
-    free(src);
+    Chunk chunk;
+    initChunk(&chunk);
+
+    bool compiled;
+    if (isLaxc(path)) {
+        compiled = loadLaxc(vm, path, &chunk);
+        if (!compiled) laxlog(ERROR, "'%s' is damaged or from another build of Lax.", path);
+    } else {
+        char *src = readFile(path);
+        compiled = cache ? compileCached(vm, src, &chunk) : compileSource(vm, src, &chunk);
+        free(src);
+    }
+
+    InterpretResult result = compiled ? runChunk(vm, &chunk) : INTERPRET_COMPILE_ERROR;
+    freeChunk(&chunk);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+/*
+ * 'path' less its extension, with 'extension' added. When
+ * there is no extension to drop, 'fallback' is added instead
+ * so the result can't be 'path' itself.
+*/
+static char *
+replaceExtension(const char *path, const char *extension, const char *fallback)
+{
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    const char *dot = strrchr(base, '.');
+    bool dropped = dot != NULL && dot != base;
+    size_t length = dropped ? (size_t)(dot - path) : strlen(path);
+    const char *suffix = dropped ? extension : fallback;
+
+    char *name = (char *)malloc(length + strlen(suffix) + 1);
+    if (name == NULL) exit(1);
+    memcpy(name, path, length);
+    strcpy(name + length, suffix);
+    return name;
+}
+
+/*
+ * '--compile-only': writes the bytecode of 'path' to 'output',
+ * by default the source's name with a .laxc extension.
+*/
+static int
+compileFile(VM *vm, const char *path, const char *output)
+{
+    if (isLaxc(path)) {
+        laxlog(ERROR, "'%s' is already compiled.", path);
+        return 64;
+    }
+
+    char *name = output == NULL ? replaceExtension(path, ".laxc", ".laxc") : NULL;
+    if (output == NULL) output = name;
+
+    Chunk chunk;
+    initChunk(&chunk);
+    char *src = readFile(path);
+
+    int status = 0;
+    if (!compileSource(vm, src, &chunk)) {
+        status = 65;
+    } else if (!writeLaxc(&chunk, src, vm->optimize, output)) {
+        laxlog(ERROR, "Could not write '%s'.", output);
+        status = 74;
+    }
+
+    freeChunk(&chunk);
+    free(src);
+    free(name);
+    return status;
+}
+
+static void
+usage(const char *name)
+{
+    laxlog(INFO, "Usage: %s [-O] [--jit] [--no-cache] <source | program.laxc>", name);
+    laxlog(INFO, "       %s --compile-only [-O] <source> [-o <output>]", name);
+    laxlog(INFO, "       %s build [-O] [--emit-c] <source> [-o <output>]", name);
+    laxlog(INFO, "       %s serve --socket <path> [-O] [--jit] <source>...", name);
+    laxlog(INFO, "       %s --socket <path> <source>", name);
+    laxlog(INFO, "  -O             Optimize the source before running it");
+    laxlog(INFO, "  --jit          Compile the bytecode to native code before running it");
+    laxlog(INFO, "  --no-cache     Compile the source even if the bytecode cache has it");
+    laxlog(INFO, "  --compile-only Write the bytecode to <output>, a .laxc, instead of running it");
+    laxlog(INFO, "  build          Compile the source to a standalone executable through C");
+    laxlog(INFO, "  --emit-c       Write the C to <output> instead of building it");
+    laxlog(INFO, "  serve          Compile the sources once, then run them on request from <path>");
+    laxlog(INFO, "  --socket       Have the server on <path> run the source instead");
+}
+
+/*
+ * 'lax build': the executable is named after the source,
+ * less its extension, unless '-o' says otherwise.
+*/
+static int
+buildFile(VM *vm, int argc, char **argv)
+{
+    const char *path = NULL;
+    const char *output = NULL;
+    bool emitOnly = false;
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-O")) {
+            vm->optimize = true;
+        } else if (!strcmp(argv[i], "--emit-c")) {
+            emitOnly = true;
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            exit(64);
+        }
+    }
+
+    if (path == NULL) {
+        usage(argv[0]);
+        exit(64);
+    }
+
+    char *name = NULL;
+    if (output == NULL) {
+        name = replaceExtension(path, "", ".out");
+        output = name;
+    }
+
+    char *src = readFile(path);
+    BuildResult result = buildProgram(vm, src, path, output, emitOnly);
+    free(src);
+    free(name);
+
+    if (result == BUILD_COMPILE_ERROR) return 65;
+    if (result == BUILD_TOOLCHAIN_ERROR) return 70;
+    return 0;
+}
+
+/*
+ * 'lax serve': every source is compiled before the first
+ * request, so a request only costs a fork.
+*/
+static int
+serveFiles(VM *vm, int argc, char **argv)
+{
+    const char *socketPath = NULL;
+    char **paths = (char **)malloc(sizeof(char *) * argc);
+    if (paths == NULL) exit(1);
+    int count = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-O")) {
+            vm->optimize = true;
+        } else if (!strcmp(argv[i], "--jit")) {
+            vm->jit = true;
+        } else if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else {
+            paths[count++] = argv[i];
+        }
+    }
+
+    if (socketPath == NULL || count == 0) {
+        usage(argv[0]);
+        free(paths);
+        exit(64);
+    }
+
+    int status = serveScripts(vm, socketPath, paths, count);
+    free(paths);
+    return status;
+}
+
 /* Start her up! */
 int
 main(int argc, char **argv)
 {
     VM *vm = initVM();
+    if (argc > 1 && !strcmp(argv[1], "build")) {
+        int status = buildFile(vm, argc, argv);
+        freeVM(vm);
+        return status;
+    }
 
-    if (argc == 1) {
+    if (argc > 1 && !strcmp(argv[1], "serve")) {
+        int status = serveFiles(vm, argc, argv);
+        freeVM(vm);
+        return status;
+    }
+
+    const char *path = NULL;
+    const char *output = NULL;
+    const char *socketPath = NULL;
+    bool optimize = false;
+    bool jit = false;
+    bool cache = true;
+    bool compileOnly = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-O")) {
+            optimize = true;
+        } else if (!strcmp(argv[i], "--jit")) {
+            jit = true;
+        } else if (!strcmp(argv[i], "--no-cache")) {
+            cache = false;
+        } else if (!strcmp(argv[i], "--compile-only")) {
+            compileOnly = true;
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            laxlog(ERROR, "Lax currently can only run 1 source file.");
+            exit(64);
+        }
+    }
+
+    if (output != NULL && !compileOnly) {
+        usage(argv[0]);
+        exit(64);
+    }
+
+    if (socketPath != NULL) {
+        // The server compiled the source with its own flags
+        if (path == NULL || compileOnly || optimize || jit) {
+            usage(argv[0]);
+            exit(64);
+        }
+
+        freeVM(vm);
+        return runServed(socketPath, path);
+    }
+
+    if (compileOnly) {
+        if (path == NULL) {
+            usage(argv[0]);
+            exit(64);
+        }
+
+        vm->optimize = optimize;
+        int status = compileFile(vm, path, output);
+        freeVM(vm);
+        return status;
+    }
+
+    if (path == NULL) {
+        // The REPL keeps the fast single-pass compiler
         repl(vm);
-    } else if (argc == 2) {
-        runFile(vm, argv[1]);
     } else {
-        laxlog(INFO, "Usage: %s <source>", argv[0]);
-        laxlog(ERROR, "Lax currently can only run 1 source file.");
-        exit(64);
+        vm->optimize = optimize;
+        vm->jit = jit;
+        runFile(vm, path, cache);
     }
 
     freeVM(vm);
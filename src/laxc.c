@@ -0,0 +1,554 @@
+#define _DEFAULT_SOURCE     // mmap() and friends aren't part of C99
+
+#include <stdio.h>
+#include <string.h>
+
+#include "laxc.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LAXC_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define LAXC_MAGIC      "LAXC"
+#define HEADER_SIZE     36
+#define FLAG_OPTIMIZED  0x01
+
+// Set by the Makefile from the sources; 0 is a build it can't tell apart
+#ifndef LAXC_BUILD_ID
+#define LAXC_BUILD_ID   UINT64_C(0)
+#endif
+
+// Constant tags, the Value tags with strings split off objects
+enum { TAG_BOOL, TAG_NULL, TAG_NUMBER, TAG_STRING };
+
+typedef struct {
+    uint8_t *bytes;
+    int count;
+    int capacity;
+} Buffer;
+
+typedef struct {
+    const uint8_t *bytes;
+    size_t count;
+    size_t offset;
+    bool failed;
+} Reader;
+
+/*
+ * 64-bit FNV-1a, over the source for the cache key and
+ * over the body of a file to catch it being damaged.
+*/
+static uint64_t
+hashBytes(uint64_t hash, const uint8_t *bytes, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        hash ^= bytes[i];
+        hash *= UINT64_C(1099511628211);
+    }
+
+    return hash;
+}
+
+static uint64_t
+sourceKey(const char *src, bool optimized)
+{
+    uint8_t flags = optimized ? FLAG_OPTIMIZED : 0;
+    uint64_t build = LAXC_BUILD_ID;
+    uint64_t hash = hashBytes(UINT64_C(14695981039346656037), (const uint8_t *)src, strlen(src));
+    hash = hashBytes(hash, (const uint8_t *)&build, sizeof(build));
+    return hashBytes(hash, &flags, 1);
+}
+
+static void
+writeBytes(Buffer *buf, const void *bytes, int count)
+{
+    if (count == 0) return;
+
+    if (buf->capacity < buf->count + count) {
+        int oldCap = buf->capacity;
+        while (buf->capacity < buf->count + count) buf->capacity = GROW_CAPACITY(buf->capacity);
+        buf->bytes = GROW_ARRAY(uint8_t, buf->bytes, oldCap, buf->capacity);
+    }
+
+    memcpy(buf->bytes + buf->count, bytes, count);
+    buf->count += count;
+}
+
+static void
+writeByte(Buffer *buf, uint8_t byte)
+{
+    writeBytes(buf, &byte, 1);
+}
+
+static void
+writeU32(Buffer *buf, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+    writeBytes(buf, bytes, 4);
+}
+
+static void
+writeU64(Buffer *buf, uint64_t value)
+{
+    writeU32(buf, (uint32_t)value);
+    writeU32(buf, (uint32_t)(value >> 32));
+}
+
+static void
+writeNumber(Buffer *buf, double number)
+{
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeU64(buf, bits);
+}
+
+static void
+writeString(Buffer *buf, ObjString *string)
+{
+    writeU32(buf, string->length);
+    writeBytes(buf, string->chars, string->length);
+}
+
+static void
+writeConstant(Buffer *buf, Value value)
+{
+    switch (value.type) {
+        case VAL_BOOL: {
+            writeByte(buf, TAG_BOOL);
+            writeByte(buf, AS_BOOL(value));
+        } break;
+        case VAL_NULL:      writeByte(buf, TAG_NULL); break;
+        case VAL_NUMBER: {
+            writeByte(buf, TAG_NUMBER);
+            writeNumber(buf, AS_NUMBER(value));
+        } break;
+        case VAL_OBJ: {
+            writeByte(buf, TAG_STRING);
+            writeString(buf, AS_STRING(value));
+        } break;
+    }
+}
+
+static void
+writeJumpTable(Buffer *buf, JumpTable *table)
+{
+    writeU32(buf, (uint32_t)table->trueTarget);
+    writeU32(buf, (uint32_t)table->falseTarget);
+    writeU32(buf, (uint32_t)table->nullTarget);
+
+    writeU32(buf, table->numberCount);
+    for (int i = 0; i < table->numberCount; i++) {
+        writeNumber(buf, table->numbers[i]);
+        writeU32(buf, table->numberTargets[i]);
+    }
+
+    writeU32(buf, table->strings.count);
+    for (int i = 0; i < table->strings.capacity; i++) {
+        Entry *entry = &table->strings.entries[i];
+        if (entry->key == NULL) continue;
+
+        writeString(buf, entry->key);
+        writeU32(buf, (uint32_t)AS_NUMBER(entry->value));
+    }
+}
+
+/*
+ * The line table is stored as runs of bytes on one line,
+ * most of a chunk's lines repeat the one before.
+*/
+static void
+writeBody(Buffer *buf, Chunk *chunk)
+{
+    writeU32(buf, chunk->count);
+    writeBytes(buf, chunk->code, chunk->count);
+
+    int runs = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) runs++;
+    }
+
+    writeU32(buf, runs);
+    for (int start = 0; start < chunk->count;) {
+        int end = start;
+        while (end < chunk->count && chunk->lines[end] == chunk->lines[start]) end++;
+        writeU32(buf, chunk->lines[start]);
+        writeU32(buf, end - start);
+        start = end;
+    }
+
+    writeU32(buf, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeConstant(buf, chunk->constants.values[i]);
+    }
+
+    writeU32(buf, chunk->jumpTableCount);
+    for (int i = 0; i < chunk->jumpTableCount; i++) {
+        writeJumpTable(buf, &chunk->jumpTables[i]);
+    }
+}
+
+/*
+ * Writes through a temporary file renamed into place, so
+ * a process reading the file never sees half of it.
+*/
+static bool
+writeFile(const char *path, Buffer *header, Buffer *body)
+{
+    size_t length = strlen(path);
+    char *temp = ALLOCATE(char, length + 32);
+#ifdef LAXC_POSIX
+    snprintf(temp, length + 32, "%s.%ld.tmp", path, (long)getpid());
+#else
+    snprintf(temp, length + 32, "%s.tmp", path);
+#endif
+
+    FILE *file = fopen(temp, "wb");
+    bool written = file != NULL &&
+                   fwrite(header->bytes, 1, header->count, file) == (size_t)header->count &&
+                   fwrite(body->bytes, 1, body->count, file) == (size_t)body->count;
+    if (file != NULL && fclose(file) != 0) written = false;
+
+    if (written) {
+        remove(path);   // Only POSIX rename() replaces an existing file
+        written = rename(temp, path) == 0;
+    }
+    if (!written) remove(temp);
+
+    FREE_ARRAY(char, temp, length + 32);
+    return written;
+}
+
+static bool
+writeKeyed(Chunk *chunk, uint64_t key, bool optimized, const char *path)
+{
+    Buffer body = {NULL, 0, 0};
+    writeBody(&body, chunk);
+
+    Buffer header = {NULL, 0, 0};
+    writeBytes(&header, LAXC_MAGIC, 4);
+    writeByte(&header, LAXC_VERSION & 0xff);
+    writeByte(&header, LAXC_VERSION >> 8);
+    writeByte(&header, OP_RETURN + 1);  // Catches the opcodes changing without a version bump
+    writeByte(&header, optimized ? FLAG_OPTIMIZED : 0);
+    writeU64(&header, LAXC_BUILD_ID);
+    writeU64(&header, key);
+    writeU64(&header, hashBytes(UINT64_C(14695981039346656037), body.bytes, body.count));
+    writeU32(&header, body.count);
+
+    bool written = writeFile(path, &header, &body);
+    FREE_ARRAY(uint8_t, header.bytes, header.capacity);
+    FREE_ARRAY(uint8_t, body.bytes, body.capacity);
+    return written;
+}
+
+bool
+writeLaxc(Chunk *chunk, const char *src, bool optimized, const char *path)
+{
+    return writeKeyed(chunk, sourceKey(src, optimized), optimized, path);
+}
+
+static const uint8_t *
+readBytes(Reader *reader, size_t count)
+{
+    if (reader->failed || reader->count - reader->offset < count) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->bytes + reader->offset;
+    reader->offset += count;
+    return bytes;
+}
+
+static uint8_t
+readByte(Reader *reader)
+{
+    const uint8_t *byte = readBytes(reader, 1);
+    return byte != NULL ? *byte : 0;
+}
+
+static uint32_t
+readU32(Reader *reader)
+{
+    const uint8_t *bytes = readBytes(reader, 4);
+    if (bytes == NULL) return 0;
+
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint64_t
+readU64(Reader *reader)
+{
+    uint64_t low = readU32(reader);
+    return low | (uint64_t)readU32(reader) << 32;
+}
+
+static double
+readNumber(Reader *reader)
+{
+    uint64_t bits = readU64(reader);
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    return number;
+}
+
+/*
+ * A count of things each at least 'size' bytes long, which
+ * can't be more than the rest of the file holds. Keeps a
+ * damaged count from asking for a huge allocation.
+*/
+static int
+readCount(Reader *reader, size_t size)
+{
+    uint32_t count = readU32(reader);
+    if (count > INT32_MAX || (reader->count - reader->offset) / size < count) {
+        reader->failed = true;
+        return 0;
+    }
+
+    return (int)count;
+}
+
+static ObjString *
+readString(VM *vm, Reader *reader)
+{
+    int length = readCount(reader, 1);
+    const uint8_t *chars = readBytes(reader, length);
+    return chars != NULL ? copyString(vm, (const char *)chars, length) : NULL;
+}
+
+static Value
+readConstant(VM *vm, Reader *reader)
+{
+    switch (readByte(reader)) {
+        case TAG_BOOL:      return BOOL_VAL(readByte(reader) != 0);
+        case TAG_NULL:      return NULL_VAL;
+        case TAG_NUMBER:    return NUMBER_VAL(readNumber(reader));
+        case TAG_STRING: {
+            ObjString *string = readString(vm, reader);
+            return string != NULL ? OBJ_VAL(string) : NULL_VAL;
+        }
+        default: {
+            reader->failed = true;
+            return NULL_VAL;
+        }
+    }
+}
+
+static void
+readJumpTable(VM *vm, Reader *reader, JumpTable *table)
+{
+    table->trueTarget = (int32_t)readU32(reader);
+    table->falseTarget = (int32_t)readU32(reader);
+    table->nullTarget = (int32_t)readU32(reader);
+
+    int numbers = readCount(reader, 12);
+    table->numbers = ALLOCATE(double, numbers);
+    table->numberTargets = ALLOCATE(int, numbers);
+    table->numberCount = numbers;
+    for (int i = 0; i < numbers; i++) {
+        table->numbers[i] = readNumber(reader);
+        table->numberTargets[i] = (int32_t)readU32(reader);
+    }
+
+    int strings = readCount(reader, 8);
+    for (int i = 0; i < strings && !reader->failed; i++) {
+        ObjString *label = readString(vm, reader);
+        int target = (int32_t)readU32(reader);
+        if (label != NULL) tableSet(&table->strings, label, NUMBER_VAL(target));
+    }
+}
+
+static bool
+readBody(VM *vm, Reader *reader, Chunk *chunk)
+{
+    int count = readCount(reader, 1);
+    const uint8_t *code = readBytes(reader, count);
+    if (code == NULL) return false;
+
+    chunk->code = ALLOCATE(uint8_t, count);
+    chunk->lines = ALLOCATE(int, count);
+    chunk->capacity = count;
+    chunk->count = count;
+    memcpy(chunk->code, code, count);
+
+    int runs = readCount(reader, 8);
+    int line = 0;
+    for (int i = 0; i < runs; i++) {
+        int number = (int32_t)readU32(reader);
+        uint32_t length = readU32(reader);
+        if (length > (uint32_t)(count - line)) return false;
+
+        for (uint32_t j = 0; j < length; j++) chunk->lines[line++] = number;
+    }
+    if (line != count) return false;
+
+    int constants = readCount(reader, 1);
+    for (int i = 0; i < constants && !reader->failed; i++) {
+        appendValueArray(&chunk->constants, readConstant(vm, reader));
+    }
+
+    int tables = readCount(reader, 20);
+    if (tables > 0) chunk->jumpTables = ALLOCATE(JumpTable, tables);
+    for (int i = 0; i < tables && !reader->failed; i++) {
+        JumpTable *table = &chunk->jumpTables[chunk->jumpTableCount++];
+        initTable(&table->strings);
+        readJumpTable(vm, reader, table);
+    }
+
+    return !reader->failed && reader->offset == reader->count;
+}
+
+/*
+ * Loads a file already in memory. With a nonzero 'key',
+ * the file must also have been compiled from that source.
+*/
+static bool
+readLaxc(VM *vm, const uint8_t *bytes, size_t count, uint64_t key, Chunk *chunk)
+{
+    Reader reader = {bytes, count, 0, false};
+    const uint8_t *magic = readBytes(&reader, 4);
+    int version = readByte(&reader);
+    version |= readByte(&reader) << 8;
+    int opcodes = readByte(&reader);
+    readByte(&reader);  // Flags, already part of the source key
+    uint64_t build = readU64(&reader);
+    uint64_t source = readU64(&reader);
+    uint64_t hash = readU64(&reader);
+    uint32_t length = readU32(&reader);
+
+    if (reader.failed || memcmp(magic, LAXC_MAGIC, 4) || version != LAXC_VERSION ||
+        opcodes != OP_RETURN + 1 || build != LAXC_BUILD_ID || (key != 0 && source != key) || length != count - HEADER_SIZE ||
+        hash != hashBytes(UINT64_C(14695981039346656037), bytes + HEADER_SIZE, length)) {
+        return false;
+    }
+
+    if (!readBody(vm, &reader, chunk)) {
+        freeChunk(chunk);
+        return false;
+    }
+    return true;
+}
+
+static bool
+loadKeyed(VM *vm, const char *path, uint64_t key, Chunk *chunk)
+{
+#ifdef LAXC_POSIX
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    size_t count = (size_t)info.st_size;
+    void *bytes = mmap(NULL, count, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) return false;
+
+    bool loaded = readLaxc(vm, (const uint8_t *)bytes, count, key, chunk);
+    munmap(bytes, count);
+    return loaded;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size < HEADER_SIZE) {
+        fclose(file);
+        return false;
+    }
+
+    uint8_t *bytes = ALLOCATE(uint8_t, size);
+    bool loaded = fread(bytes, 1, size, file) == (size_t)size &&
+                  readLaxc(vm, bytes, size, key, chunk);
+    fclose(file);
+    FREE_ARRAY(uint8_t, bytes, size);
+    return loaded;
+#endif // LAXC_POSIX
+}
+
+bool
+isLaxc(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    char magic[4];
+    bool matches = fread(magic, 1, 4, file) == 4 && !memcmp(magic, LAXC_MAGIC, 4);
+    fclose(file);
+    return matches;
+}
+
+bool
+loadLaxc(VM *vm, const char *path, Chunk *chunk)
+{
+    return loadKeyed(vm, path, 0, chunk);
+}
+
+/*
+ * Writes the path of the cache file for 'key' to 'path',
+ * creating the cache directory if need be. Returns false
+ * if there is nowhere to put it.
+*/
+static bool
+cachePath(uint64_t key, char *path, size_t size)
+{
+    const char *dir = getenv("LAX_CACHE_DIR");
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    int length;
+    if (dir != NULL) {
+        if (*dir == '\0') return false;     // Set but empty turns the cache off
+        length = snprintf(path, size, "%s", dir);
+    } else if (base != NULL && *base != '\0') {
+        length = snprintf(path, size, "%s/lax", base);
+    } else if (home != NULL && *home != '\0') {
+        length = snprintf(path, size, "%s/.cache/lax", home);
+    } else {
+        return false;
+    }
+    if (length < 0 || (size_t)length >= size) return false;
+
+#ifdef LAXC_POSIX
+    // Each missing directory up to the cache's own
+    for (char *slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) *slash = '\0';
+        mkdir(path, 0755);
+        if (slash == NULL) break;
+        *slash = '/';
+    }
+#endif // LAXC_POSIX
+
+    int name = snprintf(path + length, size - length, "/%016llx.laxc", (unsigned long long)key);
+    return name > 0 && (size_t)name < size - length;
+}
+
+bool
+compileCached(VM *vm, const char *src, Chunk *chunk)
+{
+    uint64_t key = sourceKey(src, vm->optimize);
+    char path[4096];
+    bool cacheable = LAXC_BUILD_ID != 0 && cachePath(key, path, sizeof(path));
+
+    if (cacheable && loadKeyed(vm, path, key, chunk)) return true;
+    if (!compileSource(vm, src, chunk)) return false;
+
+    if (cacheable) writeKeyed(chunk, key, vm->optimize, path);
+    return true;
+}
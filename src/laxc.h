@@ -0,0 +1,58 @@
+#ifndef LAX_LAXC_H
+#define LAX_LAXC_H
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Bumped whenever the bytecode changes meaning, so files
+ * from an older Lax are recompiled rather than misread.
+*/
+#define LAXC_VERSION 2
+
+/*
+ * A .laxc file holds one compiled Chunk: its code, line
+ * table, constants and switch jump tables, behind a header
+ * naming the format version, the build of Lax that wrote it
+ * and the source it came from. Only that same build loads
+ * it, as any change to the compiler may change the bytecode
+ * without a version bump. Everything is stored little-endian,
+ * whatever the host.
+*/
+
+/*
+ * Writes 'chunk', compiled from 'src', to 'path'.
+ * Returns false if the file couldn't be written.
+*/
+bool
+writeLaxc(Chunk *chunk, const char *src, bool optimized, const char *path);
+
+/*
+ * Returns true if the file at 'path' starts like a .laxc.
+*/
+bool
+isLaxc(const char *path);
+
+/*
+ * Maps the .laxc at 'path' and loads it into 'chunk'.
+ * Returns false, leaving 'chunk' empty, if the file is
+ * damaged or was written by another build of Lax.
+*/
+bool
+loadLaxc(VM *vm, const char *path, Chunk *chunk);
+
+/*
+ * Compiles 'src' as interpret() does, unless the cache
+ * already holds a chunk this build compiled from the same
+ * source with the same flags, and adds what it compiles to
+ * the cache. A Lax built without a build identifier, other
+ * than by the Makefile, doesn't use the cache.
+ * The cache is in $LAX_CACHE_DIR, $XDG_CACHE_HOME/lax or
+ * ~/.cache/lax, with a file per source hash. Failing to
+ * read or write it only costs the compile.
+*/
+bool
+compileCached(VM *vm, const char *src, Chunk *chunk);
+
+#endif // LAX_LAXC_H
@@ -9,6 +9,7 @@ initLexer(Lexer *l, const char *src)
     l->start = src;
     l->current = src;
     l->line = 1;
+    l->interpolationDepth = 0;
 }
 
 static bool
@@ -149,6 +150,7 @@ identifierType(Lexer *l)
         case 'c': {
             if (l->current - l->start > 1) {
                 switch (l->start[1]) {
+                    case 'a':   return checkKeyword(l, 2, 2, "se", TK_CASE);
                     case 'l':   return checkKeyword(l, 2, 3, "ass", TK_CLASS);
                     case 'o': {
                         if (l->current - l->start > 1) {
@@ -161,12 +163,20 @@ identifierType(Lexer *l)
                 }
             }
         } break;
-        case 'd':   return checkKeyword(l, 1, 1, "o", TK_DO);
+        case 'd': {
+            if (l->current - l->start > 1) {
+                switch (l->start[1]) {
+                    case 'e':   return checkKeyword(l, 2, 5, "fault", TK_DEFAULT);
+                    case 'o':   return checkKeyword(l, 2, 0, "", TK_DO);
+                }
+            }
+        } break;
         case 'e': {
             if (l->current - l->start > 1) {
                 switch (l->start[1]) {
                     case 'c':   return checkKeyword(l, 2, 2, "ho", TK_ECHO);
                     case 'l':   return checkKeyword(l, 2, 2, "se", TK_ELSE);
+                    case 'n':   return checkKeyword(l, 2, 2, "um", TK_ENUM);
                 }
             }
         } break;
@@ -196,6 +206,7 @@ identifierType(Lexer *l)
                 switch (l->start[1]) {
                     case 'e':   return checkKeyword(l, 2, 2, "lf", TK_SELF);
                     case 'u':   return checkKeyword(l, 2, 3, "per", TK_SUPER);
+                    case 'w':   return checkKeyword(l, 2, 4, "itch", TK_SWITCH);
                 }
             }
         } break;
@@ -214,11 +225,32 @@ identifier(Lexer *l)
     return makeToken(l, identifierType(l));
 }
 
+/*
+ * Scans the rest of a string, or of the piece of one after
+ * a '${...}'. A piece ending in '${' is a TK_INTERPOLATION
+ * whose text stops at the '$', so every piece is its
+ * characters between two delimiters, as a TK_STRING is.
+*/
 static Token
 string(Lexer *l)
 {
     while (peek(l) != '"' && !isAtEnd(l)) {
         if (peek(l) == '\n') l->line++;
+
+        // '\$' and '\\' are escapes, an escaped '$' never interpolates
+        if (peek(l) == '\\' && (peekNext(l) == '$' || peekNext(l) == '\\')) {
+            advance(l);
+        } else if (peek(l) == '$' && peekNext(l) == '{') {
+            if (l->interpolationDepth == MAX_INTERPOLATION_DEPTH) {
+                return errorToken(l, "Interpolation nested too deeply.");
+            }
+
+            advance(l);
+            Token token = makeToken(l, TK_INTERPOLATION);
+            advance(l);
+            l->braces[l->interpolationDepth++] = 0;
+            return token;
+        }
         advance(l);
     }
 
@@ -260,11 +292,25 @@ scanToken(Lexer *l)
     switch (c) {
         case '(':   return makeToken(l, TK_LPAREN);
         case ')':   return makeToken(l, TK_RPAREN);
-        case '{':   return makeToken(l, TK_LBRACE);
-        case '}':   return makeToken(l, TK_RBRACE);
+        case '{': {
+            if (l->interpolationDepth > 0) l->braces[l->interpolationDepth - 1]++;
+            return makeToken(l, TK_LBRACE);
+        }
+        case '}': {
+            if (l->interpolationDepth > 0) {
+                // The '}' closing a '${' resumes the string
+                if (l->braces[l->interpolationDepth - 1] == 0) {
+                    l->interpolationDepth--;
+                    return string(l);
+                }
+                l->braces[l->interpolationDepth - 1]--;
+            }
+            return makeToken(l, TK_RBRACE);
+        }
         case '[':   return makeToken(l, TK_LBRACK);
         case ']':   return makeToken(l, TK_RBRACK);
         case ';':   return makeToken(l, TK_SEMICOLON);
+        case ':':   return makeToken(l, TK_COLON);
         case ',':   return makeToken(l, TK_COMMA);
         case '.':   return makeToken(l, TK_DOT);
         case '%':   return makeToken(l, TK_MODULUS);
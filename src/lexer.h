@@ -37,20 +37,24 @@ typedef enum {
     // Literal Tokens
     TK_IDENTIFIER,
     TK_STRING,
+    TK_INTERPOLATION,   // A string piece ending in '${', more pieces follow
     TK_NUMBER,
 
     // Lax Keyword Tokens
     TK_AND, TK_BREAK,
-    TK_CLASS, TK_CONST,
-    TK_CONTINUE, TK_DO,
+    TK_CASE, TK_CLASS,
+    TK_CONST, TK_CONTINUE,
+    TK_DEFAULT, TK_DO,
     TK_ELSE, TK_ECHO,
+    TK_ENUM,
     TK_FALSE, TK_FOR,
     TK_FN, TK_IF,
     TK_INCLUDE, TK_MODULE,
     TK_NULL, TK_OR,
     TK_RETURN, TK_SELF,
-    TK_SUPER, TK_TRUE,
-    TK_VAR, TK_WHILE,
+    TK_SUPER, TK_SWITCH,
+    TK_TRUE, TK_VAR,
+    TK_WHILE,
 
     // Special Tokens
     TK_ERROR, TK_EOF, TK_COUNT
@@ -64,10 +68,16 @@ typedef struct {
     int line;
 } Token;
 
+#define MAX_INTERPOLATION_DEPTH 8
+
 typedef struct {
     const char *start;
     const char *current;
     int line;
+
+    // Unclosed '{' within each '${' the lexer is inside of
+    int braces[MAX_INTERPOLATION_DEPTH];
+    int interpolationDepth;
 } Lexer;
 
 void
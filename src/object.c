@@ -1,3 +1,5 @@
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "common.h"
@@ -70,6 +72,87 @@ copyString(VM *vm, const char *chars, int length)
     return allocateString(vm, heapChars, length, hash);
 }
 
+static bool
+isSmallInteger(double number)
+{
+    // In this range "%g" prints exactly the digits of an integer
+    return number > -1e6 && number < 1e6 && number == (int)number &&
+           !(number == 0 && signbit(number));
+}
+
+static int
+pieceLength(Value value)
+{
+    switch (value.type) {
+        case VAL_BOOL:  return AS_BOOL(value) ? 4 : 5;
+        case VAL_NULL:  return 4;
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(value);
+            if (!isSmallInteger(number)) return snprintf(NULL, 0, "%g", number);
+
+            int integer = (int)number;
+            int length = integer < 0 ? 2 : 1;
+            for (integer /= 10; integer != 0; integer /= 10) length++;
+            return length;
+        }
+        default:        return AS_STRING(value)->length;
+    }
+}
+
+/*
+ * Writes the 'length' characters of a piece. snprintf() also
+ * writes a '\0', the next piece or the terminator overwrites it.
+*/
+static void
+writePiece(char *dest, Value value, int length)
+{
+    switch (value.type) {
+        case VAL_BOOL:  memcpy(dest, AS_BOOL(value) ? "true" : "false", length); break;
+        case VAL_NULL:  memcpy(dest, "null", length); break;
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(value);
+            if (!isSmallInteger(number)) {
+                snprintf(dest, length + 1, "%g", number);
+                break;
+            }
+
+            // Digits are written from the last one backwards
+            int integer = (int)number;
+            int magnitude = integer < 0 ? -integer : integer;
+            char *digit = dest + length;
+            do {
+                *--digit = (char)('0' + magnitude % 10);
+                magnitude /= 10;
+            } while (magnitude != 0);
+            if (integer < 0) *--digit = '-';
+        } break;
+        default:        memcpy(dest, AS_CSTRING(value), length); break;
+    }
+}
+
+ObjString *
+buildString(VM *vm, Value *pieces, int count)
+{
+    if (count == 1 && IS_STRING(pieces[0])) return AS_STRING(pieces[0]);
+
+    int lengths[UINT8_COUNT];
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        lengths[i] = pieceLength(pieces[i]);
+        length += lengths[i];
+    }
+
+    char *chars = ALLOCATE(char, length + 1);
+    char *dest = chars;
+    for (int i = 0; i < count; i++) {
+        writePiece(dest, pieces[i], lengths[i]);
+        dest += lengths[i];
+    }
+    chars[length] = '\0';
+
+    return takeString(vm, chars, length);
+}
+
 void
 printObject(Value value)
 {
@@ -33,6 +33,13 @@ takeString(VM *vm, char *chars, int length);
 ObjString *
 copyString(VM *vm, const char *chars, int length);
 
+/*
+ * Joins the values, written as 'echo' prints them, into a
+ * single string. The result is allocated and interned once.
+*/
+ObjString *
+buildString(VM *vm, Value *pieces, int count);
+
 void
 printObject(Value value);
 
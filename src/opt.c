@@ -0,0 +1,849 @@
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "opt.h"
+
+typedef struct {
+    Ast *ast;
+    int loops;          // Id of the loop being hoisted from
+    bool changed;
+} Optimizer;
+
+typedef void (*VisitFn)(Optimizer *opt, Node *node);
+typedef Node *(*RewriteFn)(Optimizer *opt, Node *node);
+
+/*
+ * Visits every node in pre-order, following statement lists.
+*/
+static void
+walk(Optimizer *opt, Node *node, VisitFn visit)
+{
+    for (; node != NULL; node = node->next) {
+        visit(opt, node);
+
+        switch (node->type) {
+            case NODE_ASSIGN:   walk(opt, node->as.assign.value, visit); break;
+            case NODE_UNARY:    walk(opt, node->as.unary.operand, visit); break;
+            case NODE_BINARY:
+            case NODE_LOGICAL: {
+                walk(opt, node->as.binary.left, visit);
+                walk(opt, node->as.binary.right, visit);
+            } break;
+            case NODE_INTERPOLATION: {
+                for (int i = 0; i < node->as.interpolation.count; i++) {
+                    walk(opt, node->as.interpolation.pieces[i], visit);
+                }
+            } break;
+            case NODE_EXPRESSION:
+            case NODE_ECHO:     walk(opt, node->as.expression, visit); break;
+            case NODE_VAR:      walk(opt, node->as.var.init, visit); break;
+            case NODE_BLOCK:    walk(opt, node->as.block, visit); break;
+            case NODE_IF: {
+                walk(opt, node->as.branch.condition, visit);
+                walk(opt, node->as.branch.thenBranch, visit);
+                walk(opt, node->as.branch.elseBranch, visit);
+            } break;
+            case NODE_LOOP: {
+                walk(opt, node->as.loop.init, visit);
+                walk(opt, node->as.loop.hoisted, visit);
+                walk(opt, node->as.loop.condition, visit);
+                walk(opt, node->as.loop.increment, visit);
+                walk(opt, node->as.loop.body, visit);
+            } break;
+            case NODE_SWITCH: {
+                walk(opt, node->as.switchStmt.subject, visit);
+                walk(opt, node->as.switchStmt.arms, visit);
+            } break;
+            case NODE_CASE:     walk(opt, node->as.arm.body, visit); break;
+            default: break;
+        }
+    }
+}
+
+/*
+ * Rewrites a statement list, dropping statements
+ * the rewrite function returns NULL for.
+*/
+static Node *
+rewriteList(Optimizer *opt, Node *list, RewriteFn rewrite)
+{
+    Node *head = NULL;
+    Node **tail = &head;
+
+    while (list != NULL) {
+        Node *next = list->next;
+        Node *node = rewrite(opt, list);
+        if (node != NULL) {
+            *tail = node;
+            tail = &node->next;
+        }
+        list = next;
+    }
+
+    *tail = NULL;
+    return head;
+}
+
+static void
+countUse(Optimizer *opt, Node *node)
+{
+    switch (node->type) {
+        case NODE_VARIABLE: node->as.variable->reads++; break;
+        case NODE_ASSIGN:   node->as.assign.var->writes++; break;
+        case NODE_INCREMENT: {
+            node->as.incr.var->reads++;
+            node->as.incr.var->writes++;
+        } break;
+        case NODE_VAR:      node->as.var.var->defines++; break;
+        default: break;
+    }
+}
+
+static void
+countUses(Optimizer *opt)
+{
+    for (Var *var = opt->ast->vars; var != NULL; var = var->next) {
+        var->defines = 0;
+        var->reads = 0;
+        var->writes = 0;
+    }
+
+    walk(opt, opt->ast->statements, countUse);
+}
+
+/*
+ * True if the expression evaluates to a number whenever
+ * it completes. Arithmetic other than '+' either yields
+ * a number or raises a runtime error.
+*/
+static bool
+isNumeric(Node *node)
+{
+    switch (node->type) {
+        case NODE_LITERAL:      return IS_NUMBER(node->as.literal);
+        case NODE_VARIABLE:     return node->as.variable->isNumber;
+        case NODE_ASSIGN:       return isNumeric(node->as.assign.value);
+        case NODE_INCREMENT:    return true;
+        case NODE_UNARY:        return node->as.unary.op == TK_MINUS;
+        case NODE_LOGICAL: {
+            return isNumeric(node->as.binary.left) &&
+                   isNumeric(node->as.binary.right);
+        }
+        case NODE_BINARY: {
+            switch (node->as.binary.op) {
+                case TK_PLUS: {
+                    return isNumeric(node->as.binary.left) &&
+                           isNumeric(node->as.binary.right);
+                }
+                case TK_MINUS:
+                case TK_STAR:
+                case TK_SLASH:
+                case TK_MODULUS:
+                case TK_POWER:
+                case TK_BAND:
+                case TK_BOR:
+                case TK_BXOR:
+                case TK_SHL:
+                case TK_SHR:    return true;
+                default:        return false;
+            }
+        }
+        default: return false;
+    }
+}
+
+/*
+ * True if evaluating the expression can neither raise
+ * an error nor change any state, so it may be removed
+ * or moved. Globals may be undefined, '%' and the shifts
+ * may trap, so they never qualify.
+*/
+static bool
+isPure(Node *node)
+{
+    switch (node->type) {
+        case NODE_LITERAL:      return true;
+        case NODE_VARIABLE:     return !node->as.variable->isGlobal;
+        case NODE_UNARY: {
+            if (!isPure(node->as.unary.operand)) return false;
+            return node->as.unary.op == TK_BANG || isNumeric(node->as.unary.operand);
+        }
+        case NODE_LOGICAL: {
+            return isPure(node->as.binary.left) && isPure(node->as.binary.right);
+        }
+        case NODE_INTERPOLATION: {
+            // Any value can be turned into a string
+            for (int i = 0; i < node->as.interpolation.count; i++) {
+                if (!isPure(node->as.interpolation.pieces[i])) return false;
+            }
+            return true;
+        }
+        case NODE_BINARY: {
+            if (!isPure(node->as.binary.left) || !isPure(node->as.binary.right)) {
+                return false;
+            }
+
+            switch (node->as.binary.op) {
+                case TK_EQEQ:
+                case TK_BANGEQ:     return true;
+                case TK_MODULUS:
+                case TK_SHL:
+                case TK_SHR:        return false;
+                default: {
+                    return isNumeric(node->as.binary.left) &&
+                           isNumeric(node->as.binary.right);
+                }
+            }
+        }
+        default: return false;
+    }
+}
+
+static void
+inferDefinition(Optimizer *opt, Node *node)
+{
+    Var *var;
+    bool numeric;
+
+    switch (node->type) {
+        case NODE_VAR: {
+            var = node->as.var.var;
+            numeric = node->as.var.init != NULL && isNumeric(node->as.var.init);
+        } break;
+        case NODE_ASSIGN: {
+            var = node->as.assign.var;
+            numeric = isNumeric(node->as.assign.value);
+        } break;
+        default: return;
+    }
+
+    if (var->isNumber && !numeric) {
+        var->isNumber = false;
+        opt->changed = true;
+    }
+}
+
+/*
+ * Finds the locals that only ever hold numbers. Every local
+ * starts out optimistically numeric and is demoted until
+ * nothing changes; '++' and '--' can't produce anything else.
+*/
+static void
+inferNumbers(Optimizer *opt)
+{
+    for (Var *var = opt->ast->vars; var != NULL; var = var->next) {
+        var->isNumber = !var->isGlobal;
+    }
+
+    do {
+        opt->changed = false;
+        walk(opt, opt->ast->statements, inferDefinition);
+    } while (opt->changed);
+}
+
+static bool
+isFalsey(Value value)
+{
+    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+bool
+foldUnary(TokenType op, Value a, Value *result)
+{
+    if (op == TK_BANG) {
+        *result = BOOL_VAL(isFalsey(a));
+        return true;
+    }
+
+    if (op != TK_MINUS || !IS_NUMBER(a)) return false;
+    *result = NUMBER_VAL(-AS_NUMBER(a));
+    return true;
+}
+
+static bool
+isLiteral(Node *node)
+{
+    return node != NULL && node->type == NODE_LITERAL;
+}
+
+static bool
+toInt(double number, int *result)
+{
+    // Out of range conversions are undefined, leave those to the VM
+    if (!(number > INT_MIN - 1.0 && number < INT_MAX + 1.0)) return false;
+
+    *result = (int)number;
+    return true;
+}
+
+bool
+foldBinary(VM *vm, TokenType op, Value a, Value b, Value *result)
+{
+    if (op == TK_EQEQ || op == TK_BANGEQ) {
+        bool equal = valuesEqual(a, b);
+        *result = BOOL_VAL(op == TK_EQEQ ? equal : !equal);
+        return true;
+    }
+
+    if (op == TK_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+
+        *result = OBJ_VAL(takeString(vm, chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (op) {
+        case TK_GREATER:    *result = BOOL_VAL(x > y);      return true;
+        case TK_GTEQ:       *result = BOOL_VAL(!(x < y));   return true;
+        case TK_LESS:       *result = BOOL_VAL(x < y);      return true;
+        case TK_LTEQ:       *result = BOOL_VAL(!(x > y));   return true;
+        case TK_PLUS:       *result = NUMBER_VAL(x + y);    return true;
+        case TK_MINUS:      *result = NUMBER_VAL(x - y);    return true;
+        case TK_STAR:       *result = NUMBER_VAL(x * y);    return true;
+        case TK_SLASH:      *result = NUMBER_VAL(x / y);    return true;
+        case TK_MODULUS:
+        case TK_POWER:
+        case TK_BAND:
+        case TK_BOR:
+        case TK_BXOR:
+        case TK_SHL:
+        case TK_SHR: {
+            int i, j;
+            if (!toInt(x, &i) || !toInt(y, &j)) return false;
+
+            switch (op) {
+                case TK_MODULUS: {
+                    // Both of these trap in the VM
+                    if (j == 0 || (i == INT_MIN && j == -1)) return false;
+                    *result = NUMBER_VAL(i % j);
+                } break;
+                case TK_SHL: {
+                    // Overflowing or negative shifts are undefined
+                    if (j < 0 || j > 30 || i < 0 || i > (INT_MAX >> j)) return false;
+                    *result = NUMBER_VAL(i << j);
+                } break;
+                case TK_SHR: {
+                    if (j < 0 || j > 31 || i < 0) return false;
+                    *result = NUMBER_VAL(i >> j);
+                } break;
+                case TK_POWER:  *result = NUMBER_VAL(pow(i, j)); break;
+                case TK_BAND:   *result = NUMBER_VAL(i & j);     break;
+                case TK_BOR:    *result = NUMBER_VAL(i | j);     break;
+                default:        *result = NUMBER_VAL(i ^ j);     break;
+            }
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static void
+makeLiteral(Node *node, Value value)
+{
+    node->type = NODE_LITERAL;
+    node->as.literal = value;
+}
+
+static Node *
+foldExpr(Optimizer *opt, Node *node)
+{
+    switch (node->type) {
+        case NODE_VARIABLE: {
+            Var *var = node->as.variable;
+            if (var->isConstant) makeLiteral(node, var->constant);
+        } break;
+        case NODE_ASSIGN: {
+            node->as.assign.value = foldExpr(opt, node->as.assign.value);
+        } break;
+        case NODE_UNARY: {
+            Node *operand = foldExpr(opt, node->as.unary.operand);
+            node->as.unary.operand = operand;
+            if (!isLiteral(operand)) break;
+
+            Value result;
+            if (foldUnary(node->as.unary.op, operand->as.literal, &result)) {
+                makeLiteral(node, result);
+            }
+        } break;
+        case NODE_BINARY: {
+            Node *left = foldExpr(opt, node->as.binary.left);
+            Node *right = foldExpr(opt, node->as.binary.right);
+            node->as.binary.left = left;
+            node->as.binary.right = right;
+
+            Value result;
+            if (isLiteral(left) && isLiteral(right) &&
+                foldBinary(opt->ast->vm, node->as.binary.op,
+                           left->as.literal, right->as.literal, &result)) {
+                makeLiteral(node, result);
+            }
+        } break;
+        case NODE_LOGICAL: {
+            Node *left = foldExpr(opt, node->as.binary.left);
+            Node *right = foldExpr(opt, node->as.binary.right);
+            node->as.binary.left = left;
+            node->as.binary.right = right;
+            if (!isLiteral(left)) break;
+
+            // 'and' and 'or' yield one of their operands
+            bool falsey = isFalsey(left->as.literal);
+            if (node->as.binary.op == TK_AND) return falsey ? left : right;
+            return falsey ? right : left;
+        }
+        case NODE_INTERPOLATION: {
+            Node **pieces = node->as.interpolation.pieces;
+            int count = 0;
+
+            // Every run of literal pieces is joined at compile time
+            for (int i = 0; i < node->as.interpolation.count; i++) {
+                Node *piece = foldExpr(opt, pieces[i]);
+                if (isLiteral(piece) && count > 0 && isLiteral(pieces[count - 1])) {
+                    Value run[2] = { pieces[count - 1]->as.literal, piece->as.literal };
+                    makeLiteral(pieces[count - 1], OBJ_VAL(buildString(opt->ast->vm, run, 2)));
+                } else {
+                    pieces[count++] = piece;
+                }
+            }
+            node->as.interpolation.count = count;
+
+            if (count == 1 && isLiteral(pieces[0])) {
+                makeLiteral(node, OBJ_VAL(buildString(opt->ast->vm, &pieces[0]->as.literal, 1)));
+            }
+        } break;
+        default: break;
+    }
+
+    return node;
+}
+
+/*
+ * Constant propagation, folding and dead-code elimination
+ * in one pass over the program in source order. A variable
+ * that is declared once and never written is a constant
+ * from its declaration onwards; for globals the reads that
+ * come before it must still reach the VM, which reports
+ * them as undefined, and walking in source order keeps them.
+*/
+static Node *
+foldStmt(Optimizer *opt, Node *node)
+{
+    switch (node->type) {
+        case NODE_EXPRESSION: {
+            node->as.expression = foldExpr(opt, node->as.expression);
+            if (isPure(node->as.expression)) return NULL;
+        } break;
+        case NODE_ECHO: {
+            node->as.expression = foldExpr(opt, node->as.expression);
+        } break;
+        case NODE_VAR: {
+            Var *var = node->as.var.var;
+            Node *init = node->as.var.init;
+            if (init != NULL) init = node->as.var.init = foldExpr(opt, init);
+
+            if (var->defines == 1 && var->writes == 0 &&
+                (init == NULL || isLiteral(init))) {
+                var->isConstant = true;
+                var->constant = init == NULL ? NULL_VAL : init->as.literal;
+            }
+        } break;
+        case NODE_BLOCK: {
+            node->as.block = rewriteList(opt, node->as.block, foldStmt);
+            if (node->as.block == NULL) return NULL;
+        } break;
+        case NODE_IF: {
+            Node *condition = foldExpr(opt, node->as.branch.condition);
+            node->as.branch.condition = condition;
+
+            if (isLiteral(condition)) {
+                Node *taken = isFalsey(condition->as.literal) ?
+                    node->as.branch.elseBranch : node->as.branch.thenBranch;
+                return taken == NULL ? NULL : foldStmt(opt, taken);
+            }
+
+            if (node->as.branch.thenBranch != NULL) {
+                node->as.branch.thenBranch = foldStmt(opt, node->as.branch.thenBranch);
+            }
+            if (node->as.branch.elseBranch != NULL) {
+                node->as.branch.elseBranch = foldStmt(opt, node->as.branch.elseBranch);
+            }
+
+            if (node->as.branch.thenBranch == NULL &&
+                node->as.branch.elseBranch == NULL && isPure(condition)) {
+                return NULL;
+            }
+        } break;
+        case NODE_LOOP: {
+            if (node->as.loop.init != NULL) {
+                node->as.loop.init = foldStmt(opt, node->as.loop.init);
+            }
+
+            Node *condition = node->as.loop.condition;
+            if (condition != NULL) {
+                condition = node->as.loop.condition = foldExpr(opt, condition);
+            }
+
+            if (isLiteral(condition)) {
+                if (isFalsey(condition->as.literal)) {
+                    // The body never runs, only the initializer is left
+                    Node *init = node->as.loop.init;
+                    if (init == NULL) return NULL;
+
+                    Node *block = newNode(opt->ast, NODE_BLOCK, node->line);
+                    block->as.block = init;
+                    return block;
+                }
+
+                node->as.loop.condition = NULL;
+            }
+
+            if (node->as.loop.increment != NULL) {
+                node->as.loop.increment = foldExpr(opt, node->as.loop.increment);
+                if (isPure(node->as.loop.increment)) node->as.loop.increment = NULL;
+            }
+            if (node->as.loop.body != NULL) {
+                node->as.loop.body = foldStmt(opt, node->as.loop.body);
+            }
+        } break;
+        case NODE_SWITCH: {
+            // Empty arms are kept, they still stop a match from reaching 'default'
+            node->as.switchStmt.subject = foldExpr(opt, node->as.switchStmt.subject);
+            for (Node *arm = node->as.switchStmt.arms; arm != NULL; arm = arm->next) {
+                if (arm->as.arm.body != NULL) arm->as.arm.body = foldStmt(opt, arm->as.arm.body);
+            }
+        } break;
+        default: break;
+    }
+
+    return node;
+}
+
+/*
+ * Stores to an annotated local are kept, as they may fail
+ * the check of its type.
+*/
+static bool
+isUnused(Var *var)
+{
+    return !var->isGlobal && var->reads == 0 && var->declared == TYPE_ANY;
+}
+
+/*
+ * Replaces assignments to unused locals with their value.
+*/
+static Node *
+pruneExpr(Optimizer *opt, Node *node)
+{
+    switch (node->type) {
+        case NODE_ASSIGN: {
+            Node *value = pruneExpr(opt, node->as.assign.value);
+            if (isUnused(node->as.assign.var)) return value;
+            node->as.assign.value = value;
+        } break;
+        case NODE_UNARY: {
+            node->as.unary.operand = pruneExpr(opt, node->as.unary.operand);
+        } break;
+        case NODE_BINARY:
+        case NODE_LOGICAL: {
+            node->as.binary.left = pruneExpr(opt, node->as.binary.left);
+            node->as.binary.right = pruneExpr(opt, node->as.binary.right);
+        } break;
+        case NODE_INTERPOLATION: {
+            for (int i = 0; i < node->as.interpolation.count; i++) {
+                node->as.interpolation.pieces[i] = pruneExpr(opt, node->as.interpolation.pieces[i]);
+            }
+        } break;
+        default: break;
+    }
+
+    return node;
+}
+
+/*
+ * Unused-local elimination. The declaration of a local that
+ * is never read is dropped, keeping its initializer as an
+ * expression statement if evaluating it could be observed.
+*/
+static Node *
+pruneStmt(Optimizer *opt, Node *node)
+{
+    switch (node->type) {
+        case NODE_EXPRESSION: {
+            node->as.expression = pruneExpr(opt, node->as.expression);
+            if (isPure(node->as.expression)) return NULL;
+        } break;
+        case NODE_ECHO: {
+            node->as.expression = pruneExpr(opt, node->as.expression);
+        } break;
+        case NODE_VAR: {
+            Node *init = node->as.var.init;
+            if (init != NULL) init = node->as.var.init = pruneExpr(opt, init);
+            if (!isUnused(node->as.var.var)) break;
+
+            opt->changed = true;
+            if (init == NULL || isPure(init)) return NULL;
+
+            node->type = NODE_EXPRESSION;
+            node->as.expression = init;
+        } break;
+        case NODE_BLOCK: {
+            node->as.block = rewriteList(opt, node->as.block, pruneStmt);
+            if (node->as.block == NULL) return NULL;
+        } break;
+        case NODE_IF: {
+            node->as.branch.condition = pruneExpr(opt, node->as.branch.condition);
+            if (node->as.branch.thenBranch != NULL) {
+                node->as.branch.thenBranch = pruneStmt(opt, node->as.branch.thenBranch);
+            }
+            if (node->as.branch.elseBranch != NULL) {
+                node->as.branch.elseBranch = pruneStmt(opt, node->as.branch.elseBranch);
+            }
+        } break;
+        case NODE_LOOP: {
+            if (node->as.loop.init != NULL) {
+                node->as.loop.init = pruneStmt(opt, node->as.loop.init);
+            }
+            if (node->as.loop.condition != NULL) {
+                node->as.loop.condition = pruneExpr(opt, node->as.loop.condition);
+            }
+            if (node->as.loop.increment != NULL) {
+                node->as.loop.increment = pruneExpr(opt, node->as.loop.increment);
+                if (isPure(node->as.loop.increment)) node->as.loop.increment = NULL;
+            }
+            if (node->as.loop.body != NULL) {
+                node->as.loop.body = pruneStmt(opt, node->as.loop.body);
+            }
+        } break;
+        case NODE_SWITCH: {
+            node->as.switchStmt.subject = pruneExpr(opt, node->as.switchStmt.subject);
+            for (Node *arm = node->as.switchStmt.arms; arm != NULL; arm = arm->next) {
+                if (arm->as.arm.body != NULL) arm->as.arm.body = pruneStmt(opt, arm->as.arm.body);
+            }
+        } break;
+        default: break;
+    }
+
+    return node;
+}
+
+static void
+markVariant(Optimizer *opt, Node *node)
+{
+    switch (node->type) {
+        case NODE_VAR:          node->as.var.var->loop = opt->loops; break;
+        case NODE_ASSIGN:       node->as.assign.var->loop = opt->loops; break;
+        case NODE_INCREMENT:    node->as.incr.var->loop = opt->loops; break;
+        default: break;
+    }
+}
+
+/*
+ * True if the expression is numeric arithmetic over numeric
+ * locals that the current loop neither declares nor writes,
+ * so it computes the same value on every iteration and can't fail.
+*/
+static bool
+isInvariant(Optimizer *opt, Node *node)
+{
+    switch (node->type) {
+        case NODE_LITERAL:  return IS_NUMBER(node->as.literal);
+        case NODE_VARIABLE: {
+            Var *var = node->as.variable;
+            return !var->isGlobal && var->isNumber && var->loop != opt->loops;
+        }
+        case NODE_UNARY: {
+            return node->as.unary.op == TK_MINUS &&
+                   isInvariant(opt, node->as.unary.operand);
+        }
+        case NODE_BINARY: {
+            switch (node->as.binary.op) {
+                case TK_PLUS:
+                case TK_MINUS:
+                case TK_STAR:
+                case TK_SLASH:
+                case TK_POWER: {
+                    return isInvariant(opt, node->as.binary.left) &&
+                           isInvariant(opt, node->as.binary.right);
+                }
+                default: return false;
+            }
+        }
+        default: return false;
+    }
+}
+
+static bool
+sameExpr(Node *a, Node *b)
+{
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+        case NODE_LITERAL:  return valuesEqual(a->as.literal, b->as.literal);
+        case NODE_VARIABLE: return a->as.variable == b->as.variable;
+        case NODE_UNARY: {
+            return a->as.unary.op == b->as.unary.op &&
+                   sameExpr(a->as.unary.operand, b->as.unary.operand);
+        }
+        case NODE_BINARY: {
+            return a->as.binary.op == b->as.binary.op &&
+                   sameExpr(a->as.binary.left, b->as.binary.left) &&
+                   sameExpr(a->as.binary.right, b->as.binary.right);
+        }
+        default: return false;
+    }
+}
+
+/*
+ * Moves the largest invariant subexpressions of '*slot' into
+ * hidden locals declared ahead of the loop. Equal expressions
+ * share a single hidden local.
+*/
+static void
+hoistExpr(Optimizer *opt, Node *loop, Node **slot)
+{
+    Node *node = *slot;
+
+    if ((node->type == NODE_UNARY || node->type == NODE_BINARY) &&
+        isInvariant(opt, node)) {
+        Node **tail = &loop->as.loop.hoisted;
+        Var *var = NULL;
+
+        for (; *tail != NULL; tail = &(*tail)->next) {
+            if (sameExpr((*tail)->as.var.init, node)) {
+                var = (*tail)->as.var.var;
+                break;
+            }
+        }
+
+        if (var == NULL) {
+            Token name = { TK_IDENTIFIER, "", 0, node->line };
+            var = newVar(opt->ast, name, false);
+            var->isHidden = true;
+            var->isNumber = true;
+
+            Node *decl = newNode(opt->ast, NODE_VAR, node->line);
+            decl->as.var.var = var;
+            decl->as.var.init = node;
+            *tail = decl;
+        }
+
+        Node *read = newNode(opt->ast, NODE_VARIABLE, node->line);
+        read->as.variable = var;
+        *slot = read;
+        return;
+    }
+
+    switch (node->type) {
+        case NODE_ASSIGN:   hoistExpr(opt, loop, &node->as.assign.value); break;
+        case NODE_UNARY:    hoistExpr(opt, loop, &node->as.unary.operand); break;
+        case NODE_BINARY:
+        case NODE_LOGICAL: {
+            hoistExpr(opt, loop, &node->as.binary.left);
+            hoistExpr(opt, loop, &node->as.binary.right);
+        } break;
+        case NODE_INTERPOLATION: {
+            for (int i = 0; i < node->as.interpolation.count; i++) {
+                hoistExpr(opt, loop, &node->as.interpolation.pieces[i]);
+            }
+        } break;
+        default: break;
+    }
+}
+
+static void
+hoistStmt(Optimizer *opt, Node *loop, Node *node)
+{
+    for (; node != NULL; node = node->next) {
+        switch (node->type) {
+            case NODE_EXPRESSION:
+            case NODE_ECHO:     hoistExpr(opt, loop, &node->as.expression); break;
+            case NODE_VAR: {
+                if (node->as.var.init != NULL) {
+                    hoistExpr(opt, loop, &node->as.var.init);
+                }
+            } break;
+            case NODE_BLOCK:    hoistStmt(opt, loop, node->as.block); break;
+            case NODE_IF: {
+                hoistExpr(opt, loop, &node->as.branch.condition);
+                hoistStmt(opt, loop, node->as.branch.thenBranch);
+                hoistStmt(opt, loop, node->as.branch.elseBranch);
+            } break;
+            case NODE_LOOP: {
+                // An inner loop runs as part of every outer iteration
+                hoistStmt(opt, loop, node->as.loop.init);
+                if (node->as.loop.condition != NULL) {
+                    hoistExpr(opt, loop, &node->as.loop.condition);
+                }
+                if (node->as.loop.increment != NULL) {
+                    hoistExpr(opt, loop, &node->as.loop.increment);
+                }
+                hoistStmt(opt, loop, node->as.loop.body);
+            } break;
+            case NODE_SWITCH: {
+                hoistExpr(opt, loop, &node->as.switchStmt.subject);
+                for (Node *arm = node->as.switchStmt.arms; arm != NULL; arm = arm->next) {
+                    hoistStmt(opt, loop, arm->as.arm.body);
+                }
+            } break;
+            default: break;
+        }
+    }
+}
+
+/*
+ * Loop-invariant code motion. Outer loops are visited first,
+ * so an expression is hoisted as far out as it can go.
+*/
+static void
+hoistLoop(Optimizer *opt, Node *node)
+{
+    if (node->type != NODE_LOOP) return;
+
+    opt->loops++;
+    walk(opt, node->as.loop.condition, markVariant);
+    walk(opt, node->as.loop.increment, markVariant);
+    walk(opt, node->as.loop.body, markVariant);
+
+    if (node->as.loop.condition != NULL) {
+        hoistExpr(opt, node, &node->as.loop.condition);
+    }
+    if (node->as.loop.increment != NULL) {
+        hoistExpr(opt, node, &node->as.loop.increment);
+    }
+    hoistStmt(opt, node, node->as.loop.body);
+}
+
+void
+optimizeAst(Ast *ast)
+{
+    Optimizer opt;
+    opt.ast = ast;
+    opt.loops = 0;
+    opt.changed = false;
+
+    countUses(&opt);
+    inferNumbers(&opt);
+    ast->statements = rewriteList(&opt, ast->statements, foldStmt);
+
+    do {
+        countUses(&opt);
+        opt.changed = false;
+        ast->statements = rewriteList(&opt, ast->statements, pruneStmt);
+    } while (opt.changed);
+
+    for (Var *var = ast->vars; var != NULL; var = var->next) var->loop = 0;
+    walk(&opt, ast->statements, hoistLoop);
+}
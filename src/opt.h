@@ -0,0 +1,33 @@
+#ifndef LAX_OPT_H
+#define LAX_OPT_H
+
+#include "ast.h"
+
+/*
+ * Runs the optimization passes over the Ast in place:
+ * constant propagation and folding, dead-code elimination,
+ * unused-local elimination and loop-invariant code motion.
+ *
+ * Every pass preserves the program's output and runtime
+ * errors, so a rewrite is only made when the expressions
+ * involved can neither fail nor have side effects.
+*/
+void
+optimizeAst(Ast *ast);
+
+/*
+ * Evaluates '!' or '-' on a constant exactly as the VM
+ * would. Returns false if it would raise an error.
+*/
+bool
+foldUnary(TokenType op, Value a, Value *result);
+
+/*
+ * Evaluates a binary operator on two constants exactly as
+ * the VM would. Returns false if it would raise an error
+ * or its result is platform dependent.
+*/
+bool
+foldBinary(VM *vm, TokenType op, Value a, Value b, Value *result);
+
+#endif // LAX_OPT_H
@@ -0,0 +1,54 @@
+#include <stdio.h>
+
+#include "memory.h"
+#include "object.h"
+#include "runtime.h"
+#include "vm.h"
+
+#ifdef DEBUG_PROFILE_OPCODES
+#include "debug.h"
+#endif // DEBUG_PROFILE_OPCODES
+
+VM *
+initVM()
+{
+    VM *vm = (VM *)malloc(sizeof(VM));
+    vm->stackTop = vm->stack;
+    vm->objects = NULL;
+    vm->optimize = false;
+    vm->jit = false;
+    initTable(&vm->globals);
+    initTable(&vm->strings);
+
+    return vm;
+}
+
+void
+freeVM(VM *vm)
+{
+#ifdef DEBUG_PROFILE_OPCODES
+    printProfile();
+#endif // DEBUG_PROFILE_OPCODES
+
+    freeTable(&vm->strings);
+    freeObjects(vm);
+}
+
+void
+programError(int line, const char *message)
+{
+    laxlog(ERROR, "on [Ln %d] in 'Script'", line);
+    fprintf(stderr, "%s\n", message);
+    exit(70);
+}
+
+Value
+programConcat(VM *vm, Value a, Value b, int line)
+{
+    if (!IS_STRING(a) || !IS_STRING(b)) {
+        programError(line, "Operands must be two numbers or two strings.");
+    }
+
+    Value pieces[2] = { a, b };
+    return OBJ_VAL(buildString(vm, pieces, 2));
+}
@@ -0,0 +1,50 @@
+#ifndef LAX_RUNTIME_H
+#define LAX_RUNTIME_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/*
+ * What a program built by 'lax build' links against, as
+ * liblaxrt.a: the VM state with the value, object, table and
+ * memory modules, but not the compiler or run(). Generated
+ * code keeps its stack in C locals and only calls in here for
+ * work too big to expand inline.
+*/
+
+#if defined(__GNUC__)
+#define NORETURN __attribute__((noreturn))
+#else
+#define NORETURN
+#endif
+
+/*
+ * Reports a runtime error on 'line' as run() does, then exits
+ * with the status the interpreter gives one.
+*/
+NORETURN void
+programError(int line, const char *message);
+
+/*
+ * 'a + b' for anything but two numbers, which generated code
+ * adds inline. Fails on 'line' unless both are strings.
+*/
+Value
+programConcat(VM *vm, Value a, Value b, int line);
+
+static inline bool
+programFalsey(Value value)
+{
+    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static inline bool
+programEqual(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    return valuesEqual(a, b);
+}
+
+#endif // LAX_RUNTIME_H
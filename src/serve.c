@@ -0,0 +1,443 @@
+#define _DEFAULT_SOURCE     // Sockets, fork() and friends aren't part of C99
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "log.h"
+#include "memory.h"
+#include "read.h"
+#include "serve.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SERVE_POSIX
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define MAX_NAME    4096    // Longest script name a request may hold
+#define STREAMS     3       // stdin, stdout and stderr
+
+typedef struct {
+    const char *path;
+    const char *name;   // The file name alone
+    Chunk chunk;
+} Script;
+
+#ifdef SERVE_POSIX
+static volatile sig_atomic_t stopping = 0;
+static int exited[2] = { -1, -1 };  // Written to when the script's process exits
+static int served = -1;             // The client's connection to the server
+
+static void
+stop(int number)
+{
+    stopping = 1;
+}
+
+static void
+childExited(int number)
+{
+    int saved = errno;
+    uint8_t byte = 0;
+    (void)!write(exited[1], &byte, 1);
+    errno = saved;
+}
+
+// The client's Ctrl-C and kill go on to the script
+static void
+forwardSignal(int number)
+{
+    int saved = errno;
+    uint8_t byte = (uint8_t)number;
+    (void)!send(served, &byte, 1, 0);
+    errno = saved;
+}
+
+static Script *
+findScript(Script *scripts, int count, const char *name)
+{
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(scripts[i].path, name) || !strcmp(scripts[i].name, name)) {
+            return &scripts[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Reads a request from 'client' into 'name', and the
+ * client's streams into 'fds'. The streams come with the
+ * first byte, the name may take more than one read.
+ * Returns false if the request is cut short or malformed.
+*/
+static bool
+readRequest(int client, char *name, int fds[STREAMS])
+{
+    int length = 0;
+    bool streams = false;
+
+    for (;;) {
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int) * STREAMS)];
+        } control;
+
+        struct iovec iov = { name + length, MAX_NAME - length };
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+
+        ssize_t read = recvmsg(client, &message, 0);
+        if (read < 0 && errno == EINTR) continue;
+        if (read <= 0) return false;
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            int received = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int *passed = (int *)CMSG_DATA(header);
+
+            // Only a full set of streams is kept, anything else is closed
+            bool keep = !streams && received == STREAMS;
+            for (int i = 0; i < received; i++) {
+                if (keep) fds[i] = passed[i];
+                else close(passed[i]);
+            }
+
+            if (keep) streams = true;
+        }
+
+        length += (int)read;
+        char *newline = memchr(name, '\n', length);
+        if (newline != NULL) {
+            *newline = '\0';
+            return streams;
+        }
+
+        if (length == MAX_NAME) break;
+    }
+
+    for (int i = 0; streams && i < STREAMS; i++) close(fds[i]);
+    return false;
+}
+
+/*
+ * Waits for the script running as 'pid' to exit, passing on
+ * the signals the client forwards. If the client goes away,
+ * so does the script. Returns the status to report, which
+ * for a script killed by a signal is 128 plus the signal,
+ * as a shell would give, or -1 if there's no one to tell.
+*/
+static int
+watchScript(int client, pid_t pid)
+{
+    for (;;) {
+        struct pollfd fds[2] = { { client, POLLIN, 0 }, { exited[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) continue;
+
+        if (fds[1].revents != 0) {
+            uint8_t byte;
+            (void)!read(exited[0], &byte, 1);
+
+            int status;
+            if (waitpid(pid, &status, WNOHANG) == pid) {
+                if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+                return WEXITSTATUS(status);
+            }
+        }
+
+        if (fds[0].revents != 0) {
+            uint8_t number;
+            ssize_t got = recv(client, &number, 1, 0);
+            if (got < 0 && errno == EINTR) continue;
+
+            if (got <= 0) {
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+                return -1;
+            }
+
+            if (number == SIGINT || number == SIGTERM) kill(pid, number);
+        }
+    }
+}
+
+/*
+ * Runs in the child forked for a request, and never
+ * returns. With the client's streams in place of its own,
+ * the child forks the script's process, which runs it as
+ * 'lax <script>' would, and stays to watch the client while
+ * it runs. Then it sends back the status the script exited
+ * with.
+*/
+static void
+handleRequest(VM *vm, int client, Script *scripts, int count)
+{
+    char name[MAX_NAME];
+    int fds[STREAMS];
+    if (!readRequest(client, name, fds)) exit(1);
+
+    for (int i = 0; i < STREAMS; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    int status = 64;
+    Script *script = findScript(scripts, count, name);
+    if (script == NULL) {
+        laxlog(ERROR, "No script named '%s' is being served.", name);
+    } else if (pipe(exited) < 0) {
+        laxlog(ERROR, "Could not run '%s': %s.", name, strerror(errno));
+        status = 70;
+    } else {
+        // Caught before the fork, so an exit can't come and go unseen
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = childExited;
+        sigaction(SIGCHLD, &action, NULL);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(client);
+            close(exited[0]);
+            close(exited[1]);
+            action.sa_handler = SIG_DFL;
+            sigaction(SIGCHLD, &action, NULL);
+
+            InterpretResult result = runChunk(vm, &script->chunk);
+            exit(result == INTERPRET_RUNTIME_ERROR ? 70 : 0);
+        }
+
+        if (pid < 0) {
+            laxlog(ERROR, "Could not run '%s': %s.", name, strerror(errno));
+            status = 70;
+        } else {
+            status = watchScript(client, pid);
+            if (status < 0) exit(0);
+        }
+    }
+
+    // Everything the script wrote is out before the client hears it's done
+    fflush(stdout);
+    fflush(stderr);
+
+    uint8_t byte = (uint8_t)status;
+    while (write(client, &byte, 1) < 0 && errno == EINTR);
+    exit(0);
+}
+
+static void
+freeScripts(Script *scripts, int count)
+{
+    for (int i = 0; i < count; i++) freeChunk(&scripts[i].chunk);
+    FREE_ARRAY(Script, scripts, count);
+}
+
+static int
+listenOn(const char *socketPath)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        laxlog(ERROR, "The socket path '%s' is too long.", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // A socket left behind by a server that was killed is replaced,
+    // anything else at that path is left alone
+    struct stat info;
+    if (lstat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(socketPath);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) return -1;
+
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(server, SOMAXCONN) < 0) {
+        laxlog(ERROR, "Could not listen on '%s': %s.", socketPath, strerror(errno));
+        close(server);
+        return -1;
+    }
+
+    return server;
+}
+
+int
+serveScripts(VM *vm, const char *socketPath, char **paths, int count)
+{
+    Script *scripts = ALLOCATE(Script, count);
+    for (int i = 0; i < count; i++) {
+        const char *name = strrchr(paths[i], '/');
+        scripts[i].path = paths[i];
+        scripts[i].name = name != NULL ? name + 1 : paths[i];
+        initChunk(&scripts[i].chunk);
+
+        char *src = readFile(paths[i]);
+        bool compiled = compileSource(vm, src, &scripts[i].chunk);
+        free(src);
+
+        if (!compiled) {
+            laxlog(ERROR, "'%s' has errors, not serving anything.", paths[i]);
+            freeScripts(scripts, i + 1);
+            return 65;
+        }
+    }
+
+    int server = listenOn(socketPath);
+    if (server < 0) {
+        freeScripts(scripts, count);
+        return 74;
+    }
+
+    // Children are reaped as they exit, they report to their client themselves
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGCHLD, &action, NULL);
+
+    // No SA_RESTART, so accept() returns when told to stop
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    laxlog(INFO, "Serving %d script(s) on '%s'.", count, socketPath);
+
+    while (!stopping) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) continue;
+
+        // Or the child would write out the server's buffered output again
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(server);
+            action.sa_handler = SIG_DFL;
+            sigaction(SIGINT, &action, NULL);
+            sigaction(SIGTERM, &action, NULL);
+            sigaction(SIGCHLD, &action, NULL);
+            handleRequest(vm, client, scripts, count);
+        }
+
+        if (pid < 0) laxlog(ERROR, "Could not fork for a request: %s.", strerror(errno));
+        close(client);
+    }
+
+    close(server);
+    unlink(socketPath);
+    freeScripts(scripts, count);
+    return 0;
+}
+
+int
+runServed(const char *socketPath, const char *script)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        laxlog(ERROR, "The socket path '%s' is too long.", socketPath);
+        return 64;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    size_t length = strlen(script);
+    if (length + 1 > MAX_NAME || memchr(script, '\n', length) != NULL) {
+        laxlog(ERROR, "'%s' can't be requested from a server.", script);
+        return 64;
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        laxlog(ERROR, "Could not connect to '%s': %s.", socketPath, strerror(errno));
+        if (server >= 0) close(server);
+        return 74;
+    }
+
+    char request[MAX_NAME];
+    memcpy(request, script, length);
+    request[length] = '\n';
+
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * STREAMS)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    // The streams go with the whole request, so the server reads them first
+    struct iovec iov = { request, length + 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * STREAMS);
+    int streams[STREAMS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    memcpy(CMSG_DATA(header), streams, sizeof(streams));
+
+    ssize_t sent;
+    while ((sent = sendmsg(server, &message, 0)) < 0 && errno == EINTR);
+    if (sent < (ssize_t)(length + 1)) {
+        laxlog(ERROR, "Could not send the request to '%s'.", socketPath);
+        close(server);
+        return 74;
+    }
+
+    // No SA_RESTART, recv() is only retried once a signal is forwarded
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+    served = server;
+    action.sa_handler = forwardSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    uint8_t status;
+    ssize_t read;
+    while ((read = recv(server, &status, 1, 0)) < 0 && errno == EINTR);
+
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    close(server);
+
+    if (read != 1) {
+        laxlog(ERROR, "The server stopped before '%s' finished.", script);
+        return 70;
+    }
+
+    return status;
+}
+
+#else
+
+int
+serveScripts(VM *vm, const char *socketPath, char **paths, int count)
+{
+    laxlog(ERROR, "'lax serve' needs Unix sockets, which this platform doesn't have.");
+    return 64;
+}
+
+int
+runServed(const char *socketPath, const char *script)
+{
+    laxlog(ERROR, "'--socket' needs Unix sockets, which this platform doesn't have.");
+    return 64;
+}
+
+#endif // SERVE_POSIX
@@ -0,0 +1,36 @@
+#ifndef LAX_SERVE_H
+#define LAX_SERVE_H
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * 'lax serve' compiles its scripts once, then listens on a
+ * Unix socket and forks a child per request, which shares
+ * the warm VM and its compiled chunks copy-on-write. A
+ * request is a script's name and a newline, sent with the
+ * client's stdin, stdout and stderr attached, so the child
+ * writes straight to them. While it runs, the client may
+ * send a signal's number, SIGINT or SIGTERM, for the script
+ * to get, and closing the connection kills it. The reply is
+ * one byte, the exit status 'lax <script>' would have had.
+*/
+
+/*
+ * Compiles the 'count' scripts in 'paths' and serves them
+ * on 'socketPath' until interrupted. A script is requested
+ * by the path given here or by its file name alone.
+ * Returns the status for lax to exit with.
+*/
+int
+serveScripts(VM *vm, const char *socketPath, char **paths, int count);
+
+/*
+ * Asks the server on 'socketPath' to run 'script' and
+ * returns the status it ran with. SIGINT and SIGTERM are
+ * passed on to the script meanwhile.
+*/
+int
+runServed(const char *socketPath, const char *script);
+
+#endif // LAX_SERVE_H
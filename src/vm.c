@@ -4,6 +4,8 @@
 
 #include "bcompiler.h"
 #include "debug.h"
+#include "infer.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -73,25 +75,6 @@ runtimeError(VM *vm, const char *fmt, ...)
     resetStack(vm);
 }
 
-VM *
-initVM()
-{
-    VM *vm = (VM *)malloc(sizeof(VM));
-    resetStack(vm);
-    vm->objects = NULL;
-    initTable(&vm->globals);
-    initTable(&vm->strings);
-
-    return vm;
-}
-
-void
-freeVM(VM *vm)
-{
-    freeTable(&vm->strings);
-    freeObjects(vm);
-}
-
 /*
  * This is where the magic happens. This function holds
  * the logic for interpreting all of the Bytecode instructions.
@@ -124,6 +107,24 @@ run(VM *vm)
         int a = round((int)AS_NUMBER(pop(vm)));                     \
         push(vm, valueType(a op b));                                \
     } while (false)
+#define BINARY_NUM(valueType, op)                                   \
+    do {                                                            \
+        double b = AS_NUMBER(pop(vm));                              \
+        double a = AS_NUMBER(vm->stackTop[-1]);                     \
+        vm->stackTop[-1] = valueType(a op b);                       \
+    } while (false)
+#define RK(operand)                                                 \
+    ((operand) & RK_CONSTANT ?                                      \
+        vm->chunk->constants.values[(operand) & ~RK_CONSTANT] :     \
+        vm->stack[(operand)])
+#define BINARY_RK(op)                                               \
+    do {                                                            \
+        uint8_t a = READ_BYTE();                                    \
+        double b = AS_NUMBER(RK(vm->ip[0]));                        \
+        double c = AS_NUMBER(RK(vm->ip[1]));                        \
+        vm->ip += 2;                                                \
+        vm->stack[a] = NUMBER_VAL(b op c);                          \
+    } while (false)
 #define POW(valueType)                                              \
     do {                                                            \
         if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {   \
@@ -155,6 +156,10 @@ run(VM *vm)
         disassembleInstruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
 #endif // DEBUG_TRACE_EXECUTION
 
+#ifdef DEBUG_PROFILE_OPCODES
+        profileInstruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
+#endif // DEBUG_PROFILE_OPCODES
+
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
@@ -173,6 +178,10 @@ run(VM *vm)
                 uint8_t slot = READ_BYTE();
                 vm->stack[slot] = peek(vm, 0);
             } break;
+            case OP_SET_LOCAL_POP: {
+                uint8_t slot = READ_BYTE();
+                vm->stack[slot] = pop(vm);
+            } break;
             case OP_GET_GLOBAL: {
                 ObjString *name = READ_STRING();
                 Value value;
@@ -202,6 +211,33 @@ run(VM *vm)
             } break;
             case OP_GREATER:    BINARY_DBL(BOOL_VAL, >);    break;
             case OP_LESS:       BINARY_DBL(BOOL_VAL, <);    break;
+            case OP_LESS_LOCAL_CONSTANT: {
+                Value a = vm->stack[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtimeError(vm, "Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(vm, BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)));
+            } break;
+            case OP_ADD_LOCAL_LOCAL:
+            case OP_ADD_LOCAL_CONSTANT: {
+                Value a = vm->stack[READ_BYTE()];
+                uint8_t operand = READ_BYTE();
+                Value b = instruction == OP_ADD_LOCAL_LOCAL ?
+                    vm->stack[operand] : vm->chunk->constants.values[operand];
+
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    push(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    push(vm, a);
+                    push(vm, b);
+                    concatenate(vm);
+                } else {
+                    runtimeError(vm, "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } break;
             case OP_ADD: {
                 if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
                     concatenate(vm);
@@ -252,6 +288,89 @@ run(VM *vm)
                 push(vm, NUMBER_VAL(AS_NUMBER(*(--vm->stackTop)) - 1));
                 // push(vm, NUMBER_VAL(AS_NUMBER(pop(vm)) - 1));
             } break;
+            case OP_BUILD_STRING: {
+                int count = READ_BYTE();
+                ObjString *string = buildString(vm, vm->stackTop - count, count);
+                vm->stackTop -= count;
+                push(vm, OBJ_VAL(string));
+            } break;
+            case OP_GREATER_NUM:    BINARY_NUM(BOOL_VAL, >);    break;
+            case OP_LESS_NUM:       BINARY_NUM(BOOL_VAL, <);    break;
+            case OP_ADD_NUM:        BINARY_NUM(NUMBER_VAL, +);  break;
+            case OP_SUBTRACT_NUM:   BINARY_NUM(NUMBER_VAL, -);  break;
+            case OP_MULTIPLY_NUM:   BINARY_NUM(NUMBER_VAL, *);  break;
+            case OP_DIVIDE_NUM:     BINARY_NUM(NUMBER_VAL, /);  break;
+            case OP_NEGATE_NUM: {
+                vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));
+            } break;
+            case OP_INCREMENT_NUM: {
+                vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm->stackTop[-1]) + 1);
+            } break;
+            case OP_DECREMENT_NUM: {
+                vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm->stackTop[-1]) - 1);
+            } break;
+            case OP_CHECK_TYPE: {
+                uint8_t type = READ_BYTE();
+                ObjString *name = READ_STRING();
+                if (!(valueType(peek(vm, 0)) & type)) {
+                    runtimeError(vm, "Type mismatch: '%s' is declared '%s'.", name->chars, typeName(type));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } break;
+            case OP_MOVE: {
+                uint8_t a = READ_BYTE();
+                uint8_t b = READ_BYTE();
+                vm->stack[a] = RK(b);
+            } break;
+            case OP_ADD_RK:         BINARY_RK(+);   break;
+            case OP_SUBTRACT_RK:    BINARY_RK(-);   break;
+            case OP_MULTIPLY_RK:    BINARY_RK(*);   break;
+            case OP_DIVIDE_RK:      BINARY_RK(/);   break;
+            case OP_JUMP_LESS:
+            case OP_JUMP_NLESS: {
+                bool less = AS_NUMBER(RK(vm->ip[0])) < AS_NUMBER(RK(vm->ip[1]));
+                vm->ip += 2;
+                uint16_t offset = READ_SHORT();
+                if (less == (instruction == OP_JUMP_LESS)) vm->ip += offset;
+            } break;
+            case OP_FOR_RANGE: {
+                Value *counter = &vm->stack[READ_BYTE()];
+                uint8_t limit = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+
+                if (!IS_NUMBER(*counter)) {
+                    runtimeError(vm, "Operand must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *counter = NUMBER_VAL(AS_NUMBER(*counter) + 1);
+
+                // The limit is read after the increment, it may be the counter
+                Value bound = RK(limit);
+                if (!IS_NUMBER(bound)) {
+                    runtimeError(vm, "Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (AS_NUMBER(*counter) < AS_NUMBER(bound)) vm->ip -= offset;
+            } break;
+            case OP_JUMP_TABLE: {
+                Value subject = vm->stack[READ_BYTE()];
+                int min = (int16_t)READ_SHORT();
+                int span = READ_BYTE() + 1;
+                uint8_t *jumps = vm->ip;
+                vm->ip += 2 * span;
+
+                if (!IS_NUMBER(subject)) break;
+                double index = AS_NUMBER(subject) - min;
+                if (!(index >= 0 && index < span) || index != (int)index) break;
+
+                uint8_t *jump = &jumps[2 * (int)index];
+                vm->ip -= (uint16_t)((jump[0] << 8) | jump[1]);
+            } break;
+            case OP_JUMP_LOOKUP: {
+                Value subject = vm->stack[READ_BYTE()];
+                int target = findJump(&vm->chunk->jumpTables[READ_BYTE()], subject);
+                if (target != -1) vm->ip = vm->chunk->code + target;
+            } break;
             case OP_ECHO: {
                 printValue(*(--vm->stackTop));
                 printf("\n");
@@ -281,24 +400,46 @@ run(VM *vm)
 #undef READ_SHORT
 #undef BINARY_DBL
 #undef BINARY_INT
+#undef BINARY_NUM
+#undef RK
+#undef BINARY_RK
 #undef POW
 }
 
+bool
+compileSource(VM *vm, const char *src, Chunk *chunk)
+{
+    bool compiled = vm->optimize && compileOptimized(vm, src, chunk);
+    return compiled || compile(vm, src, chunk);
+}
+
 InterpretResult
-interpret(VM *vm, const char *src)
+runChunk(VM *vm, Chunk *chunk)
 {
-    Chunk chunk;
-    initChunk(&chunk);
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->code;
 
-    if (!compile(vm, src, &chunk)) {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+    InterpretResult result;
+    JitCode jit;
+    if (vm->jit && jitCompile(chunk, &jit)) {
+        // A failed guard leaves the rest of the program to run()
+        result = jitRun(vm, &jit) ? INTERPRET_OK : run(vm);
+        freeJit(&jit);
+    } else {
+        result = run(vm);
     }
 
-    vm->chunk = &chunk;
-    vm->ip = vm->chunk->code;
+    return result;
+}
+
+InterpretResult
+interpret(VM *vm, const char *src)
+{
+    Chunk chunk;
+    initChunk(&chunk);
 
-    InterpretResult result = run(vm);
+    InterpretResult result = INTERPRET_COMPILE_ERROR;
+    if (compileSource(vm, src, &chunk)) result = runChunk(vm, &chunk);
 
     freeChunk(&chunk);
     return result;
@@ -25,6 +25,12 @@ typedef struct {
     Table globals;
     Table strings;
     Obj *objects;
+
+    // Compile files through the optimizing front end
+    bool optimize;
+
+    // Run files as native code where the platform allows it
+    bool jit;
 } VM;
 
 typedef enum {
@@ -57,6 +63,21 @@ initVM();
 void
 freeVM(VM *vm);
 
+/*
+ * Compiles 'src' to 'chunk', through the optimizing front
+ * end first if vm->optimize is set. Returns false after
+ * reporting the errors if it doesn't compile.
+*/
+bool
+compileSource(VM *vm, const char *src, Chunk *chunk);
+
+/*
+ * Runs a compiled chunk, as native code if vm->jit is set
+ * and the platform allows it.
+*/
+InterpretResult
+runChunk(VM *vm, Chunk *chunk);
+
 /*
  * Sets everything up for the VM to interpret the 
  * compiled Bytecode. Passes the actual logic of